@@ -40,6 +40,8 @@ class AppInterface
 {
 public:
     static const int DEVICE_SCAN = 1;
+    static const int SEND_QUEUE_HIGH = 2;   //!< The transport queue is filling up, slow down sending
+    static const int SEND_QUEUE_LOW = 3;    //!< The transport queue drained, send at full speed again
 
     AppInterface() : receiveCallback_(NULL), stateReportCallback_(NULL), notifyCallback_(NULL) {}
 
@@ -118,6 +120,59 @@ public:
      */
     virtual vector<int64_t>* sendMessageToSiblings(const string& messageDescriptor, const string& attachementDescriptor, const string& messageAttributes) = 0;
 
+    /**
+     * @brief Send a message asynchronously.
+     *
+     * The function checks the message descriptor, queues the message and returns. Background
+     * threads then do the work of @c sendMessage: provisioning server requests, encryption
+     * and the hand-over to the transport. Messages to the same recipient leave in the order
+     * of the @c sendMessageAsync calls, messages to different recipients may overtake each
+     * other.
+     *
+     * When the send completed the function reports the result via the state report callback.
+     * The callback gets the handle as message identifier, @c OK or an error code as status
+     * code and a JSON state information block. The block contains the recipient's name, the
+     * error information if the send failed and the unique message identifiers of the transport:
+     *
+     @verbatim
+     {
+        "version":  <int32_t>,
+        "code":     <int32_t>,              # OK or error code
+        "details": {
+            "name":      <string>,          # the recipient's name
+            "otherInfo": <string>           # optional, error information
+        },
+        "msgIds":   [<int64_t>, ...]        # unique message identifiers of the transport
+     }
+     @endverbatim
+     *
+     * @param messageDescriptor      The JSON formatted message descriptor, required
+     * @param attachementDescriptor  A string that contains an attachment descriptor. An empty string
+     *                               shows that not attachment descriptor is available.
+     * @param messageAttributes      Optional, a JSON formatted string that contains message attributes.
+     *                               An empty string shows that not attributes are available.
+     * @return a positive handle of the queued message or a negative error code if the message
+     *         descriptor is not valid.
+     */
+    virtual int64_t sendMessageAsync(const string& messageDescriptor, const string& attachementDescriptor, const string& messageAttributes) = 0;
+
+    /**
+     * @brief Send message to sibling devices asynchronously.
+     *
+     * Similar to @c sendMessageAsync, however send this data to sibling devices. Sibling
+     * sync messages are background traffic, messages to other users go first.
+     *
+     * @param messageDescriptor      The JSON formatted message descriptor, required
+     * @param attachementDescriptor  A string that contains an attachment descriptor. An empty string
+     *                               shows that not attachment descriptor is available.
+     * @param messageAttributes      Optional, a JSON formatted string that contains message attributes.
+     *                               An empty string shows that not attributes are available.
+     * @return a positive handle of the queued message or a negative error code if the message
+     *         descriptor is not valid.
+     */
+    virtual int64_t sendMessageToSiblingsAsync(const string& messageDescriptor, const string& attachementDescriptor, 
+                                               const string& messageAttributes) = 0;
+
     /**
      * @brief Receive a Message from transport
      *
@@ -254,6 +309,27 @@ public:
      */
     virtual void rescanUserDevices(string& userName) = 0;
 
+    /**
+     * @brief Rescan user devices in the background.
+     *
+     * Same as @c rescanUserDevices, but the send queue runs the rescan and the pings to
+     * new devices after the interactive messages that wait to be sent.
+     */
+    virtual void rescanUserDevicesAsync(const string& userName) = 0;
+
+    /**
+     * @brief Prepare conversations with new devices of a user.
+     *
+     * The transport calls this function if a device notification announces new devices
+     * of a user. The function fetches the pre-key bundles of the devices and sets up the
+     * conversations in the background, thus the first message to such a device does not
+     * wait for the provisioning server. The function returns immediately.
+     *
+     * @param userName the user that announced the devices
+     * @param deviceIds the long device ids of the new devices
+     */
+    virtual void prefetchUserDevices(const string& userName, const list<string>& deviceIds) = 0;
+
     /**
      * @brief Callback to UI to receive a Message from transport 
      *
@@ -309,7 +385,8 @@ public:
      *                           user's Salamander devices
      * 
      * @param actionInformation  JSON formatted state information block (string) that contains the
-     *                           details required for the action.
+     *                           details required for the action. For @c SEND_QUEUE_HIGH and
+     *                           @c SEND_QUEUE_LOW the number of queued messages.
      */
     NOTIFY_FUNC notifyCallback_;
 };
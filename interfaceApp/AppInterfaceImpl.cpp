@@ -15,6 +15,8 @@ limitations under the License.
 */
 #include "AppInterfaceImpl.h"
 #include "MessageEnvelope.pb.h"
+#include "DetachedPayload.h"
+#include "EnvelopeView.h"
 
 #include "../salamander/crypto/AesCbc.h"
 #include "../salamander/Constants.h"
@@ -29,36 +31,92 @@ limitations under the License.
 #include "../util/UUID.h"
 #include "../provisioning/Provisioning.h"
 #include "../provisioning/ScProvisioning.h"
-#include "../storage/sqlite/SQLiteStoreConv.h"
+#include "../storage/ConversationStore.h"
 
 #include <common/Thread.h>
 
 #include <iostream>
 #include <algorithm>
 #include <utility>
-
-static CMutexClass convLock;
+#include <functional>
+#include <memory>
 
 using namespace salamander;
 
+const int32_t AppInterfaceImpl::PREFETCH_THREADS;
+
 static string Empty;
 
 void Log(const char* format, ...);
 
-AppInterfaceImpl::AppInterfaceImpl(const string& ownUser, const string& authorization, const string& scClientDevId,
+AppInterfaceImpl::AppInterfaceImpl(ConversationStore* store, const string& ownUser, const string& authorization, const string& scClientDevId,
                                    RECV_FUNC receiveCallback, STATE_FUNC stateReportCallback, NOTIFY_FUNC notifyCallback):
-                                   AppInterface(receiveCallback, stateReportCallback, notifyCallback), tempBuffer_(NULL), tempBufferSize_(0),
-                                   ownUser_(ownUser), authorization_(authorization), scClientDevId_(scClientDevId), flags_(0), ownChecked_(false)
+                                   AppInterface(receiveCallback, stateReportCallback, notifyCallback),
+                                   ownUser_(ownUser), authorization_(authorization), scClientDevId_(scClientDevId), store_(store),
+                                   transport_(NULL), ownWorkers_(NULL), detachThreshold_(0), compressThreshold_(0), wireVersion_(AxoRatchet::WIRE_VERSION_1),
+                                   sendQueue_(NULL), prefetchQueue_(NULL), transportQueue_(NULL), lazyQueues_(true), coalescer_(NULL),
+                                   nextHandle_(1), receiveMsgCallback_(NULL), flags_(0), ownChecked_(false)
 {
-    store_ = SQLiteStoreConv::getStore();
+    maintenance_ = new StoreMaintenance(store_);
+    maintenance_->start();
+    // A client may open many accounts: they share one worker pool, and each account
+    // starts its send, prefetch and transport queues only when it first needs them
+    workers_ = WorkerPool::shared();
+    outbox_ = new Outbox(store_, ownUser_, [this](const string& recipient, const string& msgId, int32_t code,
+                                                  const vector<int64_t>& msgIds) {
+        reportOutbox(recipient, msgId, code, msgIds);
+    });
+    duplicateFilter_ = new DuplicateFilter(store_, ownUser_);
 }
 
 AppInterfaceImpl::~AppInterfaceImpl()
 {
-    tempBufferSize_ = 0; delete tempBuffer_; tempBuffer_ = NULL;
+    // The send threads use the other members, stop them first. The coalescer queues
+    // its collected messages to the send queue. The queues run the sends they accepted,
+    // the application holds a handle for each of them and waits for its state report.
+    delete coalescer_; coalescer_ = NULL;
+    if (sendQueue_ != NULL)
+        sendQueue_->drain();
+    delete sendQueue_; sendQueue_ = NULL;
+    if (prefetchQueue_ != NULL)
+        prefetchQueue_->drain();
+    delete prefetchQueue_; prefetchQueue_ = NULL;
+    delete transportQueue_; transportQueue_ = NULL;
+    delete outbox_; outbox_ = NULL;
+    delete duplicateFilter_; duplicateFilter_ = NULL;
+    delete maintenance_; maintenance_ = NULL;
+    delete ownWorkers_; ownWorkers_ = NULL; workers_ = NULL;
     delete transport_; transport_ = NULL;
 }
 
+SendQueue* AppInterfaceImpl::getSendQueue()
+{
+    call_once(sendQueueOnce_, [this]() {
+        if (lazyQueues_)
+            sendQueue_ = new SendQueue();
+    });
+    return sendQueue_;
+}
+
+SendQueue* AppInterfaceImpl::getPrefetchQueue()
+{
+    call_once(prefetchQueueOnce_, [this]() {
+        if (lazyQueues_)
+            prefetchQueue_ = new SendQueue(PREFETCH_THREADS);
+    });
+    return prefetchQueue_;
+}
+
+TransportQueue* AppInterfaceImpl::getTransportQueue()
+{
+    call_once(transportQueueOnce_, [this]() {
+        if (lazyQueues_)
+            transportQueue_ = new TransportQueue([this](vector<TransportQueue::Item>* batch) { sendQueued(batch); },
+                                                 [this](bool high, size_t depth) { reportQueueWatermark(high, depth); });
+    });
+    return transportQueue_;
+}
+
 static void createSupplementString(const string& attachementDesc, const string& messageAttrib, string* supplement)
 {
     if (!attachementDesc.empty() || !messageAttrib.empty()) {
@@ -89,33 +147,237 @@ static void createSupplementString(const string& attachementDesc, const string&
  */
 vector<int64_t>* AppInterfaceImpl::sendMessage(const string& messageDescriptor, const string& attachementDescriptor, const string& messageAttributes)
 {
+    CallContext ctx;
+    vector<int64_t>* returnMsgIds = sendMessage(messageDescriptor, attachementDescriptor, messageAttributes, &ctx);
+    storeCallResult(ctx);
+    return returnMsgIds;
+}
 
-    string recipient;
-    string msgId;
-    string message;
-    int32_t parseResult = parseMsgDescriptor(messageDescriptor, &recipient, &msgId, &message);
+vector<int64_t>* AppInterfaceImpl::sendMessage(const string& messageDescriptor, const string& attachementDescriptor, const string& messageAttributes,
+                                               CallContext* ctx)
+{
+    ctx->reset();
+
+    // The JSON functions are adapters of the structured functions. The attachment
+    // descriptor and the attributes go to the send without a copy.
+    OutgoingMessage message;
+    int32_t parseResult = parseMsgDescriptor(messageDescriptor, &message, ctx);
 
     if (parseResult < 0) {
-        errorCode_ = parseResult;
+        ctx->setErrorCode(parseResult);
         return NULL;
     }
-    return sendMessageInternal(recipient, msgId, message, attachementDescriptor, messageAttributes);
+    return sendMessageInternal(message.recipient, message.msgId, message.message, attachementDescriptor, messageAttributes, ctx);
 }
 
 vector<int64_t>* AppInterfaceImpl::sendMessageToSiblings(const string& messageDescriptor, const string& attachementDescriptor, 
                                                          const string& messageAttributes)
 {
+    CallContext ctx;
+    vector<int64_t>* returnMsgIds = sendMessageToSiblings(messageDescriptor, attachementDescriptor, messageAttributes, &ctx);
+    storeCallResult(ctx);
+    return returnMsgIds;
+}
+
+vector<int64_t>* AppInterfaceImpl::sendMessageToSiblings(const string& messageDescriptor, const string& attachementDescriptor, 
+                                                         const string& messageAttributes, CallContext* ctx)
+{
+    ctx->reset();
 
-    string recipient;
-    string msgId;
-    string message;
-    int32_t parseResult = parseMsgDescriptor(messageDescriptor, &recipient, &msgId, &message);
+    OutgoingMessage message;
+    int32_t parseResult = parseMsgDescriptor(messageDescriptor, &message, ctx);
 
     if (parseResult < 0) {
-        errorCode_ = parseResult;
+        ctx->setErrorCode(parseResult);
         return NULL;
     }
-    return sendMessageInternal(ownUser_, msgId, message, attachementDescriptor, messageAttributes);
+    return sendMessageInternal(ownUser_, message.msgId, message.message, attachementDescriptor, messageAttributes, ctx);
+}
+
+vector<int64_t>* AppInterfaceImpl::sendMessage(const OutgoingMessage& message, CallContext* ctx)
+{
+    ctx->reset();
+    return sendMessageInternal(message.recipient, message.msgId, message.message, message.attachment, message.attributes, ctx);
+}
+
+vector<int64_t>* AppInterfaceImpl::sendMessageToSiblings(const OutgoingMessage& message, CallContext* ctx)
+{
+    ctx->reset();
+    return sendMessageInternal(ownUser_, message.msgId, message.message, message.attachment, message.attributes, ctx);
+}
+
+int64_t AppInterfaceImpl::sendMessageAsync(const string& messageDescriptor, const string& attachementDescriptor, const string& messageAttributes)
+{
+    CallContext ctx;
+    OutgoingMessage message;
+    int32_t parseResult = parseMsgDescriptor(messageDescriptor, &message, &ctx);
+    if (parseResult < 0)
+        return parseResult;
+
+    message.attachment = attachementDescriptor;
+    message.attributes = messageAttributes;
+    return enqueueSend(std::move(message), SendQueue::INTERACTIVE);
+}
+
+int64_t AppInterfaceImpl::sendMessageToSiblingsAsync(const string& messageDescriptor, const string& attachementDescriptor,
+                                                     const string& messageAttributes)
+{
+    CallContext ctx;
+    OutgoingMessage message;
+    int32_t parseResult = parseMsgDescriptor(messageDescriptor, &message, &ctx);
+    if (parseResult < 0)
+        return parseResult;
+
+    message.recipient = ownUser_;
+    message.attachment = attachementDescriptor;
+    message.attributes = messageAttributes;
+    return enqueueSend(std::move(message), SendQueue::BACKGROUND);
+}
+
+int64_t AppInterfaceImpl::sendMessageAsync(OutgoingMessage&& message)
+{
+    return enqueueSend(std::move(message), SendQueue::INTERACTIVE);
+}
+
+int64_t AppInterfaceImpl::sendMessageToSiblingsAsync(OutgoingMessage&& message)
+{
+    message.recipient = ownUser_;
+    return enqueueSend(std::move(message), SendQueue::BACKGROUND);
+}
+
+static string sendResultJson(const string& recipient, int32_t code, const string& errorInfo, const vector<int64_t>* msgIds)
+{
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "version", 1);
+    cJSON_AddNumberToObject(root, "code", code);
+
+    cJSON* details;
+    cJSON_AddItemToObject(root, "details", details = cJSON_CreateObject());
+    cJSON_AddStringToObject(details, "name", recipient.c_str());
+    if (!errorInfo.empty())
+        cJSON_AddStringToObject(details, "otherInfo", errorInfo.c_str());
+
+    cJSON* idArray;
+    cJSON_AddItemToObject(root, "msgIds", idArray = cJSON_CreateArray());
+    if (msgIds != NULL) {
+        for (size_t i = 0; i < msgIds->size(); i++)
+            cJSON_AddItemToArray(idArray, cJSON_CreateNumber((double)(*msgIds)[i]));
+    }
+    char *out = cJSON_PrintUnformatted(root);
+    string retVal(out);
+    cJSON_Delete(root); free(out);
+
+    return retVal;
+}
+
+int64_t AppInterfaceImpl::enqueueSend(OutgoingMessage&& message, SendQueue::Priority priority)
+{
+    int64_t handle = nextHandle_++;
+    if (coalescer_ != NULL) {
+        if (ControlCoalescer::isControl(message)) {
+            coalescer_->add(handle, priority, std::move(message));
+            return handle;
+        }
+        // The message must not overtake the control messages sent before it
+        coalescer_->flush(message.recipient);
+    }
+    queueSend(handle, std::move(message), priority);
+    return handle;
+}
+
+void AppInterfaceImpl::queueSend(int64_t handle, OutgoingMessage&& message, SendQueue::Priority priority)
+{
+    // The task owns the message data, C++11 lambdas can't capture by move
+    shared_ptr<OutgoingMessage> msg = make_shared<OutgoingMessage>(std::move(message));
+    function<void()> task = [this, handle, msg]() {
+        CallContext ctx;
+        vector<pair<string, string> >* msgPairs = encryptMessage(msg->recipient, msg->msgId, msg->message, msg->attachment,
+                                                                 msg->attributes, &ctx);
+
+        // The transport queue's thread sends the envelopes and reports the result
+        TransportQueue* transportQueue = getTransportQueue();
+        if (msgPairs != NULL && transportQueue != NULL) {
+            TransportQueue::Item item;
+            item.handle = handle;
+            item.recipient = msg->recipient;
+            item.msgId = msg->msgId;
+            item.msgPairs.swap(*msgPairs);
+            delete msgPairs;
+            transportQueue->push(std::move(item));
+            return;
+        }
+        vector<int64_t>* msgIds = NULL;
+        if (msgPairs != NULL) {
+            msgIds = sendEnvelopes(msg->recipient, msg->msgId, msgPairs);
+            delete msgPairs;
+        }
+
+        int32_t code = ctx.getErrorCode();
+        if (msgIds == NULL && code == OK)
+            code = GENERIC_ERROR;
+        string stateInformation = sendResultJson(msg->recipient, code, ctx.getErrorInfo(), msgIds);
+        delete msgIds;
+
+        if (stateReportCallback_ != NULL)
+            messageStateReport(handle, code, stateInformation);
+    };
+
+    // Messages to a recipient leave in order, the recipient is the key
+    SendQueue* sendQueue = getSendQueue();
+    if (sendQueue != NULL)
+        sendQueue->enqueue(msg->recipient, task, priority);
+    else
+        task();
+}
+
+void AppInterfaceImpl::setCoalesceWindow(int32_t windowMillis)
+{
+    // Deleting the coalescer queues the messages it collected
+    delete coalescer_; coalescer_ = NULL;
+    if (windowMillis <= 0)
+        return;
+    coalescer_ = new ControlCoalescer([this](const string& recipient, vector<ControlCoalescer::Entry>* entries) {
+        sendCoalesced(recipient, entries);
+    }, windowMillis);
+}
+
+void AppInterfaceImpl::sendCoalesced(const string& recipient, vector<ControlCoalescer::Entry>* entries)
+{
+    if (entries->size() == 1) {
+        ControlCoalescer::Entry& entry = entries->front();
+        queueSend(entry.handle, std::move(entry.message), entry.priority);
+        return;
+    }
+    uuid_t batchUuid;
+    uuid_string_t uuidString;
+    uuid_generate_time(batchUuid);
+    uuid_unparse(batchUuid, uuidString);
+
+    OutgoingMessage batch;
+    batch.recipient = recipient;
+    batch.msgId = uuidString;
+    batch.attributes = ControlCoalescer::pack(*entries);
+
+    // The batch takes the lane of its most urgent message
+    SendQueue::Priority priority = SendQueue::BACKGROUND;
+    vector<int64_t> handles;
+    for (size_t i = 0; i < entries->size(); i++) {
+        handles.push_back((*entries)[i].handle);
+        if ((*entries)[i].priority == SendQueue::INTERACTIVE)
+            priority = SendQueue::INTERACTIVE;
+    }
+    int64_t handle = nextHandle_++;
+    {
+        unique_lock<mutex> lck(coalescedLock_);
+        coalescedHandles_[handle].swap(handles);
+    }
+    queueSend(handle, std::move(batch), priority);
+}
+
+void AppInterfaceImpl::reportOutbox(const string& recipient, const string& msgId, int32_t code, const vector<int64_t>& msgIds)
+{
+    if (stateReportCallback_ != NULL)
+        messageStateReport(0, code, sendResultJson(recipient, code, msgId, &msgIds));
 }
 
 static string receiveErrorJson(const string& sender, const string& senderScClientDevId, const string& msgId, 
@@ -145,26 +407,72 @@ static string receiveErrorJson(const string& sender, const string& senderScClien
 // forward the data to the UI layer.
 int32_t AppInterfaceImpl::receiveMessage(const string& messageEnvelope)
 {
-    if (messageEnvelope.size() > tempBufferSize_) {
-        delete tempBuffer_;
-        tempBuffer_ = new char[messageEnvelope.size()];
-        tempBufferSize_ = messageEnvelope.size();
+    CallContext ctx;
+    int32_t result = receiveMessage(messageEnvelope, &ctx);
+    storeCallResult(ctx);
+    return result;
+}
+
+int32_t AppInterfaceImpl::receiveMessage(const string& messageEnvelope, CallContext* ctx)
+{
+    ctx->reset();
+
+    IncomingMessage message;
+    int32_t result = decryptMessage(messageEnvelope, &message, ctx);
+    if (result != OK)
+        return result;
+
+    // Deliver the messages of a coalesced batch one by one
+    vector<IncomingMessage> controls;
+    if (ControlCoalescer::unpack(message, &controls)) {
+        for (size_t i = 0; i < controls.size(); i++)
+            deliver(std::move(controls[i]));
+        return OK;
     }
-    int32_t binLength = b64Decode(messageEnvelope.data(), messageEnvelope.size(), (uint8_t*)tempBuffer_, tempBufferSize_);
-    string envelopeBin((const char*)tempBuffer_, binLength);
+    deliver(std::move(message));
+    return OK;
+}
 
-    MessageEnvelope envelope;
-    envelope.ParseFromString(envelopeBin);
+void AppInterfaceImpl::deliver(IncomingMessage&& message)
+{
+    if (receiveMsgCallback_ != NULL)
+        receiveMsgCallback_(std::move(message));
+    else
+        deliverJson(message);
+}
+
+int32_t AppInterfaceImpl::decryptMessage(const string& messageEnvelope, IncomingMessage* received, CallContext* ctx)
+{
+    if (maintenance_ != NULL)
+        maintenance_->notifyActivity();
+
+    // Decode into the context's buffer and parse the envelope in place. The message and
+    // the supplementary data go to the ratchet as spans, the ratchet decrypts them
+    // directly from the buffer. Don't use the scratch buffer until decrypt is done.
+    // The envelope of a binary-safe transport needs no decode, parse it where it is.
+    const uint8_t* binBuffer;
+    int32_t binLength;
+    if (isBinaryTransport()) {
+        binBuffer = (const uint8_t*)messageEnvelope.data();
+        binLength = (int32_t)messageEnvelope.size();
+    }
+    else {
+        uint8_t* decodeBuffer = (uint8_t*)ctx->getScratch(messageEnvelope.size());
+        binLength = b64Decode(messageEnvelope.data(), messageEnvelope.size(), decodeBuffer, messageEnvelope.size());
+        binBuffer = decodeBuffer;
+    }
 
-    const string& sender = envelope.name();
-    const string& senderScClientDevId = envelope.scclientdevid();
-    const string& supplements = envelope.has_supplement() ? envelope.supplement() : Empty;
-    const string& message = envelope.message();
-    const string& msgId = envelope.msgid();
+    EnvelopeView envelope;
+    if (binLength <= 0 || !parseEnvelopeView(binBuffer, binLength, &envelope))
+        envelope.message = DataSpan();          // decrypt reports corrupt data
 
-    string sentToId;
-    if (envelope.has_recvdevidbin())
-        sentToId = envelope.recvdevidbin();
+    const string sender = envelope.name.toString();
+    const string senderScClientDevId = envelope.scClientDevId.toString();
+    const DataSpan& supplements = envelope.supplement;
+    const DataSpan& message = envelope.message;
+    const string msgId = envelope.msgId.toString();
+
+    string sentToId = envelope.recvDevIdBin.toString();
 
     bool wrongDeviceId = false; 
     if (!sentToId.empty()) {
@@ -191,63 +499,88 @@ int32_t AppInterfaceImpl::receiveMessage(const string& messageEnvelope)
 
     pair<string, string> idHashes;
     bool hasIdHashes = false;
-    if (envelope.has_recvidhash() && envelope.has_senderidhash()) {
+    if (envelope.recvIdHash.data != NULL && envelope.senderIdHash.data != NULL) {
         hasIdHashes = true;
-        const string& recvIdHash = envelope.recvidhash();
-        const string& senderIdHash = envelope.senderidhash();
-        idHashes.first = recvIdHash;
-        idHashes.second = senderIdHash;
+        idHashes.first = envelope.recvIdHash.toString();
+        idHashes.second = envelope.senderIdHash.toString();
+    }
+    // Lock the sender's conversation. A message with an embedded pre-key (message type 2)
+    // also updates the local conversation, it counts down the available pre-keys
+    bool preKeyMsg = AxoRatchet::isPreKeyMessage(message);
+    vector<int32_t> stripes(1, convLocks_.getStripe(ownUser_, sender, senderScClientDevId));
+    convLocks_.lockStripes(&stripes);
+    if (preKeyMsg)
+        convLocks_.lockLocal();
+
+    // Drop a replayed envelope before the conversation and the staged keys are loaded. Check
+    // with the conversation locked, a copy of the envelope may be in decrypt on another thread.
+    string msgKey;
+    if (duplicateFilter_ != NULL && !msgId.empty()) {
+        msgKey = DuplicateFilter::messageKey(sender, senderScClientDevId, msgId);
+        if (duplicateFilter_->isDuplicate(msgKey)) {
+            if (preKeyMsg)
+                convLocks_.unlockLocal();
+            convLocks_.unlockStripes(stripes);
+            Log("Dropped duplicate message %s from %s", msgId.c_str(), sender.c_str());
+            ctx->setError(DUPLICATE_MESSAGE, msgId);
+            return DUPLICATE_MESSAGE;
+        }
     }
-    convLock.Lock();
-    AxoConversation* axoConv = AxoConversation::loadConversation(ownUser_, sender, senderScClientDevId);
+    AxoConversation* axoConv = AxoConversation::loadConversation(ownUser_, sender, senderScClientDevId, store_);
 
     // This is a not yet seen user. Set up a basic Conversation structure. Decrypt uses it and fills
     // in the other data based on the received message.
     if (axoConv == NULL) {
-        axoConv = new AxoConversation(ownUser_, sender, senderScClientDevId);
+        axoConv = new AxoConversation(ownUser_, sender, senderScClientDevId, store_);
     }
     string supplementsPlain;
     string* messagePlain;
+    int32_t messageFlags = 0;
 
-    messagePlain = AxoRatchet::decrypt(axoConv, message, supplements, &supplementsPlain, hasIdHashes ? &idHashes : NULL);
-    errorCode_ = axoConv->getErrorCode();
+    messagePlain = AxoRatchet::decrypt(axoConv, message, supplements, &supplementsPlain, hasIdHashes ? &idHashes : NULL, &messageFlags);
+    int32_t errorCode = axoConv->getErrorCode();
     delete axoConv;
-    convLock.Unlock();
+
+    // The ratchet used the message key, a copy of the envelope can't be decrypted anymore
+    if (messagePlain != NULL && !msgKey.empty())
+        duplicateFilter_->add(msgKey);
+    if (preKeyMsg)
+        convLocks_.unlockLocal();
+    convLocks_.unlockStripes(stripes);
+
+    // The ratchet message contains the key descriptor of a detached payload, replace it
+    // with the payload. Only the authenticated flag tells this, not the envelope.
+    if (messagePlain != NULL && (messageFlags & AxoRatchet::DETACHED) != 0) {
+        string keyDescriptor;
+        keyDescriptor.swap(*messagePlain);
+        errorCode = attachPayload(keyDescriptor, envelope.detached, messagePlain, &supplementsPlain);
+        memset_volatile((void*)keyDescriptor.data(), 0, keyDescriptor.size());
+        if (errorCode != SUCCESS) {
+            delete messagePlain;
+            messagePlain = NULL;
+        }
+    }
 
     //    Log("After decrypt: %s", messagePlain ? messagePlain->c_str() : "NULL");
     if (messagePlain == NULL) {
         if (oldMessage)
-            errorCode_ = OLD_MESSAGE;
+            errorCode = OLD_MESSAGE;
         if (wrongDeviceId)
-            errorCode_ = WRONG_RECV_DEV_ID;
-        messageStateReport(0, errorCode_, receiveErrorJson(sender, senderScClientDevId, msgId, messageEnvelope, errorCode_, sentToId));
-        return errorCode_;
+            errorCode = WRONG_RECV_DEV_ID;
+        if (errorCode == OK)        // the caller must not deliver a message
+            errorCode = GENERIC_ERROR;
+        ctx->setError(errorCode, msgId);
+        messageStateReport(0, errorCode, receiveErrorJson(sender, senderScClientDevId, msgId, messageEnvelope, errorCode, sentToId));
+        return errorCode;
     }
 
-    /*
-     * Message descriptor for received message:
-     {
-         "version":    <int32_t>,            # Version of JSON send message descriptor, 1 for the first implementation
-         "sender":     <string>,             # for SC this is either the user's name or the user's DID
-         "scClientDevId" : <string>,         # the sender's long device id
-         "message":    <string>              # the actual plain text message, UTF-8 encoded (Java programmers beware!)
-    }
-    */
-    cJSON* root = cJSON_CreateObject();
-    cJSON_AddNumberToObject(root, "version", 1);
-    cJSON_AddStringToObject(root, "sender", sender.c_str());
-    cJSON_AddStringToObject(root, "scClientDevId", senderScClientDevId.c_str());
-    cJSON_AddStringToObject(root, "msgId", msgId.c_str());
-    cJSON_AddStringToObject(root, "message", messagePlain->c_str());
+    received->sender = sender;
+    received->scClientDevId = senderScClientDevId;
+    received->msgId = msgId;
+    received->message.swap(*messagePlain);
     delete messagePlain;
 
-    char *out = cJSON_PrintUnformatted(root);
-    string msgDescriptor(out);
-
-    cJSON_Delete(root); free(out);
-
-    string attachmentDescr;
-    string attributesDescr;
+    // The supplementary data is part of the message format, it is always JSON
     if (!supplementsPlain.empty()) {
         checkAndRemovePadding(supplementsPlain);
         cJSON* jsSupplement = cJSON_Parse(supplementsPlain.c_str());
@@ -255,20 +588,45 @@ int32_t AppInterfaceImpl::receiveMessage(const string& messageEnvelope)
         cJSON* cjTemp = cJSON_GetObjectItem(jsSupplement, "a");
         char* jsString = (cjTemp != NULL) ? cjTemp->valuestring : NULL;
         if (jsString != NULL) {
-            attachmentDescr = jsString;
+            received->attachment = jsString;
         }
 
         cjTemp = cJSON_GetObjectItem(jsSupplement, "m");
         jsString = (cjTemp != NULL) ? cjTemp->valuestring : NULL;
         if (jsString != NULL) {
-            attributesDescr = jsString;
+            received->attributes = jsString;
         }
         cJSON_Delete(jsSupplement);
     }
-    receiveCallback_(msgDescriptor, attachmentDescr, attributesDescr);
     return OK;
 }
 
+int32_t AppInterfaceImpl::deliverJson(const IncomingMessage& message)
+{
+    /*
+     * Message descriptor for received message:
+     {
+         "version":    <int32_t>,            # Version of JSON send message descriptor, 1 for the first implementation
+         "sender":     <string>,             # for SC this is either the user's name or the user's DID
+         "scClientDevId" : <string>,         # the sender's long device id
+         "message":    <string>              # the actual plain text message, UTF-8 encoded (Java programmers beware!)
+    }
+    */
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "version", 1);
+    cJSON_AddStringToObject(root, "sender", message.sender.c_str());
+    cJSON_AddStringToObject(root, "scClientDevId", message.scClientDevId.c_str());
+    cJSON_AddStringToObject(root, "msgId", message.msgId.c_str());
+    cJSON_AddStringToObject(root, "message", message.message.c_str());
+
+    char *out = cJSON_PrintUnformatted(root);
+    string msgDescriptor(out);
+
+    cJSON_Delete(root); free(out);
+
+    return receiveCallback_(msgDescriptor, message.attachment, message.attributes);
+}
+
 /*
 JSON state information block:
 {   
@@ -289,6 +647,23 @@ JSON state information block:
 */
 void AppInterfaceImpl::messageStateReport(int64_t messageIdentfier, int32_t statusCode, const string& stateInformation)
 {
+    // The report of a coalesced batch goes to each of its messages. The coalescer
+    // may be gone already, the batches it sent are still in the map.
+    if (messageIdentfier != 0) {
+        vector<int64_t> handles;
+        {
+            unique_lock<mutex> lck(coalescedLock_);
+            map<int64_t, vector<int64_t> >::iterator it = coalescedHandles_.find(messageIdentfier);
+            if (it != coalescedHandles_.end()) {
+                handles.swap(it->second);
+                coalescedHandles_.erase(it);
+            }
+        }
+        for (size_t i = 0; i < handles.size(); i++)
+            stateReportCallback_(handles[i], statusCode, stateInformation);
+        if (!handles.empty())
+            return;
+    }
     stateReportCallback_(messageIdentfier, statusCode, stateInformation);
 }
 
@@ -299,7 +674,7 @@ string* AppInterfaceImpl::getKnownUsers()
 
     list<string>* names = store_->getKnownConversations(ownUser_);
 
-    if (SQL_FAIL(store_->getSqlCode()) || names == NULL) {
+    if (STORE_FAIL(store_->getStoreCode()) || names == NULL) {
 //        Log("generatePreKey: %d", store_->getLastError());
         return NULL;
     }
@@ -349,13 +724,16 @@ int32_t AppInterfaceImpl::registerSalamanderDevice(string* result)
     cJSON_AddNumberToObject(root, "version", 1);
 //    cJSON_AddStringToObject(root, "scClientDevId", scClientDevId_.c_str());
 
-    AxoConversation* ownConv = AxoConversation::loadLocalConversation(ownUser_);
+    convLocks_.lockLocal();
+    AxoConversation* ownConv = AxoConversation::loadLocalConversation(ownUser_, store_);
     if (ownConv == NULL) {
+        convLocks_.unlockLocal();
         cJSON_Delete(root);
         return NO_OWN_ID;
     }
     const DhKeyPair* myIdPair = ownConv->getDHIs();
     if (myIdPair == NULL) {
+        convLocks_.unlockLocal();
         cJSON_Delete(root);
         delete ownConv;
         return NO_OWN_ID;
@@ -376,6 +754,7 @@ int32_t AppInterfaceImpl::registerSalamanderDevice(string* result)
     ownConv->setPreKeysAvail(numPreKeys);
     ownConv->storeConversation();
     delete ownConv;
+    convLocks_.unlockLocal();
 
     for (int32_t i = 0; i < size; i++) {
         pair< int32_t, const DhKeyPair* >pkPair = preList->front();
@@ -411,9 +790,8 @@ int32_t AppInterfaceImpl::removeSalamanderDevice(string& devId, string* result)
 
 int32_t AppInterfaceImpl::newPreKeys(int32_t number)
 {
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
     string result;
-    return ScProvisioning::newPreKeys(store, scClientDevId_, authorization_, number, &result);
+    return ScProvisioning::newPreKeys(store_, scClientDevId_, authorization_, number, &result);
 }
 
 int32_t AppInterfaceImpl::getNumPreKeys() const
@@ -430,7 +808,7 @@ static string ping("{\"cmd\":\"ping\"}");
 
 void AppInterfaceImpl::rescanUserDevices(string& userName)
 {
-    list<pair<string, string> >* devices = Provisioning::getAxoDeviceIds(userName, authorization_);
+    list<pair<string, string> >* devices = deviceCache_.getDeviceIds(userName, authorization_);
     if (devices == NULL || devices->empty()) {
         delete devices;
         return;
@@ -439,8 +817,6 @@ void AppInterfaceImpl::rescanUserDevices(string& userName)
     // Get known devices from DB, compare with devices from provisioning server
     // and remove old devices in DB, i.e. devices not longer known on provisioning server
     //
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
-
     list<string>* devicesDb = store_->getLongDeviceIds(userName, ownUser_);
 
     while (!devicesDb->empty()) {
@@ -456,7 +832,7 @@ void AppInterfaceImpl::rescanUserDevices(string& userName)
             }
         }
         if (!found)
-            store->deleteConversation(userName, devIdDb, ownUser_);
+            store_->deleteConversation(userName, devIdDb, ownUser_);
     }
     delete devicesDb;
 
@@ -470,7 +846,14 @@ void AppInterfaceImpl::rescanUserDevices(string& userName)
     // Prepare the messages for all known new devices of this user
     vector<pair<string, string> >* msgPairs = new vector<pair<string, string> >;
 
-    convLock.Lock();
+    // Lock the conversations of all devices in one go, lockStripes locks in a fixed
+    // order thus concurrent fan-outs to overlapping devices don't deadlock
+    vector<int32_t> stripes;
+    for (list<pair<string, string> >::iterator it = devices->begin(); it != devices->end(); ++it)
+        stripes.push_back(convLocks_.getStripe(ownUser_, userName, it->first));
+    convLocks_.lockStripes(&stripes);
+
+    CallContext ctx;
     uuid_t pingUuid;
     uuid_string_t uuidString;
 
@@ -480,23 +863,39 @@ void AppInterfaceImpl::rescanUserDevices(string& userName)
         devices->pop_front();
 
         // If we already have a conversation for this device skip further processing
-        if (store->hasConversation(userName, deviceId, ownUser_)) {
-            AxoConversation* conv = AxoConversation::loadConversation(ownUser_, userName, deviceId);
-            if (conv != NULL) {
-                const string& convDevName = conv->getDeviceName();
-                if (convDevName.empty()) {
-                    conv->setDeviceName(deviceName);
-                    conv->storeConversation();
-                }
+        if (store_->hasConversation(userName, deviceId, ownUser_)) {
+            AxoConversation* conv = AxoConversation::loadConversation(ownUser_, userName, deviceId, store_);
+            if (conv == NULL)
+                continue;
+
+            // The prefetch set up this conversation and sent no message yet, send the ping
+            if (conv->getA0() != NULL && conv->getNs() == 0) {
                 delete conv;
+                uuid_generate_time(pingUuid);
+                uuid_unparse(pingUuid, uuidString);
+
+                DeviceJob job(deviceId);
+                encryptForDevice(ownUser_, scClientDevId_, userName, string(uuidString), Empty, supplements, NULL, isBinaryTransport(), compressThreshold_, wireVersion_, store_, &job);
+                if (job.conv == NULL)
+                    continue;
+                conv = job.conv;
+                conv->setDeviceName(deviceName);
+                conv->storeConversation();
+                if (!job.envelope.empty())
+                    msgPairs->push_back(pair<string, string>(deviceId, job.envelope));
+            }
+            else if (conv->getDeviceName().empty()) {
+                conv->setDeviceName(deviceName);
+                conv->storeConversation();
             }
+            delete conv;
             continue;
         }
         uuid_generate_time(pingUuid);
         uuid_unparse(pingUuid, uuidString);
         string msgId(uuidString);
 
-        int32_t result = createPreKeyMsg(userName, deviceId, deviceName, Empty, supplements, msgId, msgPairs);
+        int32_t result = createPreKeyMsg(userName, deviceId, deviceName, Empty, supplements, msgId, msgPairs, &ctx);
         if (result == 0)   // no pre-key bundle available for name/device-id combination
             continue;
 
@@ -504,11 +903,11 @@ void AppInterfaceImpl::rescanUserDevices(string& userName)
         if (result < 0) {
             delete msgPairs;
             delete devices;
-            convLock.Unlock();
+            convLocks_.unlockStripes(stripes);
             return;
         }
     }
-    convLock.Unlock();
+    convLocks_.unlockStripes(stripes);
     delete devices;
 
     if (msgPairs->empty()) {
@@ -521,6 +920,46 @@ void AppInterfaceImpl::rescanUserDevices(string& userName)
     return;
 }
 
+void AppInterfaceImpl::rescanUserDevicesAsync(const string& userName)
+{
+    // The user's name is the key, the rescan runs between the messages to this user
+    string name(userName);
+    SendQueue* sendQueue = getSendQueue();
+    if (sendQueue == NULL) {
+        rescanUserDevices(name);
+        return;
+    }
+    sendQueue->enqueue(name, [this, name]() {
+        string userName(name);
+        rescanUserDevices(userName);
+    }, SendQueue::BACKGROUND);
+}
+
+void AppInterfaceImpl::prefetchUserDevices(const string& userName, const list<string>& deviceIds)
+{
+    if (!lazyQueues_)
+        return;
+
+    // Prefetch only for users we already talk to, don't use up the pre-keys of other users
+    list<string>* devicesDb = store_->getLongDeviceIds(userName, ownUser_);
+    bool knownUser = !devicesDb->empty();
+    delete devicesDb;
+    if (!knownUser)
+        return;
+    SendQueue* prefetchQueue = getPrefetchQueue();
+
+    // One key per device: a repeated notification for the same device waits for the
+    // running prefetch and then finds the conversation
+    for (list<string>::const_iterator it = deviceIds.begin(); it != deviceIds.end(); ++it) {
+        if (userName == ownUser_ && *it == scClientDevId_)
+            continue;
+        string deviceId = *it;
+        prefetchQueue->enqueue(userName + ':' + deviceId, [this, userName, deviceId]() {
+            prefetchDevice(userName, deviceId);
+        });
+    }
+}
+
 void AppInterfaceImpl::setHttpHelper(HTTP_FUNC httpHelper)
 {
     ScProvisioning::setHttpHelper(httpHelper);
@@ -529,25 +968,156 @@ void AppInterfaceImpl::setHttpHelper(HTTP_FUNC httpHelper)
 // ***** Private functions 
 // *******************************
 
+// Encrypt the message for one device of the recipient and create the B64 encoded
+// message envelope. Runs on a worker thread, uses no state of AppInterfaceImpl.
+// The updated conversation stays in the job, the caller stores it.
+void AppInterfaceImpl::encryptForDevice(const string& ownUser, const string& scClientDevId, const string& recipient,
+                                        const string& msgId, const string& message, const string& supplements,
+                                        const string* detached, bool binary, size_t compressThreshold, int32_t wireVersion,
+                                        ConversationStore* store, DeviceJob* job)
+{
+    const string& recipientDeviceId = job->deviceId;
+
+    AxoConversation* axoConv = AxoConversation::loadConversation(ownUser, recipient, recipientDeviceId, store);
+    if (axoConv == NULL) {
+        Log("++++ Salamander Conversation is NULL. Owner: %s, receipient: %s, recipientDeviceId: %s", 
+            ownUser.c_str(), recipient.c_str(), recipientDeviceId.c_str());
+        return;
+    }
+    job->conv = axoConv;
+
+    string supplementsEncrypted;
+
+    // Encrypt the user's message and the supplementary data if necessary
+    pair<string, string> idHashes;
+    // The flag of a detached payload is in the authenticated part of the wire message
+    int32_t messageFlags = detached != NULL ? AxoRatchet::DETACHED : 0;
+    const string* wireMessage = AxoRatchet::encrypt(*axoConv, message, supplements, &supplementsEncrypted, &idHashes,
+                                                    compressThreshold, wireVersion, messageFlags);
+    if (wireMessage == NULL)
+        return;
+    bool hasIdHashes = !idHashes.first.empty() && !idHashes.second.empty();
+    /*
+     * Create the message envelope:
+     {
+         "name":           <string>         # sender's name
+         "scClientDevId":  <string>         # sender's long device id
+         "supplement":     <string>         # suplementary data, encrypted, B64
+         "message":        <string>         # message, encrypted, B64
+     }
+    */
+
+    MessageEnvelope envelope;
+    envelope.set_name(ownUser);
+    envelope.set_scclientdevid(scClientDevId);
+    envelope.set_msgid(msgId);
+    if (!supplementsEncrypted.empty())
+        envelope.set_supplement(supplementsEncrypted);
+    envelope.set_message(*wireMessage);
+    delete wireMessage;
+    if (detached != NULL)
+        envelope.set_detached(*detached);
+    if (hasIdHashes) {
+        envelope.set_recvidhash(idHashes.first.data(), 4);
+        envelope.set_senderidhash(idHashes.second.data(), 4);
+    }
+
+    uint8_t binDevId[20];
+    int32_t res = hex2bin(recipientDeviceId.c_str(), binDevId);
+    if (res >= 0)
+        envelope.set_recvdevidbin(binDevId, 4);
+//    envelope.set_recvdeviceid(recipientDeviceId);
+
+    string serialized = envelope.SerializeAsString();
+
+    // A binary-safe transport takes the serialized envelope as it is
+    if (binary) {
+        job->envelope.swap(serialized);
+        return;
+    }
+
+    // We need to have them in b64 encoding. Use twice the size of binary data, this
+    // is big enough to hold B64 plus paddling and terminator
+    job->envelope.resize(serialized.size()*2);
+    int32_t b64Len = b64Encode((const uint8_t*)serialized.data(), serialized.size(), &job->envelope[0], serialized.size()*2);
+    job->envelope.resize(b64Len);
+}
+
+void AppInterfaceImpl::prefetchDevice(const string& userName, const string& deviceId)
+{
+    if (store_->hasConversation(userName, deviceId, ownUser_))
+        return;
+
+    // Don't hold the conversation lock during the server request
+    pair<const DhPublicKey*, const DhPublicKey*> preIdKeys;
+    int32_t preKeyId = Provisioning::getPreKeyBundle(userName, deviceId, authorization_, &preIdKeys);
+    if (preKeyId == 0)
+        return;
+
+    vector<int32_t> stripes;
+    stripes.push_back(convLocks_.getStripe(ownUser_, userName, deviceId));
+    convLocks_.lockStripes(&stripes);
+
+    // The conversation takes the keys only if the setup succeeds
+    int32_t result = AxoPreKeyConnector::setupConversationAlice(ownUser_, userName, deviceId, preKeyId, preIdKeys, store_);
+    convLocks_.unlockStripes(stripes);
+
+    if (result != OK) {
+        delete preIdKeys.first;
+        delete preIdKeys.second;
+        if (result != AXO_CONV_EXISTS)
+            Log("++++ Prefetch for device %s of %s failed: %d", deviceId.c_str(), userName.c_str(), result);
+    }
+}
+
+void AppInterfaceImpl::storeCallResult(const CallContext& ctx)
+{
+    errorCode_ = ctx.getErrorCode();
+    errorInfo_ = ctx.getErrorInfo();
+}
+
 vector<int64_t>* AppInterfaceImpl::sendMessageInternal(const string& recipient, const string& msgId, const string& message,
-                                                       const string& attachementDescriptor, const string& messageAttributes)
+                                                       const string& attachementDescriptor, const string& messageAttributes,
+                                                       CallContext* ctx)
+{
+    vector<pair<string, string> >* msgPairs = encryptMessage(recipient, msgId, message, attachementDescriptor, messageAttributes, ctx);
+    if (msgPairs == NULL)
+        return NULL;
+
+    vector<int64_t>* returnMsgIds = sendEnvelopes(recipient, msgId, msgPairs);
+    delete msgPairs;
+    return returnMsgIds;
+}
+
+vector<pair<string, string> >* AppInterfaceImpl::encryptMessage(const string& recipient, const string& msgId, const string& message,
+                                                                const string& attachementDescriptor, const string& messageAttributes,
+                                                                CallContext* ctx)
 {
+    if (maintenance_ != NULL)
+        maintenance_->notifyActivity();
+
     // We got a message with embedded pre-key, thus the partner fetched one of our pre-keys from
     // the server. Countdown available pre keys.
-    errorCode_ = OK;
-    AxoConversation* localConv = AxoConversation::loadLocalConversation(ownUser_);
+    AxoConversation* localConv = AxoConversation::loadLocalConversation(ownUser_, store_);
     if (localConv != NULL) {
         int32_t numPreKeys = localConv->getPreKeysAvail();
+        delete localConv;
         if (numPreKeys < MIN_NUM_PRE_KEYS) {
             string result;
             int32_t code = Provisioning::newPreKeys(store_, scClientDevId_, authorization_, NUM_PRE_KEYS, &result);
             if (code == 200) {
-                numPreKeys += NUM_PRE_KEYS;
-                localConv->setPreKeysAvail(numPreKeys);
-                localConv->storeConversation();
+                // Don't hold the lock during the server request. Reload the local conversation,
+                // a received pre-key message may have changed the count in the meantime
+                convLocks_.lockLocal();
+                localConv = AxoConversation::loadLocalConversation(ownUser_, store_);
+                if (localConv != NULL) {
+                    localConv->setPreKeysAvail(localConv->getPreKeysAvail() + NUM_PRE_KEYS);
+                    localConv->storeConversation();
+                    delete localConv;
+                }
+                convLocks_.unlockLocal();
             }
         }
-        delete localConv;
     }
     bool toSibling = recipient == ownUser_;
 
@@ -555,108 +1125,169 @@ vector<int64_t>* AppInterfaceImpl::sendMessageInternal(const string& recipient,
     int32_t numDevices = devices->size();
 
     if (numDevices == 0) {
-        vector<pair<string, string> >* msgPairs = sendMessagePreKeys(recipient, msgId, message, attachementDescriptor, messageAttributes);
-        if (msgPairs == NULL) {
-            return NULL;
-        }
-        vector<int64_t>* returnMsgIds = transport_->sendAxoMessage(recipient, msgPairs);
-        delete msgPairs;
-        return returnMsgIds;
+        delete devices;
+        return sendMessagePreKeys(recipient, msgId, message, attachementDescriptor, messageAttributes, ctx);
     }
 
     string supplements;
     createSupplementString(attachementDescriptor, messageAttributes, &supplements);
 
-    // Prepare the messages for all known device of this user
-    vector<pair<string, string> >* msgPairs = new vector<pair<string, string> >;
+    // Don't send this to sender device, even when sending to my sibbling devices
+    vector<DeviceJob> jobs;
+    for (list<string>::iterator it = devices->begin(); it != devices->end(); ++it) {
+        if (toSibling && *it == scClientDevId_)
+            continue;
+        jobs.push_back(DeviceJob(*it));
+    }
+    delete devices;
 
-    convLock.Lock();
-    while (!devices->empty()) {
-        string recipientDeviceId = devices->front();
-        devices->pop_front();
+    vector<int32_t> stripes;
+    for (size_t i = 0; i < jobs.size(); i++)
+        stripes.push_back(convLocks_.getStripe(ownUser_, recipient, jobs[i].deviceId));
+    convLocks_.lockStripes(&stripes);
+
+    // A large payload is encrypted only once, the ratchet encrypts its key descriptor for
+    // each device. Send the payload with each device's message if this fails.
+    string keyDescriptor;
+    string detached;
+    bool detach = detachThreshold_ > 0 && jobs.size() > 1 && message.size() + supplements.size() >= detachThreshold_;
+    if (detach && detachPayload(message, supplements, &keyDescriptor, &detached) != SUCCESS) {
+        Log("++++ Detaching the payload of message %s failed", msgId.c_str());
+        detach = false;
+    }
+    const string& deviceMessage = detach ? keyDescriptor : message;
+    const string& deviceSupplements = detach ? Empty : supplements;
+    const string* devicePayload = detach ? &detached : NULL;
+    bool binary = isBinaryTransport();
+    size_t compressThreshold = compressThreshold_;
+    int32_t wireVersion = wireVersion_;
+
+    // Encrypt for all devices in parallel. The jobs only read the store, the updated
+    // conversations go to the store in one batch.
+    vector<function<void()> > work;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        DeviceJob* job = &jobs[i];
+        work.push_back([this, job, &recipient, &msgId, &deviceMessage, &deviceSupplements, devicePayload, binary, compressThreshold, wireVersion]() {
+            encryptForDevice(ownUser_, scClientDevId_, recipient, msgId, deviceMessage, deviceSupplements, devicePayload, binary, compressThreshold, wireVersion, store_, job);
+        });
+    }
+    if (workers_ != NULL)
+        workers_->runAll(work);
+    else {
+        for (size_t i = 0; i < work.size(); i++)
+            work[i]();
+    }
+    memset_volatile((void*)keyDescriptor.data(), 0, keyDescriptor.size());
 
-        // Don't send this to sender device, even when sending to my sibbling devices
-        if (toSibling && recipientDeviceId == scClientDevId_) {
-            continue;
-        }
+    list<AxoConversation*> conversations;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (jobs[i].conv != NULL)
+            conversations.push_back(jobs[i].conv);
+    }
+    int32_t storeResult = AxoConversation::storeConversations(conversations);
+    if (STORE_FAIL(storeResult))
+        Log("++++ Storing conversations of %s failed: %d", recipient.c_str(), storeResult);
 
-        AxoConversation* axoConv = AxoConversation::loadConversation(ownUser_, recipient, recipientDeviceId);
-        if (axoConv == NULL) {
-            Log("++++ Salamander Conversation is NULL. Owner: %s, receipient: %s, recipientDeviceId: %s", 
-                ownUser_.c_str(), recipient.c_str(), recipientDeviceId.c_str());
-            continue;
-        }
- 
-        string supplementsEncrypted;
+    for (list<AxoConversation*>::iterator it = conversations.begin(); it != conversations.end(); ++it)
+        delete *it;
+    convLocks_.unlockStripes(stripes);
 
-        // Encrypt the user's message and the supplementary data if necessary
-        pair<string, string> idHashes;
-        const string* wireMessage = AxoRatchet::encrypt(*axoConv, message, supplements, &supplementsEncrypted, &idHashes);
-        axoConv->storeConversation();
-        delete axoConv;
-        if (wireMessage == NULL)
+    // Assemble the messages in device order
+    vector<pair<string, string> >* msgPairs = new vector<pair<string, string> >;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (!jobs[i].envelope.empty())
+            msgPairs->push_back(pair<string, string>(jobs[i].deviceId, jobs[i].envelope));
+    }
+
+    if (msgPairs->empty()) {
+        delete msgPairs;
+        return NULL;
+    }
+    return msgPairs;
+}
+
+void AppInterfaceImpl::sendQueued(vector<TransportQueue::Item>* batch)
+{
+    // Only the transport queue's thread uses the batch and the id array
+    transportBatch_.clear();
+    vector<TransportQueue::Item*> sent;
+    for (size_t i = 0; i < batch->size(); i++) {
+        TransportQueue::Item& item = (*batch)[i];
+
+        // Keep the order of the recipient's messages, the envelopes wait behind the stored ones
+        if (outbox_ != NULL && outbox_->hasPending(item.recipient)) {
+            outbox_->add(item.recipient, item.msgId, item.msgPairs, false);
+            if (stateReportCallback_ != NULL)
+                messageStateReport(item.handle, OK, sendResultJson(item.recipient, OK, Empty, NULL));
             continue;
-        bool hasIdHashes = !idHashes.first.empty() && !idHashes.second.empty();
-        /*
-         * Create the message envelope:
-         {
-             "name":           <string>         # sender's name
-             "scClientDevId":  <string>         # sender's long device id
-             "supplement":     <string>         # suplementary data, encrypted, B64
-             "message":        <string>         # message, encrypted, B64
-         }
-        */
-
-        MessageEnvelope envelope;
-        envelope.set_name(ownUser_);
-        envelope.set_scclientdevid(scClientDevId_);
-        envelope.set_msgid(msgId);
-        if (!supplementsEncrypted.empty())
-            envelope.set_supplement(supplementsEncrypted);
-        envelope.set_message(*wireMessage);
-        if (hasIdHashes) {
-            envelope.set_recvidhash(idHashes.first.data(), 4);
-            envelope.set_senderidhash(idHashes.second.data(), 4);
         }
-
-        uint8_t binDevId[20];
-        int32_t res = hex2bin(recipientDeviceId.c_str(), binDevId);
-        if (res >= 0)
-            envelope.set_recvdevidbin(binDevId, 4);
-//        envelope.set_recvdeviceid(recipientDeviceId);
-
-        string serialized = envelope.SerializeAsString();
-
-        // We need to have them in b64 encoding, check if buffer is large enough. Allocate twice
-        // the size of binary data, this is big enough to hold B64 plus paddling and terminator
-        if (serialized.size() * 2 > tempBufferSize_) {
-            delete tempBuffer_;
-            tempBuffer_ = new char[serialized.size()*2];
-            tempBufferSize_ = serialized.size()*2;
+        for (size_t j = 0; j < item.msgPairs.size(); j++)
+            transportBatch_.add(item.recipient, item.msgPairs[j].first, item.msgPairs[j].second);
+        sent.push_back(&item);
+    }
+    transportIds_.assign(transportBatch_.size(), 0);
+    if (!transportBatch_.empty() && transport_ != NULL)
+        transport_->sendAxoBatch(&transportBatch_, &transportIds_[0], transportIds_.size());
+
+    size_t index = 0;
+    for (size_t i = 0; i < sent.size(); i++) {
+        TransportQueue::Item& item = *sent[i];
+        vector<int64_t> msgIds;
+        vector<pair<string, string> > failed;
+        for (size_t j = 0; j < item.msgPairs.size(); j++, index++) {
+            if (transportIds_[index] != 0)
+                msgIds.push_back(transportIds_[index]);
+            else
+                failed.push_back(item.msgPairs[j]);
         }
-        int32_t b64Len = b64Encode((const uint8_t*)serialized.data(), serialized.size(), tempBuffer_, tempBufferSize_);
+        if (!failed.empty() && outbox_ != NULL)
+            outbox_->add(item.recipient, item.msgId, failed, true);
 
-        // replace the binary data with B64 representation
-        serialized.assign(tempBuffer_, b64Len);
+        if (stateReportCallback_ != NULL)
+            messageStateReport(item.handle, OK, sendResultJson(item.recipient, OK, Empty, &msgIds));
+    }
+    transportBatch_.clear();
+}
 
-        pair<string, string> msgPair(recipientDeviceId, serialized);
-        msgPairs->push_back(msgPair);
+void AppInterfaceImpl::reportQueueWatermark(bool high, size_t depth)
+{
+    if (notifyCallback_ == NULL)
+        return;
+    char info[24];
+    snprintf(info, sizeof(info), "%lu", (unsigned long)depth);
+    notifyCallback_(high ? SEND_QUEUE_HIGH : SEND_QUEUE_LOW, string(info), Empty);
+}
 
-        supplementsEncrypted.clear();
-    }
-    convLock.Unlock();
-    delete devices;
+vector<int64_t>* AppInterfaceImpl::sendEnvelopes(const string& recipient, const string& msgId, vector<pair<string, string> >* msgPairs)
+{
+    if (outbox_ == NULL)
+        return transport_->sendAxoMessage(recipient, msgPairs);
 
-    vector<int64_t>* returnMsgIds = NULL;
-    if (!msgPairs->empty())
-        returnMsgIds = transport_->sendAxoMessage(recipient, msgPairs);
+    // Keep the order of the recipient's messages, the envelopes wait behind the stored ones
+    if (outbox_->hasPending(recipient)) {
+        outbox_->add(recipient, msgId, *msgPairs, false);
+        return new vector<int64_t>;
+    }
+    vector<int64_t>* results = transport_->sendAxoMessageResults(recipient, msgPairs);
+
+    vector<int64_t>* returnMsgIds = new vector<int64_t>;
+    vector<pair<string, string> > failed;
+    for (size_t i = 0; i < msgPairs->size(); i++) {
+        if (results != NULL && i < results->size() && (*results)[i] != 0)
+            returnMsgIds->push_back((*results)[i]);
+        else
+            failed.push_back((*msgPairs)[i]);
+    }
+    delete results;
 
-    delete msgPairs;
+    if (!failed.empty())
+        outbox_->add(recipient, msgId, failed, true);
     return returnMsgIds;
 }
 
 vector<pair<string, string> >* AppInterfaceImpl::sendMessagePreKeys(const string& recipient, const string& msgId, const string& message,
-                                                                    const string& attachementDescriptor, const string& messageAttributes)
+                                                                    const string& attachementDescriptor, const string& messageAttributes,
+                                                                    CallContext* ctx)
 {
     string supplements;
     createSupplementString(attachementDescriptor, messageAttributes, &supplements);
@@ -665,11 +1296,10 @@ vector<pair<string, string> >* AppInterfaceImpl::sendMessagePreKeys(const string
 
     list<pair<string, string> >* devices = NULL;
     if (!toSibling || !ownChecked_) {
-        devices = Provisioning::getAxoDeviceIds(recipient, authorization_);
+        devices = deviceCache_.getDeviceIds(recipient, authorization_);
     }
     if (devices == NULL || devices->empty()) {
-        errorCode_ = NO_DEVS_FOUND;
-        errorInfo_ = recipient;
+        ctx->setError(NO_DEVS_FOUND, recipient);
         delete devices;
         return NULL;
     }
@@ -677,7 +1307,11 @@ vector<pair<string, string> >* AppInterfaceImpl::sendMessagePreKeys(const string
     // Prepare the messages for all known devices of this user
     vector<pair<string, string> >* msgPairs = new vector<pair<string, string> >;
 
-    convLock.Lock();
+    vector<int32_t> stripes;
+    for (list<pair<string, string> >::iterator it = devices->begin(); it != devices->end(); ++it)
+        stripes.push_back(convLocks_.getStripe(ownUser_, recipient, it->first));
+    convLocks_.lockStripes(&stripes);
+
     while (!devices->empty()) {
         string recipientDeviceId = devices->front().first;
         string recipientDeviceName = devices->front().second;
@@ -688,7 +1322,7 @@ vector<pair<string, string> >* AppInterfaceImpl::sendMessagePreKeys(const string
             continue;
         }
 
-        int32_t result = createPreKeyMsg(recipient, recipientDeviceId, recipientDeviceName, message, supplements, msgId, msgPairs);
+        int32_t result = createPreKeyMsg(recipient, recipientDeviceId, recipientDeviceName, message, supplements, msgId, msgPairs, ctx);
         if (result == 0)   // no pre-key bundle available for name/device-id combination
             continue;
 
@@ -696,20 +1330,18 @@ vector<pair<string, string> >* AppInterfaceImpl::sendMessagePreKeys(const string
         if (result < 0) {
             delete msgPairs;
             delete devices;
-            errorCode_ = result;
-            errorInfo_ = recipientDeviceId;
-            convLock.Unlock();
+            ctx->setError(result, recipientDeviceId);
+            convLocks_.unlockStripes(stripes);
             return NULL;
         }
     }
-    convLock.Unlock();
+    convLocks_.unlockStripes(stripes);
     delete devices;
 
     if (msgPairs->empty()) {
         delete msgPairs;
         if (!toSibling) {
-            errorCode_ = NO_PRE_KEY_FOUND;
-            errorInfo_ = recipient;
+            ctx->setError(NO_PRE_KEY_FOUND, recipient);
         }
         else {
             ownChecked_ = true;
@@ -720,12 +1352,11 @@ vector<pair<string, string> >* AppInterfaceImpl::sendMessagePreKeys(const string
 }
 
 
-int32_t AppInterfaceImpl::parseMsgDescriptor(const string& messageDescriptor, string* recipient, string* msgId, string* message)
+int32_t AppInterfaceImpl::parseMsgDescriptor(const string& messageDescriptor, OutgoingMessage* message, CallContext* ctx)
 {
     cJSON* root = cJSON_Parse(messageDescriptor.c_str());
     if (root == NULL) {
-        errorInfo_ = "root";
-        errorCode_ = JS_FIELD_MISSING;
+        ctx->setError(JS_FIELD_MISSING, "root");
         return JS_FIELD_MISSING;
     }
 
@@ -733,28 +1364,28 @@ int32_t AppInterfaceImpl::parseMsgDescriptor(const string& messageDescriptor, st
     char* jsString = (cjTemp != NULL) ? cjTemp->valuestring : NULL;
 
     if (jsString == NULL) {
-        errorInfo_ = "recipient";
+        ctx->setError(JS_FIELD_MISSING, "recipient");
         goto cleanup;
     }
-    recipient->assign(jsString);
+    message->recipient.assign(jsString);
 
     // Get the message id
     cjTemp = cJSON_GetObjectItem(root, "msgId");
     jsString = (cjTemp != NULL) ? cjTemp->valuestring : NULL;
     if (jsString == NULL) {
-        errorInfo_ = "msgId";
+        ctx->setError(JS_FIELD_MISSING, "msgId");
         goto cleanup;
     }
-    msgId->assign(jsString);
+    message->msgId.assign(jsString);
 
     // Get the message
     cjTemp = cJSON_GetObjectItem(root, "message");
     jsString = (cjTemp != NULL) ? cjTemp->valuestring : NULL;
     if (jsString == NULL) {
-        errorInfo_ = "message";
+        ctx->setError(JS_FIELD_MISSING, "message");
         goto cleanup;
     }
-    message->assign(jsString);
+    message->message.assign(jsString);
     cJSON_Delete(root);    // Done with JSON root for message data
     return OK;
 
@@ -766,29 +1397,28 @@ cleanup:
 
 int32_t AppInterfaceImpl::createPreKeyMsg(const string& recipient,  const string& recipientDeviceId, const string& recipientDeviceName,
                                           const string& message, const string& supplements,
-                                          const string& msgId, vector<pair<string, string> >* msgPairs)
+                                          const string& msgId, vector<pair<string, string> >* msgPairs, CallContext* ctx)
 {
     pair<const DhPublicKey*, const DhPublicKey*> preIdKeys;
     int32_t preKeyId = Provisioning::getPreKeyBundle(recipient, recipientDeviceId, authorization_, &preIdKeys);
     if (preKeyId == 0)
         return 0;
 
-    int32_t buildResult = AxoPreKeyConnector::setupConversationAlice(ownUser_, recipient, recipientDeviceId, preKeyId, preIdKeys);
+    int32_t buildResult = AxoPreKeyConnector::setupConversationAlice(ownUser_, recipient, recipientDeviceId, preKeyId, preIdKeys, store_);
 
     // This is always a security issue: return immediately, don't process and send a message
     if (buildResult < 0) {
-        errorCode_ = buildResult;
-        errorInfo_ = recipientDeviceId;
+        ctx->setError(buildResult, recipientDeviceId);
         return buildResult;
     }
-    AxoConversation* axoConv = AxoConversation::loadConversation(ownUser_, recipient, recipientDeviceId);
+    AxoConversation* axoConv = AxoConversation::loadConversation(ownUser_, recipient, recipientDeviceId, store_);
     axoConv->setDeviceName(recipientDeviceName);
 
     string supplementsEncrypted;
 
     // Encrypt the user's message and the supplementary data if necessary
     pair<string, string> idHashes;
-    const string* wireMessage = AxoRatchet::encrypt(*axoConv, message, supplements, &supplementsEncrypted, &idHashes);
+    const string* wireMessage = AxoRatchet::encrypt(*axoConv, message, supplements, &supplementsEncrypted, &idHashes, compressThreshold_, wireVersion_);
     axoConv->storeConversation();
     delete axoConv;
 
@@ -825,17 +1455,16 @@ int32_t AppInterfaceImpl::createPreKeyMsg(const string& recipient,  const string
 
     string serialized = envelope.SerializeAsString();
 
-    // We need to have them in b64 encoding, check if buffer is large enough. Allocate twice
-    // the size of binary data, this is big enough to hold B64 plus padding and terminator
-    if (serialized.size() * 2 > tempBufferSize_) {
-        delete tempBuffer_;
-        tempBuffer_ = new char[serialized.size()*2];
-        tempBufferSize_ = serialized.size()*2;
-    }
-    int32_t b64Len = b64Encode((const uint8_t*)serialized.data(), serialized.size(), tempBuffer_, tempBufferSize_);
+    // A binary-safe transport takes the serialized envelope as it is
+    if (!isBinaryTransport()) {
+        // We need to have them in b64 encoding. Use twice the size of binary data, this
+        // is big enough to hold B64 plus padding and terminator
+        char* b64Buffer = ctx->getScratch(serialized.size()*2);
+        int32_t b64Len = b64Encode((const uint8_t*)serialized.data(), serialized.size(), b64Buffer, serialized.size()*2);
 
-    // replace the binary data with B64 representation
-    serialized.assign(tempBuffer_, b64Len);
+        // replace the binary data with B64 representation
+        serialized.assign(b64Buffer, b64Len);
+    }
 
     pair<string, string> msgPair(recipientDeviceId, serialized);
     msgPairs->push_back(msgPair);
@@ -846,7 +1475,7 @@ int32_t AppInterfaceImpl::createPreKeyMsg(const string& recipient,  const string
 string AppInterfaceImpl::getOwnIdentityKey() const
 {
     char b64Buffer[MAX_KEY_BYTES_ENCODED*2];   // Twice the max. size on binary data - b64 is times 1.5
-    AxoConversation* axoConv = AxoConversation::loadLocalConversation(ownUser_);
+    AxoConversation* axoConv = AxoConversation::loadLocalConversation(ownUser_, store_);
     if (axoConv == NULL)
         return Empty;
 
@@ -874,7 +1503,7 @@ list<string>* AppInterfaceImpl::getIdentityKeys(string& user) const
     while (!devices->empty()) {
         string recipientDeviceId = devices->front();
         devices->pop_front();
-        AxoConversation* axoConv = AxoConversation::loadConversation(ownUser_, user, recipientDeviceId);
+        AxoConversation* axoConv = AxoConversation::loadConversation(ownUser_, user, recipientDeviceId, store_);
         const DhPublicKey* idKey = axoConv->getDHIr();
 
         int b64Len = b64Encode((const uint8_t*)idKey->getPublicKeyPointer(), idKey->getSize(), b64Buffer, MAX_KEY_BYTES_ENCODED*2);
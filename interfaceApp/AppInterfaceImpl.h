@@ -22,13 +22,32 @@ limitations under the License.
  * @ingroup Salamander++
  * @{
  * 
- * The implementation of this class is not thread safe.
+ * The send and receive functions that take a CallContext are re-entrant, the
+ * application may call them on several threads at the same time. They serialize
+ * updates of the same conversation, see ConversationLocks.h. The asynchronous send
+ * functions are thread safe too. The other functions and the send and receive
+ * functions without a CallContext are not thread safe.
  */
 
 #include <stdint.h>
+#include <atomic>
+#include <map>
+#include <mutex>
 
 #include "AppInterface.h"
-#include "../storage/sqlite/SQLiteStoreConv.h"
+#include "../storage/ConversationStore.h"
+#include "../storage/StoreMaintenance.h"
+#include "ConversationLocks.h"
+#include "CallContext.h"
+#include "MessageData.h"
+#include "SendQueue.h"
+#include "Outbox.h"
+#include "DuplicateFilter.h"
+#include "TransportQueue.h"
+#include "ControlCoalescer.h"
+#include "../salamander/ratchet/SalRatchet.h"
+#include "../provisioning/DeviceCache.h"
+#include "../util/WorkerPool.h"
 
 // Same as in ScProvisioning, keep in sync
 typedef int32_t (*HTTP_FUNC)(const string& requestUri, const string& requestData, const string& method, string* response);
@@ -37,23 +56,33 @@ using namespace std;
 
 namespace salamander {
 class SipTransport;
+class AxoConversation;
 
 class AppInterfaceImpl : public AppInterface
 {
 public:
 #ifdef UNITTESTS
-    AppInterfaceImpl(SQLiteStoreConv* store) : AppInterface(), tempBuffer_(NULL), store_(store), transport_(NULL) {}
-    AppInterfaceImpl(SQLiteStoreConv* store, const string& ownUser, const string& authorization, const string& scClientDevId) : 
-                    AppInterface(), tempBuffer_(NULL), ownUser_(ownUser), authorization_(authorization), scClientDevId_(scClientDevId), 
-                    store_(store), transport_(NULL), ownChecked_(false) {}
+    AppInterfaceImpl(ConversationStore* store) : AppInterface(), store_(store), transport_(NULL), maintenance_(NULL), workers_(NULL), ownWorkers_(NULL), detachThreshold_(0), compressThreshold_(0), wireVersion_(AxoRatchet::WIRE_VERSION_1), sendQueue_(NULL), prefetchQueue_(NULL), outbox_(NULL), duplicateFilter_(NULL), transportQueue_(NULL), lazyQueues_(false), coalescer_(NULL), nextHandle_(1), receiveMsgCallback_(NULL), ownChecked_(false) {}
+    AppInterfaceImpl(ConversationStore* store, const string& ownUser, const string& authorization, const string& scClientDevId) : 
+                    AppInterface(), ownUser_(ownUser), authorization_(authorization), scClientDevId_(scClientDevId), 
+                    store_(store), transport_(NULL), maintenance_(NULL), workers_(NULL), ownWorkers_(NULL), detachThreshold_(0), compressThreshold_(0), wireVersion_(AxoRatchet::WIRE_VERSION_1), sendQueue_(NULL), prefetchQueue_(NULL), outbox_(NULL), duplicateFilter_(NULL), transportQueue_(NULL), lazyQueues_(false), coalescer_(NULL), nextHandle_(1), receiveMsgCallback_(NULL),
+                    ownChecked_(false) {}
 #endif
-    AppInterfaceImpl(const string& ownUser, const string& authorization, const string& scClientDevId, 
+    /**
+     * @brief Create the application interface for one account.
+     *
+     * Each account uses its own store. The caller owns the store, it must be open and
+     * must outlive this instance.
+     *
+     * @param store the account's open store
+     */
+    AppInterfaceImpl(ConversationStore* store, const string& ownUser, const string& authorization, const string& scClientDevId, 
                      RECV_FUNC receiveCallback, STATE_FUNC stateReportCallback, NOTIFY_FUNC notifyCallback);
 
     ~AppInterfaceImpl();
 
     // Documentation see AppInterface.h
-    void setTransport(Transport* transport) { transport_ = transport; }
+    void setTransport(Transport* transport) { transport_ = transport; if (outbox_ != NULL) outbox_->setTransport(transport); }
 
     Transport* getTransport()               { return transport_; }
 
@@ -63,6 +92,86 @@ public:
 
     int32_t receiveMessage(const string& messageEnvelope);
 
+    int64_t sendMessageAsync(const string& messageDescriptor, const string& attachementDescriptor, const string& messageAttributes);
+
+    int64_t sendMessageToSiblingsAsync(const string& messageDescriptor, const string& attachementDescriptor, const string& messageAttributes);
+
+    /**
+     * @brief Send a message, re-entrant version.
+     *
+     * Same as @c sendMessage but the function keeps its intermediate data in the call
+     * context and reports the error code and error information there instead of in
+     * this instance.
+     *
+     * @param ctx the call context of the calling thread
+     */
+    vector<int64_t>* sendMessage(const string& messageDescriptor, const string& attachementDescriptor, const string& messageAttributes,
+                                 CallContext* ctx);
+
+    /**
+     * @brief Send message to sibling devices, re-entrant version.
+     *
+     * @param ctx the call context of the calling thread
+     * @see sendMessage
+     */
+    vector<int64_t>* sendMessageToSiblings(const string& messageDescriptor, const string& attachementDescriptor, const string& messageAttributes,
+                                           CallContext* ctx);
+
+    /**
+     * @brief Receive a message, re-entrant version.
+     *
+     * @param ctx the call context of the calling thread
+     * @return @c OK or an error code, the context has the same error code
+     */
+    int32_t receiveMessage(const string& messageEnvelope, CallContext* ctx);
+
+    /**
+     * @brief Send a message, structured version.
+     *
+     * Same as @c sendMessage with a call context but takes the message data in a
+     * structure instead of the JSON message descriptor.
+     *
+     * @param message the message data
+     * @param ctx the call context of the calling thread
+     */
+    vector<int64_t>* sendMessage(const OutgoingMessage& message, CallContext* ctx);
+
+    /**
+     * @brief Send message to sibling devices, structured version.
+     *
+     * @param message the message data, the function ignores the recipient
+     * @param ctx the call context of the calling thread
+     */
+    vector<int64_t>* sendMessageToSiblings(const OutgoingMessage& message, CallContext* ctx);
+
+    /**
+     * @brief Send a message asynchronously, structured version.
+     *
+     * The queued send takes over the message data.
+     *
+     * @param message the message data
+     * @return the positive handle of the send, see @c sendMessageAsync
+     */
+    int64_t sendMessageAsync(OutgoingMessage&& message);
+
+    /**
+     * @brief Send message to sibling devices asynchronously, structured version.
+     *
+     * @param message the message data, the function ignores the recipient
+     * @return the positive handle of the send, see @c sendMessageAsync
+     */
+    int64_t sendMessageToSiblingsAsync(OutgoingMessage&& message);
+
+    /**
+     * @brief Set the structured receive callback.
+     *
+     * If set then the receive functions deliver the received messages to this callback
+     * instead of the receive callback with the JSON message descriptor.
+     *
+     * @param receiveCallback the callback, @c NULL selects the JSON receive callback
+     */
+    void setReceiveMessageCallback(RECV_MSG_FUNC receiveCallback) { receiveMsgCallback_ = receiveCallback; }
+
     void messageStateReport(int64_t messageIdentfier, int32_t statusCode, const string& stateInformation);
 
     string* getKnownUsers();
@@ -81,6 +190,10 @@ public:
 
     void rescanUserDevices(string& userName);
 
+    void rescanUserDevicesAsync(const string& userName);
+
+    void prefetchUserDevices(const string& userName, const list<string>& deviceIds);
+
     /**
      * @brief Return the stored error code.
      * 
@@ -90,7 +203,8 @@ public:
      * data.
      * 
      * Functions overwrite the stored error code only if they return @c NULL or some
-     * other error indicator.
+     * other error indicator. The send and receive functions always overwrite it, the
+     * versions with a CallContext report their error in the context only.
      * 
      * @return The stored error code.
      */
@@ -132,6 +246,179 @@ public:
 
     bool isRegistered()           {return ((flags_ & 0x1) == 1); }
 
+    /**
+     * @brief Get the store maintenance scheduler.
+     *
+     * @return the scheduler or @c NULL if this instance does not run store maintenance.
+     */
+    StoreMaintenance* getStoreMaintenance() { return maintenance_; }
+
+    /**
+     * @brief Get the store of this account.
+     */
+    ConversationStore* getStore()   { return store_; }
+
+    /**
+     * @brief Set the number of threads that encrypt a message for the recipient's devices.
+     *
+     * By default the account uses the process wide pool @c WorkerPool::shared, this
+     * function gives the account its own pool. 0 encrypts on the sending thread only.
+     * Call this function before sending messages.
+     */
+    void setWorkerThreads(int32_t threads) { delete ownWorkers_; ownWorkers_ = new WorkerPool(threads); workers_ = ownWorkers_; }
+
+    /**
+     * @brief Set the payload size to encrypt once for all devices of a recipient.
+     *
+     * If the message and the supplementary data together have at least @c threshold
+     * bytes and the recipient has more than one device then the functions encrypt
+     * the payload once with a random content key, see DetachedPayload.h. The ratchet
+     * then encrypts only the content key for each device.
+     *
+     * The default 0 disables this, enable it only if all devices of the recipients
+     * support detached payloads.
+     *
+     * @param threshold minimum payload size in bytes, 0 disables detached payloads
+     */
+    void setDetachThreshold(size_t threshold) { detachThreshold_ = threshold; }
+
+    /**
+     * @brief Compress messages before encryption.
+     *
+     * If the message and the supplementary data together have at least @c threshold
+     * bytes then the ratchet compresses them before it encrypts them and sets a flag
+     * in the wire message. The ratchet sends the message uncompressed if compression
+     * does not make it smaller.
+     *
+     * Compression leaks information through the length of the encrypted message. If
+     * an attacker can get data of his choice into a message that also contains a
+     * secret, then he may learn the secret by watching how the length changes, see
+     * the CRIME and BREACH attacks. Enable compression only if the messages don't mix
+     * such data, for example for attachment descriptors and long texts.
+     *
+     * The default 0 disables this, enable it only if all devices of the recipients
+     * support compressed messages.
+     *
+     * @param threshold minimum payload size in bytes, 0 disables compression
+     */
+    void setCompressThreshold(size_t threshold) { compressThreshold_ = threshold; }
+
+    /**
+     * @brief Set the layout of the wire messages this instance sends.
+     *
+     * Version 2 uses a compact header with varints and no inner length, it saves
+     * about a dozen bytes per message, see AxoRatchet::WIRE_VERSION_2. The receive
+     * functions read both versions.
+     *
+     * The default is version 1, switch to version 2 only if all devices of the
+     * recipients can read it.
+     *
+     * @param version @c AxoRatchet::WIRE_VERSION_1 or @c AxoRatchet::WIRE_VERSION_2
+     */
+    void setWireVersion(int32_t version) { wireVersion_ = version; }
+
+    /**
+     * @brief Pack the asynchronous control messages to a recipient into one message.
+     *
+     * The asynchronous send functions collect control messages for @c windowMillis
+     * and send them as one batch, see ControlCoalescer.h. The receive functions unpack
+     * a batch in any case.
+     *
+     * The default 0 sends each control message, enable coalescing only if all devices
+     * of the recipients unpack batches. Call this function before sending messages.
+     *
+     * @param windowMillis how long the first message of a batch waits, 0 disables coalescing
+     */
+    void setCoalesceWindow(int32_t windowMillis);
+
+    /**
+     * @brief Get the queue of the asynchronous send functions.
+     *
+     * User messages run in the interactive lane. Sibling sync messages and device
+     * rescans run in the background lane. The queue counts the waiting tasks per lane.
+     *
+     * The function creates the queue and starts its threads on first use.
+     *
+     * @return the queue or @c NULL if this instance sends asynchronous messages on the
+     *         calling thread.
+     */
+    SendQueue* getSendQueue();
+
+    /**
+     * @brief Get the queue that prefetches the pre-key bundles of new devices.
+     *
+     * The queue runs @c PREFETCH_THREADS server requests at the same time. The function
+     * creates the queue and starts its threads on first use.
+     *
+     * @return the queue or @c NULL if this instance does not prefetch pre-key bundles.
+     */
+    SendQueue* getPrefetchQueue();
+
+    static const int32_t PREFETCH_THREADS = 2;
+
+    /**
+     * @brief Get the device list cache of this account.
+     *
+     * The transport invalidates the device list of a user if it receives a device
+     * notification for this user.
+     */
+    DeviceCache* getDeviceCache() { return &deviceCache_; }
+
+    /**
+     * @brief Get the outbox of this account.
+     *
+     * The outbox keeps the envelopes that the transport could not send and retries
+     * them. The state report callback reports the result of these messages with
+     * message identifier 0, the @c otherInfo of the report is the message id.
+     *
+     * @return the outbox or @c NULL if this instance reports and drops the messages
+     *         that the transport could not send.
+     */
+    Outbox* getOutbox() { return outbox_; }
+
+    /**
+     * @brief Send the envelopes in the outbox now.
+     *
+     * Call this function if the network is available again. The outbox's thread sends
+     * the envelopes, several calls before it starts result in one flush.
+     */
+    void flushOutbox() { if (outbox_ != NULL) outbox_->requestFlush(); }
+
+    /**
+     * @brief Get the filter that drops envelopes the transport delivered before.
+     *
+     * The receive functions return @c DUPLICATE_MESSAGE for such an envelope and
+     * send no state report. The filter's counters show the dropped envelopes.
+     *
+     * @return the filter or @c NULL if this instance does not filter envelopes
+     */
+    DuplicateFilter* getDuplicateFilter() { return duplicateFilter_; }
+
+    /**
+     * @brief Get the queue between the asynchronous sends and the transport.
+     *
+     * The send threads queue the encrypted envelopes, the queue's thread hands them to
+     * the transport in batches. If the queue fills up, the notify callback reports
+     * @c SEND_QUEUE_HIGH, and @c SEND_QUEUE_LOW after it drained again. The function
+     * creates the queue and starts its thread on first use.
+     *
+     * @return the queue or @c NULL if the asynchronous sends call the transport directly
+     */
+    TransportQueue* getTransportQueue();
+
+    /**
+     * @brief Get the coalescer of the asynchronous control messages.
+     *
+     * The asynchronous send functions collect control messages, messages without text
+     * whose attributes carry a command, and send those to the same recipient as one
+     * message. A text message to the recipient flushes the collected messages first.
+     * The state report callback reports each collected message with its own handle.
+     *
+     * @return the coalescer or @c NULL if this instance sends each control message,
+     *         see @c setCoalesceWindow
+     */
+    ControlCoalescer* getControlCoalescer() { return coalescer_; }
+
 private:
     // not support for copy, assignment and equals
     AppInterfaceImpl ( const AppInterfaceImpl& other ) {}
@@ -142,30 +429,112 @@ private:
 #pragma clang diagnostic pop
 
     vector<int64_t>* sendMessageInternal(const string& recipient, const string& msgId, const string& message,
-                                         const string& attachementDescriptor, const string& messageAttributes);
+                                         const string& attachementDescriptor, const string& messageAttributes, CallContext* ctx);
+
+    // Encrypt a message for all devices of the recipient, return NULL if encryption failed for all
+    vector<pair<string, string> >* encryptMessage(const string& recipient, const string& msgId, const string& message,
+                                                  const string& attachementDescriptor, const string& messageAttributes, CallContext* ctx);
 
     vector<pair<string, string> >* sendMessagePreKeys(const string& recipient, const string& msgId, const string& message,
-                                                      const string& attachementDescriptor, const string& messageAttributes);
+                                                      const string& attachementDescriptor, const string& messageAttributes, CallContext* ctx);
+
+    int32_t parseMsgDescriptor(const string& messageDescriptor, OutgoingMessage* message, CallContext* ctx);
+
+    // Decrypt the message envelope, on error report the error and return the error code
+    int32_t decryptMessage(const string& messageEnvelope, IncomingMessage* received, CallContext* ctx);
 
-    int32_t parseMsgDescriptor(const string& messageDescriptor, string* recipient, string* msgId, string* message );
+    // Create the JSON message descriptor and call the JSON receive callback
+    int32_t deliverJson(const IncomingMessage& message);
 
     int32_t createPreKeyMsg(const string& recipient, const string& recipientDeviceId, const string& recipientDeviceName, const string& message, 
-                            const string& supplements, const string& msgId, vector< pair< string, string > >* msgPairs );
-    char* tempBuffer_;
-    size_t tempBufferSize_;
+                            const string& supplements, const string& msgId, vector< pair< string, string > >* msgPairs, CallContext* ctx);
+
+    // Queue a send, the queue's thread reports the result via the state report callback
+    int64_t enqueueSend(OutgoingMessage&& message, SendQueue::Priority priority);
+
+    // Queue the send task of a message with its handle
+    void queueSend(int64_t handle, OutgoingMessage&& message, SendQueue::Priority priority);
+
+    // Queue a batch of collected control messages as one message, called by the coalescer
+    void sendCoalesced(const string& recipient, vector<ControlCoalescer::Entry>* entries);
+
+    // Deliver a received message to the structured or the JSON receive callback
+    void deliver(IncomingMessage&& message);
+
+    // Send envelopes via the transport, the outbox takes the envelopes the transport could not send
+    vector<int64_t>* sendEnvelopes(const string& recipient, const string& msgId, vector<pair<string, string> >* msgPairs);
+
+    // Send a batch of the transport queue and report the results, runs on the queue's thread
+    void sendQueued(vector<TransportQueue::Item>* batch);
+
+    // Report a watermark of the transport queue via the notify callback
+    void reportQueueWatermark(bool high, size_t depth);
+
+    // Report the result of a message in the outbox via the state report callback
+    void reportOutbox(const string& recipient, const string& msgId, int32_t code, const vector<int64_t>& msgIds);
+
+    // Fetch the pre-key bundle of a device and set up the conversation, runs on the prefetch queue
+    void prefetchDevice(const string& userName, const string& deviceId);
+
+    // Copy the result of a call into errorCode_ and errorInfo_ for the functions without call context
+    void storeCallResult(const CallContext& ctx);
+
+    // Encryption job for one device of the recipient
+    struct DeviceJob {
+        DeviceJob(const string& devId) : deviceId(devId), conv(NULL) {}
+        string deviceId;
+        AxoConversation* conv;      //!< the updated conversation, NULL if none was found
+        string envelope;            //!< the message envelope, B64 encoded for a text transport, empty if encryption failed
+    };
+
+    // If detached is not NULL then message and supplements contain the key descriptor of the
+    // detached payload, the envelope carries the detached payload. If binary is true then the
+    // envelope is not B64 encoded. compressThreshold and wireVersion are passed to the ratchet.
+    static void encryptForDevice(const string& ownUser, const string& scClientDevId, const string& recipient,
+                                 const string& msgId, const string& message, const string& supplements,
+                                 const string* detached, bool binary, size_t compressThreshold, int32_t wireVersion,
+                                 ConversationStore* store, DeviceJob* job);
+
+    // The transport takes and delivers binary envelopes
+    bool isBinaryTransport() const { return transport_ != NULL && transport_->isBinarySafe(); }
+
     string ownUser_;
     string authorization_;
     string scClientDevId_;
 
     int32_t errorCode_;
     string errorInfo_;
-    SQLiteStoreConv* store_;
+    ConversationStore* store_;
     Transport* transport_;
+    StoreMaintenance* maintenance_;
+    WorkerPool* workers_;           //!< encrypts a message for several devices in parallel
+    WorkerPool* ownWorkers_;        //!< pool of this account only, set by setWorkerThreads
+    size_t detachThreshold_;        //!< minimum payload size to encrypt once for all devices, 0 disables
+    size_t compressThreshold_;      //!< minimum payload size to compress before encryption, 0 disables
+    int32_t wireVersion_;           //!< layout of the sent wire messages
+    SendQueue* sendQueue_;          //!< runs the asynchronous sends
+    SendQueue* prefetchQueue_;      //!< sets up the conversations with new devices
+    Outbox* outbox_;                //!< retries the envelopes the transport could not send
+    DuplicateFilter* duplicateFilter_;  //!< drops replayed envelopes before decryption
+    TransportQueue* transportQueue_;    //!< hands the asynchronous sends to the transport in batches
+    bool lazyQueues_;                   //!< create the queues on first use, false keeps them NULL
+    std::once_flag sendQueueOnce_;
+    std::once_flag prefetchQueueOnce_;
+    std::once_flag transportQueueOnce_;
+    SendBatch transportBatch_;          //!< used by the transport queue's thread only
+    vector<int64_t> transportIds_;      //!< used by the transport queue's thread only
+    ControlCoalescer* coalescer_;       //!< packs the asynchronous control messages to a recipient
+    std::map<int64_t, vector<int64_t> > coalescedHandles_;  //!< handle of a batch -> handles of its messages
+    std::mutex coalescedLock_;
+    std::atomic<int64_t> nextHandle_;   //!< handle of the next asynchronous send
+    RECV_MSG_FUNC receiveMsgCallback_;  //!< structured receive callback, NULL to use the JSON callback
     int32_t flags_;
     // If this is true then we checked own device and see only one device for
     // this account. If another device registeres for this account it sends out
     // a sync message, the client receives this and we have a second device
-    bool ownChecked_;
+    std::atomic<bool> ownChecked_;  //!< set and read by the send queue threads and the worker pool
+    ConversationLocks convLocks_;   //!< serialize updates of the same conversation of this account
+    DeviceCache deviceCache_;       //!< device lists of the recipients
 };
 } // namespace
 
@@ -0,0 +1,106 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef CALLCONTEXT_H
+#define CALLCONTEXT_H
+
+/**
+ * @file CallContext.h
+ * @brief Per-call state and result of a send or receive call
+ * @ingroup Salamander++
+ * @{
+ *
+ * A send or receive call that gets a call context keeps all its intermediate
+ * data in the context and reports its result there. Calls with different
+ * contexts don't share mutable state, thus the application may send and receive
+ * messages on several threads at the same time.
+ *
+ * A context belongs to one thread. The application may reuse it for further
+ * calls on that thread, each call resets the result and keeps the scratch
+ * buffer.
+ */
+
+#include <string>
+#include <stdint.h>
+
+#include "../salamander/Constants.h"
+
+namespace salamander {
+
+class CallContext
+{
+public:
+    CallContext() : errorCode_(OK), scratch_(NULL), scratchSize_(0) {}
+
+    ~CallContext() { delete[] scratch_; scratch_ = NULL; scratchSize_ = 0; }
+
+    /**
+     * @brief Clear the result of a previous call.
+     */
+    void reset() { errorCode_ = OK; errorInfo_.clear(); }
+
+    /**
+     * @brief Set the result of the call.
+     *
+     * @param code the error code, one of the codes in Constants.h
+     * @param info additional information, for example the device id that caused the error
+     */
+    void setError(int32_t code, const std::string& info) { errorCode_ = code; errorInfo_ = info; }
+
+    void setErrorCode(int32_t code) { errorCode_ = code; }
+
+    /**
+     * @brief Get the error code of the call, @c OK if the call succeeded.
+     */
+    int32_t getErrorCode() const { return errorCode_; }
+
+    /**
+     * @brief Get the additional error information of the call.
+     */
+    const std::string& getErrorInfo() const { return errorInfo_; }
+
+    /**
+     * @brief Get a scratch buffer of at least @c size bytes.
+     *
+     * The buffer belongs to the context and stays valid until the next call of
+     * this function, it grows if necessary.
+     */
+    char* getScratch(size_t size)
+    {
+        if (size > scratchSize_) {
+            delete[] scratch_;
+            scratch_ = new char[size];
+            scratchSize_ = size;
+        }
+        return scratch_;
+    }
+
+private:
+    // No copies, the context owns the scratch buffer
+    CallContext(const CallContext& other);
+    CallContext& operator=(const CallContext& other);
+
+    int32_t errorCode_;
+    std::string errorInfo_;
+    char* scratch_;
+    size_t scratchSize_;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // CALLCONTEXT_H
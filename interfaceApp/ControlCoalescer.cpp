@@ -0,0 +1,223 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "ControlCoalescer.h"
+
+#include "../util/cJSON.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+using namespace salamander;
+using namespace std;
+
+const int32_t ControlCoalescer::DEFAULT_WINDOW_MS;
+const int32_t ControlCoalescer::DEFAULT_MAX_MESSAGES;
+const size_t ControlCoalescer::MAX_ATTRIBUTES_SIZE;
+
+static const char* batchCommand = "batch";
+
+ControlCoalescer::ControlCoalescer(const FLUSH_FUNC& flush, int32_t windowMillis, int32_t maxMessages) :
+                                   flush_(flush), window_(windowMillis < 0 ? 0 : windowMillis),
+                                   maxMessages_(maxMessages < 1 ? 1 : maxMessages), coalesced_(0), batches_(0), stop_(false)
+{
+    thread_ = thread(&ControlCoalescer::run, this);
+}
+
+ControlCoalescer::~ControlCoalescer()
+{
+    {
+        unique_lock<mutex> lck(lock_);
+        stop_ = true;
+    }
+    changed_.notify_all();
+    thread_.join();
+}
+
+bool ControlCoalescer::isControl(const OutgoingMessage& message)
+{
+    if (!message.message.empty() || !message.attachment.empty() || message.attributes.empty() ||
+        message.attributes.size() > MAX_ATTRIBUTES_SIZE)
+        return false;
+
+    // Parse only attributes that may have a command
+    if (message.attributes.find("\"cmd\"") == string::npos)
+        return false;
+
+    cJSON* root = cJSON_Parse(message.attributes.c_str());
+    cJSON* cmd = cJSON_GetObjectItem(root, "cmd");
+    bool control = cmd != NULL && cmd->type == cJSON_String && strcmp(cmd->valuestring, batchCommand) != 0;
+    cJSON_Delete(root);
+    return control;
+}
+
+void ControlCoalescer::add(int64_t handle, SendQueue::Priority priority, OutgoingMessage&& message)
+{
+    vector<Entry> full;
+    string recipient = message.recipient;
+    {
+        unique_lock<mutex> lck(lock_);
+        map<string, Pending>::iterator it = pending_.find(recipient);
+        if (it == pending_.end()) {
+            it = pending_.insert(pair<string, Pending>(recipient, Pending())).first;
+            it->second.due = chrono::steady_clock::now() + window_;
+            changed_.notify_all();
+        }
+        it->second.entries.push_back(Entry());
+        Entry& entry = it->second.entries.back();
+        entry.handle = handle;
+        entry.priority = priority;
+        entry.message = std::move(message);
+
+        if (it->second.entries.size() < maxMessages_)
+            return;
+    }
+    // A full batch does not wait for the window
+    flush(recipient);
+}
+
+void ControlCoalescer::flush(const string& recipient)
+{
+    vector<Entry> entries;
+    unique_lock<mutex> lck(lock_);
+    map<string, Pending>::iterator it = pending_.find(recipient);
+    if (it == pending_.end())
+        return;
+    take(it, &entries);
+
+    // Send with the lock, a message queued after this call must not overtake the batch
+    send(recipient, &entries);
+}
+
+void ControlCoalescer::flushAll()
+{
+    unique_lock<mutex> lck(lock_);
+    while (!pending_.empty()) {
+        string recipient = pending_.begin()->first;
+        vector<Entry> entries;
+        take(pending_.begin(), &entries);
+        send(recipient, &entries);
+    }
+}
+
+void ControlCoalescer::take(map<string, Pending>::iterator it, vector<Entry>* entries)
+{
+    entries->swap(it->second.entries);
+    pending_.erase(it);
+    batches_++;
+    if (entries->size() > 1)
+        coalesced_ += entries->size();
+}
+
+void ControlCoalescer::send(const string& recipient, vector<Entry>* entries)
+{
+    if (flush_)
+        flush_(recipient, entries);
+}
+
+string ControlCoalescer::pack(const vector<Entry>& entries)
+{
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "cmd", batchCommand);
+
+    cJSON* msgs;
+    cJSON_AddItemToObject(root, "msgs", msgs = cJSON_CreateArray());
+    for (size_t i = 0; i < entries.size(); i++) {
+        cJSON* msg = cJSON_CreateObject();
+        cJSON_AddStringToObject(msg, "id", entries[i].message.msgId.c_str());
+        cJSON_AddStringToObject(msg, "m", entries[i].message.attributes.c_str());
+        cJSON_AddItemToArray(msgs, msg);
+    }
+    char *out = cJSON_PrintUnformatted(root);
+    string attributes(out);
+    cJSON_Delete(root); free(out);
+
+    return attributes;
+}
+
+bool ControlCoalescer::unpack(const IncomingMessage& batch, vector<IncomingMessage>* messages)
+{
+    if (!batch.message.empty() || batch.attributes.find(batchCommand) == string::npos)
+        return false;
+
+    cJSON* root = cJSON_Parse(batch.attributes.c_str());
+    cJSON* cmd = cJSON_GetObjectItem(root, "cmd");
+    cJSON* msgs = cJSON_GetObjectItem(root, "msgs");
+    if (cmd == NULL || cmd->type != cJSON_String || strcmp(cmd->valuestring, batchCommand) != 0 ||
+        msgs == NULL || msgs->type != cJSON_Array) {
+        cJSON_Delete(root);
+        return false;
+    }
+    int32_t size = cJSON_GetArraySize(msgs);
+    for (int32_t i = 0; i < size; i++) {
+        cJSON* msg = cJSON_GetArrayItem(msgs, i);
+        cJSON* id = cJSON_GetObjectItem(msg, "id");
+        cJSON* attributes = cJSON_GetObjectItem(msg, "m");
+        if (id == NULL || id->type != cJSON_String || attributes == NULL || attributes->type != cJSON_String)
+            continue;
+
+        messages->push_back(IncomingMessage());
+        IncomingMessage& message = messages->back();
+        message.sender = batch.sender;
+        message.scClientDevId = batch.scClientDevId;
+        message.msgId = id->valuestring;
+        message.attributes = attributes->valuestring;
+    }
+    cJSON_Delete(root);
+    return true;
+}
+
+uint64_t ControlCoalescer::getCoalesced()
+{
+    unique_lock<mutex> lck(lock_);
+    return coalesced_;
+}
+
+uint64_t ControlCoalescer::getBatches()
+{
+    unique_lock<mutex> lck(lock_);
+    return batches_;
+}
+
+void ControlCoalescer::run()
+{
+    unique_lock<mutex> lck(lock_);
+    while (true) {
+        if (pending_.empty()) {
+            if (stop_)
+                return;
+            changed_.wait(lck);
+            continue;
+        }
+        // Send the batches whose window closed, all batches if the coalescer stops
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        chrono::steady_clock::time_point next = chrono::steady_clock::time_point::max();
+        map<string, Pending>::iterator it = pending_.begin();
+        while (it != pending_.end()) {
+            if (!stop_ && it->second.due > now) {
+                if (it->second.due < next)
+                    next = it->second.due;
+                ++it;
+                continue;
+            }
+            string recipient = it->first;
+            vector<Entry> entries;
+            take(it++, &entries);
+            send(recipient, &entries);
+        }
+        if (next != chrono::steady_clock::time_point::max())
+            changed_.wait_until(lck, next);
+    }
+}
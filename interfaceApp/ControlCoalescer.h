@@ -0,0 +1,183 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef CONTROLCOALESCER_H
+#define CONTROLCOALESCER_H
+
+/**
+ * @file ControlCoalescer.h
+ * @brief Packs small control messages to the same recipient into one message
+ * @ingroup Salamander++
+ * @{
+ *
+ * Control messages, for example delivery and read receipts or sync commands,
+ * have no text and carry a command in their message attributes. Each of them
+ * costs a ratchet step and an envelope per device. The coalescer collects the
+ * asynchronous control messages to a recipient for a short window and hands
+ * them over as one batch. The send functions encrypt the batch as one message
+ * whose attributes hold the commands and message ids of all collected messages.
+ *
+ * The receive functions unpack a batch and deliver each control message with
+ * its own message id, the application does not see the batch. The sender gets
+ * a state report for each collected message.
+ *
+ * A text message must not overtake the control messages that were sent before
+ * it, flush the recipient's batch before such a message is queued.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "MessageData.h"
+#include "SendQueue.h"
+
+namespace salamander {
+
+class ControlCoalescer
+{
+public:
+    static const int32_t DEFAULT_WINDOW_MS = 20;        //!< How long the first message of a batch waits
+    static const int32_t DEFAULT_MAX_MESSAGES = 32;     //!< A full batch leaves at once
+    static const size_t MAX_ATTRIBUTES_SIZE = 1024;     //!< Larger attributes are not a small control message
+
+    /**
+     * @brief A collected control message.
+     */
+    struct Entry {
+        Entry() : handle(0), priority(SendQueue::BACKGROUND) {}
+        int64_t handle;                 //!< the handle the send function returned
+        SendQueue::Priority priority;   //!< the lane the message would have used
+        OutgoingMessage message;
+    };
+
+    /**
+     * @brief Send the batch of a recipient.
+     *
+     * Called on the coalescer's thread when the window closed, or on the thread that
+     * calls @c add or @c flush. The coalescer holds its lock during the call, the
+     * function must not call the coalescer and should only queue the send.
+     */
+    typedef std::function<void(const std::string& recipient, std::vector<Entry>* entries)> FLUSH_FUNC;
+
+    /**
+     * @brief Create the coalescer and start its thread.
+     *
+     * @param flush the function that sends a batch
+     * @param windowMillis how long the first message of a batch waits for more messages
+     * @param maxMessages maximum number of messages in a batch
+     */
+    ControlCoalescer(const FLUSH_FUNC& flush, int32_t windowMillis = DEFAULT_WINDOW_MS,
+                     int32_t maxMessages = DEFAULT_MAX_MESSAGES);
+
+    /**
+     * @brief Flush the collected messages and stop the thread.
+     */
+    ~ControlCoalescer();
+
+    /**
+     * @brief Check if a message is a small control message.
+     *
+     * A control message has no text and no attachment, its attributes contain a
+     * @c cmd field.
+     */
+    static bool isControl(const OutgoingMessage& message);
+
+    /**
+     * @brief Collect a control message.
+     *
+     * Safe to call from several threads.
+     */
+    void add(int64_t handle, SendQueue::Priority priority, OutgoingMessage&& message);
+
+    /**
+     * @brief Send the collected messages of a recipient now, on the calling thread.
+     */
+    void flush(const std::string& recipient);
+
+    /**
+     * @brief Send the collected messages of all recipients now, on the calling thread.
+     */
+    void flushAll();
+
+    /**
+     * @brief Create the message attributes of a batch.
+     *
+     * @param entries the control messages, at least one
+     * @return the JSON attributes with the command and message id of each message
+     */
+    static std::string pack(const std::vector<Entry>& entries);
+
+    /**
+     * @brief Unpack a received batch into its control messages.
+     *
+     * @param batch the received message
+     * @param messages gets the control messages, with the sender of the batch
+     * @return @c true if the message is a batch
+     */
+    static bool unpack(const IncomingMessage& batch, std::vector<IncomingMessage>* messages);
+
+    /**
+     * @brief Number of control messages that went out in a batch with others.
+     */
+    uint64_t getCoalesced();
+
+    /**
+     * @brief Number of batches sent.
+     */
+    uint64_t getBatches();
+
+private:
+    ControlCoalescer(const ControlCoalescer& other);
+    ControlCoalescer& operator=(const ControlCoalescer& other);
+
+    struct Pending {
+        std::chrono::steady_clock::time_point due;
+        std::vector<Entry> entries;
+    };
+
+    // Takes the entries of a recipient, called with the lock held
+    void take(std::map<std::string, Pending>::iterator it, std::vector<Entry>* entries);
+
+    void send(const std::string& recipient, std::vector<Entry>* entries);
+
+    void run();
+
+    FLUSH_FUNC flush_;
+    std::chrono::milliseconds window_;
+    size_t maxMessages_;
+    std::map<std::string, Pending> pending_;
+    uint64_t coalesced_;
+    uint64_t batches_;
+
+    std::mutex lock_;
+    std::condition_variable changed_;
+    bool stop_;
+    std::thread thread_;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // CONTROLCOALESCER_H
@@ -0,0 +1,77 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "ConversationLocks.h"
+
+#include <algorithm>
+
+using namespace salamander;
+using namespace std;
+
+// Hash a field with FNV-1a and mix it into the hash. FNV alone spreads small
+// differences badly, for example "peer_0"/"devId_0" and "peer_1"/"devId_1"
+// land on the same stripe, thus finalize each field with the murmur3 mixer.
+static uint32_t hashField(uint32_t hash, const string& field)
+{
+    uint32_t fnv = 2166136261U;
+    for (size_t i = 0; i < field.size(); i++) {
+        fnv ^= (uint8_t)field[i];
+        fnv *= 16777619U;
+    }
+    hash = (hash ^ fnv) * 0x9e3779b1U;
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+const int32_t ConversationLocks::DEFAULT_STRIPES;
+
+ConversationLocks::ConversationLocks(int32_t stripes) : numStripes_(stripes > 0 ? stripes : 1)
+{
+    stripes_ = new CMutexClass[numStripes_];
+}
+
+ConversationLocks::~ConversationLocks()
+{
+    delete[] stripes_;
+}
+
+int32_t ConversationLocks::getStripe(const string& localUser, const string& user, const string& deviceId) const
+{
+    uint32_t hash = 0;
+    hash = hashField(hash, localUser);
+    hash = hashField(hash, user);
+    hash = hashField(hash, deviceId);
+    return hash % numStripes_;
+}
+
+void ConversationLocks::lockStripes(vector<int32_t>* stripes)
+{
+    sort(stripes->begin(), stripes->end());
+    stripes->erase(unique(stripes->begin(), stripes->end()), stripes->end());
+
+    for (size_t i = 0; i < stripes->size(); i++)
+        stripes_[(*stripes)[i]].Lock();
+}
+
+void ConversationLocks::unlockStripes(const vector<int32_t>& stripes)
+{
+    for (size_t i = stripes.size(); i > 0; i--)
+        stripes_[stripes[i-1]].Unlock();
+}
@@ -0,0 +1,111 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef CONVERSATIONLOCKS_H
+#define CONVERSATIONLOCKS_H
+
+/**
+ * @file ConversationLocks.h
+ * @brief Striped locks that serialize updates of the same conversation
+ * @ingroup Salamander++
+ * @{
+ *
+ * Encrypt and decrypt read a conversation, update the ratchet state and store the
+ * conversation again. Two such updates of the same conversation must not overlap,
+ * updates of different conversations may run in parallel.
+ *
+ * The lock of a conversation is one of a fixed number of stripes, selected by a hash
+ * of the local user, the peer's name and the peer's device id. Different conversations
+ * may share a stripe, this serializes their updates but is otherwise harmless.
+ *
+ * To avoid deadlocks the functions follow a fixed lock order:
+ * - a thread that needs several stripes, for example to send a message to all devices
+ *   of a peer, locks them in one call to @c lockStripes, which locks them in ascending
+ *   order
+ * - a thread that holds stripes does not lock further stripes until it unlocks them
+ * - the lock of the local conversation comes last: a thread may lock it while it holds
+ *   stripes, but must not lock stripes while it holds the local conversation lock
+ */
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <common/Thread.h>
+
+namespace salamander {
+
+class ConversationLocks
+{
+public:
+    static const int32_t DEFAULT_STRIPES = 64;
+
+    /**
+     * @brief Create a set of striped conversation locks.
+     *
+     * @param stripes number of stripes, 1 makes this a single lock for all conversations
+     */
+    explicit ConversationLocks(int32_t stripes = DEFAULT_STRIPES);
+
+    ~ConversationLocks();
+
+    /**
+     * @brief Get the stripe of a conversation.
+     */
+    int32_t getStripe(const std::string& localUser, const std::string& user, const std::string& deviceId) const;
+
+    /**
+     * @brief Lock a set of stripes.
+     *
+     * The function sorts the stripes and removes duplicates, then locks the stripes in
+     * ascending order. Pass the same vector to @c unlockStripes.
+     *
+     * @param stripes the stripes to lock, the function sorts the vector
+     */
+    void lockStripes(std::vector<int32_t>* stripes);
+
+    /**
+     * @brief Unlock stripes that @c lockStripes locked.
+     */
+    void unlockStripes(const std::vector<int32_t>& stripes);
+
+    /**
+     * @brief Lock the local conversation.
+     *
+     * The local conversation holds the account's identity key and the number of
+     * available pre-keys.
+     */
+    void lockLocal()   { localLock_.Lock(); }
+
+    void unlockLocal() { localLock_.Unlock(); }
+
+    int32_t getNumStripes() const { return numStripes_; }
+
+private:
+    // No copies, the mutexes cannot be copied
+    ConversationLocks(const ConversationLocks& other);
+    ConversationLocks& operator=(const ConversationLocks& other);
+
+    int32_t numStripes_;
+    CMutexClass* stripes_;
+    CMutexClass localLock_;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // CONVERSATIONLOCKS_H
@@ -0,0 +1,173 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "DetachedPayload.h"
+
+#include "../salamander/Constants.h"
+#include "../attachments/fileHandler/scloud.h"
+#include "../util/cJSON.h"
+
+#include <cryptcommon/ZrtpRandom.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+using namespace salamander;
+using namespace std;
+
+// The random nonce precedes the supplementary data in the SCloud meta data. SCloud
+// derives the key from the hash of meta data and data, thus the nonce makes the key
+// random, even for equal messages.
+static const size_t NONCE_LENGTH = 16;
+
+static void *(*volatile memset_volatile)(void *, int, size_t) = memset;
+
+// Hash the payload and get the locator. The context uses the buffers, it does not copy them.
+static SCLError computeLocator(const string& message, const string& meta, SCloudContextRef* scCtx, string* locator)
+{
+    SCLError err = SCloudEncryptNew(NULL, 0, (void*)message.data(), message.size(), (void*)meta.data(), meta.size(),
+                                    NULL, NULL, scCtx);
+    if (err != kSCLError_NoErr)
+        return err;
+
+    err = SCloudCalculateKey(*scCtx, 0);
+    if (err != kSCLError_NoErr)
+        return err;
+
+    uint8_t buffer[SCLOUD_LOCATOR_LEN * 2];
+    size_t bufSize = sizeof(buffer);
+    err = SCloudEncryptGetLocatorREST(*scCtx, buffer, &bufSize);
+    if (err != kSCLError_NoErr)
+        return err;
+
+    locator->assign((const char*)buffer, bufSize);
+    return kSCLError_NoErr;
+}
+
+int32_t salamander::detachPayload(const string& message, const string& supplements, string* keyDescriptor, string* detached)
+{
+    uint8_t nonce[NONCE_LENGTH];
+    ZrtpRandom::getRandomData(nonce, NONCE_LENGTH);
+
+    string meta((const char*)nonce, NONCE_LENGTH);
+    meta.append(supplements);
+
+    SCloudContextRef scCtx = kInvalidSCloudContextRef;
+    string locator;
+    uint8_t* blob = NULL;
+    size_t blobSize = 0;
+    size_t encryptedSize;
+
+    SCLError err = computeLocator(message, meta, &scCtx, &locator);
+    if (err != kSCLError_NoErr)
+        goto cleanup;
+
+    err = SCloudEncryptGetKeyBLOB(scCtx, &blob, &blobSize);
+    if (err != kSCLError_NoErr)
+        goto cleanup;
+
+    // SCloudEncryptBufferSize covers header, meta data, data and padding, one call encrypts all
+    encryptedSize = SCloudEncryptBufferSize(scCtx);
+    detached->resize(encryptedSize);
+    err = SCloudEncryptNext(scCtx, (uint8_t*)&(*detached)[0], &encryptedSize);
+    if (err != kSCLError_NoErr)
+        goto cleanup;
+    detached->resize(encryptedSize);
+
+    {
+        /*
+         * The key descriptor:
+         {
+             "k": <string>,         # SCloud key blob, JSON
+             "l": <string>          # SCloud locator of the payload, URL64
+         }
+         */
+        cJSON* root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "k", string((const char*)blob, blobSize).c_str());
+        cJSON_AddStringToObject(root, "l", locator.c_str());
+
+        char *out = cJSON_PrintUnformatted(root);
+        keyDescriptor->assign(out);
+        cJSON_Delete(root); memset_volatile(out, 0, strlen(out)); free(out);
+    }
+
+cleanup:
+    if (blob != NULL) {
+        memset_volatile(blob, 0, blobSize);
+        free(blob);
+    }
+    memset_volatile((void*)meta.data(), 0, meta.size());
+    SCloudFree(scCtx, 0);
+    return (err == kSCLError_NoErr) ? SUCCESS : GENERIC_ERROR;
+}
+
+int32_t salamander::attachPayload(const string& keyDescriptor, const DataSpan& detached, string* message, string* supplements)
+{
+    cJSON* root = cJSON_Parse(keyDescriptor.c_str());
+    if (root == NULL)
+        return DETACHED_PAYLOAD_FAILED;
+
+    cJSON* cjTemp = cJSON_GetObjectItem(root, "k");
+    string key = (cjTemp != NULL && cjTemp->valuestring != NULL) ? cjTemp->valuestring : "";
+    cjTemp = cJSON_GetObjectItem(root, "l");
+    string locator = (cjTemp != NULL && cjTemp->valuestring != NULL) ? cjTemp->valuestring : "";
+    cJSON_Delete(root);
+
+    if (key.empty() || locator.empty() || detached.empty())
+        return DETACHED_PAYLOAD_FAILED;
+
+    SCloudContextRef scCtxDec = kInvalidSCloudContextRef;
+    SCloudContextRef scCtxEnc = kInvalidSCloudContextRef;
+    uint8_t* dataBuffer = NULL;
+    uint8_t* metaBuffer = NULL;
+    size_t dataLen = 0;
+    size_t metaLen = 0;
+    string meta;
+    string computedLocator;
+    int32_t result = DETACHED_PAYLOAD_FAILED;
+
+    SCLError err = SCloudDecryptNew((uint8_t*)key.data(), key.size(), NULL, NULL, &scCtxDec);
+    if (err != kSCLError_NoErr)
+        goto cleanup;
+
+    err = SCloudDecryptNext(scCtxDec, (uint8_t*)detached.data, detached.size);
+    if (err != kSCLError_NoErr)
+        goto cleanup;
+
+    SCloudDecryptGetData(scCtxDec, &dataBuffer, &dataLen, &metaBuffer, &metaLen);
+    if (dataBuffer == NULL || metaBuffer == NULL || metaLen < NONCE_LENGTH || dataLen + metaLen > detached.size)
+        goto cleanup;
+
+    message->assign((const char*)dataBuffer, dataLen);
+    meta.assign((const char*)metaBuffer, metaLen);
+
+    // SCloud has no MAC: the locator from the authenticated ratchet message must match
+    // the locator of the decrypted payload
+    err = computeLocator(*message, meta, &scCtxEnc, &computedLocator);
+    if (err != kSCLError_NoErr || computedLocator != locator) {
+        memset_volatile((void*)message->data(), 0, message->size());
+        message->clear();
+        goto cleanup;
+    }
+    supplements->assign(meta, NONCE_LENGTH, string::npos);
+    result = SUCCESS;
+
+cleanup:
+    memset_volatile((void*)key.data(), 0, key.size());
+    memset_volatile((void*)meta.data(), 0, meta.size());
+    SCloudFree(scCtxEnc, 0);
+    SCloudFree(scCtxDec, 1);
+    return result;
+}
@@ -0,0 +1,73 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef DETACHEDPAYLOAD_H
+#define DETACHEDPAYLOAD_H
+
+/**
+ * @file DetachedPayload.h
+ * @brief Encrypt a large message payload once for all devices of a recipient
+ * @ingroup Salamander++
+ * @{
+ *
+ * The functions encrypt the message and the supplementary data with the SCloud
+ * functions and a random content key. The per-device ratchet messages then carry
+ * a small key descriptor only: the SCloud key blob and the locator of the
+ * encrypted payload. The message envelopes carry the encrypted payload in the
+ * @c detached field.
+ *
+ * The SCloud key depends on the hash of the payload and a random nonce. The
+ * receiver recomputes the locator of the decrypted payload and compares it with
+ * the locator in the key descriptor, thus the ratchet message also authenticates
+ * the detached payload.
+ */
+
+#include <string>
+#include <stdint.h>
+
+#include "../util/DataSpan.h"
+
+namespace salamander {
+
+/**
+ * @brief Encrypt a message payload with a random content key.
+ *
+ * @param message the message
+ * @param supplements the supplementary data, may be empty
+ * @param keyDescriptor the key descriptor to encrypt with the ratchet for each device
+ * @param detached the encrypted payload for the message envelope
+ * @return @c SUCCESS or @c GENERIC_ERROR if SCloud reported an error
+ */
+int32_t detachPayload(const std::string& message, const std::string& supplements,
+                      std::string* keyDescriptor, std::string* detached);
+
+/**
+ * @brief Decrypt and verify a detached message payload.
+ *
+ * @param keyDescriptor the key descriptor, decrypted by the ratchet
+ * @param detached the encrypted payload from the message envelope
+ * @param message the decrypted message
+ * @param supplements the decrypted supplementary data
+ * @return @c SUCCESS or @c DETACHED_PAYLOAD_FAILED
+ */
+int32_t attachPayload(const std::string& keyDescriptor, const DataSpan& detached,
+                      std::string* message, std::string* supplements);
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // DETACHEDPAYLOAD_H
@@ -0,0 +1,180 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "DuplicateFilter.h"
+
+#include <time.h>
+#include <list>
+
+#include "../salamander/Constants.h"
+
+using namespace salamander;
+using namespace std;
+
+void Log(const char* format, ...);
+
+const int32_t DuplicateFilter::DEFAULT_CAPACITY;
+
+// 10 bits per id and 7 probes give a false positive rate of about 1% per generation
+static const size_t BITS_PER_ID = 10;
+static const int32_t NUM_PROBES = 7;
+
+// FNV-1a, the second hash is a finalizer of the first, for double hashing
+static void hashKey(const string& key, uint64_t* hash1, uint64_t* hash2)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < key.size(); i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    *hash1 = hash;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    *hash2 = hash | 1;
+}
+
+DuplicateFilter::DuplicateFilter(ConversationStore* store, const string& ownName, int32_t capacity) :
+                                 store_(store), ownName_(ownName), capacity_(capacity < 1 ? 1 : capacity),
+                                 current_(0), inserted_(0), checked_(0), duplicates_(0), falsePositives_(0)
+{
+    numBits_ = ((capacity_ * BITS_PER_ID + 63) / 64) * 64;
+    generations_[0].assign(numBits_ / 64, 0);
+    generations_[1].assign(numBits_ / 64, 0);
+
+    if (store_ == NULL || !store_->isReady())
+        return;
+
+    list<string>* keys = store_->loadReceivedIds(ownName_, time(NULL) - RECEIVED_ID_STORE_TIME);
+    if (keys == NULL) {
+        Log("++++ Loading the received message ids failed: %s", store_->getLastError());
+        return;
+    }
+    for (list<string>::iterator it = keys->begin(); it != keys->end(); ++it)
+        insert(*it);
+    delete keys;
+}
+
+// The sender sets the fields, prefix them with their lengths. Otherwise the fields of
+// one sender could form the key of another sender's message.
+static void appendField(string* key, const string& field)
+{
+    uint32_t length = (uint32_t)field.size();
+    key->push_back((char)(length >> 24));
+    key->push_back((char)(length >> 16));
+    key->push_back((char)(length >> 8));
+    key->push_back((char)length);
+    key->append(field);
+}
+
+string DuplicateFilter::messageKey(const string& sender, const string& scClientDevId, const string& msgId)
+{
+    string key;
+    key.reserve(sender.size() + scClientDevId.size() + msgId.size() + 12);
+    appendField(&key, sender);
+    appendField(&key, scClientDevId);
+    appendField(&key, msgId);
+    return key;
+}
+
+bool DuplicateFilter::isDuplicate(const string& msgKey)
+{
+    uint64_t hash1, hash2;
+    hashKey(msgKey, &hash1, &hash2);
+    {
+        unique_lock<mutex> lck(lock_);
+        checked_++;
+        if (!testBits(generations_[current_], hash1, hash2) && !testBits(generations_[1 - current_], hash1, hash2))
+            return false;
+    }
+    // Rare: confirm with the store, without the lock
+    bool duplicate = store_ != NULL && store_->isReady() && store_->hasReceivedId(ownName_, msgKey);
+
+    unique_lock<mutex> lck(lock_);
+    if (duplicate)
+        duplicates_++;
+    else
+        falsePositives_++;
+    return duplicate;
+}
+
+int32_t DuplicateFilter::add(const string& msgKey)
+{
+    {
+        unique_lock<mutex> lck(lock_);
+        insert(msgKey);
+    }
+    if (store_ == NULL || !store_->isReady())
+        return STORE_MISUSE;
+
+    int32_t result = store_->insertReceivedId(ownName_, msgKey);
+    if (result != STORE_OK)
+        Log("++++ Storing a received message id failed: %s", store_->getLastError());
+    return result;
+}
+
+int64_t DuplicateFilter::getChecked()
+{
+    unique_lock<mutex> lck(lock_);
+    return checked_;
+}
+
+int64_t DuplicateFilter::getDuplicates()
+{
+    unique_lock<mutex> lck(lock_);
+    return duplicates_;
+}
+
+int64_t DuplicateFilter::getFalsePositives()
+{
+    unique_lock<mutex> lck(lock_);
+    return falsePositives_;
+}
+
+void DuplicateFilter::insert(const string& msgKey)
+{
+    uint64_t hash1, hash2;
+    hashKey(msgKey, &hash1, &hash2);
+
+    // Rotate: the previous generation drops out, the current one becomes previous
+    if (inserted_ >= capacity_) {
+        current_ = 1 - current_;
+        generations_[current_].assign(numBits_ / 64, 0);
+        inserted_ = 0;
+    }
+    setBits(&generations_[current_], hash1, hash2);
+    inserted_++;
+}
+
+void DuplicateFilter::setBits(vector<uint64_t>* bits, uint64_t hash1, uint64_t hash2)
+{
+    for (int32_t i = 0; i < NUM_PROBES; i++) {
+        uint64_t bit = (hash1 + i * hash2) % numBits_;
+        (*bits)[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+bool DuplicateFilter::testBits(const vector<uint64_t>& bits, uint64_t hash1, uint64_t hash2) const
+{
+    for (int32_t i = 0; i < NUM_PROBES; i++) {
+        uint64_t bit = (hash1 + i * hash2) % numBits_;
+        if ((bits[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0)
+            return false;
+    }
+    return true;
+}
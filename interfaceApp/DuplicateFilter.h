@@ -0,0 +1,138 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef DUPLICATEFILTER_H
+#define DUPLICATEFILTER_H
+
+/**
+ * @file DuplicateFilter.h
+ * @brief Detect envelopes that the transport delivers more than once
+ * @ingroup Salamander++
+ * @{
+ *
+ * Transports deliver envelopes again after a reconnect. Without a filter a
+ * replayed envelope runs the complete receive path, including trial decryption
+ * with all staged message keys, and then fails. The filter identifies a message
+ * by sender, sender device and message id, and the receive path checks it
+ * before it loads the conversation.
+ *
+ * The filter keeps the ids of the recent messages in two Bloom filters. New ids
+ * go to the current filter. If the current filter holds @c capacity ids it
+ * becomes the previous filter, and the filter that was previous before is cleared
+ * and becomes the current one. Thus the filter remembers at least the last
+ * @c capacity ids, with a fixed memory size. A check that finds no match costs a
+ * few hash probes and no store access. Only a match, a duplicate or a false
+ * positive, reads the store, which keeps the ids for @c RECEIVED_ID_STORE_TIME.
+ *
+ * At start the filter loads the ids from the store, thus it also detects
+ * envelopes that the transport replays after an application restart.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "../storage/ConversationStore.h"
+
+namespace salamander {
+
+class DuplicateFilter
+{
+public:
+    static const int32_t DEFAULT_CAPACITY = 4096;   //!< Ids per Bloom filter generation
+
+    /**
+     * @brief Create the filter of an account and load the recent ids from the store.
+     *
+     * Ownership of the store stays with the caller, it must stay valid while the filter exists.
+     *
+     * @param store the account's open store
+     * @param ownName the local user's name
+     * @param capacity number of ids per generation
+     */
+    DuplicateFilter(ConversationStore* store, const std::string& ownName, int32_t capacity = DEFAULT_CAPACITY);
+
+    /**
+     * @brief Return the key that identifies a received message.
+     */
+    static std::string messageKey(const std::string& sender, const std::string& scClientDevId, const std::string& msgId);
+
+    /**
+     * @brief Check if a message was received before.
+     *
+     * @param msgKey the message key, see @c messageKey
+     * @return @c true if the store has the message key
+     */
+    bool isDuplicate(const std::string& msgKey);
+
+    /**
+     * @brief Record a received message.
+     *
+     * Call this function after the ratchet decrypted the message.
+     *
+     * @param msgKey the message key, see @c messageKey
+     * @return a store code
+     */
+    int32_t add(const std::string& msgKey);
+
+    /**
+     * @brief Number of checked messages.
+     */
+    int64_t getChecked();
+
+    /**
+     * @brief Number of messages that were received before, the receive path dropped them.
+     */
+    int64_t getDuplicates();
+
+    /**
+     * @brief Number of checks that matched a Bloom filter but not the store.
+     */
+    int64_t getFalsePositives();
+
+private:
+    DuplicateFilter(const DuplicateFilter& other);
+    DuplicateFilter& operator=(const DuplicateFilter& other);
+
+    // Set or test the bits of a key in a generation. Call with lock_ held.
+    void setBits(std::vector<uint64_t>* bits, uint64_t hash1, uint64_t hash2);
+    bool testBits(const std::vector<uint64_t>& bits, uint64_t hash1, uint64_t hash2) const;
+
+    void insert(const std::string& msgKey);
+
+    ConversationStore* store_;
+    std::string ownName_;
+    int32_t capacity_;
+    size_t numBits_;
+
+    std::vector<uint64_t> generations_[2];
+    int32_t current_;               //!< index of the current generation
+    int32_t inserted_;              //!< number of ids in the current generation
+
+    int64_t checked_;
+    int64_t duplicates_;
+    int64_t falsePositives_;
+
+    std::mutex lock_;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // DUPLICATEFILTER_H
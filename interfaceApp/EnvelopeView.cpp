@@ -0,0 +1,78 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "EnvelopeView.h"
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <limits.h>
+
+using namespace salamander;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormatLite;
+
+bool salamander::parseEnvelopeView(const uint8_t* data, size_t size, EnvelopeView* view)
+{
+    if (size > INT_MAX)
+        return false;
+
+    CodedInputStream input(data, (int)size);
+    uint32_t tag;
+    while ((tag = input.ReadTag()) != 0) {
+        int32_t field = WireFormatLite::GetTagFieldNumber(tag);
+
+        // The device id is the only varint field
+        if (field == 3 && WireFormatLite::GetTagWireType(tag) == WireFormatLite::WIRETYPE_VARINT) {
+            if (!input.ReadVarint32(&view->deviceId))
+                return false;
+            continue;
+        }
+        DataSpan* span = NULL;
+        if (WireFormatLite::GetTagWireType(tag) == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+            switch (field) {
+                case 1:  span = &view->name; break;
+                case 2:  span = &view->scClientDevId; break;
+                case 4:  span = &view->supplement; break;
+                case 5:  span = &view->message; break;
+                case 6:  span = &view->msgId; break;
+                case 7:  span = &view->recvIdHash; break;
+                case 8:  span = &view->senderIdHash; break;
+                case 9:  span = &view->recvDeviceId; break;
+                case 10: span = &view->recvDevIdBin; break;
+                case 11: span = &view->detached; break;
+                default: break;
+            }
+        }
+        if (span == NULL) {
+            if (!WireFormatLite::SkipField(&input, tag))
+                return false;
+            continue;
+        }
+        // Point into the buffer, the last occurrence of a field wins as in protobuf
+        uint32_t length;
+        if (!input.ReadVarint32(&length))
+            return false;
+        size_t position = (size_t)input.CurrentPosition();
+        if (length > size - position)
+            return false;
+        span->data = data + position;
+        span->size = length;
+        if (!input.Skip((int)length))
+            return false;
+    }
+    // ReadTag returns 0 at the end of the data and on errors
+    return input.ConsumedEntireMessage();
+}
@@ -0,0 +1,74 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef ENVELOPEVIEW_H
+#define ENVELOPEVIEW_H
+
+/**
+ * @file EnvelopeView.h
+ * @brief Parse a serialized message envelope without copying its fields
+ * @ingroup Salamander++
+ * @{
+ *
+ * The generated @c MessageEnvelope class copies each field into a string. The
+ * receive path uses this view instead: its fields are spans into the buffer
+ * that holds the serialized envelope. The buffer must outlive the view.
+ *
+ * The view reads the fields of MessageEnvelope.proto and skips unknown fields,
+ * keep it in sync with the proto file.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../util/DataSpan.h"
+
+namespace salamander {
+
+struct EnvelopeView {
+    EnvelopeView() : deviceId(0) {}
+
+    DataSpan name;
+    DataSpan scClientDevId;
+    uint32_t deviceId;
+    DataSpan supplement;
+    DataSpan message;
+    DataSpan msgId;
+    DataSpan recvIdHash;
+    DataSpan senderIdHash;
+    DataSpan recvDeviceId;
+    DataSpan recvDevIdBin;
+    DataSpan detached;
+};
+
+/**
+ * @brief Parse a serialized message envelope.
+ *
+ * A field that is not in the envelope has a span with @c NULL data.
+ *
+ * @param data the serialized envelope
+ * @param size the length of the serialized envelope
+ * @param view gets the fields of the envelope
+ * @return @c true if the envelope is well-formed
+ */
+bool parseEnvelopeView(const uint8_t* data, size_t size, EnvelopeView* view);
+
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // ENVELOPEVIEW_H
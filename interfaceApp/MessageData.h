@@ -0,0 +1,77 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef MESSAGEDATA_H
+#define MESSAGEDATA_H
+
+/**
+ * @file MessageData.h
+ * @brief Plain message data for the structured send and receive functions
+ * @ingroup Salamander++
+ * @{
+ *
+ * The structured functions of AppInterfaceImpl take and deliver these structures
+ * instead of the JSON message descriptors. They save the JSON parsing and
+ * formatting for each message. The strings may contain any data, they are not
+ * escaped.
+ */
+
+#include <string>
+#include <stdint.h>
+
+namespace salamander {
+
+/**
+ * @brief A message to send.
+ */
+struct OutgoingMessage {
+    OutgoingMessage() {}
+    OutgoingMessage(const std::string& recip, const std::string& id, const std::string& msg) :
+        recipient(recip), msgId(id), message(msg) {}
+
+    std::string recipient;      //!< the recipient's name, ignored when sending to siblings
+    std::string msgId;          //!< the message id, a time based UUID
+    std::string message;        //!< the plain text message, UTF-8
+    std::string attachment;     //!< the attachment descriptor, may be empty
+    std::string attributes;     //!< the JSON message attributes, may be empty
+};
+
+/**
+ * @brief A received and decrypted message.
+ */
+struct IncomingMessage {
+    std::string sender;         //!< the sender's name
+    std::string scClientDevId;  //!< the sender's long device id
+    std::string msgId;          //!< the message id
+    std::string message;        //!< the plain text message
+    std::string attachment;     //!< the attachment descriptor, may be empty
+    std::string attributes;     //!< the JSON message attributes, may be empty
+};
+
+/**
+ * @brief Receive callback of the structured functions.
+ *
+ * The callback may move the strings out of the message. The same rules as for
+ * @c AppInterface::receiveCallback_ apply.
+ */
+typedef int32_t (*RECV_MSG_FUNC)(IncomingMessage&& message);
+
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // MESSAGEDATA_H
@@ -79,6 +79,7 @@ const int MessageEnvelope::kRecvIdHashFieldNumber;
 const int MessageEnvelope::kSenderIdHashFieldNumber;
 const int MessageEnvelope::kRecvDeviceIdFieldNumber;
 const int MessageEnvelope::kRecvDevIdBinFieldNumber;
+const int MessageEnvelope::kDetachedFieldNumber;
 #endif  // !_MSC_VER
 
 MessageEnvelope::MessageEnvelope()
@@ -110,6 +111,7 @@ void MessageEnvelope::SharedCtor() {
   senderidhash_ = const_cast< ::std::string*>(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
   recvdeviceid_ = const_cast< ::std::string*>(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
   recvdevidbin_ = const_cast< ::std::string*>(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  detached_ = const_cast< ::std::string*>(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
   ::memset(_has_bits_, 0, sizeof(_has_bits_));
 }
 
@@ -146,6 +148,9 @@ void MessageEnvelope::SharedDtor() {
   if (recvdevidbin_ != &::google::protobuf::internal::GetEmptyStringAlreadyInited()) {
     delete recvdevidbin_;
   }
+  if (detached_ != &::google::protobuf::internal::GetEmptyStringAlreadyInited()) {
+    delete detached_;
+  }
   #ifdef GOOGLE_PROTOBUF_NO_STATIC_INITIALIZER
   if (this != &default_instance()) {
   #else
@@ -213,7 +218,7 @@ void MessageEnvelope::Clear() {
       }
     }
   }
-  if (_has_bits_[8 / 32] & 768) {
+  if (_has_bits_[8 / 32] & 1792) {
     if (has_recvdeviceid()) {
       if (recvdeviceid_ != &::google::protobuf::internal::GetEmptyStringAlreadyInited()) {
         recvdeviceid_->clear();
@@ -224,6 +229,11 @@ void MessageEnvelope::Clear() {
         recvdevidbin_->clear();
       }
     }
+    if (has_detached()) {
+      if (detached_ != &::google::protobuf::internal::GetEmptyStringAlreadyInited()) {
+        detached_->clear();
+      }
+    }
   }
   ::memset(_has_bits_, 0, sizeof(_has_bits_));
   mutable_unknown_fields()->clear();
@@ -370,6 +380,19 @@ bool MessageEnvelope::MergePartialFromCodedStream(
         } else {
           goto handle_unusual;
         }
+        if (input->ExpectTag(90)) goto parse_detached;
+        break;
+      }
+
+      // optional bytes detached = 11;
+      case 11: {
+        if (tag == 90) {
+         parse_detached:
+          DO_(::google::protobuf::internal::WireFormatLite::ReadBytes(
+                input, this->mutable_detached()));
+        } else {
+          goto handle_unusual;
+        }
         if (input->ExpectAtEnd()) goto success;
         break;
       }
@@ -458,6 +481,12 @@ void MessageEnvelope::SerializeWithCachedSizes(
       10, this->recvdevidbin(), output);
   }
 
+  // optional bytes detached = 11;
+  if (has_detached()) {
+    ::google::protobuf::internal::WireFormatLite::WriteBytesMaybeAliased(
+      11, this->detached(), output);
+  }
+
   output->WriteRaw(unknown_fields().data(),
                    unknown_fields().size());
   // @@protoc_insertion_point(serialize_end:salamander.MessageEnvelope)
@@ -539,6 +568,13 @@ int MessageEnvelope::ByteSize() const {
           this->recvdevidbin());
     }
 
+    // optional bytes detached = 11;
+    if (has_detached()) {
+      total_size += 1 +
+        ::google::protobuf::internal::WireFormatLite::BytesSize(
+          this->detached());
+    }
+
   }
   total_size += unknown_fields().size();
 
@@ -588,6 +624,9 @@ void MessageEnvelope::MergeFrom(const MessageEnvelope& from) {
     if (from.has_recvdevidbin()) {
       set_recvdevidbin(from.recvdevidbin());
     }
+    if (from.has_detached()) {
+      set_detached(from.detached());
+    }
   }
   mutable_unknown_fields()->append(from.unknown_fields());
 }
@@ -615,6 +654,7 @@ void MessageEnvelope::Swap(MessageEnvelope* other) {
     std::swap(senderidhash_, other->senderidhash_);
     std::swap(recvdeviceid_, other->recvdeviceid_);
     std::swap(recvdevidbin_, other->recvdevidbin_);
+    std::swap(detached_, other->detached_);
     std::swap(_has_bits_[0], other->_has_bits_[0]);
     _unknown_fields_.swap(other->_unknown_fields_);
     std::swap(_cached_size_, other->_cached_size_);
@@ -227,6 +227,18 @@ class MessageEnvelope : public ::google::protobuf::MessageLite {
   inline ::std::string* release_recvdevidbin();
   inline void set_allocated_recvdevidbin(::std::string* recvdevidbin);
 
+  // optional bytes detached = 11;
+  inline bool has_detached() const;
+  inline void clear_detached();
+  static const int kDetachedFieldNumber = 11;
+  inline const ::std::string& detached() const;
+  inline void set_detached(const ::std::string& value);
+  inline void set_detached(const char* value);
+  inline void set_detached(const void* value, size_t size);
+  inline ::std::string* mutable_detached();
+  inline ::std::string* release_detached();
+  inline void set_allocated_detached(::std::string* detached);
+
   // @@protoc_insertion_point(class_scope:salamander.MessageEnvelope)
  private:
   inline void set_has_name();
@@ -249,6 +261,8 @@ class MessageEnvelope : public ::google::protobuf::MessageLite {
   inline void clear_has_recvdeviceid();
   inline void set_has_recvdevidbin();
   inline void clear_has_recvdevidbin();
+  inline void set_has_detached();
+  inline void clear_has_detached();
 
   ::std::string _unknown_fields_;
 
@@ -263,6 +277,7 @@ class MessageEnvelope : public ::google::protobuf::MessageLite {
   ::std::string* senderidhash_;
   ::std::string* recvdeviceid_;
   ::std::string* recvdevidbin_;
+  ::std::string* detached_;
   ::google::protobuf::uint32 device_id_;
   #ifdef GOOGLE_PROTOBUF_NO_STATIC_INITIALIZER
   friend void  protobuf_AddDesc_MessageEnvelope_2eproto_impl();
@@ -990,6 +1005,82 @@ inline void MessageEnvelope::set_allocated_recvdevidbin(::std::string* recvdevid
   // @@protoc_insertion_point(field_set_allocated:salamander.MessageEnvelope.recvDevIdBin)
 }
 
+// optional bytes detached = 11;
+inline bool MessageEnvelope::has_detached() const {
+  return (_has_bits_[0] & 0x00000400u) != 0;
+}
+inline void MessageEnvelope::set_has_detached() {
+  _has_bits_[0] |= 0x00000400u;
+}
+inline void MessageEnvelope::clear_has_detached() {
+  _has_bits_[0] &= ~0x00000400u;
+}
+inline void MessageEnvelope::clear_detached() {
+  if (detached_ != &::google::protobuf::internal::GetEmptyStringAlreadyInited()) {
+    detached_->clear();
+  }
+  clear_has_detached();
+}
+inline const ::std::string& MessageEnvelope::detached() const {
+  // @@protoc_insertion_point(field_get:salamander.MessageEnvelope.detached)
+  return *detached_;
+}
+inline void MessageEnvelope::set_detached(const ::std::string& value) {
+  set_has_detached();
+  if (detached_ == &::google::protobuf::internal::GetEmptyStringAlreadyInited()) {
+    detached_ = new ::std::string;
+  }
+  detached_->assign(value);
+  // @@protoc_insertion_point(field_set:salamander.MessageEnvelope.detached)
+}
+inline void MessageEnvelope::set_detached(const char* value) {
+  set_has_detached();
+  if (detached_ == &::google::protobuf::internal::GetEmptyStringAlreadyInited()) {
+    detached_ = new ::std::string;
+  }
+  detached_->assign(value);
+  // @@protoc_insertion_point(field_set_char:salamander.MessageEnvelope.detached)
+}
+inline void MessageEnvelope::set_detached(const void* value, size_t size) {
+  set_has_detached();
+  if (detached_ == &::google::protobuf::internal::GetEmptyStringAlreadyInited()) {
+    detached_ = new ::std::string;
+  }
+  detached_->assign(reinterpret_cast<const char*>(value), size);
+  // @@protoc_insertion_point(field_set_pointer:salamander.MessageEnvelope.detached)
+}
+inline ::std::string* MessageEnvelope::mutable_detached() {
+  set_has_detached();
+  if (detached_ == &::google::protobuf::internal::GetEmptyStringAlreadyInited()) {
+    detached_ = new ::std::string;
+  }
+  // @@protoc_insertion_point(field_mutable:salamander.MessageEnvelope.detached)
+  return detached_;
+}
+inline ::std::string* MessageEnvelope::release_detached() {
+  clear_has_detached();
+  if (detached_ == &::google::protobuf::internal::GetEmptyStringAlreadyInited()) {
+    return NULL;
+  } else {
+    ::std::string* temp = detached_;
+    detached_ = const_cast< ::std::string*>(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+    return temp;
+  }
+}
+inline void MessageEnvelope::set_allocated_detached(::std::string* detached) {
+  if (detached_ != &::google::protobuf::internal::GetEmptyStringAlreadyInited()) {
+    delete detached_;
+  }
+  if (detached) {
+    set_has_detached();
+    detached_ = detached;
+  } else {
+    clear_has_detached();
+    detached_ = const_cast< ::std::string*>(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  }
+  // @@protoc_insertion_point(field_set_allocated:salamander.MessageEnvelope.detached)
+}
+
 
 // @@protoc_insertion_point(namespace_scope)
 
@@ -0,0 +1,315 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "Outbox.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <list>
+
+using namespace salamander;
+using namespace std;
+
+void Log(const char* format, ...);
+
+const int32_t Outbox::DEFAULT_RETRY_DELAY;
+const int32_t Outbox::MAX_RETRY_DELAY;
+
+static const time_t ALL_ENTRIES = numeric_limits<time_t>::max();
+
+Outbox::Outbox(ConversationStore* store, const string& ownName, const REPORT_FUNC& report,
+               int32_t retryDelay, int32_t maxRetryDelay, int32_t maxAge) :
+               store_(store), ownName_(ownName), report_(report), transport_(NULL),
+               retryDelay_(retryDelay < 1 ? 1 : retryDelay), maxRetryDelay_(maxRetryDelay), maxAge_(maxAge),
+               flushRequested_(false), running_(true)
+{
+    // Continue with the envelopes of the last run
+    if (store_ != NULL && store_->isReady()) {
+        list<OutboxEntry>* entries = store_->loadOutboxEntries(ownName_, ALL_ENTRIES);
+        if (entries != NULL) {
+            for (list<OutboxEntry>::iterator it = entries->begin(); it != entries->end(); ++it)
+                addPending(*it);
+        }
+        delete entries;
+    }
+    thread_ = thread(&Outbox::run, this);
+}
+
+Outbox::~Outbox()
+{
+    {
+        unique_lock<mutex> lck(stateLock_);
+        running_ = false;
+    }
+    wakeUp_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void Outbox::setTransport(Transport* transport)
+{
+    unique_lock<mutex> lck(stateLock_);
+    transport_ = transport;
+    wakeUp_.notify_all();
+}
+
+int32_t Outbox::add(const string& recipient, const string& msgId, const vector<pair<string, string> >& msgPairs, bool failed)
+{
+    time_t now = time(NULL);
+    time_t next = now + retryDelay_;
+    {
+        // Join the next batch of the recipient
+        unique_lock<mutex> lck(stateLock_);
+        for (map<int64_t, Pending>::iterator it = pending_.begin(); it != pending_.end(); ++it) {
+            if (it->second.recipient == recipient && it->second.nextTry < next)
+                next = it->second.nextTry;
+        }
+    }
+    list<OutboxEntry> entries;
+    for (size_t i = 0; i < msgPairs.size(); i++) {
+        OutboxEntry entry;
+        entry.recipient = recipient;
+        entry.longDevId = msgPairs[i].first;
+        entry.msgId = msgId;
+        entry.envelope = msgPairs[i].second;
+        entry.since = now;
+        entry.nextTry = next;
+        entry.tries = failed ? 1 : 0;
+        entries.push_back(entry);
+    }
+    int32_t result = store_->insertOutboxEntries(ownName_, &entries);
+    if (result != STORE_OK) {
+        Log("++++ Storing envelopes of message %s in the outbox failed: %s", msgId.c_str(), store_->getLastError());
+        return result;
+    }
+    unique_lock<mutex> lck(stateLock_);
+    for (list<OutboxEntry>::iterator it = entries.begin(); it != entries.end(); ++it)
+        addPending(*it);
+    wakeUp_.notify_all();
+    return STORE_OK;
+}
+
+bool Outbox::hasPending(const string& recipient)
+{
+    unique_lock<mutex> lck(stateLock_);
+    return recipients_.find(recipient) != recipients_.end();
+}
+
+size_t Outbox::getPending()
+{
+    unique_lock<mutex> lck(stateLock_);
+    return pending_.size();
+}
+
+void Outbox::requestFlush()
+{
+    unique_lock<mutex> lck(stateLock_);
+    flushRequested_ = true;
+    wakeUp_.notify_all();
+}
+
+int32_t Outbox::flushNow(bool all)
+{
+    typedef pair<string, string> MessageKey;    // recipient and message id
+
+    vector<MessageKey> reportOrder;
+    map<MessageKey, vector<int64_t> > sentIds;
+    vector<MessageKey> expired;
+    int32_t numSent = 0;
+    {
+        unique_lock<mutex> flushLck(flushLock_);
+
+        Transport* transport;
+        {
+            unique_lock<mutex> lck(stateLock_);
+            transport = transport_;
+        }
+        if (transport == NULL || store_ == NULL || !store_->isReady())
+            return 0;
+
+        // Load all envelopes, a recipient whose retry is due gets all its envelopes in order
+        time_t now = time(NULL);
+        list<OutboxEntry>* entries = store_->loadOutboxEntries(ownName_, ALL_ENTRIES);
+        if (entries == NULL) {
+            Log("++++ Loading the outbox failed: %s", store_->getLastError());
+
+            // Don't try again at once
+            unique_lock<mutex> lck(stateLock_);
+            for (map<int64_t, Pending>::iterator it = pending_.begin(); it != pending_.end(); ++it) {
+                if (it->second.nextTry <= now)
+                    it->second.nextTry = now + retryDelay_;
+            }
+            return 0;
+        }
+
+        // Group the envelopes by recipient, the store returns them in the order they were added
+        list<int64_t> removes;
+        vector<string> recipients;
+        map<string, vector<OutboxEntry*> > batches;
+        map<string, bool> due;
+        for (list<OutboxEntry>::iterator it = entries->begin(); it != entries->end(); ++it) {
+            if (now - it->since >= maxAge_) {
+                removes.push_back(it->id);
+                MessageKey key(it->recipient, it->msgId);
+                if (find(expired.begin(), expired.end(), key) == expired.end())
+                    expired.push_back(key);
+                continue;
+            }
+            vector<OutboxEntry*>& batch = batches[it->recipient];
+            if (batch.empty())
+                recipients.push_back(it->recipient);
+            batch.push_back(&(*it));
+            if (all || it->nextTry <= now)
+                due[it->recipient] = true;
+        }
+
+        // One transport call for all recipients, the batch refers to the loaded envelopes
+        batch_.clear();
+        vector<OutboxEntry*> sent;
+        for (size_t i = 0; i < recipients.size(); i++) {
+            if (!due[recipients[i]])
+                continue;
+            vector<OutboxEntry*>& batch = batches[recipients[i]];
+            for (size_t j = 0; j < batch.size(); j++) {
+                batch_.add(batch[j]->recipient, batch[j]->longDevId, batch[j]->envelope);
+                sent.push_back(batch[j]);
+            }
+        }
+        batchIds_.assign(sent.size(), 0);
+        if (!sent.empty())
+            transport->sendAxoBatch(&batch_, &batchIds_[0], batchIds_.size());
+
+        // The failed envelopes of a recipient share one backoff, thus none of them gets
+        // due before an older one
+        vector<OutboxEntry*> failed;
+        map<string, int32_t> tries;
+        for (size_t i = 0; i < sent.size(); i++) {
+            OutboxEntry* entry = sent[i];
+            if (batchIds_[i] != 0) {
+                removes.push_back(entry->id);
+                MessageKey key(entry->recipient, entry->msgId);
+                vector<int64_t>& ids = sentIds[key];
+                if (ids.empty())
+                    reportOrder.push_back(key);
+                ids.push_back(batchIds_[i]);
+                numSent++;
+                continue;
+            }
+            failed.push_back(entry);
+            int32_t& recipientTries = tries[entry->recipient];
+            if (entry->tries > recipientTries)
+                recipientTries = entry->tries;
+        }
+        list<OutboxEntry> retries;
+        for (size_t i = 0; i < failed.size(); i++) {
+            OutboxEntry* entry = failed[i];
+            int32_t recipientTries = tries[entry->recipient];
+
+            // Exponential backoff, the shift can't overflow
+            int64_t delay = (int64_t)retryDelay_ << (recipientTries < 20 ? recipientTries : 20);
+            entry->tries = recipientTries + 1;
+            entry->nextTry = now + (delay < maxRetryDelay_ ? delay : maxRetryDelay_);
+            retries.push_back(*entry);
+        }
+        batch_.clear();
+        delete entries;
+
+        // A failed remove sends the envelope again after a restart, the receiver then fails to
+        // decrypt it. That's better than to lose messages.
+        if (!removes.empty() && store_->deleteOutboxEntries(ownName_, removes) != STORE_OK)
+            Log("++++ Removing envelopes from the outbox failed: %s", store_->getLastError());
+        if (!retries.empty() && store_->updateOutboxEntries(ownName_, retries) != STORE_OK)
+            Log("++++ Updating the outbox failed: %s", store_->getLastError());
+
+        unique_lock<mutex> lck(stateLock_);
+        for (list<int64_t>::iterator it = removes.begin(); it != removes.end(); ++it)
+            removePending(*it);
+        for (list<OutboxEntry>::iterator it = retries.begin(); it != retries.end(); ++it) {
+            map<int64_t, Pending>::iterator pending = pending_.find(it->id);
+            if (pending != pending_.end())
+                pending->second.nextTry = it->nextTry;
+        }
+    }
+
+    // Report without a lock, the report function may send messages
+    if (report_) {
+        for (size_t i = 0; i < reportOrder.size(); i++)
+            report_(reportOrder[i].first, reportOrder[i].second, SUCCESS, sentIds[reportOrder[i]]);
+        for (size_t i = 0; i < expired.size(); i++)
+            report_(expired[i].first, expired[i].second, MSG_EXPIRED, vector<int64_t>());
+    }
+    return numSent;
+}
+
+time_t Outbox::nextTry() const
+{
+    time_t next = 0;
+    for (map<int64_t, Pending>::const_iterator it = pending_.begin(); it != pending_.end(); ++it) {
+        if (next == 0 || it->second.nextTry < next)
+            next = it->second.nextTry;
+    }
+    return next;
+}
+
+void Outbox::addPending(const OutboxEntry& entry)
+{
+    Pending& pending = pending_[entry.id];
+    pending.recipient = entry.recipient;
+    pending.nextTry = entry.nextTry;
+    recipients_[entry.recipient]++;
+}
+
+void Outbox::removePending(int64_t id)
+{
+    map<int64_t, Pending>::iterator it = pending_.find(id);
+    if (it == pending_.end())
+        return;
+
+    map<string, int32_t>::iterator recipient = recipients_.find(it->second.recipient);
+    if (recipient != recipients_.end() && --recipient->second <= 0)
+        recipients_.erase(recipient);
+    pending_.erase(it);
+}
+
+// The thread sleeps until the next retry is due or until someone requests a flush. It
+// doesn't flush without a transport.
+void Outbox::run()
+{
+    unique_lock<mutex> lck(stateLock_);
+
+    while (running_) {
+        bool ready = transport_ != NULL;
+        time_t next = ready ? nextTry() : 0;
+        if (!ready || !flushRequested_) {
+            if (next == 0)
+                wakeUp_.wait(lck);
+            else if (next > time(NULL))
+                wakeUp_.wait_until(lck, chrono::system_clock::from_time_t(next));
+        }
+        if (!running_ || transport_ == NULL)
+            continue;
+
+        bool all = flushRequested_;
+        next = nextTry();
+        if (!all && (next == 0 || next > time(NULL)))
+            continue;
+
+        flushRequested_ = false;
+        lck.unlock();
+        flushNow(all);
+        lck.lock();
+    }
+}
@@ -0,0 +1,195 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+/**
+ * @file Outbox.h
+ * @brief Persistent outbox for message envelopes the transport could not send
+ * @ingroup Salamander++
+ * @{
+ *
+ * If the transport cannot send an envelope, the send functions put it in the
+ * outbox. The outbox keeps the envelope in the store and retries it with
+ * exponential backoff. It does not encrypt the message again, because the ratchet
+ * has already advanced for this envelope. Until the stored envelopes of a
+ * recipient are sent, new envelopes to this recipient go to the outbox as well,
+ * so the recipient gets the messages in order.
+ *
+ * The retries are scheduled per recipient: if a retry of a recipient is due, a
+ * flush sends all stored envelopes of this recipient, oldest first, and the
+ * envelopes that failed again share one backoff. Thus a newer envelope never
+ * becomes due before an older one of the same recipient.
+ *
+ * A flush sends the envelopes of all due recipients in one transport call. The
+ * outbox's thread runs a flush when the next retry is due or when the
+ * application requests one, for example after the network came back. Requests
+ * that arrive while a flush is pending run in that flush.
+ *
+ * The receiver keeps the message keys of skipped messages for @c MK_STORE_TIME,
+ * so it cannot decrypt an older envelope. The outbox drops such envelopes and
+ * reports @c MSG_EXPIRED.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+#include <map>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "../storage/ConversationStore.h"
+#include "../interfaceTransport/Transport.h"
+#include "../salamander/Constants.h"
+
+namespace salamander {
+
+class Outbox
+{
+public:
+    static const int32_t DEFAULT_RETRY_DELAY = 5;       //!< First retry after 5 seconds
+    static const int32_t MAX_RETRY_DELAY = 900;         //!< Retry at least every 15 minutes
+
+    /**
+     * @brief Report the result of a stored message.
+     *
+     * The outbox calls this function with @c SUCCESS and the transport's message ids after it sent
+     * envelopes of a message, or with @c MSG_EXPIRED and no ids if it dropped them.
+     */
+    typedef std::function<void(const std::string& recipient, const std::string& msgId, int32_t code,
+                               const std::vector<int64_t>& msgIds)> REPORT_FUNC;
+
+    /**
+     * @brief Create the outbox of an account and start its thread.
+     *
+     * The outbox continues with the envelopes that are in the store. Ownership of the
+     * store stays with the caller, it must stay valid while the outbox exists.
+     *
+     * @param store the account's open store
+     * @param ownName the local user's name
+     * @param report the function that reports the results of the stored messages
+     * @param retryDelay delay of the first retry in seconds, doubles with each failure
+     * @param maxRetryDelay maximum delay between retries in seconds
+     * @param maxAge drop envelopes of messages that are older than this, in seconds
+     */
+    Outbox(ConversationStore* store, const std::string& ownName, const REPORT_FUNC& report,
+           int32_t retryDelay = DEFAULT_RETRY_DELAY, int32_t maxRetryDelay = MAX_RETRY_DELAY,
+           int32_t maxAge = MK_STORE_TIME);
+
+    /**
+     * @brief Stop the thread and wait until it terminates.
+     *
+     * The stored envelopes stay in the store.
+     */
+    ~Outbox();
+
+    /**
+     * @brief Set the transport that sends the envelopes.
+     *
+     * Set the transport before the first flush, ownership stays with the caller.
+     */
+    void setTransport(Transport* transport);
+
+    /**
+     * @brief Store envelopes of a message.
+     *
+     * @param recipient the recipient's name
+     * @param msgId the message id
+     * @param msgPairs the recipient's long device ids and the envelopes for these devices
+     * @param failed @c true if the transport failed to send the envelopes, @c false if they
+     *        wait behind stored envelopes of this recipient
+     * @return a store code
+     */
+    int32_t add(const std::string& recipient, const std::string& msgId,
+                const std::vector<std::pair<std::string, std::string> >& msgPairs, bool failed);
+
+    /**
+     * @brief Check if the outbox has envelopes for a recipient.
+     */
+    bool hasPending(const std::string& recipient);
+
+    /**
+     * @brief Number of stored envelopes.
+     */
+    size_t getPending();
+
+    /**
+     * @brief Ask the outbox's thread to send all stored envelopes.
+     *
+     * Sends the envelopes even if their retry is not due yet. Several requests before the
+     * thread starts the flush result in one flush.
+     */
+    void requestFlush();
+
+    /**
+     * @brief Send the stored envelopes on the caller's thread.
+     *
+     * @param all send all envelopes, @c false sends only the envelopes of recipients with a due retry
+     * @return number of envelopes that the transport sent
+     */
+    int32_t flushNow(bool all = false);
+
+private:
+    Outbox(const Outbox& other);
+    Outbox& operator=(const Outbox& other);
+
+    void run();
+
+    // Return the time of the next due retry, 0 if the outbox is empty. Call with stateLock_ held.
+    time_t nextTry() const;
+
+    void addPending(const OutboxEntry& entry);
+
+    void removePending(int64_t id);
+
+    struct Pending {
+        std::string recipient;
+        time_t nextTry;
+    };
+
+    ConversationStore* store_;
+    std::string ownName_;
+    REPORT_FUNC report_;
+    Transport* transport_;          //!< guarded by stateLock_
+    int32_t retryDelay_;
+    int32_t maxRetryDelay_;
+    int32_t maxAge_;
+
+    std::map<int64_t, Pending> pending_;            //!< the stored envelopes by id
+    std::map<std::string, int32_t> recipients_;     //!< number of stored envelopes per recipient
+
+    SendBatch batch_;                               //!< guarded by flushLock_, reused by each flush
+    std::vector<int64_t> batchIds_;                 //!< guarded by flushLock_
+
+    bool flushRequested_;
+    bool running_;
+    std::thread thread_;
+    std::mutex flushLock_;          //!< serializes flushes
+    std::mutex stateLock_;
+    std::condition_variable wakeUp_;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // OUTBOX_H
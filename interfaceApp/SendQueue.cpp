@@ -0,0 +1,170 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "SendQueue.h"
+
+#include <algorithm>
+
+using namespace salamander;
+using namespace std;
+
+const int32_t SendQueue::DEFAULT_THREADS;
+const int32_t SendQueue::DEFAULT_BURST;
+
+SendQueue::SendQueue(int32_t numThreads, int32_t maxBurst) : maxBurst_(maxBurst < 1 ? 1 : maxBurst), burst_(0),
+                                                             pending_(0), stop_(false)
+{
+    for (int32_t i = 0; i < NUM_LANES; i++) {
+        depth_[i] = 0;
+        maxDepth_[i] = 0;
+        started_[i] = 0;
+    }
+    if (numThreads < 1)
+        numThreads = 1;
+    for (int32_t i = 0; i < numThreads; i++)
+        threads_.push_back(thread(&SendQueue::run, this));
+}
+
+SendQueue::~SendQueue()
+{
+    {
+        unique_lock<mutex> lck(lock_);
+        stop_ = true;
+    }
+    workAvailable_.notify_all();
+    idle_.notify_all();
+    for (size_t i = 0; i < threads_.size(); i++)
+        threads_[i].join();
+}
+
+void SendQueue::enqueue(const string& key, const function<void()>& task, Priority priority)
+{
+    unique_lock<mutex> lck(lock_);
+
+    Task entry;
+    entry.run = task;
+    entry.priority = priority;
+
+    // A key has an entry while it has queued or running tasks. A new key is ready
+    // at once, otherwise the thread that runs the current task re-schedules the key.
+    map<string, KeyTasks>::iterator it = tasks_.find(key);
+    if (it == tasks_.end()) {
+        KeyTasks& keyTasks = tasks_[key];
+        keyTasks.tasks.push_back(entry);
+        keyTasks.running = false;
+        schedule(key, &keyTasks);
+    }
+    else {
+        KeyTasks& keyTasks = it->second;
+        keyTasks.tasks.push_back(entry);
+
+        // The key waits in the background lane, an interactive task moves it
+        if (!keyTasks.running && priority < keyTasks.lane) {
+            deque<string>& lane = ready_[keyTasks.lane];
+            lane.erase(find(lane.begin(), lane.end(), key));
+            schedule(key, &keyTasks);
+        }
+    }
+    if (++depth_[priority] > maxDepth_[priority])
+        maxDepth_[priority] = depth_[priority];
+    pending_++;
+}
+
+void SendQueue::drain()
+{
+    unique_lock<mutex> lck(lock_);
+    idle_.wait(lck, [this]{ return pending_ == 0 || stop_; });
+}
+
+size_t SendQueue::getPending()
+{
+    unique_lock<mutex> lck(lock_);
+    return pending_;
+}
+
+size_t SendQueue::getQueueDepth(Priority priority)
+{
+    unique_lock<mutex> lck(lock_);
+    return depth_[priority];
+}
+
+size_t SendQueue::getMaxQueueDepth(Priority priority)
+{
+    unique_lock<mutex> lck(lock_);
+    return maxDepth_[priority];
+}
+
+uint64_t SendQueue::getStarted(Priority priority)
+{
+    unique_lock<mutex> lck(lock_);
+    return started_[priority];
+}
+
+void SendQueue::schedule(const string& key, KeyTasks* keyTasks)
+{
+    Priority lane = BACKGROUND;
+    for (deque<Task>::const_iterator it = keyTasks->tasks.begin(); it != keyTasks->tasks.end(); ++it) {
+        if (it->priority < lane)
+            lane = it->priority;
+    }
+    keyTasks->lane = lane;
+    ready_[lane].push_back(key);
+    workAvailable_.notify_one();
+}
+
+void SendQueue::run()
+{
+    unique_lock<mutex> lck(lock_);
+    while (true) {
+        workAvailable_.wait(lck, [this]{ return stop_ || !ready_[INTERACTIVE].empty() || !ready_[BACKGROUND].empty(); });
+        if (stop_)
+            return;
+
+        // Interactive first, but let a background task run after a burst of interactive tasks
+        int32_t lane;
+        if (!ready_[INTERACTIVE].empty() && (ready_[BACKGROUND].empty() || burst_ < maxBurst_)) {
+            lane = INTERACTIVE;
+            burst_ = ready_[BACKGROUND].empty() ? 0 : burst_ + 1;
+        }
+        else {
+            lane = BACKGROUND;
+            burst_ = 0;
+        }
+        string key = ready_[lane].front();
+        ready_[lane].pop_front();
+
+        KeyTasks& keyTasks = tasks_[key];
+        keyTasks.running = true;
+        Task task = keyTasks.tasks.front();
+        depth_[task.priority]--;
+        started_[task.priority]++;
+
+        lck.unlock();
+        task.run();
+        lck.lock();
+
+        // Other keys of the lane go first if this key has more tasks, a busy recipient
+        // does not starve the others
+        KeyTasks& done = tasks_[key];
+        done.tasks.pop_front();
+        done.running = false;
+        if (done.tasks.empty())
+            tasks_.erase(key);
+        else
+            schedule(key, &done);
+        if (--pending_ == 0)
+            idle_.notify_all();
+    }
+}
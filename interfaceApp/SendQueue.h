@@ -0,0 +1,154 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef SENDQUEUE_H
+#define SENDQUEUE_H
+
+/**
+ * @file SendQueue.h
+ * @brief Background queue for asynchronous message sends
+ * @ingroup Salamander++
+ * @{
+ *
+ * The queue runs the send tasks on its own threads. Each task has a key, usually
+ * the recipient's name. Tasks with the same key run one after the other in the
+ * order they were enqueued. Tasks with different keys run in parallel. Thus a
+ * slow recipient, for example one that requires provisioning server requests,
+ * does not delay the messages to other recipients.
+ *
+ * Each task has a priority. The threads take interactive tasks, the messages a
+ * user sends, before background tasks such as device rescans and sibling sync
+ * messages. A key with an interactive task moves to the interactive lane with
+ * all its tasks, the tasks of a key still run in order. After @c maxBurst
+ * interactive tasks in a row a waiting background task runs, thus a steady
+ * stream of user messages does not starve the background work.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace salamander {
+
+class SendQueue
+{
+public:
+    static const int32_t DEFAULT_THREADS = 2;
+    static const int32_t DEFAULT_BURST = 8;     //!< Interactive tasks before a waiting background task runs
+
+    enum Priority {
+        INTERACTIVE = 0,    //!< Messages the user waits for
+        BACKGROUND  = 1,    //!< Control traffic: device rescans, pings, sibling sync
+        NUM_LANES   = 2
+    };
+
+    /**
+     * @brief Create a queue and start its threads.
+     *
+     * @param numThreads number of send threads, at least 1
+     * @param maxBurst number of interactive tasks in a row before a waiting background
+     *        task runs, at least 1
+     */
+    explicit SendQueue(int32_t numThreads = DEFAULT_THREADS, int32_t maxBurst = DEFAULT_BURST);
+
+    /**
+     * @brief Stop the threads and wait until they terminate.
+     *
+     * Running tasks complete, the queue drops tasks that did not start yet.
+     */
+    ~SendQueue();
+
+    /**
+     * @brief Enqueue a task.
+     *
+     * @param key tasks with the same key run in order, one at a time
+     * @param task the task to run on a queue thread
+     * @param priority the lane of the task
+     */
+    void enqueue(const std::string& key, const std::function<void()>& task, Priority priority = INTERACTIVE);
+
+    /**
+     * @brief Wait until all enqueued tasks completed.
+     */
+    void drain();
+
+    /**
+     * @brief Number of tasks that are queued or run.
+     */
+    size_t getPending();
+
+    /**
+     * @brief Number of tasks of a priority that wait to run.
+     */
+    size_t getQueueDepth(Priority priority);
+
+    /**
+     * @brief Largest number of tasks of a priority that waited at the same time.
+     */
+    size_t getMaxQueueDepth(Priority priority);
+
+    /**
+     * @brief Number of tasks of a priority that started.
+     */
+    uint64_t getStarted(Priority priority);
+
+private:
+    SendQueue(const SendQueue& other);
+    SendQueue& operator=(const SendQueue& other);
+
+    struct Task {
+        std::function<void()> run;
+        Priority priority;
+    };
+
+    struct KeyTasks {
+        std::deque<Task> tasks;     //!< the running task stays first
+        bool running;
+        Priority lane;              //!< the lane the key waits in if it does not run
+    };
+
+    void run();
+
+    // Put a key that does not run into the lane of its most urgent task. Call with lock_ held.
+    void schedule(const std::string& key, KeyTasks* keyTasks);
+
+    std::vector<std::thread> threads_;
+    std::map<std::string, KeyTasks> tasks_;    //!< tasks per key
+    std::deque<std::string> ready_[NUM_LANES]; //!< keys with tasks where no task runs, per lane
+    size_t depth_[NUM_LANES];
+    size_t maxDepth_[NUM_LANES];
+    uint64_t started_[NUM_LANES];
+    int32_t maxBurst_;
+    int32_t burst_;                     //!< interactive tasks in a row while background tasks wait
+    size_t pending_;
+    std::mutex lock_;
+    std::condition_variable workAvailable_;
+    std::condition_variable idle_;
+    bool stop_;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // SENDQUEUE_H
@@ -0,0 +1,190 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "TransportQueue.h"
+
+#include <chrono>
+
+using namespace salamander;
+using namespace std;
+
+const int32_t TransportQueue::DEFAULT_CAPACITY;
+const int32_t TransportQueue::DEFAULT_MAX_BATCH;
+
+TransportQueue::TransportQueue(const SEND_FUNC& send, const WATERMARK_FUNC& watermark, int32_t capacity, int32_t maxBatch) :
+                               send_(send), watermark_(watermark), maxBatch_(maxBatch < 1 ? 1 : maxBatch),
+                               enqueuePos_(0), dequeuePos_(0), depth_(0), high_(false), sleeping_(false), waiting_(0),
+                               fullWaits_(0), batches_(0), stop_(false)
+{
+    size_t size = 2;
+    while (size < (size_t)capacity)
+        size <<= 1;
+    mask_ = size - 1;
+    highWatermark_ = size - size / 4;
+    lowWatermark_ = size / 4;
+
+    cells_ = new Cell[size];
+    for (size_t i = 0; i < size; i++)
+        cells_[i].sequence.store(i, memory_order_relaxed);
+
+    thread_ = thread(&TransportQueue::run, this);
+}
+
+TransportQueue::~TransportQueue()
+{
+    {
+        unique_lock<mutex> lck(lock_);
+        stop_ = true;
+    }
+    wakeup_.notify_all();
+    thread_.join();
+    idle_.notify_all();
+    delete[] cells_;
+}
+
+void TransportQueue::push(Item&& item)
+{
+    // Count first, the drain thread must not see the item before its count
+    size_t depth = ++depth_;
+    if (depth >= highWatermark_ && !high_.exchange(true) && watermark_)
+        watermark_(true, depth);
+
+    if (!tryPush(&item)) {
+        fullWaits_++;
+        waiting_++;
+        do {
+            // The drain thread notifies after it freed slots, the timeout covers a missed notify
+            unique_lock<mutex> lck(lock_);
+            space_.wait_for(lck, chrono::milliseconds(10));
+        } while (!tryPush(&item));
+        waiting_--;
+    }
+
+    // Pairs with the fence in run(): either the drain thread sees the item or this thread
+    // sees that the drain thread sleeps
+    atomic_thread_fence(memory_order_seq_cst);
+    if (sleeping_.load()) {
+        unique_lock<mutex> lck(lock_);
+        wakeup_.notify_one();
+    }
+}
+
+void TransportQueue::drain()
+{
+    unique_lock<mutex> lck(lock_);
+    idle_.wait(lck, [this]{ return depth_.load() == 0 || stop_; });
+}
+
+bool TransportQueue::tryPush(Item* item)
+{
+    size_t pos = enqueuePos_.load(memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &cells_[pos & mask_];
+        size_t sequence = cell->sequence.load(memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (enqueuePos_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return false;       // the drain thread did not take the item of the previous round
+        else
+            pos = enqueuePos_.load(memory_order_relaxed);
+    }
+    cell->item = std::move(*item);
+    cell->sequence.store(pos + 1, memory_order_release);
+    return true;
+}
+
+bool TransportQueue::tryPop(Item* item)
+{
+    Cell* cell = &cells_[dequeuePos_ & mask_];
+    if (cell->sequence.load(memory_order_acquire) != dequeuePos_ + 1)
+        return false;
+
+    *item = std::move(cell->item);
+    cell->item = Item();
+    cell->sequence.store(dequeuePos_ + mask_ + 1, memory_order_release);
+    dequeuePos_++;
+    return true;
+}
+
+bool TransportQueue::hasItem() const
+{
+    return cells_[dequeuePos_ & mask_].sequence.load(memory_order_acquire) == dequeuePos_ + 1;
+}
+
+void TransportQueue::checkLowWatermark()
+{
+    size_t depth = depth_.load();
+    if (depth <= lowWatermark_ && high_.load() && high_.exchange(false) && watermark_)
+        watermark_(false, depth);
+}
+
+void TransportQueue::run()
+{
+    vector<Item> batch;
+    Item next;
+    bool hasNext = false;
+
+    while (true) {
+        if (!hasNext && !hasItem()) {
+            checkLowWatermark();
+
+            unique_lock<mutex> lck(lock_);
+            sleeping_.store(true);
+            atomic_thread_fence(memory_order_seq_cst);
+            wakeup_.wait(lck, [this]{ return stop_ || hasItem(); });
+            sleeping_.store(false);
+            if (!hasItem())
+                return;             // stopped, the queue is empty
+        }
+
+        // At most one message per recipient, a message that fails goes to the outbox
+        // before the next message to this recipient is sent
+        batch.clear();
+        if (hasNext) {
+            batch.push_back(std::move(next));
+            hasNext = false;
+        }
+        while (batch.size() < maxBatch_ && tryPop(&next)) {
+            for (size_t i = 0; i < batch.size(); i++) {
+                if (batch[i].recipient == next.recipient) {
+                    hasNext = true;
+                    break;
+                }
+            }
+            if (hasNext)
+                break;
+            batch.push_back(std::move(next));
+        }
+        if (waiting_.load() > 0) {
+            unique_lock<mutex> lck(lock_);
+            space_.notify_all();
+        }
+
+        send_(&batch);
+        batches_++;
+
+        // Report the watermark before drain() returns
+        depth_ -= batch.size();
+        checkLowWatermark();
+        if (depth_.load() == 0) {
+            unique_lock<mutex> lck(lock_);
+            idle_.notify_all();
+        }
+    }
+}
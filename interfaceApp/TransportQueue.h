@@ -0,0 +1,190 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef TRANSPORTQUEUE_H
+#define TRANSPORTQUEUE_H
+
+/**
+ * @file TransportQueue.h
+ * @brief Bounded queue between the send threads and the transport
+ * @ingroup Salamander++
+ * @{
+ *
+ * The send function of the transport is synchronous. If the network stack is
+ * slow, a thread that calls it waits until the stack accepts the envelopes. The
+ * send threads put the encrypted envelopes into this queue instead and continue
+ * with the next message. A drain thread takes the queued messages and hands them
+ * to the transport in batches.
+ *
+ * The queue is a ring of fixed size. Producers claim a slot with a compare and
+ * swap, the drain thread is the only consumer, thus @c push takes no lock. The
+ * drain thread takes at most one message per recipient into a batch, the messages
+ * of a recipient leave in the order of the @c push calls.
+ *
+ * The queue reports backpressure. If the number of queued messages reaches the
+ * high watermark, the watermark function gets @c true, if it drops to the low
+ * watermark again, the function gets @c false. Producers should slow down
+ * between the two reports. If the ring is full, @c push waits for a free slot.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace salamander {
+
+class TransportQueue
+{
+public:
+    static const int32_t DEFAULT_CAPACITY = 256;    //!< Messages in the ring, a power of 2
+    static const int32_t DEFAULT_MAX_BATCH = 32;    //!< Messages per transport call
+
+    /**
+     * @brief A message with its envelopes, one pair of device id and envelope per device.
+     */
+    struct Item {
+        Item() : handle(0) {}
+        int64_t handle;
+        std::string recipient;
+        std::string msgId;
+        std::vector<std::pair<std::string, std::string> > msgPairs;
+    };
+
+    /**
+     * @brief Send a batch of messages, called on the drain thread.
+     */
+    typedef std::function<void(std::vector<Item>* batch)> SEND_FUNC;
+
+    /**
+     * @brief Report a watermark, @c true if the queue reached the high watermark,
+     *        @c false if it dropped to the low watermark.
+     *
+     * @param high the crossed watermark
+     * @param depth the number of queued messages
+     */
+    typedef std::function<void(bool high, size_t depth)> WATERMARK_FUNC;
+
+    /**
+     * @brief Create the queue and start its drain thread.
+     *
+     * @param send the function that sends a batch
+     * @param watermark the function that reports the watermarks, may be empty
+     * @param capacity size of the ring, rounded up to a power of 2
+     * @param maxBatch maximum number of messages per batch
+     */
+    TransportQueue(const SEND_FUNC& send, const WATERMARK_FUNC& watermark, int32_t capacity = DEFAULT_CAPACITY,
+                   int32_t maxBatch = DEFAULT_MAX_BATCH);
+
+    /**
+     * @brief Send the queued messages and stop the drain thread.
+     *
+     * Stop the producers before, the envelopes in the queue are encrypted, dropping
+     * them would lose the messages.
+     */
+    ~TransportQueue();
+
+    /**
+     * @brief Queue a message, wait for a free slot if the ring is full.
+     *
+     * Safe to call from several threads.
+     */
+    void push(Item&& item);
+
+    /**
+     * @brief Wait until the drain thread sent all queued messages.
+     */
+    void drain();
+
+    /**
+     * @brief Number of queued messages, including the batch the drain thread sends.
+     */
+    size_t getDepth() const { return depth_.load(); }
+
+    size_t getCapacity() const { return mask_ + 1; }
+
+    size_t getHighWatermark() const { return highWatermark_; }
+
+    size_t getLowWatermark() const { return lowWatermark_; }
+
+    /**
+     * @brief Number of pushes that found the ring full and waited.
+     */
+    uint64_t getFullWaits() const { return fullWaits_.load(); }
+
+    /**
+     * @brief Number of batches the drain thread sent.
+     */
+    uint64_t getBatches() const { return batches_.load(); }
+
+private:
+    TransportQueue(const TransportQueue& other);
+    TransportQueue& operator=(const TransportQueue& other);
+
+    // A slot's sequence tells its state: equal to the position if it is free for the
+    // producer of this position, position + 1 if it holds the item of this position
+    struct Cell {
+        std::atomic<size_t> sequence;
+        Item item;
+    };
+
+    bool tryPush(Item* item);
+
+    // Called on the drain thread only
+    bool tryPop(Item* item);
+
+    bool hasItem() const;
+
+    void run();
+
+    void checkLowWatermark();
+
+    SEND_FUNC send_;
+    WATERMARK_FUNC watermark_;
+    Cell* cells_;
+    size_t mask_;
+    size_t maxBatch_;
+    size_t highWatermark_;
+    size_t lowWatermark_;
+
+    std::atomic<size_t> enqueuePos_;
+    size_t dequeuePos_;                 //!< used by the drain thread only
+    std::atomic<size_t> depth_;
+    std::atomic<bool> high_;            //!< the high watermark was reported, the low one not yet
+    std::atomic<bool> sleeping_;        //!< the drain thread waits for items
+    std::atomic<int32_t> waiting_;      //!< producers that wait for a free slot
+    std::atomic<uint64_t> fullWaits_;
+    std::atomic<uint64_t> batches_;
+
+    std::mutex lock_;
+    std::condition_variable wakeup_;    //!< items available, or stop
+    std::condition_variable space_;     //!< slots available
+    std::condition_variable idle_;      //!< the queue is empty
+    bool stop_;
+    std::thread thread_;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // TRANSPORTQUEUE_H
@@ -24,6 +24,7 @@ limitations under the License.
 #include "../AppInterfaceImpl.h"
 #include "../../provisioning/Provisioning.h"
 #include "../../appRepository/AppRepository.h"
+#include "../../storage/sqlite/SQLiteStoreConv.h"
 #include "../../interfaceTransport/sip/SipTransport.h"
 #include "../../salamander/state/SalConversation.h"
 #include "../../salamander/crypto/EcCurve.h"
@@ -65,6 +66,7 @@ JavaVM *t_getJavaVM();
 #endif
 
 static AppInterfaceImpl* axoAppInterface = NULL;
+static SQLiteStoreConv* axoStore = NULL;
 static JavaVM* javaVM = NULL;
 
 // Set in doInit(...)
@@ -477,8 +479,10 @@ JNI_FUNCTION(doInit)(JNIEnv* env, jobject thiz, jint flags, jstring dbName, jbyt
     memset_volatile((void*)pw, 0, pwLen);
     env->ReleaseByteArrayElements(dbPassphrase, (jbyte*)pw, 0);
 
-    // initialize and open the persitent store singleton instance
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
+    // initialize and open the persitent store of this account
+    if (axoStore == NULL)
+        axoStore = new SQLiteStoreConv();
+    SQLiteStoreConv* store = axoStore;
     store->setKey(dbPw);
 
     const char* db = (const char *)env->GetStringUTFChars(dbName, 0);
@@ -488,9 +492,9 @@ JNI_FUNCTION(doInit)(JNIEnv* env, jobject thiz, jint flags, jstring dbName, jbyt
     memset_volatile((void*)dbPw.data(), 0, dbPw.size());
 
     int32_t retVal = 1;
-    AxoConversation* ownAxoConv = AxoConversation::loadLocalConversation(name);
+    AxoConversation* ownAxoConv = AxoConversation::loadLocalConversation(name, store);
     if (ownAxoConv == NULL) {  // no yet available, create one. An own conversation has the same local and remote name, empty device id
-        ownAxoConv = new AxoConversation(name, name, string());
+        ownAxoConv = new AxoConversation(name, name, string(), store);
         const DhKeyPair* idKeyPair = EcCurve::generateKeyPair(EcCurveTypes::Curve25519);
         ownAxoConv->setDHIs(idKeyPair);
         ownAxoConv->storeConversation();
@@ -498,8 +502,8 @@ JNI_FUNCTION(doInit)(JNIEnv* env, jobject thiz, jint flags, jstring dbName, jbyt
     }
     delete ownAxoConv;    // Not needed anymore here
 
-    axoAppInterface = new AppInterfaceImpl(name, auth, devId, receiveMessage, messageStateReport, notifyCallback);
-    Transport* sipTransport = new SipTransport(axoAppInterface);
+    axoAppInterface = new AppInterfaceImpl(store, name, auth, devId, receiveMessage, messageStateReport, notifyCallback);
+    Transport* sipTransport = new SipTransport(axoAppInterface, store, axoAppInterface->getDeviceCache());
 
     /* ***********************************************************************************
      * Initialize pointers/callback to the send/receive SIP data functions (network layer) 
@@ -869,7 +873,7 @@ JNI_FUNCTION(testCommand)(JNIEnv* env, jclass clazz, jstring command, jbyteArray
     }
 #endif
     if (strcmp("resetaxodb", cmd) == 0) {
-        SQLiteStoreConv* store = SQLiteStoreConv::getStore();
+        ConversationStore* store = axoAppInterface->getStore();
         store->resetStore();
         Log("Resetted Salamander store");
     }
@@ -898,19 +902,19 @@ JNI_FUNCTION(axoCommand) (JNIEnv* env, jclass clazz, jstring command, jbyteArray
     if (strcmp("removeAxoConversation", cmd) == 0) {
         Log("Removing Salamander conversation data for '%s'\n", dataContainer.c_str());
 
-        SQLiteStoreConv* store = SQLiteStoreConv::getStore();
+        ConversationStore* store = axoAppInterface->getStore();
         store->deleteConversationsName(dataContainer, axoAppInterface->getOwnUser());
 
-        Log("Removing Salamander conversation data for '%s' returned %d\n", dataContainer.c_str(), store->getSqlCode());
-        if (SQL_FAIL(store->getSqlCode())) {
+        Log("Removing Salamander conversation data for '%s' returned %d\n", dataContainer.c_str(), store->getStoreCode());
+        if (STORE_FAIL(store->getStoreCode())) {
             jstring result = env->NewStringUTF(store->getLastError());
         }
         else {
-            axoAppInterface->rescanUserDevices(dataContainer);
+            axoAppInterface->rescanUserDevicesAsync(dataContainer);
         }
     }
     if (strcmp("rescanUserDevices", cmd) == 0 && !dataContainer.empty()) {
-        axoAppInterface->rescanUserDevices(dataContainer);
+        axoAppInterface->rescanUserDevicesAsync(dataContainer);
     }
 
     env->ReleaseStringUTFChars(command, cmd);
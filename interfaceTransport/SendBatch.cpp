@@ -0,0 +1,48 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "SendBatch.h"
+
+using namespace salamander;
+using namespace std;
+
+void SendBatch::clear()
+{
+    // Each array keeps its NULL terminator
+    names_.assign(1, NULL);
+    devIds_.assign(1, NULL);
+    envelopes_.assign(1, NULL);
+    sizes_.clear();
+}
+
+void SendBatch::reserve(size_t numEnvelopes)
+{
+    names_.reserve(numEnvelopes + 1);
+    devIds_.reserve(numEnvelopes + 1);
+    envelopes_.reserve(numEnvelopes + 1);
+    sizes_.reserve(numEnvelopes);
+}
+
+void SendBatch::add(const string& recipient, const string& deviceId, const string& envelope)
+{
+    // The entry replaces the terminator, a new terminator follows it
+    names_.back() = (uint8_t*)recipient.c_str();
+    names_.push_back(NULL);
+    devIds_.back() = (uint8_t*)deviceId.c_str();
+    devIds_.push_back(NULL);
+    envelopes_.back() = (uint8_t*)envelope.data();
+    envelopes_.push_back(NULL);
+    sizes_.push_back(envelope.size());
+}
@@ -0,0 +1,111 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef SENDBATCH_H
+#define SENDBATCH_H
+
+/**
+ * @file SendBatch.h
+ * @brief Reusable descriptor of the envelopes for one transport call
+ * @ingroup Salamander++
+ * @{
+ *
+ * A batch holds references to recipient names, device ids and envelopes, it
+ * does not copy them. The caller keeps the referenced data valid and unchanged
+ * until the transport call returns. A batch may contain envelopes for several
+ * recipients.
+ *
+ * The batch keeps the data in the layout of the @c SEND_DATA_FUNC: parallel
+ * arrays, terminated by a @c NULL entry. Thus the transport hands the arrays to
+ * the send function as they are. @c clear keeps the capacity, a batch that is
+ * reused for each send does not allocate memory after the first sends.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace salamander {
+
+class SendBatch
+{
+public:
+    SendBatch() { clear(); }
+
+    /**
+     * @brief Remove all envelopes, keep the allocated capacity.
+     */
+    void clear();
+
+    /**
+     * @brief Reserve capacity for a number of envelopes.
+     */
+    void reserve(size_t numEnvelopes);
+
+    /**
+     * @brief Add an envelope.
+     *
+     * @param recipient the recipient's name
+     * @param deviceId the recipient's long device id
+     * @param envelope the message envelope
+     */
+    void add(const std::string& recipient, const std::string& deviceId, const std::string& envelope);
+
+    /**
+     * @brief Number of envelopes in the batch.
+     */
+    size_t size() const { return sizes_.size(); }
+
+    bool empty() const { return sizes_.empty(); }
+
+    /**
+     * @brief The arrays for the @c SEND_DATA_FUNC, names, device ids and envelopes end with @c NULL.
+     */
+    uint8_t** names() { return &names_[0]; }
+
+    uint8_t** deviceIds() { return &devIds_[0]; }
+
+    uint8_t** envelopes() { return &envelopes_[0]; }
+
+    size_t* sizes() { return sizes_.empty() ? NULL : &sizes_[0]; }
+
+    /**
+     * @brief Return the recipient, device id or envelope of an envelope as a string.
+     *
+     * For transports that don't use the arrays, these functions copy the data.
+     */
+    std::string recipient(size_t index) const { return std::string((const char*)names_[index]); }
+
+    std::string deviceId(size_t index) const { return std::string((const char*)devIds_[index]); }
+
+    std::string envelope(size_t index) const { return std::string((const char*)envelopes_[index], sizes_[index]); }
+
+private:
+    SendBatch(const SendBatch& other);
+    SendBatch& operator=(const SendBatch& other);
+
+    std::vector<uint8_t*> names_;
+    std::vector<uint8_t*> devIds_;
+    std::vector<uint8_t*> envelopes_;
+    std::vector<size_t> sizes_;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // SENDBATCH_H
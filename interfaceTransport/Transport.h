@@ -28,6 +28,8 @@ limitations under the License.
 #include <vector>
 #include <string>
 
+#include "SendBatch.h"
+#include "../salamander/Constants.h"
 
 //void sendDataFunc(uint8_t* names[], uint8_t* recipientScClientDevIds[], uint8_t* data[], size_t length[], uint64_t msgIds[]);
 typedef void (*SEND_DATA_FUNC)(uint8_t* [], uint8_t* [], uint8_t* [], size_t [], uint64_t []);
@@ -68,13 +70,93 @@ public:
      */
     virtual std::vector<int64_t>* sendAxoMessage(const std::string& recipient, std::vector< std::pair< std::string, std::string > >* msgPairs) = 0;
 
+    /**
+     * @brief Send message envelopes and report the result of each envelope.
+     *
+     * Same as @c sendAxoMessage but the returned vector has one message id for each message pair,
+     * 0 if the transport could not send this envelope, and the function does not modify the message
+     * pairs. The outbox uses this function to retry only the envelopes that failed.
+     *
+     * The default implementation calls @c sendAxoMessage. If this returns fewer ids than envelopes
+     * then the default implementation cannot tell which envelopes failed and reports all as failed.
+     *
+     * @param recipient The receipient's name.
+     * @param msgPairs a vector of message pairs, see @c sendAxoMessage.
+     * @return a vector of int64_t message ids, one for each message pair, @c NULL if the transport
+     *         could not send any envelope.
+     */
+    virtual std::vector<int64_t>* sendAxoMessageResults(const std::string& recipient,
+                                                        const std::vector< std::pair< std::string, std::string > >* msgPairs)
+    {
+        std::vector< std::pair< std::string, std::string > > pairs(*msgPairs);
+        std::vector<int64_t>* msgIds = sendAxoMessage(recipient, &pairs);
+        if (msgIds != NULL && msgIds->size() != msgPairs->size())
+            msgIds->assign(msgPairs->size(), 0);
+        return msgIds;
+    }
+
+    /**
+     * @brief Send a batch of message envelopes, for one or more recipients.
+     *
+     * The caller fills and reuses the batch and the message id array, the transport does not
+     * copy the envelopes. The function stores the message id of each envelope at the envelope's
+     * index in @c msgIds, 0 if the transport could not send this envelope.
+     *
+     * The default implementation calls @c sendAxoMessageResults for each run of envelopes to the
+     * same recipient, thus it copies the envelopes.
+     *
+     * @param batch the envelopes to send
+     * @param msgIds array for the message ids, at least @c batch->size() elements
+     * @param numIds number of elements in @c msgIds
+     * @return number of envelopes sent, @c GENERIC_ERROR if @c msgIds is too small
+     */
+    virtual int32_t sendAxoBatch(SendBatch* batch, int64_t* msgIds, size_t numIds)
+    {
+        size_t numEnvelopes = batch->size();
+        if (numIds < numEnvelopes)
+            return GENERIC_ERROR;
+
+        int32_t numSent = 0;
+        size_t start = 0;
+        while (start < numEnvelopes) {
+            std::string recipient = batch->recipient(start);
+            std::vector< std::pair< std::string, std::string > > pairs;
+            size_t end = start;
+            for (; end < numEnvelopes && batch->recipient(end) == recipient; end++)
+                pairs.push_back(std::pair<std::string, std::string>(batch->deviceId(end), batch->envelope(end)));
+
+            std::vector<int64_t>* results = sendAxoMessageResults(recipient, &pairs);
+            for (size_t i = start; i < end; i++) {
+                msgIds[i] = (results != NULL && i - start < results->size()) ? (*results)[i - start] : 0;
+                if (msgIds[i] != 0)
+                    numSent++;
+            }
+            delete results;
+            start = end;
+        }
+        return numSent;
+    }
+
+    /**
+     * @brief Tell if the transport carries binary envelopes.
+     *
+     * A text-only transport, for example SIP MESSAGE bodies, gets the serialized envelopes
+     * base64 encoded. If the transport returns @c true here then the App interface hands over
+     * the serialized envelopes as they are and expects binary envelopes on receive, which saves
+     * a third of the wire size and the encode and decode passes. Both ends must use the same mode.
+     *
+     * @return @c true if the transport is binary-safe, the default is @c false
+     */
+    virtual bool isBinarySafe() const { return false; }
+
     /**
      * @brief Receive data from network transport - callback function for network layer.
      *
      * The network layer calls this function to forward a received Salamander message bundle. The network
      * transport can delete its data buffer after the call returns.
      *
-     * @param data    pointer to received data, printable characters
+     * @param data    pointer to received data, printable characters, binary data if the
+     *                transport is binary-safe
      * @param length  length of the data array (may not be 0 terminated)
      * @return Success (1) if function can process the message, -10 for generic error, -13 if message
      *         is not for this client.
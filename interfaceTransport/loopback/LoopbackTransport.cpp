@@ -0,0 +1,237 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "LoopbackTransport.h"
+
+using namespace salamander;
+using namespace std;
+
+LoopbackNetwork::LoopbackNetwork() : delivering_(NULL), latencyMicros_(0), jitterMicros_(0), lossRate_(0.0),
+                                     nextId_(1), sequence_(0), sent_(0), delivered_(0), dropped_(0),
+                                     bytes_(0), binarySafe_(false), stop_(false)
+{
+    thread_ = thread(&LoopbackNetwork::run, this);
+}
+
+LoopbackNetwork::~LoopbackNetwork()
+{
+    {
+        unique_lock<mutex> lck(lock_);
+        stop_ = true;
+    }
+    changed_.notify_all();
+    thread_.join();
+}
+
+void LoopbackNetwork::setLatency(int32_t latencyMicros, int32_t jitterMicros)
+{
+    unique_lock<mutex> lck(lock_);
+    latencyMicros_ = latencyMicros < 0 ? 0 : latencyMicros;
+    jitterMicros_ = jitterMicros < 0 ? 0 : jitterMicros;
+}
+
+void LoopbackNetwork::setLossRate(double lossRate)
+{
+    unique_lock<mutex> lck(lock_);
+    lossRate_ = lossRate;
+}
+
+void LoopbackNetwork::setSeed(uint32_t seed)
+{
+    unique_lock<mutex> lck(lock_);
+    random_.seed(seed);
+}
+
+string LoopbackNetwork::endpointKey(const string& name, const string& deviceId)
+{
+    string key(name);
+    key.append(1, '\0').append(deviceId);
+    return key;
+}
+
+void LoopbackNetwork::attach(const string& name, const string& deviceId, Transport* transport)
+{
+    unique_lock<mutex> lck(lock_);
+    endpoints_[endpointKey(name, deviceId)] = transport;
+}
+
+void LoopbackNetwork::detach(const string& name, const string& deviceId)
+{
+    unique_lock<mutex> lck(lock_);
+    map<string, Transport*>::iterator it = endpoints_.find(endpointKey(name, deviceId));
+    if (it == endpoints_.end())
+        return;
+
+    Transport* transport = it->second;
+    endpoints_.erase(it);
+    changed_.wait(lck, [this, transport]{ return delivering_ != transport; });
+}
+
+int64_t LoopbackNetwork::send(const string& name, const string& deviceId, const string& envelope)
+{
+    unique_lock<mutex> lck(lock_);
+    string endpoint = endpointKey(name, deviceId);
+    if (endpoints_.find(endpoint) == endpoints_.end())
+        return 0;
+
+    sent_++;
+    bytes_ += envelope.size();
+    int64_t msgId = nextId_++;
+
+    // The sender does not notice a loss
+    if (lossRate_ > 0.0 && uniform_real_distribution<double>(0.0, 1.0)(random_) < lossRate_) {
+        dropped_++;
+        return msgId;
+    }
+    int32_t delay = latencyMicros_;
+    if (jitterMicros_ > 0)
+        delay += uniform_int_distribution<int32_t>(0, jitterMicros_)(random_);
+
+    Delivery delivery;
+    delivery.due = chrono::steady_clock::now() + chrono::microseconds(delay);
+    delivery.sequence = sequence_++;
+    delivery.endpoint.swap(endpoint);
+    delivery.envelope = envelope;
+    pending_.push(delivery);
+    changed_.notify_all();
+    return msgId;
+}
+
+void LoopbackNetwork::drain()
+{
+    unique_lock<mutex> lck(lock_);
+    changed_.wait(lck, [this]{ return (pending_.empty() && delivering_ == NULL) || stop_; });
+}
+
+uint64_t LoopbackNetwork::getSent()
+{
+    unique_lock<mutex> lck(lock_);
+    return sent_;
+}
+
+uint64_t LoopbackNetwork::getDelivered()
+{
+    unique_lock<mutex> lck(lock_);
+    return delivered_;
+}
+
+uint64_t LoopbackNetwork::getDropped()
+{
+    unique_lock<mutex> lck(lock_);
+    return dropped_;
+}
+
+uint64_t LoopbackNetwork::getBytes()
+{
+    unique_lock<mutex> lck(lock_);
+    return bytes_;
+}
+
+void LoopbackNetwork::run()
+{
+    unique_lock<mutex> lck(lock_);
+    while (true) {
+        if (pending_.empty()) {
+            if (stop_)
+                return;
+            changed_.wait(lck);
+            continue;
+        }
+        // Deliver the pending envelopes at once if the network stops
+        chrono::steady_clock::time_point due = pending_.top().due;
+        if (!stop_ && due > chrono::steady_clock::now()) {
+            changed_.wait_until(lck, due);
+            continue;
+        }
+        Delivery delivery = pending_.top();
+        pending_.pop();
+
+        map<string, Transport*>::iterator it = endpoints_.find(delivery.endpoint);
+        if (it == endpoints_.end()) {
+            dropped_++;
+            changed_.notify_all();
+            continue;
+        }
+        // Receive without the lock, the receiver may send an answer
+        delivering_ = it->second;
+        lck.unlock();
+        delivering_->receiveAxoMessage((uint8_t*)delivery.envelope.data(), delivery.envelope.size());
+        lck.lock();
+        delivering_ = NULL;
+        delivered_++;
+        changed_.notify_all();
+    }
+}
+
+LoopbackTransport::LoopbackTransport(LoopbackNetwork* network, AppInterface* appInterface, const string& name, const string& deviceId) :
+                                     network_(network), appInterface_(appInterface), name_(name), deviceId_(deviceId)
+{
+    network_->attach(name_, deviceId_, this);
+}
+
+LoopbackTransport::~LoopbackTransport()
+{
+    network_->detach(name_, deviceId_);
+}
+
+vector<int64_t>* LoopbackTransport::sendAxoMessage(const string& recipient, vector<pair<string, string> >* msgPairs)
+{
+    vector<int64_t>* msgIds = new vector<int64_t>;
+    for (size_t i = 0; i < msgPairs->size(); i++) {
+        int64_t msgId = network_->send(recipient, (*msgPairs)[i].first, (*msgPairs)[i].second);
+        if (msgId != 0)
+            msgIds->push_back(msgId);
+    }
+    msgPairs->clear();
+    return msgIds;
+}
+
+vector<int64_t>* LoopbackTransport::sendAxoMessageResults(const string& recipient, const vector<pair<string, string> >* msgPairs)
+{
+    vector<int64_t>* msgIds = new vector<int64_t>;
+    for (size_t i = 0; i < msgPairs->size(); i++)
+        msgIds->push_back(network_->send(recipient, (*msgPairs)[i].first, (*msgPairs)[i].second));
+    return msgIds;
+}
+
+int32_t LoopbackTransport::sendAxoBatch(SendBatch* batch, int64_t* msgIds, size_t numIds)
+{
+    size_t numEnvelopes = batch->size();
+    if (numIds < numEnvelopes)
+        return GENERIC_ERROR;
+
+    int32_t numSent = 0;
+    for (size_t i = 0; i < numEnvelopes; i++) {
+        msgIds[i] = network_->send(batch->recipient(i), batch->deviceId(i), batch->envelope(i));
+        if (msgIds[i] != 0)
+            numSent++;
+    }
+    return numSent;
+}
+
+int32_t LoopbackTransport::receiveAxoMessage(uint8_t* data, size_t length)
+{
+    string envelope((const char*)data, length);
+    return appInterface_->receiveMessage(envelope);
+}
+
+void LoopbackTransport::stateReportAxo(int64_t messageIdentifier, int32_t stateCode, uint8_t* data, size_t length)
+{
+    string info;
+    if (data != NULL)
+        info.assign((const char*)data, length);
+    if (appInterface_->stateReportCallback_ != NULL)
+        appInterface_->stateReportCallback_(messageIdentifier, stateCode, info);
+}
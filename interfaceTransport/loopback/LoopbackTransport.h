@@ -0,0 +1,221 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef LOOPBACKTRANSPORT_H
+#define LOOPBACKTRANSPORT_H
+
+/**
+ * @file LoopbackTransport.h
+ * @brief In-process transport, routes envelopes between application interfaces
+ * @ingroup Salamander++
+ * @{
+ *
+ * The loopback network connects several application interfaces in one process,
+ * without the SIP stack. Each interface gets a @c LoopbackTransport that attaches
+ * its user name and device id to the network. A send hands the envelope to the
+ * network, the network's thread calls the receive function of the recipient's
+ * transport.
+ *
+ * For tests the network can delay each envelope, add a random jitter to the
+ * delay, which reorders envelopes, and drop envelopes. The sender gets a message
+ * id for a dropped envelope, as with a real network. A seed makes the random
+ * decisions repeatable.
+ *
+ * The network carries binary envelopes if it is binary-safe, base64 encoded
+ * envelopes otherwise. Set the mode before the first send, all application
+ * interfaces on the network use the same mode.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include "../Transport.h"
+#include "../../interfaceApp/AppInterface.h"
+
+namespace salamander {
+
+class LoopbackNetwork
+{
+public:
+    LoopbackNetwork();
+
+    /**
+     * @brief Deliver the pending envelopes and stop the network's thread.
+     */
+    ~LoopbackNetwork();
+
+    /**
+     * @brief Set the delay of each envelope.
+     *
+     * @param latencyMicros the fixed delay
+     * @param jitterMicros maximum random delay on top of the fixed delay, envelopes with
+     *        a smaller total delay overtake others
+     */
+    void setLatency(int32_t latencyMicros, int32_t jitterMicros);
+
+    /**
+     * @brief Set the probability to drop an envelope, 0.0 to 1.0.
+     */
+    void setLossRate(double lossRate);
+
+    /**
+     * @brief Seed the random decisions of jitter and loss.
+     */
+    void setSeed(uint32_t seed);
+
+    /**
+     * @brief Carry binary envelopes instead of base64 encoded ones.
+     */
+    void setBinarySafe(bool binarySafe) { binarySafe_ = binarySafe; }
+
+    bool isBinarySafe() const { return binarySafe_.load(); }
+
+    /**
+     * @brief Attach the transport of a device, the network delivers the device's envelopes to it.
+     */
+    void attach(const std::string& name, const std::string& deviceId, Transport* transport);
+
+    /**
+     * @brief Detach the transport of a device, waits if the network delivers to it.
+     */
+    void detach(const std::string& name, const std::string& deviceId);
+
+    /**
+     * @brief Send an envelope to a device.
+     *
+     * @return the message id, 0 if no transport is attached for the device
+     */
+    int64_t send(const std::string& name, const std::string& deviceId, const std::string& envelope);
+
+    /**
+     * @brief Wait until the network delivered or dropped all sent envelopes.
+     */
+    void drain();
+
+    uint64_t getSent();
+
+    uint64_t getDelivered();
+
+    uint64_t getDropped();
+
+    /**
+     * @brief Number of envelope bytes sent, including dropped envelopes.
+     */
+    uint64_t getBytes();
+
+private:
+    LoopbackNetwork(const LoopbackNetwork& other);
+    LoopbackNetwork& operator=(const LoopbackNetwork& other);
+
+    struct Delivery {
+        std::chrono::steady_clock::time_point due;
+        uint64_t sequence;          //!< keeps the send order of envelopes with the same due time
+        std::string endpoint;
+        std::string envelope;
+
+        bool operator>(const Delivery& other) const
+        {
+            return due > other.due || (due == other.due && sequence > other.sequence);
+        }
+    };
+
+    static std::string endpointKey(const std::string& name, const std::string& deviceId);
+
+    void run();
+
+    std::map<std::string, Transport*> endpoints_;
+    std::priority_queue<Delivery, std::vector<Delivery>, std::greater<Delivery> > pending_;
+    Transport* delivering_;         //!< the transport the network's thread calls, NULL if none
+    int32_t latencyMicros_;
+    int32_t jitterMicros_;
+    double lossRate_;
+    std::mt19937 random_;
+
+    int64_t nextId_;
+    uint64_t sequence_;
+    uint64_t sent_;
+    uint64_t delivered_;
+    uint64_t dropped_;
+    uint64_t bytes_;
+    std::atomic<bool> binarySafe_;
+
+    std::mutex lock_;
+    std::condition_variable changed_;
+    bool stop_;
+    std::thread thread_;
+};
+
+class LoopbackTransport : public Transport
+{
+public:
+    /**
+     * @brief Create the transport of a device and attach it to the network.
+     *
+     * The network must outlive the transport.
+     *
+     * @param network the loopback network
+     * @param appInterface the device's application interface, gets the received envelopes
+     * @param name the user name of the device
+     * @param deviceId the long device id of the device
+     */
+    LoopbackTransport(LoopbackNetwork* network, AppInterface* appInterface, const std::string& name, const std::string& deviceId);
+
+    ~LoopbackTransport();
+
+    void setSendDataFunction(SEND_DATA_FUNC /* sendData */) {}
+
+    SEND_DATA_FUNC getTransport() { return NULL; }
+
+    std::vector<int64_t>* sendAxoMessage(const std::string& recipient, std::vector< std::pair< std::string, std::string > >* msgPairs);
+
+    std::vector<int64_t>* sendAxoMessageResults(const std::string& recipient,
+                                                const std::vector< std::pair< std::string, std::string > >* msgPairs);
+
+    int32_t sendAxoBatch(SendBatch* batch, int64_t* msgIds, size_t numIds);
+
+    bool isBinarySafe() const { return network_->isBinarySafe(); }
+
+    int32_t receiveAxoMessage(uint8_t* data, size_t length);
+
+    void stateReportAxo(int64_t messageIdentifier, int32_t stateCode, uint8_t* data, size_t length);
+
+    void notifyAxo(uint8_t* /* data */, size_t /* length */) {}
+
+private:
+    LoopbackTransport(const LoopbackTransport& other);
+    LoopbackTransport& operator=(const LoopbackTransport& other);
+
+    LoopbackNetwork* network_;
+    AppInterface* appInterface_;
+    std::string name_;
+    std::string deviceId_;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // LOOPBACKTRANSPORT_H
@@ -14,8 +14,9 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 #include "SipTransport.h"
-#include "../../storage/sqlite/SQLiteStoreConv.h"
+#include "../../storage/ConversationStore.h"
 #include <iostream>
+#include <string.h>
 
 using namespace salamander;
 
@@ -23,39 +24,59 @@ void Log(const char* format, ...);
 
 vector< int64_t >* SipTransport::sendAxoMessage(const string& recipient, vector< pair< string, string > >* msgPairs)
 {
-    int32_t numPairs = msgPairs->size();
-
-    uint8_t** names = new uint8_t*[numPairs+1];
-    uint8_t** devIds = new uint8_t*[numPairs+1];
-    uint8_t** envelopes = new uint8_t*[numPairs+1];
-    size_t*   sizes = new size_t[numPairs+1];
-    uint64_t* msgIds = new uint64_t[numPairs+1];
-
-    int32_t index = 0;
-    for(; index < numPairs; index++) {
-        pair<string, string>& msgPair = msgPairs->at(index);
-        names[index] = (uint8_t*)recipient.c_str();
-        devIds[index] = (uint8_t*)msgPair.first.c_str();
-        envelopes[index] = (uint8_t*)msgPair.second.data();
-        sizes[index] = msgPair.second.size();
-    }
-    names[index] = NULL; devIds[index] = NULL; envelopes[index] = NULL; 
-
-    sendAxoData_(names, devIds, envelopes, sizes, msgIds);
+    vector<int64_t>* results = sendAxoMessageResults(recipient, msgPairs);
 
     // This should clear everything because no pointers involved
     msgPairs->clear();
-    delete names; delete devIds; delete envelopes; delete sizes;
 
     vector<int64_t>* msgIdsReturn = new std::vector<int64_t>;
-    for (int32_t i = 0; i < numPairs; i++) {
-        if (msgIds[i] != 0)
-            msgIdsReturn->push_back(msgIds[i]);
+    for (size_t i = 0; i < results->size(); i++) {
+        if ((*results)[i] != 0)
+            msgIdsReturn->push_back((*results)[i]);
     }
-    delete msgIds;
+    delete results;
     return msgIdsReturn;
 }
 
+vector< int64_t >* SipTransport::sendAxoMessageResults(const string& recipient, const vector< pair< string, string > >* msgPairs)
+{
+    size_t numPairs = msgPairs->size();
+
+    SendBatch batch;
+    batch.reserve(numPairs);
+    for (size_t i = 0; i < numPairs; i++)
+        batch.add(recipient, (*msgPairs)[i].first, (*msgPairs)[i].second);
+
+    vector<int64_t>* results = new std::vector<int64_t>(numPairs, 0);
+    if (numPairs > 0)
+        sendAxoBatch(&batch, &(*results)[0], numPairs);
+    return results;
+}
+
+int32_t SipTransport::sendAxoBatch(SendBatch* batch, int64_t* msgIds, size_t numIds)
+{
+    size_t numEnvelopes = batch->size();
+    if (numIds < numEnvelopes)
+        return GENERIC_ERROR;
+    if (numEnvelopes == 0)
+        return 0;
+
+    // The send function fills the caller's array, int64_t and uint64_t have the same layout.
+    // It leaves 0 if it could not send the envelope.
+    uint64_t* ids = reinterpret_cast<uint64_t*>(msgIds);
+    for (size_t i = 0; i < numEnvelopes; i++)
+        ids[i] = 0;
+
+    sendAxoData_(batch->names(), batch->deviceIds(), batch->envelopes(), batch->sizes(), ids);
+
+    int32_t numSent = 0;
+    for (size_t i = 0; i < numEnvelopes; i++) {
+        if (ids[i] != 0)
+            numSent++;
+    }
+    return numSent;
+}
+
 int32_t SipTransport::receiveAxoMessage(uint8_t* data, size_t length)
 {
     string envelope((const char*)data, length);
@@ -77,45 +98,57 @@ static string Zeros("00000000000000000000000000000000");
 
 void SipTransport::notifyAxo(uint8_t* data, size_t length)
 {
-    string info((const char*)data, length);
     /*
      * notify call back from SIP:
      *   - parse data from SIP, get name and devices
-     *   - check for new devices (store->hasConversation() )
+     *   - check for new devices (store_->hasConversations() )
      *   - if a new device was found call appInterface_->notifyCallback(...)
      *     NOTE: the notifyCallback function in app should return ASAP, queue/trigger actions only
      *   - done
      */
-    size_t found = info.find(':');
-    if (found == string::npos)        // No colon? No name -> return
+    const char* info = (const char*)data;
+    const char* colon = (const char*)memchr(info, ':', length);
+    if (colon == NULL)        // No colon? No name -> return
         return;
 
-    string name = info.substr(0, found);
-    size_t foundAt = name.find('@');
-    if (foundAt != string::npos) {
-        name = name.substr(0, foundAt);
+    size_t nameLength = colon - info;
+    const char* at = (const char*)memchr(info, '@', nameLength);
+    if (at != NULL)
+        nameLength = at - info;
+    string name(info, nameLength);
+
+    // The user added or removed a device, the cached device list is outdated
+    if (deviceCache_ != NULL)
+        deviceCache_->invalidate(name);
+
+    // The device ids point into the caller's data, each id ends with a semicolon
+    const char* devIds = colon + 1;
+    const char* end = info + length;
+    vector<DataSpan> devices;
+    for (const char* devId = devIds; devId < end; ) {
+        const char* semicolon = (const char*)memchr(devId, ';', end - devId);
+        if (semicolon == NULL)
+            break;
+        size_t devIdLength = semicolon - devId;
+        if (devIdLength > Zeros.size() || Zeros.compare(0, devIdLength, devId, devIdLength) != 0)
+            devices.push_back(DataSpan((const uint8_t*)devId, devIdLength));
+        devId = semicolon + 1;
     }
+    if (devices.empty())
+        return;
 
-    string devIds = info.substr(found + 1);
-    string devIdsSave(devIds);
-
-    size_t pos = 0;
-    string devId;
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
-
-    bool newDevice = false;
-    while ((pos = devIds.find(';')) != string::npos) {
-        devId = devIds.substr(0, pos);
-        devIds.erase(0, pos + 1);
-        if (Zeros.compare(0, devId.size(), devId) == 0) {
-            continue;
-        }
-        if (!store->hasConversation(name, devId, appInterface_->getOwnUser())) {
-            newDevice = true;
-            break;
-        }
+    // If the lookup fails the devices count as new, the prefetch checks them again
+    vector<bool> known;
+    store_->hasConversations(name, devices, appInterface_->getOwnUser(), &known);
+
+    list<string> newDevices;
+    for (size_t i = 0; i < devices.size(); i++) {
+        if (!known[i])
+            newDevices.push_back(devices[i].toString());
+    }
+    if (!newDevices.empty()) {
+        appInterface_->prefetchUserDevices(name, newDevices);
+        appInterface_->notifyCallback_(AppInterface::DEVICE_SCAN, name, string(devIds, end - devIds));
     }
-    if (newDevice)
-        appInterface_->notifyCallback_(AppInterface::DEVICE_SCAN, name, devIdsSave);
 }
 
@@ -29,6 +29,8 @@ limitations under the License.
 
 #include "../Transport.h"
 #include "../../interfaceApp/AppInterface.h"
+#include "../../storage/ConversationStore.h"
+#include "../../provisioning/DeviceCache.h"
 
 using namespace std;
 
@@ -37,7 +39,16 @@ namespace salamander {
 class SipTransport: public Transport
 {
 public:
-    SipTransport(AppInterface* appInterface) : appInterface_(appInterface) {}
+    /**
+     * @brief Create the SIP transport for one account.
+     *
+     * @param appInterface the account's application interface
+     * @param store the account's store, used to check for known devices
+     * @param deviceCache the account's device list cache, device notifications invalidate
+     *        the user's device list, may be @c NULL
+     */
+    SipTransport(AppInterface* appInterface, ConversationStore* store, DeviceCache* deviceCache = NULL) :
+        appInterface_(appInterface), store_(store), deviceCache_(deviceCache) {}
 
     ~SipTransport() {}
 
@@ -47,6 +58,10 @@ public:
 
     vector<int64_t>* sendAxoMessage(const string& recipient, vector< pair< string, string > >* msgPairs);
 
+    vector<int64_t>* sendAxoMessageResults(const string& recipient, const vector< pair< string, string > >* msgPairs);
+
+    int32_t sendAxoBatch(SendBatch* batch, int64_t* msgIds, size_t numIds);
+
     int32_t receiveAxoMessage(uint8_t* data, size_t length);
 
     void stateReportAxo(int64_t messageIdentifier, int32_t stateCode, uint8_t* data, size_t length);
@@ -63,6 +78,8 @@ private:
 #pragma clang diagnostic pop
 
     AppInterface *appInterface_;
+    ConversationStore* store_;
+    DeviceCache* deviceCache_;
     SEND_DATA_FUNC sendAxoData_;
 };
 }
@@ -26,6 +26,7 @@ limitations under the License.
 #include <iostream>
 #include <time.h>
 #include <utility>
+#include <unordered_set>
 
 using namespace salamander;
 static string* preKeyJson(int32_t keyId, const DhKeyPair& preKeyPair)
@@ -41,14 +42,14 @@ static string* preKeyJson(int32_t keyId, const DhKeyPair& preKeyPair)
     b64Len = b64Encode((const uint8_t*)preKeyPair.getPublicKey().serialize().data(), preKeyPair.getPublicKey().getEncodedSize(), b64Buffer, MAX_KEY_BYTES_ENCODED*2);
     cJSON_AddStringToObject(root, "public", b64Buffer);
 
-    char *out = cJSON_Print(root);
+    char *out = cJSON_PrintUnformatted(root);
     std::string* data = new std::string(out);
     cJSON_Delete(root); free(out);
 
     return data;
 }
 
-pair<int32_t, const DhKeyPair*> PreKeys::generatePreKey(SQLiteStoreConv* store)
+pair<int32_t, const DhKeyPair*> PreKeys::generatePreKey(ConversationStore* store)
 {
     int32_t keyId;
     for (bool ok = false; !ok; ) {
@@ -59,20 +60,47 @@ pair<int32_t, const DhKeyPair*> PreKeys::generatePreKey(SQLiteStoreConv* store)
     const DhKeyPair* preKeyPair = EcCurve::generateKeyPair(EcCurveTypes::Curve25519);
 
     // Create storage format (JSON) of pre-key and store it. Storage encrypts the JSON data
-    const string pk = *preKeyJson(keyId, *preKeyPair);
-    store->storePreKey(keyId, pk);
+    string* pk = preKeyJson(keyId, *preKeyPair);
+    store->storePreKey(keyId, *pk);
+    delete pk;
 
     pair <int32_t, const DhKeyPair*> prePair(keyId, preKeyPair);
     return prePair;
 }
 
-list<pair<int32_t, const DhKeyPair*> >* PreKeys::generatePreKeys(SQLiteStoreConv* store, int32_t num)
+list<pair<int32_t, const DhKeyPair*> >* PreKeys::generatePreKeys(ConversationStore* store, int32_t num)
 {
     std::list< pair<int32_t, const DhKeyPair*> >* pkrList = new std::list< pair<int32_t, const DhKeyPair*> >;
 
+    // Read the used ids once and check new random ids against this snapshot instead
+    // of querying the store for each id
+    list<int32_t>* storedIds = store->getPreKeyIds();
+    if (storedIds == NULL)
+        return pkrList;
+    unordered_set<int32_t> usedIds(storedIds->begin(), storedIds->end());
+    delete storedIds;
+
+    list<pair<int32_t, string> > preKeys;
     for (int32_t i = 0; i < num; i++) {
-        pair<int32_t, const DhKeyPair*> pkPair = generatePreKey(store);
-        pkrList->push_back(pkPair);
+        int32_t keyId;
+        do {
+            ZrtpRandom::getRandomData((uint8_t*)&keyId, sizeof(int32_t));
+            keyId &= 0x7fffffff;      // always a positive value
+        } while (!usedIds.insert(keyId).second);
+
+        const DhKeyPair* preKeyPair = EcCurve::generateKeyPair(EcCurveTypes::Curve25519);
+        string* pk = preKeyJson(keyId, *preKeyPair);
+        preKeys.push_back(pair<int32_t, string>(keyId, *pk));
+        delete pk;
+
+        pkrList->push_back(pair<int32_t, const DhKeyPair*>(keyId, preKeyPair));
+    }
+    // All or nothing: if the store fails the caller gets an empty list
+    if (store->storePreKeys(preKeys) != STORE_OK) {
+        while (!pkrList->empty()) {
+            delete pkrList->front().second;
+            pkrList->pop_front();
+        }
     }
     return pkrList;
 }
@@ -28,7 +28,7 @@ limitations under the License.
 #include <list>
 
 #include "../salamander/crypto/DhKeyPair.h"
-#include "../storage/sqlite/SQLiteStoreConv.h"
+#include "../storage/ConversationStore.h"
 #include "../salamander/Constants.h"
 
 using namespace std;
@@ -46,13 +46,14 @@ public:
      * @param store The persitent Salamander store to store and retrieve state information.
      * @return a new pre-key and its id
      */
-    static pair< int32_t, const DhKeyPair* > generatePreKey(SQLiteStoreConv* store );
+    static pair< int32_t, const DhKeyPair* > generatePreKey(ConversationStore* store );
 
     /**
      * @brief Generate a batch of pre-keys.
      * 
      * This functions generates a batch pre-keys and stores them in the persistent
-     * store. The store instance must be open and ready.
+     * store. The store instance must be open and ready. The function stores all
+     * pre-keys in one transaction, either all pre-keys are stored or none.
      * 
      * The caller should check the size of the list if it contains generated pre-keys.
      * The list does not contain @c NULL pointers.
@@ -60,7 +61,7 @@ public:
      * @param store The persitent Salamander store to store and retrieve state information.
      * @return a list of the generated new pre-key.
      */
-    static list< pair< int32_t, const DhKeyPair* > >* generatePreKeys(SQLiteStoreConv* store, int32_t num = NUM_PRE_KEYS);
+    static list< pair< int32_t, const DhKeyPair* > >* generatePreKeys(ConversationStore* store, int32_t num = NUM_PRE_KEYS);
 
     /**
      * @brief Parse pre-key JSON data and return the keys
@@ -0,0 +1,120 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "DeviceCache.h"
+#include "Provisioning.h"
+
+using namespace salamander;
+using namespace std;
+
+const int32_t DeviceCache::DEFAULT_TTL;
+const int32_t DeviceCache::DEFAULT_NEGATIVE_TTL;
+
+DeviceCache::DeviceCache(int32_t ttl, int32_t negativeTtl) : ttl_(ttl), negativeTtl_(negativeTtl), hits_(0), misses_(0)
+{
+}
+
+list<pair<string, string> >* DeviceCache::getDeviceIds(const string& name, const string& authorization)
+{
+    if (ttl_ <= 0) {
+        unique_lock<mutex> lck(lock_);
+        misses_++;
+        lck.unlock();
+        return Provisioning::getAxoDeviceIds(name, authorization);
+    }
+
+    unique_lock<mutex> lck(lock_);
+    Entry& entry = entries_[name];
+
+    if (entry.expires != 0 && time(NULL) < entry.expires) {
+        hits_++;
+        return new DeviceList(entry.devices);
+    }
+
+    // Another thread requests this list, wait for its result
+    if (entry.request) {
+        shared_ptr<Request> request = entry.request;
+        requestDone_.wait(lck, [&request]{ return request->done; });
+        hits_++;
+        return request->failed ? NULL : new DeviceList(request->devices);
+    }
+
+    misses_++;
+    shared_ptr<Request> request = make_shared<Request>();
+    entry.request = request;
+    uint64_t generation = entry.generation;
+    lck.unlock();
+
+    DeviceList* devices = Provisioning::getAxoDeviceIds(name, authorization);
+
+    // clear() keeps entries with a running request, the reference is still valid
+    lck.lock();
+    entry.request.reset();
+
+    request->failed = devices == NULL;
+    if (devices != NULL) {
+        request->devices = *devices;
+        // Don't store an outdated list, the user's devices changed during the request
+        if (entry.generation == generation) {
+            entry.devices = *devices;
+            entry.expires = time(NULL) + (devices->empty() ? negativeTtl_ : ttl_);
+        }
+    }
+    request->done = true;
+    requestDone_.notify_all();
+    return devices;
+}
+
+void DeviceCache::invalidate(const string& name)
+{
+    unique_lock<mutex> lck(lock_);
+    map<string, Entry>::iterator it = entries_.find(name);
+    if (it == entries_.end())
+        return;
+
+    it->second.devices.clear();
+    it->second.expires = 0;
+    it->second.generation++;
+}
+
+void DeviceCache::clear()
+{
+    unique_lock<mutex> lck(lock_);
+
+    // Keep the entries with running requests, invalidate them instead
+    map<string, Entry>::iterator it = entries_.begin();
+    while (it != entries_.end()) {
+        if (it->second.request) {
+            it->second.devices.clear();
+            it->second.expires = 0;
+            it->second.generation++;
+            ++it;
+        }
+        else
+            entries_.erase(it++);
+    }
+}
+
+uint64_t DeviceCache::getHits()
+{
+    unique_lock<mutex> lck(lock_);
+    return hits_;
+}
+
+uint64_t DeviceCache::getMisses()
+{
+    unique_lock<mutex> lck(lock_);
+    return misses_;
+}
@@ -0,0 +1,143 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef DEVICECACHE_H
+#define DEVICECACHE_H
+
+/**
+ * @file DeviceCache.h
+ * @brief Cache of the users' Salamander device lists
+ * @ingroup Salamander++
+ * @{
+ *
+ * The cache keeps the device lists that @c Provisioning::getAxoDeviceIds returns
+ * for some time and thus saves a provisioning server request for each send to a
+ * user without a stored conversation and for each device rescan.
+ *
+ * A device list expires after the TTL, an empty device list after the shorter
+ * negative TTL. The cache does not keep failed requests. Device notifications
+ * from the transport invalidate the user's list, see @c SipTransport::notifyAxo.
+ *
+ * If several threads request the device list of the same user and the cache
+ * does not have the list then only the first thread sends a request to the
+ * server. The other threads wait for the result of this request.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+#include <list>
+#include <map>
+#include <memory>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+
+namespace salamander {
+
+class DeviceCache
+{
+public:
+    static const int32_t DEFAULT_TTL = 300;          //!< Keep device lists for 5 minutes
+    static const int32_t DEFAULT_NEGATIVE_TTL = 30;  //!< Keep empty device lists for 30 seconds
+
+    /**
+     * @brief Create an empty cache.
+     *
+     * @param ttl seconds to keep a device list, 0 disables the cache
+     * @param negativeTtl seconds to keep an empty device list
+     */
+    explicit DeviceCache(int32_t ttl = DEFAULT_TTL, int32_t negativeTtl = DEFAULT_NEGATIVE_TTL);
+
+    ~DeviceCache() {}
+
+    /**
+     * @brief Get the available registered Salamander devices of a user.
+     *
+     * Returns the cached device list or requests it from the provisioning server.
+     *
+     * @param name username of the other user
+     * @param authorization autorization data, may be needed for some servers
+     * @return a new list of device ids and device names, the caller must delete it,
+     *         @c NULL if the request to server failed.
+     * @see Provisioning::getAxoDeviceIds
+     */
+    std::list<std::pair<std::string, std::string> >* getDeviceIds(const std::string& name, const std::string& authorization);
+
+    /**
+     * @brief Remove the device list of a user.
+     *
+     * A running server request for this user completes but its result does not
+     * go to the cache.
+     *
+     * @param name username of the user
+     */
+    void invalidate(const std::string& name);
+
+    /**
+     * @brief Remove all device lists.
+     */
+    void clear();
+
+    /**
+     * @brief Number of requests that did not need a server request.
+     *
+     * This includes the requests that waited for the server request of another thread.
+     */
+    uint64_t getHits();
+
+    /**
+     * @brief Number of server requests.
+     */
+    uint64_t getMisses();
+
+private:
+    DeviceCache(const DeviceCache& other);
+    DeviceCache& operator=(const DeviceCache& other);
+
+    typedef std::list<std::pair<std::string, std::string> > DeviceList;
+
+    // A running server request, the waiting threads share it
+    struct Request {
+        Request() : done(false), failed(false) {}
+        bool done;
+        bool failed;
+        DeviceList devices;
+    };
+
+    struct Entry {
+        Entry() : expires(0), generation(0) {}
+        DeviceList devices;
+        time_t expires;             //!< 0 if the entry has no device list
+        uint64_t generation;        //!< incremented by invalidate
+        std::shared_ptr<Request> request;   //!< the running server request or empty
+    };
+
+    int32_t ttl_;
+    int32_t negativeTtl_;
+    std::map<std::string, Entry> entries_;
+    uint64_t hits_;
+    uint64_t misses_;
+    std::mutex lock_;
+    std::condition_variable requestDone_;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // DEVICECACHE_H
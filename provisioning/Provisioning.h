@@ -28,7 +28,7 @@ limitations under the License.
 #include <utility>
 
 #include "../salamander/crypto/DhPublicKey.h"
-#include "../storage/sqlite/SQLiteStoreConv.h"
+#include "../storage/ConversationStore.h"
 
 using namespace std;
 
@@ -116,7 +116,7 @@ public:
      * @param result To store the result data of the server, usually in case of an error only
      * @return the server's request return code, e.g. 200 or 404 or alike.
      */
-    static int32_t newPreKeys(SQLiteStoreConv* store, const string& longDevId, const string& authorization, int32_t number, string* result);
+    static int32_t newPreKeys(ConversationStore* store, const string& longDevId, const string& authorization, int32_t number, string* result);
 
 };
 } // namespace
@@ -285,7 +285,7 @@ list<pair<string, string> >* Provisioning::getAxoDeviceIds(const std::string& na
     }]
  }
 */
-int32_t Provisioning::newPreKeys(SQLiteStoreConv* store, const string& longDevId, const string& authorization, int32_t number, string* result )
+int32_t Provisioning::newPreKeys(ConversationStore* store, const string& longDevId, const string& authorization, int32_t number, string* result )
 {
     char temp[1000];
     snprintf(temp, 990, registerRequest, longDevId.c_str(), authorization.c_str());
@@ -35,6 +35,7 @@ namespace salamander {
     static const int SYMMETRIC_KEY_LENGTH  = 32;      //!< Use 256 bit keys for symmetric crypto
 
     static const int MK_STORE_TIME      = 100*86400;    //!< cleanup stored MKs after 100 days
+    static const int RECEIVED_ID_STORE_TIME = 7*86400;  //!< cleanup ids of received messages after 7 days
 
     static const int NUM_PRE_KEYS          = 100;
     static const int MIN_NUM_PRE_KEYS      = 30;
@@ -68,6 +69,10 @@ namespace salamander {
     static const int32_t SENDER_ID_WRONG = -28;       //!< Sender''s long term id key hash mismatch
     static const int32_t RECV_DATA_LENGTH = -29;      //!< Expected length of data does not match received length
     static const int32_t WRONG_RECV_DEV_ID = -30;     //!< Expected device id does not match actual device id
+    static const int32_t DETACHED_PAYLOAD_FAILED = -31; //!< Could not decrypt or verify a detached message payload
+    static const int32_t MSG_EXPIRED = -32;           //!< The outbox could not send a message before it expired
+    static const int32_t DUPLICATE_MESSAGE = -33;     //!< Message was received before, dropped without a report
+    static const int32_t DECOMPRESS_FAILED = -34;     //!< A compressed message did not decompress
 
     // Error codes for public key modules, between -100 and -199
     static const int32_t NO_SUCH_CURVE     = -100;    //!< Curve not supported
@@ -22,7 +22,7 @@ limitations under the License.
 #include "../util/b64helper.h"
 #include "../keymanagment/PreKeys.h"
 
-#include "../storage/sqlite/SQLiteStoreConv.h"
+#include "../storage/ConversationStore.h"
 #include <iostream>
 #include <stdio.h>
 
@@ -66,13 +66,15 @@ static void hexdump(const char* title, const std::string& in)
     masterSecret = HASH(DH(A, B0) || DH(A0, B) || DH(A0, B0))
 */
 int32_t AxoPreKeyConnector::setupConversationAlice(const string& localUser, const string& user, const string& deviceId, 
-                                                   int32_t bobPreKeyId, pair<const DhPublicKey*, const DhPublicKey*> bobKeys)
+                                                   int32_t bobPreKeyId, pair<const DhPublicKey*, const DhPublicKey*> bobKeys,
+                                                   ConversationStore* store)
 {
-    AxoConversation* conv = AxoConversation::loadConversation(localUser, user, deviceId);
+    AxoConversation* conv = AxoConversation::loadConversation(localUser, user, deviceId, store);
     if (conv != NULL) {              // Already a conversation available, no setup necessary
+        delete conv;
         return AXO_CONV_EXISTS;
     }
-    AxoConversation* localConv = AxoConversation::loadLocalConversation(localUser);
+    AxoConversation* localConv = AxoConversation::loadLocalConversation(localUser, store);
     if (localConv == NULL)
         return NO_OWN_ID;
 
@@ -99,7 +101,7 @@ int32_t AxoPreKeyConnector::setupConversationAlice(const string& localUser, cons
     memset_volatile(masterSecret, 0, EcCurveTypes::Curve25519KeyLength*3);
     memset_volatile((void*)master.data(), 0, master.size());
 
-    conv = new AxoConversation(localUser, user, deviceId);
+    conv = new AxoConversation(localUser, user, deviceId, store);
 
     // Conversation takes over the ownership of the keys.
     conv->setDHIr(B);
@@ -128,7 +130,7 @@ int32_t AxoPreKeyConnector::setupConversationAlice(const string& localUser, cons
 */
 int32_t AxoPreKeyConnector::setupConversationBob(AxoConversation* conv, int32_t bobPreKeyId, const DhPublicKey* aliceId, const DhPublicKey* alicePreKey)
 {
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
+    ConversationStore* store = conv->getStore();
 //    store->dumpPreKeys();
     string* preKeyData = store->loadPreKey(bobPreKeyId);
 
@@ -152,7 +154,7 @@ int32_t AxoPreKeyConnector::setupConversationBob(AxoConversation* conv, int32_t
     DhKeyPair* A0 = PreKeys::parsePreKeyData(*preKeyData);
     delete preKeyData;
 
-    AxoConversation* localConv = AxoConversation::loadLocalConversation(conv->getLocalUser());
+    AxoConversation* localConv = AxoConversation::loadLocalConversation(conv->getLocalUser(), store);
     const DhKeyPair* A = new DhKeyPair(*(localConv->getDHIs()));
     delete localConv;
 
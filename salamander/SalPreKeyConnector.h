@@ -64,10 +64,12 @@ public:
      * @param bobPreKeyId Identifier of Bob's pre-key
      * @param bobKeys A pair that contains Bob's keys, the first entry Bob's identity key, the second
      *                Bob's pre-key.
+     * @param store the local user's store
      * @return @c OK or an error code
      */
     static int32_t setupConversationAlice(const string& localUser, const string& user, const string& deviceId,
-                                          int32_t bobPreKeyId, pair<const DhPublicKey*, const DhPublicKey*> bobKeys);
+                                          int32_t bobPreKeyId, pair<const DhPublicKey*, const DhPublicKey*> bobKeys,
+                                          ConversationStore* store);
 
     /**
      * @brief Setup Salamander conversation for Bob role.
@@ -83,7 +85,8 @@ public:
      * - sets the new ratchet key.
      * - decrypts the message.
      * 
-     * This function performs the master secret computation.
+     * This function performs the master secret computation. It uses the store of the conversation
+     * to lookup Bob's pre-key and local conversation.
      */
     static int32_t setupConversationBob( salamander::AxoConversation* conv, int32_t bobPreKeyId, const salamander::DhPublicKey* aliceId, const salamander::DhPublicKey* alicePreKey );
 
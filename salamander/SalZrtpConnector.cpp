@@ -19,7 +19,6 @@ limitations under the License.
 #include "crypto/EcCurveTypes.h"
 #include "crypto/HKDF.h"
 #include "Constants.h"
-#include "../interfaceApp/AppInterface.h"
 
 #include <common/Thread.h>
 #include <iostream>
@@ -58,18 +57,19 @@ static map<string, AxoZrtpConnector*>* stagingList = new map<string, AxoZrtpConn
 using namespace salamander;
 void Log(const char* format, ...);
 
-const std::string getAxoPublicKeyData(const std::string& localUser, const std::string& user, const std::string& deviceId)
+const std::string getAxoPublicKeyData(const std::string& localUser, const std::string& user, const std::string& deviceId,
+                                      ConversationStore* store)
 {
     sessionLock.Lock();
-    AxoConversation* conv = AxoConversation::loadConversation(localUser, user, deviceId);
+    AxoConversation* conv = AxoConversation::loadConversation(localUser, user, deviceId, store);
     if (conv != NULL) {              // Already a conversation available, no setup necessary
         sessionLock.Unlock();
         return emptyString;
     }
-    AxoConversation* localConv = AxoConversation::loadLocalConversation(localUser);
+    AxoConversation* localConv = AxoConversation::loadLocalConversation(localUser, store);
     const DhKeyPair* idKey = localConv->getDHIs();
 
-    conv = new AxoConversation(localUser, user, deviceId);
+    conv = new AxoConversation(localUser, user, deviceId, store);
     AxoZrtpConnector* staging = new AxoZrtpConnector(conv, localConv);
 
     pair<string, AxoZrtpConnector*> stage(localUser, staging);
@@ -210,19 +210,6 @@ void setAxoExportedKey(const std::string& localUser, const std::string& user, co
     sessionLock.Unlock();
 }
 
-typedef AppInterface* (*GET_APP_IF)();
-
-#ifdef ANDROID_NDK
-AppInterface* j_getAxoAppInterface();
-static GET_APP_IF getAppIf = j_getAxoAppInterface;
-#elif defined __APPLE__
-AppInterface* t_getAxoAppInterface();
-static GET_APP_IF getAppIf = t_getAxoAppInterface;
-#else
-#warning Get application interface call not initialized - ZRTP connection may not work
-static GET_APP_IF getAppIf = NULL;
-#endif
-
 static string extractNameFromUri(const string sipUri)
 {
     size_t colon = sipUri.find_first_of(':');
@@ -237,15 +224,9 @@ static string extractNameFromUri(const string sipUri)
     return name;
 }
 
-const string getOwnAxoIdKey() 
+const string getOwnAxoIdKey(const string& localUser, ConversationStore* store)
 {
-    if (getAppIf == NULL)
-        return string();
-    AppInterface* appIf = getAppIf();
-
-    const string& localUser = appIf->getOwnUser();
-
-    AxoConversation* local = AxoConversation::loadLocalConversation(localUser);
+    AxoConversation* local = AxoConversation::loadLocalConversation(localUser, store);
     if (local == NULL)
         return string();
 
@@ -259,15 +240,11 @@ const string getOwnAxoIdKey()
     return key;
 }
 
-void checkRemoteAxoIdKey(const string user, const string deviceId, const string pubKey, int32_t verifyState)
+void checkRemoteAxoIdKey(const string& localUser, const string user, const string deviceId, const string pubKey, int32_t verifyState,
+                         ConversationStore* store)
 {
-    if (getAppIf == NULL)
-        return;
-    AppInterface* appIf = getAppIf();
-    const string& localUser = appIf->getOwnUser();
-
     string remoteName = extractNameFromUri(user);
-    AxoConversation* remote = AxoConversation::loadConversation(localUser, remoteName, deviceId);
+    AxoConversation* remote = AxoConversation::loadConversation(localUser, remoteName, deviceId, store);
 
     if (remote == NULL) {
 //        Log("Remote conversation for user %s (%s) not found", remoteName.c_str(), deviceId.c_str());
@@ -42,9 +42,11 @@ limitations under the License.
  * @param localUser name of local user/account
  * @param user Name of the remote user
  * @param deviceId The remote user's device id if it is available
+ * @param store the local user's store
  * @return the serialized data of the public keys.
  */
-const std::string getAxoPublicKeyData( const std::string& localUser, const std::string& user, const std::string& deviceId );
+const std::string getAxoPublicKeyData( const std::string& localUser, const std::string& user, const std::string& deviceId,
+                                       salamander::ConversationStore* store );
 
 /**
  * @brief Set public keys of a remote user.
@@ -83,9 +85,29 @@ void setAxoPublicKeyData(const std::string& localUser, const std::string& user,
 void setAxoExportedKey( const std::string& localUser, const std::string& user, const std::string& deviceId, const std::string& exportedKey );
 
 
-const string getOwnIdKey();
+/**
+ * @brief Get the public part of the local user's identity key.
+ *
+ * @param localUser name of local user/account
+ * @param store the local user's store
+ * @return the public key data, an empty string if the local user has no identity key
+ */
+const string getOwnAxoIdKey( const string& localUser, salamander::ConversationStore* store );
 
-void checkRemoteIdKey( const string user, const string deviceId, const string pubKey, int32_t verifyState );
+/**
+ * @brief Compare the identity key of a remote user with the key that ZRTP reports.
+ *
+ * If the keys match the function sets the ZRTP verify state of the remote conversation.
+ *
+ * @param localUser name of local user/account
+ * @param user the remote user's SIP URI or name
+ * @param deviceId The remote user's device id
+ * @param pubKey the remote user's identity key as ZRTP got it
+ * @param verifyState 1 if both users verified the SAS
+ * @param store the local user's store
+ */
+void checkRemoteAxoIdKey( const string& localUser, const string user, const string deviceId, const string pubKey, int32_t verifyState,
+                          salamander::ConversationStore* store );
 
 /*
  * To get some information from the SIP engine we need to something like this:
@@ -57,13 +57,16 @@ int32_t salamander::aesCbcEncrypt(const std::string& key, const std::string& IV,
 
 
 int32_t salamander::aesCbcDecrypt(const std::string& key, const std::string& IV, const std::string& cryptText, std::string* plainText)
+{
+    return aesCbcDecrypt(key, IV, (const uint8_t*)cryptText.data(), cryptText.size(), plainText);
+}
+
+int32_t salamander::aesCbcDecrypt(const std::string& key, const std::string& IV, const uint8_t* cryptText, size_t cryptLength,
+                                  std::string* plainText)
 {
     if (IV.size() != AES_BLOCK_SIZE)
         return WRONG_BLK_SIZE;
 
-    uint8_t* outBuffer = new uint8_t[cryptText.size()];
-    memcpy(outBuffer, cryptText.data(), cryptText.size());
-
     uint8_t ivTemp[AES_BLOCK_SIZE];                             // copy IV, AES code modifies IV buffer
     memcpy(ivTemp, IV.data(), AES_BLOCK_SIZE);
 
@@ -75,16 +78,17 @@ int32_t salamander::aesCbcDecrypt(const std::string& key, const std::string& IV,
     else
         return UNSUPPORTED_KEY_SIZE;
 
-    aes.cbc_decrypt(outBuffer, outBuffer, cryptText.size(), ivTemp);
-    plainText->assign((const char*)outBuffer, cryptText.size());
-
-    delete[] outBuffer;
+    plainText->resize(cryptLength);
+    if (cryptLength > 0)
+        aes.cbc_decrypt(cryptText, (uint8_t*)&(*plainText)[0], cryptLength, ivTemp);
     return SUCCESS;
 }
 
 bool salamander::checkAndRemovePadding(std::string& data)
 {
     int32_t length = data.size();
+    if (length == 0)
+        return false;
     int32_t padCount = data[length-1] & 0xff;
 
    if (padCount == 0 || padCount > AES_BLOCK_SIZE || padCount > length)
@@ -68,6 +68,18 @@ int32_t aesCbcEncrypt(const std::string& key, const std::string& IV, const std::
 int32_t aesCbcDecrypt(const std::string& key, const std::string& IV, const std::string& cryptText,
                       std::string* plainText);
 
+/**
+ * @brief Decrypt data with AES CBC mode, data in a buffer.
+ *
+ * Same as above, the function decrypts the data directly into the plaintext string,
+ * it does not copy the encrypted data.
+ *
+ * @param cryptText points to the encrypted data
+ * @param cryptLength length of the encrypted data
+ */
+int32_t aesCbcDecrypt(const std::string& key, const std::string& IV, const uint8_t* cryptText, size_t cryptLength,
+                      std::string* plainText);
+
 bool checkAndRemovePadding(std::string& data);
 
 } // namespace
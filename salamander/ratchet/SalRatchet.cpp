@@ -22,7 +22,8 @@ limitations under the License.
 #include "../crypto/Ec255PublicKey.h"
 #include "../crypto/HKDF.h"
 #include "../Constants.h"
-#include "../../storage/sqlite/SQLiteStoreConv.h"
+#include "../../storage/ConversationStore.h"
+#include "../../util/LzCodec.h"
 
 #include <zrtp/crypto/hmac256.h>
 #include <zrtp/crypto/sha256.h>
@@ -60,6 +61,14 @@ using namespace salamander;
 
 void Log(const char* format, ...);
 
+const int32_t AxoRatchet::COMPRESSED;
+const int32_t AxoRatchet::DETACHED;
+const int32_t AxoRatchet::WIRE_VERSION_1;
+const int32_t AxoRatchet::WIRE_VERSION_2;
+
+// Limit of a decompressed message, protects against a small message that expands to a huge one
+static const size_t MAX_DECOMPRESSED_SIZE = 16 * 1024 * 1024;
+
 AxoRatchet::AxoRatchet()
 {
 
@@ -147,7 +156,98 @@ static void deriveMk(const string& chainKey, string* MK, string* iv, string* mac
 #define FIXED_TYPE1_OVERHEAD  (4 + 4 + 4 + 4 + 8)
 #define ADD_TYPE2_OVERHEAD    (4)
 
-static void createWireMessage(AxoConversation& conv, string& message, string& mac, string* wire)
+#define MAX_VARINT_LENGTH     5
+
+// Write an unsigned 32 bit integer as varint, 7 bits per byte, least significant first
+static int32_t writeVarint(uint32_t value, uint8_t* data)
+{
+    int32_t length = 0;
+    while (value >= 0x80) {
+        data[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    data[length++] = (uint8_t)value;
+    return length;
+}
+
+// Read a varint, return false if the data ends or the value does not fit in 32 bits
+static bool readVarint(const uint8_t* data, size_t size, size_t* byteIndex, uint32_t* value)
+{
+    *value = 0;
+    for (int32_t i = 0; i < MAX_VARINT_LENGTH; i++) {
+        if (*byteIndex >= size)
+            return false;
+        uint8_t next = data[(*byteIndex)++];
+        if (i == MAX_VARINT_LENGTH - 1 && next > 0x0f)
+            return false;
+        *value |= (uint32_t)(next & 0x7f) << (7 * i);
+        if ((next & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+// The first byte of a version 2 wire message: version in the upper 4 bits, then 3 bits curve
+// type, the lowest bit is set for message type 2. A version 1 message starts with its type,
+// 1 or 2, thus the parser can tell the versions apart.
+#define V2_TYPE_BYTE(msgType, curveType) ((AxoRatchet::WIRE_VERSION_2 << 4) | (((curveType) & 0x07) << 1) | ((msgType) == 2 ? 1 : 0))
+
+static void createWireMessageV2(AxoConversation& conv, int32_t msgType, string& message, string& mac, int32_t flags, string* wire)
+{
+    // The version 2 wire message format:
+    /*
+       type:      1 byte, version, curve type and message type
+       flags:     varint
+       Ns:        varint
+       PNs:       varint
+       DHRs:      32 byte ratchet key
+       mac:       8 byte mac, truncated hmac256 of encrypted message
+       if msgType == 2
+           varint remote pre-key id
+           32 byte Alice's identity key
+           32 byte Alice's local, generated pre-key
+
+       encryptedMsg: the rest of the wire message
+     */
+    int32_t keyLength = EcCurveTypes::Curve25519KeyLength;
+    size_t msgLength = 1 + 3 * MAX_VARINT_LENGTH + keyLength + 8 + message.size();
+    if (msgType == 2)
+        msgLength += MAX_VARINT_LENGTH + keyLength + keyLength;
+
+    uint8_t* wmPb = new uint8_t[msgLength];
+    int32_t byteIndex = 0;
+
+    wmPb[byteIndex++] = V2_TYPE_BYTE(msgType, EcCurveTypes::Curve25519);
+    byteIndex += writeVarint((uint32_t)flags, &wmPb[byteIndex]);
+    byteIndex += writeVarint((uint32_t)conv.getNs(), &wmPb[byteIndex]);
+    byteIndex += writeVarint((uint32_t)conv.getPNs(), &wmPb[byteIndex]);
+
+    const DhPublicKey& rKey = conv.getDHRs()->getPublicKey();
+    memcpy(&wmPb[byteIndex], rKey.getPublicKeyPointer(), rKey.getSize());
+    byteIndex += rKey.getSize();
+
+    memcpy(&wmPb[byteIndex], mac.data(), 8);
+    byteIndex += 8;
+
+    if (msgType == 2) {
+        byteIndex += writeVarint(conv.getPreKeyId(), &wmPb[byteIndex]);
+
+        const DhPublicKey& idKey = conv.getDHIs()->getPublicKey();
+        memcpy(&wmPb[byteIndex], idKey.getPublicKeyPointer(), idKey.getSize());
+        byteIndex += idKey.getSize();
+
+        const DhPublicKey& a0Key = conv.getA0()->getPublicKey();
+        memcpy(&wmPb[byteIndex], a0Key.getPublicKeyPointer(), a0Key.getSize());
+        byteIndex += a0Key.getSize();
+    }
+    memcpy(&wmPb[byteIndex], message.data(), message.size());
+    byteIndex += message.size();
+
+    wire->assign((const char*)wmPb, byteIndex);
+    delete[] wmPb;
+}
+
+static void createWireMessage(AxoConversation& conv, string& message, string& mac, int32_t flags, int32_t version, string* wire)
 {
     // Determine the wire message type:
     // 1: Normal message with new Ratchet key
@@ -159,6 +259,11 @@ static void createWireMessage(AxoConversation& conv, string& message, string& ma
     // wire message type 2 only if we use pre-key initialization
     msgType = (conv.getA0() == NULL) ? 1 : 2;
 
+    if (version == AxoRatchet::WIRE_VERSION_2) {
+        createWireMessageV2(conv, msgType, message, mac, flags, wire);
+        return;
+    }
+
     // The code below currently uses the curve 25519 only. This curve requires 32 byte key data.
     // To support other curves we need to adapt that code
     // The general wire message format:
@@ -196,7 +301,7 @@ static void createWireMessage(AxoConversation& conv, string& message, string& ma
     wmPb[byteIndex++] = msgType;
     wmPb[byteIndex++] = EcCurveTypes::Curve25519;
     wmPb[byteIndex++] = 1;
-    wmPb[byteIndex++] = 0;
+    wmPb[byteIndex++] = (uint8_t)flags;
     intIndex++;
 
     wmPi[intIndex++] = zrtpHtonl(conv.getNs()); byteIndex += sizeof(uint32_t);
@@ -225,74 +330,167 @@ static void createWireMessage(AxoConversation& conv, string& message, string& ma
     memcpy(&wmPb[byteIndex], message.data(), message.size());
 
     wire->assign((const char*)wireMessage, msgLength);
+    delete[] wireMessage;
 //    hexdump("create wire", *wire); Log("%s", hexBuffer);
 }
 
+// Read a 32 bit integer in network order, the wire data may be unaligned
+static int32_t readInt(const uint8_t* data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(uint32_t));
+    return zrtpNtohl(value);
+}
+
+static int32_t parseWireMsgV2(const DataSpan& wire, ParsedMessage* msgStruct)
+{
+    const uint8_t* data = wire.data;
+    size_t byteIndex = 0;
+    int32_t keyDataLength = EcCurveTypes::Curve25519KeyLength;
+
+    uint8_t type = data[byteIndex++];
+    msgStruct->msgType = (type & 1) != 0 ? 2 : 1;
+    msgStruct->curveType = (type >> 1) & 0x07;
+    msgStruct->version = type >> 4;
+
+    uint32_t value;
+    if (!readVarint(data, wire.size, &byteIndex, &value))
+        return RECV_DATA_LENGTH;
+    msgStruct->flags = (int32_t)value;
+    if (!readVarint(data, wire.size, &byteIndex, &value))
+        return RECV_DATA_LENGTH;
+    msgStruct->Np = (int32_t)value;
+    if (!readVarint(data, wire.size, &byteIndex, &value))
+        return RECV_DATA_LENGTH;
+    msgStruct->PNp = (int32_t)value;
+
+    if (wire.size < byteIndex + keyDataLength + 8)
+        return RECV_DATA_LENGTH;
+    msgStruct->ratchet = &data[byteIndex];
+    byteIndex += keyDataLength;
+
+    msgStruct->mac = &data[byteIndex];
+    byteIndex += 8;
+
+    if (msgStruct->msgType == 2) {
+        if (!readVarint(data, wire.size, &byteIndex, &value))
+            return RECV_DATA_LENGTH;
+        msgStruct->localPreKeyId = (int32_t)value;
+
+        if (wire.size < byteIndex + keyDataLength + keyDataLength)
+            return RECV_DATA_LENGTH;
+        msgStruct->remoteIdKey = &data[byteIndex];
+        byteIndex += keyDataLength;
+
+        msgStruct->remotePreKey = &data[byteIndex];
+        byteIndex += keyDataLength;
+    }
+    else {
+        msgStruct->localPreKeyId = 0;
+        msgStruct->remoteIdKey = NULL;
+        msgStruct->remotePreKey = NULL;
+    }
+    msgStruct->encryptedMsgLen = (int32_t)(wire.size - byteIndex);
+    msgStruct->encryptedMsg = &data[byteIndex];
+    return OK;
+}
+
 // Parse a wire message and setup a structure with data from and pointers into wire message.
 //
-static int32_t parseWireMsg(const string& wire, ParsedMessage* msgStruct) 
+static int32_t parseWireMsg(const DataSpan& wire, ParsedMessage* msgStruct) 
 {
 //    hexdump("parse wire", wire); Log("%s", hexBuffer);
 
-    const uint8_t* data = (const uint8_t*)wire.data();
-    const int32_t* dPi = (int32_t*)data;
-    int32_t byteIndex = 0;
-    int32_t intIndex = 0;
+    const uint8_t* data = wire.data;
+    size_t byteIndex = 0;
 
     int32_t keyDataLength = EcCurveTypes::Curve25519KeyLength;
     size_t expectedLength = FIXED_TYPE1_OVERHEAD + keyDataLength;
 
+    msgStruct->encryptedMsg = NULL;
+    msgStruct->encryptedMsgLen = 0;
+    if (wire.size > 0 && (data[0] >> 4) == AxoRatchet::WIRE_VERSION_2)
+        return parseWireMsgV2(wire, msgStruct);
+
+    if (wire.size < expectedLength)
+        return RECV_DATA_LENGTH;
+
     msgStruct->msgType = data[byteIndex++] & 0xff;
     msgStruct->curveType = data[byteIndex++] & 0xff;
     msgStruct->version = data[byteIndex++] & 0xff;
     msgStruct->flags = data[byteIndex++] & 0xff;
-    intIndex++;
 
-    msgStruct->Np = zrtpNtohl(dPi[intIndex++]); byteIndex += sizeof(int32_t);
-    msgStruct->PNp = zrtpNtohl(dPi[intIndex++]); byteIndex += sizeof(int32_t);
+    msgStruct->Np = readInt(&data[byteIndex]); byteIndex += sizeof(int32_t);
+    msgStruct->PNp = readInt(&data[byteIndex]); byteIndex += sizeof(int32_t);
 
     msgStruct->ratchet = &data[byteIndex];
-    intIndex += keyDataLength/sizeof(int32_t); byteIndex += keyDataLength;
+    byteIndex += keyDataLength;
 
     msgStruct->mac = &data[byteIndex];
-    intIndex += 8/sizeof(int32_t); byteIndex += 8;
+    byteIndex += 8;
 
     if (msgStruct->msgType == 2) {
         expectedLength += ADD_TYPE2_OVERHEAD + keyDataLength + keyDataLength;
-        msgStruct->localPreKeyId = zrtpNtohl(dPi[intIndex++]); byteIndex += sizeof(int32_t);
+        if (wire.size < expectedLength)
+            return RECV_DATA_LENGTH;
+
+        msgStruct->localPreKeyId = readInt(&data[byteIndex]); byteIndex += sizeof(int32_t);
 
         msgStruct->remoteIdKey = &data[byteIndex];
-        intIndex += keyDataLength/sizeof(int32_t); byteIndex += keyDataLength;
+        byteIndex += keyDataLength;
 
         msgStruct->remotePreKey = &data[byteIndex];
-        intIndex += keyDataLength/sizeof(int32_t); byteIndex += keyDataLength;
+        byteIndex += keyDataLength;
     }
     else {
         msgStruct->localPreKeyId = 0;
         msgStruct->remoteIdKey = NULL;
         msgStruct->remotePreKey = NULL;
     }
-    msgStruct->encryptedMsgLen = zrtpNtohl(dPi[intIndex++]); byteIndex += sizeof(int32_t);
+    size_t encryptedLength = (uint32_t)readInt(&data[byteIndex]); byteIndex += sizeof(int32_t);
+    if (byteIndex + encryptedLength > wire.size)
+        return RECV_DATA_LENGTH;
+
+    msgStruct->encryptedMsgLen = (int32_t)encryptedLength;
     msgStruct->encryptedMsg = &data[byteIndex];
-    if ((byteIndex + msgStruct->encryptedMsgLen) > wire.size()) {
-        msgStruct->encryptedMsg = NULL;
-        msgStruct->encryptedMsgLen = 0;
-    }
-    expectedLength += msgStruct->encryptedMsgLen;
-    if (expectedLength != wire.size())
+    expectedLength += encryptedLength;
+    if (expectedLength != wire.size)
         return RECV_DATA_LENGTH;
     return OK;
 }
 
-static int32_t decryptAndCheck(const string& MK, const string& iv, const string& encrypted, const string& supplements, const string& macKey, 
-                            const string& mac, string* decrypted, string* supplementsPlain)
+// A message without flags has the MAC of the encrypted data only, as before the flags
+static void computeMessageMac(const string& macKey, int32_t flags, const uint8_t* encrypted, size_t size, uint8_t* mac)
 {
-
     uint32_t macLen;
+    if (flags == 0) {
+        hmac_sha256((uint8_t*)macKey.data(), (uint32_t)macKey.size(), (uint8_t*)encrypted, (int32_t)size, mac, &macLen);
+        return;
+    }
+    uint8_t flagsByte = (uint8_t)flags;
+    uint8_t* data[3] = {&flagsByte, (uint8_t*)encrypted, NULL};
+    uint32_t dataLength[3] = {1, (uint32_t)size, 0};
+    hmac_sha256((uint8_t*)macKey.data(), (uint32_t)macKey.size(), data, dataLength, mac, &macLen);
+}
+
+// Decompress in place, the compressed data is plaintext and gets wiped
+static bool decompress(string* data)
+{
+    string plain;
+    bool ok = lzDecompress((const uint8_t*)data->data(), data->size(), MAX_DECOMPRESSED_SIZE, &plain);
+    memset_volatile((void*)data->data(), 0, data->size());
+    data->swap(plain);
+    return ok;
+}
+
+static int32_t decryptAndCheck(const string& MK, const string& iv, const DataSpan& encrypted, const DataSpan& supplements, const string& macKey, 
+                            const string& mac, int32_t flags, string* decrypted, string* supplementsPlain)
+{
+
     uint8_t computedMac[SHA256_DIGEST_LENGTH];
 //    Log("+++++ decryptCheck: mac size: %d, data size: %d", macKey.size(), encrypted.size());
 
-    hmac_sha256((uint8_t*)macKey.data(), (uint32_t)macKey.size(), (uint8_t*)encrypted.data(), encrypted.size(), computedMac, &macLen);
+    computeMessageMac(macKey, flags, encrypted.data, encrypted.size, computedMac);
 
     int32_t result = memcmp(computedMac, mac.data(), 8);
 //    Log("checking mac, result: %d", result);
@@ -302,20 +500,26 @@ static int32_t decryptAndCheck(const string& MK, const string& iv, const string&
     if (result != 0)
         return MAC_CHECK_FAILED;
 
-    aesCbcDecrypt(MK, iv, encrypted, decrypted);
+    aesCbcDecrypt(MK, iv, encrypted.data, encrypted.size, decrypted);
     if (!checkAndRemovePadding(*decrypted))
         return MSG_PADDING_FAILED;
 
-    if (supplements.size() > 0 && supplementsPlain != NULL) {
-        aesCbcDecrypt(MK, iv, supplements, supplementsPlain);
+    if (supplements.size > 0 && supplementsPlain != NULL) {
+        aesCbcDecrypt(MK, iv, supplements.data, supplements.size, supplementsPlain);
         if (!checkAndRemovePadding(*supplementsPlain))
             return SUP_PADDING_FAILED;
     }
+    if ((flags & AxoRatchet::COMPRESSED) != 0) {
+        if (!decompress(decrypted))
+            return DECOMPRESS_FAILED;
+        if (supplementsPlain != NULL && !supplementsPlain->empty() && !decompress(supplementsPlain))
+            return DECOMPRESS_FAILED;
+    }
     return OK;
 }
 
-static int32_t trySkippedMessageKeys(AxoConversation* conv, const string& encrypted, const string& supplements, const string& mac, 
-                                     string* plaintext, string *supplementsPlain)
+static int32_t trySkippedMessageKeys(AxoConversation* conv, const DataSpan& encrypted, const DataSpan& supplements, const string& mac, 
+                                     int32_t flags, string* plaintext, string *supplementsPlain)
 {
     int32_t retVal = 0;
     list<string>* mks = conv->loadStagedMks();
@@ -329,7 +533,7 @@ static int32_t trySkippedMessageKeys(AxoConversation* conv, const string& encryp
         string MK = MKiv.substr(0, SYMMETRIC_KEY_LENGTH);
         string iv = MKiv.substr(SYMMETRIC_KEY_LENGTH, AES_BLOCK_SIZE);
         string macKey = MKiv.substr(SYMMETRIC_KEY_LENGTH + AES_BLOCK_SIZE);
-        if ((retVal = decryptAndCheck(MK, iv, encrypted, supplements, macKey, mac, plaintext, supplementsPlain)) >= 0) {
+        if ((retVal = decryptAndCheck(MK, iv, encrypted, supplements, macKey, mac, flags, plaintext, supplementsPlain)) >= 0) {
 //            cerr << "try skipped message - true" << endl;
             memset_volatile((void*)MK.data(), 0, MK.size());
             conv->deleteStagedMk(MKiv);
@@ -431,8 +635,23 @@ commit_skipped_header_and_message_keys()
 Nr = Np + 1
 CKr = CKp
 return read()*/
+bool AxoRatchet::isPreKeyMessage(const DataSpan& wire)
+{
+    if (wire.size == 0)
+        return false;
+    if ((wire.data[0] >> 4) == WIRE_VERSION_2)
+        return (wire.data[0] & 1) != 0;
+    return wire.data[0] == 2;
+}
+
 string* AxoRatchet::decrypt(AxoConversation* conv, const string& wire, const string& supplements, 
-                            string* supplementsPlain, pair<string, string>* idHashes)
+                            string* supplementsPlain, pair<string, string>* idHashes, int32_t* messageFlags)
+{
+    return decrypt(conv, DataSpan(wire), DataSpan(supplements), supplementsPlain, idHashes, messageFlags);
+}
+
+string* AxoRatchet::decrypt(AxoConversation* conv, const DataSpan& wire, const DataSpan& supplements,
+                            string* supplementsPlain, pair<string, string>* idHashes, int32_t* messageFlags)
 {
     ParsedMessage msgStruct;
     int32_t result = OK;
@@ -447,10 +666,18 @@ string* AxoRatchet::decrypt(AxoConversation* conv, const string& wire, const str
         conv->setErrorCode(result);
         return NULL;
     }
+    // Don't guess the meaning of flags this version does not know
+    if ((msgStruct.flags & ~(AxoRatchet::COMPRESSED | AxoRatchet::DETACHED)) != 0) {
+        conv->setErrorCode(CORRUPT_DATA);
+        return NULL;
+    }
+    // The MAC covers the flags, the caller may trust them once the message decrypted
+    if (messageFlags != NULL)
+        *messageFlags = msgStruct.flags;
 
     string recvIdHash;
 
-    AxoConversation* localConv = AxoConversation::loadLocalConversation(conv->getLocalUser());
+    AxoConversation* localConv = AxoConversation::loadLocalConversation(conv->getLocalUser(), conv->getStore());
     if (localConv != NULL && idHashes != NULL) {
         const string idPub = localConv->getDHIs()->getPublicKey().getPublicKey();
         computeIdHash(idPub, &recvIdHash);
@@ -493,12 +720,12 @@ string* AxoRatchet::decrypt(AxoConversation* conv, const string& wire, const str
         }
     }
 
-    string encrypted((const char*)msgStruct.encryptedMsg, msgStruct.encryptedMsgLen);
+    DataSpan encrypted(msgStruct.encryptedMsg, msgStruct.encryptedMsgLen);
     string* decrypted = new string();
 
     string mac((const char*)msgStruct.mac, 8);
     int32_t tryVal;
-    if ((tryVal = trySkippedMessageKeys(conv, encrypted, supplements, mac, decrypted, supplementsPlain)) >= 0) {
+    if ((tryVal = trySkippedMessageKeys(conv, encrypted, supplements, mac, msgStruct.flags, decrypted, supplementsPlain)) >= 0) {
         return decrypted;
     }
 
@@ -513,7 +740,7 @@ string* AxoRatchet::decrypt(AxoConversation* conv, const string& wire, const str
 
     if (!newRatchet) {
         stageSkippedMessageKeys(conv, conv->getNr(), msgStruct.Np, conv->getCKr(), &CKp, &MK, &macKey);
-        int32_t status = decryptAndCheck(MK.first, MK.second, encrypted, supplements,  macKey, mac, decrypted, supplementsPlain);
+        int32_t status = decryptAndCheck(MK.first, MK.second, encrypted, supplements,  macKey, mac, msgStruct.flags, decrypted, supplementsPlain);
         if (status < 0) {
             delete decrypted;
             conv->setErrorCode(status);
@@ -540,7 +767,7 @@ string* AxoRatchet::decrypt(AxoConversation* conv, const string& wire, const str
         // compute the chain key starting with the puported chain key computed above
         stageSkippedMessageKeys(conv, 0, msgStruct.Np, CKp, &CKp, &MK, &macKey);
 
-        int32_t status = decryptAndCheck(MK.first, MK.second, encrypted, supplements, macKey, mac, decrypted, supplementsPlain);
+        int32_t status = decryptAndCheck(MK.first, MK.second, encrypted, supplements, macKey, mac, msgStruct.flags, decrypted, supplementsPlain);
         if (status < 0) {
             conv->setDHRr(saveDHRr);
             delete DHRp;
@@ -588,7 +815,8 @@ return msg
  * This implementation does not use header keys.
  */
 const string* AxoRatchet::encrypt(AxoConversation& conv, const string& message, const string& supplements, 
-                                  string* encryptedSupplements, pair<string, string>* idHashes)
+                                  string* encryptedSupplements, pair<string, string>* idHashes, size_t compressThreshold,
+                                  int32_t wireVersion, int32_t messageFlags)
 {
     if (conv.getRK().empty()) {
         conv.setErrorCode(SESSION_NOT_INITED);
@@ -598,7 +826,7 @@ const string* AxoRatchet::encrypt(AxoConversation& conv, const string& message,
     if (idHashes != NULL) {
         string senderIdHash;
 
-        AxoConversation* localConv = AxoConversation::loadLocalConversation(conv.getLocalUser());
+        AxoConversation* localConv = AxoConversation::loadLocalConversation(conv.getLocalUser(), conv.getStore());
         if (localConv != NULL) {
             const string idPub = localConv->getDHIs()->getPublicKey().getPublicKey();
             computeIdHash(idPub, &senderIdHash);
@@ -636,17 +864,39 @@ const string* AxoRatchet::encrypt(AxoConversation& conv, const string& message,
 //    Log("Encrypt message to: %s, ratchet: %d, Nr: %d, Ns: %d, PNp: %d", conv.getPartner().getName().c_str(), ratchetSave, conv.getNr(), conv.getNr(), conv.getPNs());
     string encryptedData;
 
-    aesCbcEncrypt(MK, iv, message, &encryptedData);
-    if (supplements.size() > 0 && encryptedSupplements != NULL)
-        aesCbcEncrypt(MK, iv, supplements, encryptedSupplements);
+    // Compress only if it saves bytes, the flag tells the receiver to decompress
+    int32_t flags = messageFlags & DETACHED;
+    bool withSupplements = supplements.size() > 0 && encryptedSupplements != NULL;
+    size_t plainSize = message.size() + (withSupplements ? supplements.size() : 0);
+    string compressedMessage;
+    string compressedSupplements;
+    if (compressThreshold > 0 && plainSize >= compressThreshold) {
+        lzCompress((const uint8_t*)message.data(), message.size(), &compressedMessage);
+        if (withSupplements)
+            lzCompress((const uint8_t*)supplements.data(), supplements.size(), &compressedSupplements);
+        if (compressedMessage.size() + compressedSupplements.size() < plainSize)
+            flags |= COMPRESSED;
+    }
+    if ((flags & COMPRESSED) != 0) {
+        aesCbcEncrypt(MK, iv, compressedMessage, &encryptedData);
+        if (withSupplements)
+            aesCbcEncrypt(MK, iv, compressedSupplements, encryptedSupplements);
+    }
+    else {
+        aesCbcEncrypt(MK, iv, message, &encryptedData);
+        if (withSupplements)
+            aesCbcEncrypt(MK, iv, supplements, encryptedSupplements);
+    }
+    memset_volatile((void*)compressedMessage.data(), 0, compressedMessage.size());
+    memset_volatile((void*)compressedSupplements.data(), 0, compressedSupplements.size());
 
     uint8_t mac[SHA256_DIGEST_LENGTH];
     uint32_t macLen;
-    hmac_sha256((uint8_t*)macKey.data(), (uint32_t)macKey.size(), (uint8_t*)encryptedData.data(), encryptedData.size(), mac, &macLen);
+    computeMessageMac(macKey, flags, (const uint8_t*)encryptedData.data(), encryptedData.size(), mac);
     string computedMac((const char*)mac, SHA256_DIGEST_LENGTH);
 
     string* wireMessage = new string();
-    createWireMessage(conv, encryptedData, computedMac, wireMessage);
+    createWireMessage(conv, encryptedData, computedMac, flags, wireVersion, wireMessage);
     conv.setNs(conv.getNs() + 1);
 
     // Hash CKs with "1"
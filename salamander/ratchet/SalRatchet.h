@@ -26,6 +26,7 @@ limitations under the License.
 #include "../crypto/DhKeyPair.h"
 #include "../crypto/DhPublicKey.h"
 #include "../state/SalConversation.h"
+#include "../../util/DataSpan.h"
 
 using namespace std;
 
@@ -33,6 +34,39 @@ namespace salamander {
 class AxoRatchet
 {
 public:
+    /**
+     * @brief Wire message flag: the message and its supplements are compressed.
+     *
+     * The sender compresses before it encrypts. If a message has flags the MAC covers
+     * the flags byte and the encrypted message, thus nobody can set or clear the flag
+     * on the way.
+     */
+    static const int32_t COMPRESSED = 0x01;
+
+    /**
+     * @brief Wire message flag: the message is the key descriptor of a detached payload.
+     *
+     * The envelope carries the payload, see DetachedPayload.h. The receiver attaches
+     * the payload only if the authenticated flag is set.
+     */
+    static const int32_t DETACHED = 0x02;
+
+    /**
+     * @brief Wire message layout with fixed size header fields.
+     */
+    static const int32_t WIRE_VERSION_1 = 1;
+
+    /**
+     * @brief Compact wire message layout.
+     *
+     * One byte holds the message type, curve and version, the counters, flags and
+     * pre-key id are varints. The wire message has no length of the encrypted message,
+     * it ends with the encrypted message and the envelope carries its length. The
+     * decrypt functions read both versions, send version 2 only if all devices of the
+     * recipients can read it.
+     */
+    static const int32_t WIRE_VERSION_2 = 2;
+
     AxoRatchet();
     ~AxoRatchet();
 
@@ -44,10 +78,16 @@ public:
      * @param supplements Additional data for the message, will be encrypted with the message key
      * @param idHashes The sender's and receiver's id hashes to send with the message, can be @c NULL if
      *                 not required
+     * @param compressThreshold Compress the message and supplements if they have at least this number
+     *                 of bytes together, @c 0 disables compression
+     * @param wireVersion The wire message layout, @c WIRE_VERSION_1 or @c WIRE_VERSION_2
+     * @param messageFlags Flags of the message the caller sets, @c DETACHED or @c 0
      * @return An encrypted wire message, ready to send to the recipient+device tuple.
      */
     static const string* encrypt(AxoConversation& conv, const string& message, const string& supplements, 
-                                 string* supplementsEncrypted, pair<string, string>* idHashes = NULL);
+                                 string* supplementsEncrypted, pair<string, string>* idHashes = NULL,
+                                 size_t compressThreshold = 0, int32_t wireVersion = WIRE_VERSION_1,
+                                 int32_t messageFlags = 0);
 
     /**
      * @brief Parse a wire message and decrypt the payload.
@@ -58,10 +98,29 @@ public:
      * @param supplementsPlain Additional data for the message if available and decryption was successful.
      * @param idHashes The sender's and receiver's id hashes contained in the message, can be @c NULL if
      *                 not available
+     * @param messageFlags Gets the authenticated flags of the message, e.g. @c DETACHED, can be @c NULL
      * @return Plaintext or @c NULL if decryption failed
      */
     static string* decrypt( salamander::AxoConversation* conv, const string& wire, const string& supplements, 
-                            string* supplementsPlain, pair<string, string>* idHashes = NULL);
+                            string* supplementsPlain, pair<string, string>* idHashes = NULL,
+                            int32_t* messageFlags = NULL);
+
+    /**
+     * @brief Parse a wire message and decrypt the payload, data in a buffer.
+     *
+     * Same as above, the function reads the wire message and the supplementary data
+     * from the caller's buffer and does not copy them.
+     */
+    static string* decrypt( salamander::AxoConversation* conv, const DataSpan& wire, const DataSpan& supplements,
+                            string* supplementsPlain, pair<string, string>* idHashes = NULL,
+                            int32_t* messageFlags = NULL);
+
+    /**
+     * @brief Check if a wire message carries pre-key information, message type 2.
+     *
+     * Reads only the first byte of the wire message, works for both wire versions.
+     */
+    static bool isPreKeyMessage(const DataSpan& wire);
 };
 }
 /**
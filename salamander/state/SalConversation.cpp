@@ -14,7 +14,7 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 #include "SalConversation.h"
-#include "../../storage/sqlite/SQLiteStoreConv.h"
+#include "../../storage/ConversationStore.h"
 #include "../../util/cJSON.h"
 #include "../../util/b64helper.h"
 #include "../Constants.h"
@@ -29,16 +29,16 @@ using namespace std;
 
 void Log(const char* format, ...);
 
-AxoConversation* AxoConversation::loadConversation(const string& localUser, const string& user, const string& deviceId)
+AxoConversation* AxoConversation::loadConversation(const string& localUser, const string& user, const string& deviceId,
+                                                   ConversationStore* store)
 {
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
     if (!store->hasConversation(user, deviceId, localUser)) {
 //        cerr << "No conversation: " << localUser << ", user: " << user << endl;
         return NULL;
     }
 
     // Create and lock a new conversation object _before_ loading data from database
-    AxoConversation*  conv = new AxoConversation(localUser, user, deviceId);
+    AxoConversation*  conv = new AxoConversation(localUser, user, deviceId, store);
 
     string* data = store->loadConversation(user, deviceId, localUser);
     if (data == NULL || data->empty()) {   // Illegal state, should not happen
@@ -53,42 +53,55 @@ AxoConversation* AxoConversation::loadConversation(const string& localUser, cons
 
 void AxoConversation::storeConversation()
 {
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
-
     const string* data = serialize();
 
-    store->storeConversation(partner_.getName(), deviceId_, localUser_, *data);
+    store_->storeConversation(partner_.getName(), deviceId_, localUser_, *data);
     memset_volatile((void*)data->data(), 0, data->size());
 
     delete data;
 }
 
+int32_t AxoConversation::storeConversations(const list<AxoConversation*>& conversations)
+{
+    if (conversations.empty())
+        return STORE_OK;
+
+    const AxoConversation* first = conversations.front();
+    list<pair<string, string> > data;
+    for (list<AxoConversation*>::const_iterator it = conversations.begin(); it != conversations.end(); ++it) {
+        const string* convData = (*it)->serialize();
+        data.push_back(pair<string, string>((*it)->deviceId_, *convData));
+        memset_volatile((void*)convData->data(), 0, convData->size());
+        delete convData;
+    }
+    int32_t result = first->store_->storeConversations(first->partner_.getName(), first->localUser_, data);
+
+    for (list<pair<string, string> >::iterator it = data.begin(); it != data.end(); ++it)
+        memset_volatile((void*)it->second.data(), 0, it->second.size());
+    return result;
+}
+
 void AxoConversation::storeStagedMks()
 {
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
     while (!stagedMk->empty()) {
         string mkivmac = stagedMk->front();
         stagedMk->pop_front();
-        store->insertStagedMk(partner_.getName(), deviceId_, localUser_, mkivmac);
+        store_->insertStagedMk(partner_.getName(), deviceId_, localUser_, mkivmac);
     }
     delete stagedMk; stagedMk = NULL;
 
-    // Cleanup old MKs
-    time_t timestamp = time(0) - MK_STORE_TIME;
-    store->deleteStagedMk(timestamp);
+    // Expired MKs are removed by the store maintenance, see StoreMaintenance.h
 }
 
 list<string>* AxoConversation::loadStagedMks()
 {
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
-    list<string>* mks = store->loadStagedMks(partner_.getName(), deviceId_, localUser_);
+    list<string>* mks = store_->loadStagedMks(partner_.getName(), deviceId_, localUser_);
     return mks;
 }
 
 void AxoConversation::deleteStagedMk(string& mkiv)
 {
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
-    store->deleteStagedMk(partner_.getName(), deviceId_, localUser_, mkiv);
+    store_->deleteStagedMk(partner_.getName(), deviceId_, localUser_, mkiv);
 }
 
 /* *****************************************************************************
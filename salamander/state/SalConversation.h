@@ -51,12 +51,22 @@ static const std::string emptyString;
 using namespace std;
 
 namespace salamander {
+class ConversationStore;
+
 class AxoConversation
 {
 public:
-    AxoConversation(const string& localUser, const string& user, const string& deviceId) : partner_(user, emptyString), 
-                    deviceId_(deviceId), localUser_(localUser), DHRs(NULL), DHRr(NULL), DHIs(NULL), DHIr(NULL), A0(NULL), Ns(0), 
-                    Nr(0), PNs(0), preKeyId(0), ratchetFlag(false), zrtpVerifyState(0), availablePreKeys(0)
+    /**
+     * @brief Create a conversation object.
+     *
+     * @param localUser name of own user/account
+     * @param user Name of the remote user
+     * @param deviceId The remote user's device id if it is available
+     * @param store the account's store, the conversation uses this store to persist its state
+     */
+    AxoConversation(const string& localUser, const string& user, const string& deviceId, ConversationStore* store) :
+                    partner_(user, emptyString), deviceId_(deviceId), localUser_(localUser), DHRs(NULL), DHRr(NULL), DHIs(NULL), DHIr(NULL), A0(NULL), Ns(0), 
+                    Nr(0), PNs(0), preKeyId(0), ratchetFlag(false), zrtpVerifyState(0), availablePreKeys(0), store_(store)
                     { }
 
 
@@ -66,9 +76,11 @@ public:
      * @brief Load local conversation from database.
      * 
      * @param localUser name of local user/account
+     * @param store the account's store
      * @return the loaded AxoConversation or NULL if none was stored.
      */
-    static AxoConversation* loadLocalConversation(const string& localUser) { return loadConversation(localUser, localUser, string());}
+    static AxoConversation* loadLocalConversation(const string& localUser, ConversationStore* store)
+                                                  { return loadConversation(localUser, localUser, string(), store);}
 
     /**
      * @brief Load a conversation from database.
@@ -76,15 +88,25 @@ public:
      * @param localUser name of own user/account
      * @param user Name of the remote user
      * @param deviceId The remote user's device id if it is available
+     * @param store the account's store
      * @return the loaded AxoConversation or NULL if none was stored.
      */
-    static AxoConversation* loadConversation(const string& localUser, const string& user, const string& deviceId);
+    static AxoConversation* loadConversation(const string& localUser, const string& user, const string& deviceId,
+                                             ConversationStore* store);
 
     /**
      * @brief Store this conversation in persitent store
      */
     void storeConversation();
 
+    /**
+     * @brief Store several conversations with the same partner in one batch.
+     *
+     * @param conversations the conversations, all use the same store and partner
+     * @return STORE_OK if all conversations were stored, a store error code otherwise
+     */
+    static int32_t storeConversations(const list<AxoConversation*>& conversations);
+
     void storeStagedMks();
 
     list<string>* loadStagedMks();
@@ -97,6 +119,8 @@ public:
 
     const string& getDeviceId()     { return deviceId_; }
 
+    ConversationStore* getStore()     { return store_; }
+
     void setDeviceName(const string& name)  { deviceName_ = name; }
     const string& getDeviceName()           { return deviceName_; }
 
@@ -200,6 +224,7 @@ private:
                 a certain age.
     Impemented via database and temporary list, see stagedMk above.
     */ 
+    ConversationStore* store_;    //!< the account's store that persists this conversation
     int32_t errorCode_;
 };
 }
@@ -0,0 +1,356 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef CONVERSATIONSTORE_H
+#define CONVERSATIONSTORE_H
+
+/**
+ * @file ConversationStore.h
+ * @brief Interface for the persistent Salamander store
+ * @ingroup Salamander++
+ * @{
+ *
+ * The protocol code uses this interface to store conversations, staged message
+ * keys, pre-keys, the envelopes of the outbox and the ids of received messages.
+ * @c SQLiteStoreConv is the default implementation, @c LogStoreConv implements
+ * the store as an append-only log for deployments that do not need SQL.
+ *
+ * All implementations report results with the @c StoreCodes, callers check
+ * them with @c STORE_FAIL regardless of the backend.
+ */
+
+#include <string>
+#include <stdint.h>
+#include <list>
+#include <vector>
+#include <utility>
+#include <time.h>
+
+#include "../util/DataSpan.h"
+
+#define OUR_KEY_LENGTH          32
+
+#define STORE_FAIL(code) ((code) != salamander::STORE_OK)
+
+namespace salamander {
+
+/**
+ * Result codes of the store functions.
+ *
+ * A failure is a positive code. A backend may report failures that are not in
+ * this list, @c getLastError describes the failure.
+ */
+enum StoreCodes {
+    STORE_OK = 0,               //!< success
+    STORE_ERROR = 1,            //!< generic failure
+    STORE_BUSY = 5,             //!< another connection holds a lock
+    STORE_NOMEM = 7,            //!< out of memory
+    STORE_IOERR = 10,           //!< read, write or sync failed
+    STORE_CORRUPT = 11,         //!< the stored data is corrupt
+    STORE_FULL = 13,            //!< the file cannot grow
+    STORE_CANTOPEN = 14,        //!< the file cannot be opened
+    STORE_CONSTRAINT = 19,      //!< the entry exists already
+    STORE_MISUSE = 21,          //!< the store is not open
+    STORE_NOTADB = 26           //!< the file is not a store or the key is wrong
+};
+
+/**
+ * An encrypted message envelope that waits in the outbox, see Outbox.h
+ */
+struct OutboxEntry {
+    OutboxEntry() : id(0), since(0), nextTry(0), tries(0) {}
+
+    int64_t id;                 //!< set by the store
+    std::string recipient;
+    std::string longDevId;      //!< the recipient's device
+    std::string msgId;
+    std::string envelope;       //!< the B64 encoded message envelope
+    time_t since;               //!< time when the message was encrypted
+    time_t nextTry;             //!< time of the next send attempt
+    int32_t tries;              //!< number of failed send attempts
+};
+
+class ConversationStore
+{
+public:
+    virtual ~ConversationStore() {}
+
+    /**
+     * @brief Is store ready for use?
+     */
+    virtual bool isReady() = 0;
+
+    /**
+     * @brief Open Salamander store.
+     *
+     * @param filename Filename of the store, including path. An empty name opens
+     *        a store that lives in memory only.
+     * @return a store code
+     */
+    virtual int openStore(const std::string& filename) = 0;
+
+    /**
+     * @brief Set key to encrypt sensitive data.
+     *
+     * The @c string is not tread as a string but as a container that hold the
+     * key material, i.e. binary data. The length of the key must be 32 bytes.
+     * Set the key before opening the store.
+     *
+     * @param keyData a @c string container with the key data
+     * @return @c true is key is OK, @c false otherwise.
+     */
+    virtual bool setKey(const std::string& keyData) = 0;
+
+    /**
+     * @brief Get the last error message.
+     *
+     * If a functions returns an error code or if the stored code is
+     * not equal @c STORE_OK then this function returns a pointer to the last
+     * error message
+     *
+     * @return pointer to the error message.
+     */
+    virtual const char* getLastError() = 0;
+
+    /**
+     * @brief Return the result code of the last store function.
+     *
+     * The caller can check this code to see if the last operation was successful.
+     *
+     * @return @c STORE_OK or the code of the failure, see @c StoreCodes
+     */
+    virtual int32_t getStoreCode() const = 0;
+
+    /**
+     * @brief Get a list of all known identities
+     *
+     * Assemble a list of names for all known identities.
+     *
+     * @return a new list with the names, an empty list if now identities available,
+     *         NULL in case of error
+     */
+    virtual std::list<std::string>* getKnownConversations(const std::string& ownName) = 0;
+
+    /**
+     * @brief Get a list of long device ids for a name.
+     *
+     * Returns a list of known devices for a user. A user may have several Salamander device
+     * registered with the account.
+     *
+     * @param name the user's name.
+     * @return a new list with the long device ids, NULL in case of error
+     */
+    virtual std::list<std::string>* getLongDeviceIds(const std::string& name, const std::string& ownName) = 0;
+
+    // ***** Conversation store
+    virtual std::string* loadConversation(const std::string& name, const std::string& longDevId, const std::string& ownName) const = 0;
+
+    virtual void storeConversation(const std::string& name, const std::string& longDevId, const std::string& ownName, const std::string& data) = 0;
+
+    /**
+     * @brief Store several conversations of one user in one batch.
+     *
+     * Used after a message was encrypted for all devices of a user. The batch
+     * needs fewer commits than storing each conversation on its own.
+     *
+     * @param name the user's name
+     * @param ownName the local user's name
+     * @param conversations list of long device ids and their conversation data
+     * @return STORE_OK if all conversations were stored, a store error code otherwise
+     */
+    virtual int32_t storeConversations(const std::string& name, const std::string& ownName,
+                                       const std::list<std::pair<std::string, std::string> >& conversations) = 0;
+
+    virtual bool hasConversation(const std::string& name, const std::string& longDevId, const std::string& ownName) const = 0;
+
+    /**
+     * @brief Check several devices of a user for a conversation in one lookup.
+     *
+     * Reads only the long device ids of the user's conversations from the index, not
+     * the conversation data. The transport checks the device list of each device
+     * notification with this function.
+     *
+     * @param name the user's name
+     * @param longDevIds the long device ids to check, an empty id is the local conversation
+     * @param ownName the local user's name
+     * @param known gets one entry per long device id, @c true if a conversation exists
+     * @return STORE_OK or a store error code
+     */
+    virtual int32_t hasConversations(const std::string& name, const std::vector<DataSpan>& longDevIds,
+                                     const std::string& ownName, std::vector<bool>* known) const = 0;
+
+    virtual void deleteConversation(const std::string& name, const std::string& longDevId, const std::string& ownName) = 0;
+
+    virtual void deleteConversationsName(const std::string& name, const std::string& ownName) = 0;
+
+    // ***** staged message keys store
+    virtual std::list<std::string>* loadStagedMks(const std::string& name, const std::string& longDevId, const std::string& ownName) const = 0;
+
+    virtual void insertStagedMk(const std::string& name, const std::string& longDevId, const std::string& ownName, const std::string& MKiv) = 0;
+
+    virtual void deleteStagedMk(const std::string& name, const std::string& longDevId, const std::string& ownName, std::string& MKiv) = 0;
+
+    /**
+     * @brief Remove the staged message keys stored before the timestamp.
+     *
+     * @param timestamp remove all staged message keys stored before this time
+     * @return @c STORE_OK or the code of the failure
+     */
+    virtual int32_t deleteStagedMk(time_t timestamp) = 0;
+
+    // Pre key storage. The functions store/retrive Pre-key JSON strings
+    virtual std::string* loadPreKey(int32_t preKeyId) const = 0;
+
+    virtual void storePreKey(int32_t preKeyId, const std::string& preKeyData) = 0;
+
+    /**
+     * @brief Store a batch of pre-keys.
+     *
+     * Either all pre-keys are stored or none.
+     *
+     * @param preKeys list of pre-key ids and their pre-key JSON strings
+     * @return STORE_OK if all pre-keys were stored, a store error code otherwise
+     */
+    virtual int32_t storePreKeys(const std::list<std::pair<int32_t, std::string> >& preKeys) = 0;
+
+    virtual bool containsPreKey(int32_t preKeyId) const = 0;
+
+    /**
+     * @brief Return the ids of all stored pre-keys.
+     *
+     * @return list of pre-key ids, @c NULL in case of an error. The caller must delete the list.
+     */
+    virtual std::list<int32_t>* getPreKeyIds() const = 0;
+
+    virtual void removePreKey(int32_t preKeyId) = 0;
+
+    virtual void dumpPreKeys() const = 0;
+
+    // ***** Outbox, see Outbox.h
+
+    /**
+     * @brief Store a batch of outbox entries.
+     *
+     * Either all entries are stored or none. The store sets the id of each entry.
+     *
+     * @param ownName the local user's name
+     * @param entries the entries to store
+     * @return STORE_OK if all entries were stored, a store error code otherwise
+     */
+    virtual int32_t insertOutboxEntries(const std::string& ownName, std::list<OutboxEntry>* entries) = 0;
+
+    /**
+     * @brief Load the outbox entries that are due.
+     *
+     * @param ownName the local user's name
+     * @param dueTime load the entries with a next try time up to this time
+     * @return a new list of entries sorted by id, NULL in case of error
+     */
+    virtual std::list<OutboxEntry>* loadOutboxEntries(const std::string& ownName, time_t dueTime) const = 0;
+
+    /**
+     * @brief Update the number of tries and the next try time of outbox entries.
+     *
+     * @param ownName the local user's name
+     * @param entries the entries to update, the store finds them by id
+     * @return a store code
+     */
+    virtual int32_t updateOutboxEntries(const std::string& ownName, const std::list<OutboxEntry>& entries) = 0;
+
+    /**
+     * @brief Remove outbox entries.
+     *
+     * @param ownName the local user's name
+     * @param ids the ids of the entries to remove
+     * @return a store code
+     */
+    virtual int32_t deleteOutboxEntries(const std::string& ownName, const std::list<int64_t>& ids) = 0;
+
+    // ***** Received message ids, see DuplicateFilter.h
+
+    /**
+     * @brief Record the key of a received message.
+     *
+     * The store records the current time with the key.
+     *
+     * @param ownName the local user's name
+     * @param msgKey the message key, see @c DuplicateFilter::messageKey
+     * @return a store code
+     */
+    virtual int32_t insertReceivedId(const std::string& ownName, const std::string& msgKey) = 0;
+
+    /**
+     * @brief Check if the store has the key of a received message.
+     *
+     * @param ownName the local user's name
+     * @param msgKey the message key
+     * @return @c true if the store has the key, @c false if not or in case of an error
+     */
+    virtual bool hasReceivedId(const std::string& ownName, const std::string& msgKey) const = 0;
+
+    /**
+     * @brief Load the keys of messages received since a time.
+     *
+     * @param ownName the local user's name
+     * @param since load the keys recorded at or after this time
+     * @return a new list of keys, oldest first, NULL in case of error
+     */
+    virtual std::list<std::string>* loadReceivedIds(const std::string& ownName, time_t since) const = 0;
+
+    /**
+     * @brief Remove the keys of messages received before the timestamp.
+     *
+     * @param timestamp remove all keys recorded before this time
+     * @return @c STORE_OK or the code of the failure
+     */
+    virtual int32_t deleteReceivedIds(time_t timestamp) = 0;
+
+    // ***** Store maintenance, see StoreMaintenance.h
+
+    /**
+     * @brief Let the store optimize its lookup structures.
+     *
+     * @return a store code
+     */
+    virtual int32_t optimizeStore() = 0;
+
+    /**
+     * @brief Return unused space to the file system.
+     *
+     * @param pages an upper limit of pages to process, 0 to process all unused space.
+     *        The store implementation defines the size of a page.
+     * @return a store code
+     */
+    virtual int32_t incrementalVacuum(int32_t pages) = 0;
+
+    /**
+     * @brief Flush written data to persistent storage.
+     *
+     * @return a store code
+     */
+    virtual int32_t checkpointStore() = 0;
+
+    /*
+     * @brief For use for debugging and development only
+     */
+    virtual int32_t resetStore() = 0;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // CONVERSATIONSTORE_H
@@ -0,0 +1,120 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "StoreMaintenance.h"
+#include "../salamander/Constants.h"
+
+#include <chrono>
+
+using namespace salamander;
+
+void Log(const char* format, ...);
+
+StoreMaintenance::StoreMaintenance(ConversationStore* store, int32_t interval, int32_t idleTime) :
+                                   store_(store), interval_(interval), idleTime_(idleTime), lastActivity_(0),
+                                   lastRun_(0), running_(false) {}
+
+StoreMaintenance::~StoreMaintenance()
+{
+    stop();
+}
+
+void StoreMaintenance::start()
+{
+    std::unique_lock<std::mutex> lck(stateLock_);
+    if (running_)
+        return;
+    running_ = true;
+    lastRun_ = time(NULL);
+    thread_ = std::thread(&StoreMaintenance::run, this);
+}
+
+void StoreMaintenance::stop()
+{
+    {
+        std::unique_lock<std::mutex> lck(stateLock_);
+        if (!running_)
+            return;
+        running_ = false;
+    }
+    stopCondition_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+int32_t StoreMaintenance::runNow(int32_t tasks)
+{
+    std::unique_lock<std::mutex> lck(runLock_);
+
+    int32_t result = STORE_OK;
+    if (store_ == NULL || !store_->isReady())
+        return result;
+
+    time_t now = time(NULL);
+
+    if ((tasks & EXPIRE_STAGED_MKS) != 0) {
+        int32_t code = store_->deleteStagedMk(now - MK_STORE_TIME);
+        if (code != STORE_OK)
+            result = code;
+    }
+    if ((tasks & EXPIRE_RECEIVED_IDS) != 0) {
+        int32_t code = store_->deleteReceivedIds(now - RECEIVED_ID_STORE_TIME);
+        if (code != STORE_OK)
+            result = code;
+    }
+    if ((tasks & OPTIMIZE) != 0) {
+        int32_t code = store_->optimizeStore();
+        if (code != STORE_OK)
+            result = code;
+    }
+    if ((tasks & VACUUM) != 0) {
+        int32_t code = store_->incrementalVacuum(0);
+        if (code != STORE_OK)
+            result = code;
+    }
+    if ((tasks & CHECKPOINT) != 0) {
+        int32_t code = store_->checkpointStore();
+        if (code != STORE_OK)
+            result = code;
+    }
+    lastRun_ = now;
+    if (result != STORE_OK)
+        Log("Store maintenance failed: %s", store_->getLastError());
+    return result;
+}
+
+// The thread checks every idleTime_ seconds if maintenance is due. It runs the
+// maintenance tasks if the interval elapsed and the store was idle, or, if the
+// store is never idle, after four intervals at the latest.
+void StoreMaintenance::run()
+{
+    std::unique_lock<std::mutex> lck(stateLock_);
+
+    while (running_) {
+        stopCondition_.wait_for(lck, std::chrono::seconds(idleTime_));
+        if (!running_)
+            break;
+
+        time_t now = time(NULL);
+        time_t sinceLastRun = now - lastRun_;
+        bool idle = (now - lastActivity_) >= idleTime_;
+
+        if ((sinceLastRun >= interval_ && idle) || sinceLastRun >= 4 * interval_) {
+            lck.unlock();
+            runNow(ALL_TASKS);
+            lck.lock();
+        }
+    }
+}
@@ -0,0 +1,140 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef STOREMAINTENANCE_H
+#define STOREMAINTENANCE_H
+
+/**
+ * @file StoreMaintenance.h
+ * @brief Background housekeeping of the Salamander store
+ * @ingroup Salamander++
+ * @{
+ *
+ * The store maintenance runs the housekeeping tasks that were done inline
+ * before, for example the removal of expired staged message keys during each
+ * decrypt, and some tasks that never ran: update of the query planner
+ * statistics, incremental vacuum and WAL checkpoints.
+ *
+ * The maintenance does not remove unused pre-keys. The server hands them out
+ * until a client consumes them, a removed pre-key breaks the session setup of
+ * the client that got it.
+ *
+ * The maintenance runs on an own thread. The thread wakes up periodically and
+ * runs the tasks if the maintenance interval elapsed and if the store was idle
+ * for some time. If the store is never idle the thread runs the tasks after
+ * a maximum delay. Message processing calls @c notifyActivity to mark the store
+ * as busy.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "ConversationStore.h"
+
+namespace salamander {
+
+class StoreMaintenance
+{
+public:
+    static const int32_t EXPIRE_STAGED_MKS = 0x1;  //!< Remove staged message keys older than MK_STORE_TIME
+    static const int32_t OPTIMIZE          = 0x4;  //!< Update query planner statistics
+    static const int32_t VACUUM            = 0x8;  //!< Incremental vacuum
+    static const int32_t CHECKPOINT        = 0x10; //!< Passive WAL checkpoint
+    static const int32_t EXPIRE_RECEIVED_IDS = 0x20; //!< Remove received message ids older than RECEIVED_ID_STORE_TIME
+    static const int32_t ALL_TASKS         = 0x3d;
+
+    static const int32_t DEFAULT_INTERVAL  = 3600; //!< Run maintenance once per hour
+    static const int32_t DEFAULT_IDLE_TIME = 10;   //!< Store must be idle for 10s before maintenance runs
+
+    /**
+     * @brief Create a maintenance scheduler for a store.
+     *
+     * Ownership of the store stays with the caller. The store must stay valid
+     * while the scheduler runs.
+     *
+     * @param store the Salamander store to maintain
+     * @param interval maintenance interval in seconds
+     * @param idleTime the store must be idle for this time (in seconds) before the
+     *                 maintenance tasks run
+     */
+    StoreMaintenance(ConversationStore* store, int32_t interval = DEFAULT_INTERVAL, int32_t idleTime = DEFAULT_IDLE_TIME);
+
+    ~StoreMaintenance();
+
+    /**
+     * @brief Start the maintenance thread.
+     */
+    void start();
+
+    /**
+     * @brief Stop the maintenance thread and wait until it terminates.
+     */
+    void stop();
+
+    /**
+     * @brief Mark the store as busy.
+     *
+     * Message processing calls this function, the maintenance thread then
+     * defers the maintenance tasks until the store is idle again.
+     */
+    void notifyActivity() { lastActivity_ = time(NULL); }
+
+    /**
+     * @brief Run maintenance tasks on the caller's thread.
+     *
+     * @param tasks a bit mask of the tasks to run
+     * @return the store code of the last failed task or @c STORE_OK
+     */
+    int32_t runNow(int32_t tasks = ALL_TASKS);
+
+    /**
+     * @brief Time of the last maintenance run, 0 if maintenance never ran.
+     */
+    time_t getLastRun() const { return lastRun_; }
+
+private:
+    StoreMaintenance(const StoreMaintenance& other) {}
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wreturn-type"
+    StoreMaintenance& operator= ( const StoreMaintenance& other ) { }
+#pragma clang diagnostic pop
+
+    void run();
+
+    ConversationStore* store_;
+    int32_t interval_;
+    int32_t idleTime_;
+
+    std::atomic<time_t> lastActivity_;  //!< set by the send and receive threads
+    std::atomic<time_t> lastRun_;       //!< set by the maintenance run, read by any thread
+
+    bool running_;
+    std::thread thread_;
+    std::mutex runLock_;            //!< serializes maintenance runs
+    std::mutex stateLock_;
+    std::condition_variable stopCondition_;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // STOREMAINTENANCE_H
@@ -0,0 +1,1104 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "LogStoreConv.h"
+
+#include "../../salamander/crypto/AesCbc.h"
+#include "../../salamander/crypto/HKDF.h"
+#include "../../salamander/Constants.h"
+
+#include <zrtp/crypto/hmac256.h>
+#include <cryptcommon/ZrtpRandom.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace salamander;
+
+void Log(const char* format, ...);
+
+/*
+ * Log layout
+ *
+ * The log starts with a header: 8 bytes magic, followed by the HMAC of the magic. The
+ * HMAC detects a wrong key before the store replays, and possibly overwrites, the log.
+ *
+ * Each record has an 8 byte header: 4 bytes record magic, 4 bytes length of the record
+ * body. The body contains a random IV, the encrypted record data and the HMAC of IV and
+ * encrypted data. The record data is: 1 byte operation, 8 bytes timestamp, 4 bytes
+ * key length, key, value. All integers are little endian.
+ *
+ * Keys start with a type character, followed by length-prefixed fields. The fields are
+ * ordered such that all keys of a query share a common prefix.
+ */
+static const uint8_t logMagic[] = {'S', 'a', 'l', 'L', 'o', 'g', 0, 1};
+
+static const size_t MAGIC_SIZE = sizeof(logMagic);
+static const size_t MAC_SIZE = 32;
+static const size_t HEADER_SIZE = MAGIC_SIZE + MAC_SIZE;
+static const size_t RECORD_HEADER_SIZE = 8;
+static const uint32_t RECORD_MAGIC = 0x52676f4c;            // "LogR"
+
+static const size_t MIN_GROWTH = 64 * 1024;
+static const size_t COMPACT_MIN_GARBAGE = 1024 * 1024;      // Don't compact small logs
+
+static const uint8_t OP_PUT    = 1;
+static const uint8_t OP_REMOVE = 2;
+static const uint8_t OP_BEGIN  = 3;
+static const uint8_t OP_COMMIT = 4;
+
+static const char CONV_KEY    = 'C';
+static const char STAGED_KEY  = 'S';
+static const char PRE_KEY_KEY = 'P';
+static const char OUTBOX_KEY  = 'O';
+static const char RECEIVED_KEY = 'R';
+
+static const string LOG_STORE_DERIVE("SilentCircleLogStoreDerive");
+
+#define STORE_CHK(retval)                                           \
+    lock_guard<mutex> guard(lock_);                                 \
+    if (!isReady_) {                                                \
+        setError(STORE_MISUSE, "Log store is not open");           \
+        return retval;                                              \
+    }
+
+static void put32(uint8_t* buffer, uint32_t value)
+{
+    for (int32_t i = 0; i < 4; i++)
+        buffer[i] = (value >> (i * 8)) & 0xff;
+}
+
+static uint32_t get32(const uint8_t* buffer)
+{
+    uint32_t value = 0;
+    for (int32_t i = 3; i >= 0; i--)
+        value = (value << 8) | buffer[i];
+    return value;
+}
+
+static void append32(string& out, uint32_t value)
+{
+    uint8_t buffer[4];
+    put32(buffer, value);
+    out.append((const char*)buffer, 4);
+}
+
+static void append64(string& out, int64_t value)
+{
+    append32(out, (uint32_t)((uint64_t)value & 0xffffffff));
+    append32(out, (uint32_t)((uint64_t)value >> 32));
+}
+
+static int64_t get64(const uint8_t* buffer)
+{
+    return (int64_t)((uint64_t)get32(buffer) | ((uint64_t)get32(buffer + 4) << 32));
+}
+
+static void appendField(string& out, const string& field)
+{
+    append32(out, field.size());
+    out.append(field);
+}
+
+static bool readField(const string& key, size_t* pos, string* field)
+{
+    if (*pos + 4 > key.size())
+        return false;
+    uint32_t length = get32((const uint8_t*)key.data() + *pos);
+    *pos += 4;
+    if (*pos + length > key.size())
+        return false;
+    field->assign(key, *pos, length);
+    *pos += length;
+    return true;
+}
+
+static string convKey(const string& ownName, const string& name)
+{
+    string key(1, CONV_KEY);
+    appendField(key, ownName);
+    appendField(key, name);
+    return key;
+}
+
+static string convKey(const string& ownName, const string& name, const string& longDevId)
+{
+    string key = convKey(ownName, name);
+    appendField(key, longDevId);
+    return key;
+}
+
+static string stagedKey(const string& ownName, const string& name, const string& longDevId)
+{
+    string key(1, STAGED_KEY);
+    appendField(key, ownName);
+    appendField(key, name);
+    appendField(key, longDevId);
+    return key;
+}
+
+static string preKeyKey(int32_t preKeyId)
+{
+    // Big endian, the index then sorts pre-keys by id
+    uint8_t buffer[5] = {(uint8_t)PRE_KEY_KEY, (uint8_t)(preKeyId >> 24), (uint8_t)(preKeyId >> 16),
+                         (uint8_t)(preKeyId >> 8), (uint8_t)preKeyId};
+    return string((const char*)buffer, sizeof(buffer));
+}
+
+static int32_t preKeyId(const string& key)
+{
+    const uint8_t* buffer = (const uint8_t*)key.data();
+    return (int32_t)(((uint32_t)buffer[1] << 24) | (buffer[2] << 16) | (buffer[3] << 8) | buffer[4]);
+}
+
+static string outboxPrefix(const string& ownName)
+{
+    string key(1, OUTBOX_KEY);
+    appendField(key, ownName);
+    return key;
+}
+
+static string outboxKey(const string& ownName, int64_t id)
+{
+    // Big endian, the index then sorts the entries by id
+    string key = outboxPrefix(ownName);
+    for (int32_t i = 7; i >= 0; i--)
+        key.push_back((char)(((uint64_t)id >> (i * 8)) & 0xff));
+    return key;
+}
+
+static int64_t outboxId(const string& key)
+{
+    uint64_t id = 0;
+    for (size_t i = key.size() - 8; i < key.size(); i++)
+        id = (id << 8) | (uint8_t)key[i];
+    return (int64_t)id;
+}
+
+static string outboxValue(const OutboxEntry& entry)
+{
+    string value;
+    appendField(value, entry.recipient);
+    appendField(value, entry.longDevId);
+    appendField(value, entry.msgId);
+    appendField(value, entry.envelope);
+    append64(value, entry.since);
+    append64(value, entry.nextTry);
+    append32(value, (uint32_t)entry.tries);
+    return value;
+}
+
+static bool readOutboxValue(const string& value, OutboxEntry* entry)
+{
+    size_t pos = 0;
+    if (!readField(value, &pos, &entry->recipient) || !readField(value, &pos, &entry->longDevId) ||
+        !readField(value, &pos, &entry->msgId) || !readField(value, &pos, &entry->envelope))
+        return false;
+    if (pos + 20 != value.size())
+        return false;
+    const uint8_t* data = (const uint8_t*)value.data() + pos;
+    entry->since = get64(data);
+    entry->nextTry = get64(data + 8);
+    entry->tries = (int32_t)get32(data + 16);
+    return true;
+}
+
+static string receivedPrefix(const string& ownName)
+{
+    string key(1, RECEIVED_KEY);
+    appendField(key, ownName);
+    return key;
+}
+
+static bool hasPrefix(const string& key, const string& prefix)
+{
+    return key.compare(0, prefix.size(), prefix) == 0;
+}
+
+static bool equalMacs(const uint8_t* mac1, const uint8_t* mac2)
+{
+    uint8_t diff = 0;
+    for (size_t i = 0; i < MAC_SIZE; i++)
+        diff |= mac1[i] ^ mac2[i];
+    return diff == 0;
+}
+
+static size_t roundUp(size_t length)
+{
+    return (length + MIN_GROWTH - 1) / MIN_GROWTH * MIN_GROWTH;
+}
+
+LogStoreConv::LogStoreConv() : fd_(-1), base_(NULL), capacity_(0), end_(0), garbage_(0),
+                               hasKey_(false), syncWrites_(false), isReady_(false), storeCode_(STORE_OK)
+{
+    lastError_[0] = 0;
+}
+
+LogStoreConv::~LogStoreConv()
+{
+    closeLog();
+    memset(encKey_, 0, sizeof(encKey_));
+    memset(macKey_, 0, sizeof(macKey_));
+}
+
+bool LogStoreConv::setKey(const string& keyData)
+{
+    if (keyData.size() != OUR_KEY_LENGTH)
+        return false;
+
+    uint8_t derived[sizeof(encKey_) + sizeof(macKey_)];
+    HKDF::deriveSecrets((uint8_t*)keyData.data(), keyData.size(),
+                        (uint8_t*)LOG_STORE_DERIVE.data(), LOG_STORE_DERIVE.size(),
+                        derived, sizeof(derived));
+    memcpy(encKey_, derived, sizeof(encKey_));
+    memcpy(macKey_, derived + sizeof(encKey_), sizeof(macKey_));
+    memset(derived, 0, sizeof(derived));
+    hasKey_ = true;
+    return true;
+}
+
+int32_t LogStoreConv::setError(int32_t code, const char* format, ...) const
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(lastError_, sizeof(lastError_), format, args);
+    va_end(args);
+    storeCode_ = code;
+    return code;
+}
+
+int LogStoreConv::openStore(const string& filename)
+{
+    lock_guard<mutex> guard(lock_);
+
+    if (!hasKey_)
+        return setError(STORE_MISUSE, "Log store: no key set");
+    closeLog();
+
+    size_t size = 0;
+    fileName_ = filename;
+    if (!fileName_.empty()) {
+        // Remove the leftover of an interrupted compaction, the log itself is complete
+        unlink((fileName_ + ".compact").c_str());
+
+        fd_ = open(fileName_.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd_ < 0)
+            return setError(STORE_CANTOPEN, "Log store: cannot open %s: %s", fileName_.c_str(), strerror(errno));
+
+        struct stat st;
+        if (fstat(fd_, &st) != 0) {
+            setError(STORE_IOERR, "Log store: cannot stat %s: %s", fileName_.c_str(), strerror(errno));
+            closeLog();
+            return storeCode_;
+        }
+        size = st.st_size;
+    }
+    uint8_t mac[MAC_SIZE];
+    uint32_t macLength;
+    hmac_sha256(macKey_, sizeof(macKey_), (uint8_t*)logMagic, MAGIC_SIZE, mac, &macLength);
+
+    if (size == 0) {
+        if (mapLog(MIN_GROWTH) != STORE_OK) {
+            closeLog();
+            return storeCode_;
+        }
+        memcpy(base_, logMagic, MAGIC_SIZE);
+        memcpy(base_ + MAGIC_SIZE, mac, MAC_SIZE);
+        end_ = HEADER_SIZE;
+    }
+    else {
+        if (size < HEADER_SIZE || mapLog(size) != STORE_OK || memcmp(base_, logMagic, MAGIC_SIZE) != 0) {
+            closeLog();
+            return setError(STORE_NOTADB, "Log store: %s is not a log store", filename.c_str());
+        }
+        if (!equalMacs(base_ + MAGIC_SIZE, mac)) {
+            closeLog();
+            return setError(STORE_NOTADB, "Log store: wrong key for %s", filename.c_str());
+        }
+        replay();
+    }
+    isReady_ = true;
+    storeCode_ = STORE_OK;
+    return STORE_OK;
+}
+
+void LogStoreConv::closeLog()
+{
+    if (base_ != NULL)
+        munmap(base_, capacity_);
+    if (fd_ >= 0)
+        close(fd_);
+    base_ = NULL;
+    fd_ = -1;
+    capacity_ = end_ = garbage_ = 0;
+    index_.clear();
+    isReady_ = false;
+}
+
+int32_t LogStoreConv::mapLog(size_t capacity)
+{
+    void* mapped;
+    if (fd_ >= 0) {
+        if (ftruncate(fd_, capacity) != 0)
+            return setError(STORE_FULL, "Log store: cannot grow %s: %s", fileName_.c_str(), strerror(errno));
+        mapped = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    }
+    else {
+        mapped = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped != MAP_FAILED && base_ != NULL)
+            memcpy(mapped, base_, end_);
+    }
+    if (mapped == MAP_FAILED)
+        return setError(STORE_NOMEM, "Log store: cannot map %ld bytes: %s", (long)capacity, strerror(errno));
+
+    if (base_ != NULL)
+        munmap(base_, capacity_);
+    base_ = (uint8_t*)mapped;
+    capacity_ = capacity;
+    return STORE_OK;
+}
+
+int32_t LogStoreConv::ensureCapacity(size_t length)
+{
+    if (end_ + length <= capacity_)
+        return STORE_OK;
+    return mapLog(roundUp(max(capacity_ * 2, end_ + length)));
+}
+
+int32_t LogStoreConv::replay()
+{
+    vector<Pending> batch;
+    size_t batchStart = 0;
+    bool inBatch = false;
+
+    size_t pos = HEADER_SIZE;
+    uint8_t op;
+    size_t length;
+    Pending pending;
+
+    while (readRecord(pos, &op, &pending.entry.since, &pending.key, NULL, &length)) {
+        pending.entry.offset = pos;
+        pending.entry.length = length;
+
+        if (op == OP_BEGIN) {
+            batch.clear();
+            batchStart = pos;
+            inBatch = true;
+            garbage_ += length;
+        }
+        else if (op == OP_COMMIT) {
+            for (size_t i = 0; i < batch.size(); i++)
+                applyPending(batch[i]);
+            batch.clear();
+            inBatch = false;
+            garbage_ += length;
+        }
+        else if (op == OP_PUT || op == OP_REMOVE) {
+            pending.remove = op == OP_REMOVE;
+            if (inBatch)
+                batch.push_back(pending);
+            else
+                applyPending(pending);
+        }
+        else {
+            break;
+        }
+        pos += length;
+    }
+    // A batch without commit did not complete, drop it
+    if (inBatch)
+        pos = batchStart;
+    end_ = pos;
+
+    // Clear the tail: the first bad record may be followed by records of later writes
+    // that reached the disk, these must not re-appear once new records fill the gap
+    for (size_t i = end_; i < capacity_; i++) {
+        if (base_[i] != 0) {
+            Log("Log store: dropping %ld bytes after offset %ld", (long)(capacity_ - end_), (long)end_);
+            memset(base_ + end_, 0, capacity_ - end_);
+            break;
+        }
+    }
+    return STORE_OK;
+}
+
+bool LogStoreConv::readRecord(size_t offset, uint8_t* op, int64_t* since, string* key, string* value, size_t* length) const
+{
+    if (offset + RECORD_HEADER_SIZE > capacity_)
+        return false;
+
+    const uint8_t* record = base_ + offset;
+    if (get32(record) != RECORD_MAGIC)
+        return false;
+
+    size_t bodyLength = get32(record + 4);
+    if (bodyLength < AES_BLOCK_SIZE * 2 + MAC_SIZE || bodyLength > capacity_ - offset - RECORD_HEADER_SIZE)
+        return false;
+
+    const uint8_t* body = record + RECORD_HEADER_SIZE;
+    size_t cryptLength = bodyLength - AES_BLOCK_SIZE - MAC_SIZE;
+    if (cryptLength % AES_BLOCK_SIZE != 0)
+        return false;
+
+    uint8_t mac[MAC_SIZE];
+    uint32_t macLength;
+    hmac_sha256((uint8_t*)macKey_, sizeof(macKey_), (uint8_t*)body, AES_BLOCK_SIZE + cryptLength, mac, &macLength);
+    if (!equalMacs(mac, body + AES_BLOCK_SIZE + cryptLength))
+        return false;
+
+    string data;
+    aesCbcDecrypt(string((const char*)encKey_, sizeof(encKey_)), string((const char*)body, AES_BLOCK_SIZE),
+                  string((const char*)body + AES_BLOCK_SIZE, cryptLength), &data);
+    if (!checkAndRemovePadding(data) || data.size() < 13)
+        return false;
+
+    const uint8_t* plain = (const uint8_t*)data.data();
+    size_t keyLength = get32(plain + 9);
+    if (13 + keyLength > data.size())
+        return false;
+
+    *op = plain[0];
+    *since = get64(plain + 1);
+    key->assign(data, 13, keyLength);
+    if (value != NULL)
+        value->assign(data, 13 + keyLength, string::npos);
+    *length = RECORD_HEADER_SIZE + bodyLength;
+
+    memset(&data[0], 0, data.size());
+    return true;
+}
+
+int32_t LogStoreConv::appendRecord(uint8_t op, const string& key, const string& value, int64_t since, IndexEntry* entry)
+{
+    string data;
+    data.reserve(13 + key.size() + value.size());
+    data.push_back((char)op);
+    append64(data, since);
+    append32(data, key.size());
+    data.append(key);
+    data.append(value);
+
+    uint8_t iv[AES_BLOCK_SIZE];
+    ZrtpRandom::getRandomData(iv, sizeof(iv));
+
+    string encrypted;
+    aesCbcEncrypt(string((const char*)encKey_, sizeof(encKey_)), string((const char*)iv, sizeof(iv)), data, &encrypted);
+    memset(&data[0], 0, data.size());
+
+    size_t bodyLength = AES_BLOCK_SIZE + encrypted.size() + MAC_SIZE;
+    size_t length = RECORD_HEADER_SIZE + bodyLength;
+    if (ensureCapacity(length) != STORE_OK)
+        return storeCode_;
+
+    uint8_t* record = base_ + end_;
+    uint8_t* body = record + RECORD_HEADER_SIZE;
+    memcpy(body, iv, sizeof(iv));
+    memcpy(body + AES_BLOCK_SIZE, encrypted.data(), encrypted.size());
+
+    uint32_t macLength;
+    hmac_sha256(macKey_, sizeof(macKey_), body, AES_BLOCK_SIZE + encrypted.size(), body + AES_BLOCK_SIZE + encrypted.size(), &macLength);
+    put32(record + 4, bodyLength);
+    put32(record, RECORD_MAGIC);
+
+    entry->offset = end_;
+    entry->length = length;
+    entry->since = since;
+    end_ += length;
+    return STORE_OK;
+}
+
+void LogStoreConv::applyPending(const Pending& pending)
+{
+    Index::iterator it = index_.find(pending.key);
+    if (it != index_.end())
+        garbage_ += it->second.length;
+
+    if (pending.remove) {
+        garbage_ += pending.entry.length;
+        if (it != index_.end())
+            index_.erase(it);
+    }
+    else if (it != index_.end()) {
+        it->second = pending.entry;
+    }
+    else {
+        index_.insert(pair<string, IndexEntry>(pending.key, pending.entry));
+    }
+}
+
+string* LogStoreConv::loadValue(const string& key) const
+{
+    Index::const_iterator it = index_.find(key);
+    if (it == index_.end()) {
+        storeCode_ = STORE_OK;
+        return NULL;
+    }
+    uint8_t op;
+    int64_t since;
+    size_t length;
+    string recordKey;
+    string* value = new string();
+    if (!readRecord(it->second.offset, &op, &since, &recordKey, value, &length) || recordKey != key) {
+        setError(STORE_CORRUPT, "Log store: corrupted record at offset %ld", (long)it->second.offset);
+        delete value;
+        return NULL;
+    }
+    storeCode_ = STORE_OK;
+    return value;
+}
+
+int32_t LogStoreConv::putValue(const string& key, const string& value)
+{
+    Pending pending;
+    if (appendRecord(OP_PUT, key, value, time(0), &pending.entry) != STORE_OK)
+        return storeCode_;
+
+    pending.key = key;
+    pending.remove = false;
+    applyPending(pending);
+    writeDone();
+    return storeCode_;
+}
+
+int32_t LogStoreConv::removeValue(const string& key)
+{
+    storeCode_ = STORE_OK;
+    if (index_.find(key) == index_.end())
+        return STORE_OK;
+
+    Pending pending;
+    if (appendRecord(OP_REMOVE, key, string(), time(0), &pending.entry) != STORE_OK)
+        return storeCode_;
+
+    pending.key = key;
+    pending.remove = true;
+    applyPending(pending);
+    writeDone();
+    return storeCode_;
+}
+
+int32_t LogStoreConv::writeBatch(const list<pair<string, string> >& puts, const list<string>& removes)
+{
+    storeCode_ = STORE_OK;
+    if (puts.empty() && removes.empty())
+        return STORE_OK;
+
+    size_t start = end_;
+    time_t now = time(0);
+    vector<Pending> batch;
+    IndexEntry entry;
+
+    if (appendRecord(OP_BEGIN, string(), string(), now, &entry) != STORE_OK)
+        goto cleanup;
+
+    for (list<pair<string, string> >::const_iterator it = puts.begin(); it != puts.end(); ++it) {
+        Pending pending;
+        if (appendRecord(OP_PUT, it->first, it->second, now, &pending.entry) != STORE_OK)
+            goto cleanup;
+        pending.key = it->first;
+        pending.remove = false;
+        batch.push_back(pending);
+    }
+    for (list<string>::const_iterator it = removes.begin(); it != removes.end(); ++it) {
+        Pending pending;
+        if (appendRecord(OP_REMOVE, *it, string(), now, &pending.entry) != STORE_OK)
+            goto cleanup;
+        pending.key = *it;
+        pending.remove = true;
+        batch.push_back(pending);
+    }
+    if (appendRecord(OP_COMMIT, string(), string(), now, &entry) != STORE_OK)
+        goto cleanup;
+
+    // The begin and commit records are garbage once the batch is complete
+    garbage_ += 2 * entry.length;
+
+    for (size_t i = 0; i < batch.size(); i++)
+        applyPending(batch[i]);
+    writeDone();
+    return storeCode_;
+
+cleanup:
+    // Nothing of the batch is in the index yet, remove the records from the log
+    memset(base_ + start, 0, end_ - start);
+    end_ = start;
+    return storeCode_;
+}
+
+void LogStoreConv::writeDone()
+{
+    if (syncWrites_)
+        syncLog(0, end_);
+    if (garbage_ > COMPACT_MIN_GARBAGE && garbage_ > end_ / 2)
+        compact();
+}
+
+int32_t LogStoreConv::syncLog(size_t from, size_t to)
+{
+    if (fd_ < 0 || to <= from)
+        return STORE_OK;
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    from = from / pageSize * pageSize;
+    if (msync(base_ + from, to - from, MS_SYNC) != 0)
+        return setError(STORE_IOERR, "Log store: cannot sync %s: %s", fileName_.c_str(), strerror(errno));
+    return STORE_OK;
+}
+
+int32_t LogStoreConv::compact()
+{
+    size_t live = 0;
+    for (Index::const_iterator it = index_.begin(); it != index_.end(); ++it)
+        live += it->second.length;
+
+    size_t capacity = roundUp(HEADER_SIZE + live + MIN_GROWTH);
+    string tmpName = fileName_ + ".compact";
+    int fd = -1;
+    void* mapped;
+
+    if (fd_ >= 0) {
+        fd = open(tmpName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+            return setError(STORE_CANTOPEN, "Log store: cannot open %s: %s", tmpName.c_str(), strerror(errno));
+        if (ftruncate(fd, capacity) != 0) {
+            close(fd);
+            unlink(tmpName.c_str());
+            return setError(STORE_FULL, "Log store: cannot grow %s: %s", tmpName.c_str(), strerror(errno));
+        }
+        mapped = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    else {
+        mapped = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (mapped == MAP_FAILED) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmpName.c_str());
+        }
+        return setError(STORE_NOMEM, "Log store: cannot map %ld bytes: %s", (long)capacity, strerror(errno));
+    }
+    uint8_t* newBase = (uint8_t*)mapped;
+
+    // Records are position independent, copy them as they are
+    memcpy(newBase, base_, HEADER_SIZE);
+    size_t pos = HEADER_SIZE;
+    vector<size_t> offsets;
+    offsets.reserve(index_.size());
+    for (Index::const_iterator it = index_.begin(); it != index_.end(); ++it) {
+        memcpy(newBase + pos, base_ + it->second.offset, it->second.length);
+        offsets.push_back(pos);
+        pos += it->second.length;
+    }
+
+    if (fd >= 0) {
+        // The new log must be on disk before it replaces the old one
+        if (msync(newBase, pos, MS_SYNC) != 0 || rename(tmpName.c_str(), fileName_.c_str()) != 0) {
+            setError(STORE_IOERR, "Log store: cannot replace %s: %s", fileName_.c_str(), strerror(errno));
+            munmap(newBase, capacity);
+            close(fd);
+            unlink(tmpName.c_str());
+            return storeCode_;
+        }
+        close(fd_);
+        fd_ = fd;
+    }
+    munmap(base_, capacity_);
+    base_ = newBase;
+    capacity_ = capacity;
+    end_ = pos;
+    garbage_ = 0;
+
+    size_t i = 0;
+    for (Index::iterator it = index_.begin(); it != index_.end(); ++it, ++i)
+        it->second.offset = offsets[i];
+
+    return STORE_OK;
+}
+
+// ***** Conversations
+list<string>* LogStoreConv::getKnownConversations(const string& ownName)
+{
+    STORE_CHK(NULL);
+
+    string prefix(1, CONV_KEY);
+    appendField(prefix, ownName);
+
+    list<string>* names = new list<string>;
+    for (Index::const_iterator it = index_.lower_bound(prefix); it != index_.end() && hasPrefix(it->first, prefix); ++it) {
+        size_t pos = prefix.size();
+        string name;
+        if (readField(it->first, &pos, &name))
+            names->push_back(name);
+    }
+    // Keys sort by the length of the name first
+    names->sort();
+    names->unique();
+    storeCode_ = STORE_OK;
+    return names;
+}
+
+list<string>* LogStoreConv::getLongDeviceIds(const string& name, const string& ownName)
+{
+    STORE_CHK(NULL);
+
+    string prefix = convKey(ownName, name);
+
+    list<string>* devIds = new list<string>;
+    for (Index::const_iterator it = index_.lower_bound(prefix); it != index_.end() && hasPrefix(it->first, prefix); ++it) {
+        size_t pos = prefix.size();
+        string devId;
+        // The local conversation has no device id
+        if (readField(it->first, &pos, &devId) && !devId.empty())
+            devIds->push_back(devId);
+    }
+    storeCode_ = STORE_OK;
+    return devIds;
+}
+
+string* LogStoreConv::loadConversation(const string& name, const string& longDevId, const string& ownName) const
+{
+    STORE_CHK(NULL);
+    return loadValue(convKey(ownName, name, longDevId));
+}
+
+void LogStoreConv::storeConversation(const string& name, const string& longDevId, const string& ownName, const string& data)
+{
+    STORE_CHK();
+    putValue(convKey(ownName, name, longDevId), data);
+}
+
+int32_t LogStoreConv::storeConversations(const string& name, const string& ownName, const list<pair<string, string> >& conversations)
+{
+    STORE_CHK(STORE_MISUSE);
+
+    list<pair<string, string> > puts;
+    for (list<pair<string, string> >::const_iterator it = conversations.begin(); it != conversations.end(); ++it)
+        puts.push_back(pair<string, string>(convKey(ownName, name, it->first), it->second));
+    return writeBatch(puts, list<string>());
+}
+
+bool LogStoreConv::hasConversation(const string& name, const string& longDevId, const string& ownName) const
+{
+    STORE_CHK(false);
+    storeCode_ = STORE_OK;
+    return index_.find(convKey(ownName, name, longDevId)) != index_.end();
+}
+
+int32_t LogStoreConv::hasConversations(const string& name, const vector<DataSpan>& longDevIds, const string& ownName,
+                                       vector<bool>* known) const
+{
+    known->assign(longDevIds.size(), false);
+    STORE_CHK(STORE_MISUSE);
+    storeCode_ = STORE_OK;
+
+    // Walk the user's conversation keys once, the index holds the keys only
+    string prefix = convKey(ownName, name);
+    for (Index::const_iterator it = index_.lower_bound(prefix); it != index_.end() && hasPrefix(it->first, prefix); ++it) {
+        size_t pos = prefix.size();
+        string devId;
+        if (!readField(it->first, &pos, &devId))
+            continue;
+        for (size_t k = 0; k < longDevIds.size(); k++) {
+            if (longDevIds[k].size == devId.size() && memcmp(longDevIds[k].data, devId.data(), devId.size()) == 0)
+                (*known)[k] = true;
+        }
+    }
+    return storeCode_;
+}
+
+void LogStoreConv::deleteConversation(const string& name, const string& longDevId, const string& ownName)
+{
+    STORE_CHK();
+    removeValue(convKey(ownName, name, longDevId));
+}
+
+void LogStoreConv::deleteConversationsName(const string& name, const string& ownName)
+{
+    STORE_CHK();
+
+    string prefix = convKey(ownName, name);
+    list<string> removes;
+    for (Index::const_iterator it = index_.lower_bound(prefix); it != index_.end() && hasPrefix(it->first, prefix); ++it)
+        removes.push_back(it->first);
+
+    writeBatch(list<pair<string, string> >(), removes);
+}
+
+// ***** Staged message keys, the key of a record contains the staged key data
+list<string>* LogStoreConv::loadStagedMks(const string& name, const string& longDevId, const string& ownName) const
+{
+    STORE_CHK(NULL);
+
+    string prefix = stagedKey(ownName, name, longDevId);
+    storeCode_ = STORE_OK;
+
+    Index::const_iterator it = index_.lower_bound(prefix);
+    if (it == index_.end() || !hasPrefix(it->first, prefix))
+        return NULL;
+
+    list<string>* keys = new list<string>;
+    for (; it != index_.end() && hasPrefix(it->first, prefix); ++it)
+        keys->push_back(it->first.substr(prefix.size()));
+    return keys;
+}
+
+void LogStoreConv::insertStagedMk(const string& name, const string& longDevId, const string& ownName, const string& MKiv)
+{
+    STORE_CHK();
+    putValue(stagedKey(ownName, name, longDevId) + MKiv, string());
+}
+
+void LogStoreConv::deleteStagedMk(const string& name, const string& longDevId, const string& ownName, string& MKiv)
+{
+    STORE_CHK();
+    removeValue(stagedKey(ownName, name, longDevId) + MKiv);
+}
+
+int32_t LogStoreConv::deleteStagedMk(time_t timestamp)
+{
+    STORE_CHK(STORE_MISUSE);
+
+    string prefix(1, STAGED_KEY);
+    list<string> removes;
+    for (Index::const_iterator it = index_.lower_bound(prefix); it != index_.end() && hasPrefix(it->first, prefix); ++it) {
+        if (it->second.since < timestamp)
+            removes.push_back(it->first);
+    }
+    return writeBatch(list<pair<string, string> >(), removes);
+}
+
+// ***** Pre-keys
+string* LogStoreConv::loadPreKey(int32_t preKeyId) const
+{
+    STORE_CHK(NULL);
+    return loadValue(preKeyKey(preKeyId));
+}
+
+void LogStoreConv::storePreKey(int32_t preKeyId, const string& preKeyData)
+{
+    STORE_CHK();
+
+    string key = preKeyKey(preKeyId);
+    if (index_.find(key) != index_.end()) {
+        setError(STORE_CONSTRAINT, "Log store: pre-key %d exists", preKeyId);
+        return;
+    }
+    putValue(key, preKeyData);
+}
+
+int32_t LogStoreConv::storePreKeys(const list<pair<int32_t, string> >& preKeys)
+{
+    STORE_CHK(STORE_MISUSE);
+
+    list<pair<string, string> > puts;
+    for (list<pair<int32_t, string> >::const_iterator it = preKeys.begin(); it != preKeys.end(); ++it) {
+        string key = preKeyKey(it->first);
+        if (index_.find(key) != index_.end())
+            return setError(STORE_CONSTRAINT, "Log store: pre-key %d exists", it->first);
+        puts.push_back(pair<string, string>(key, it->second));
+    }
+    return writeBatch(puts, list<string>());
+}
+
+bool LogStoreConv::containsPreKey(int32_t preKeyId) const
+{
+    STORE_CHK(false);
+    storeCode_ = STORE_OK;
+    return index_.find(preKeyKey(preKeyId)) != index_.end();
+}
+
+list<int32_t>* LogStoreConv::getPreKeyIds() const
+{
+    STORE_CHK(NULL);
+
+    string prefix(1, PRE_KEY_KEY);
+    list<int32_t>* ids = new list<int32_t>;
+    for (Index::const_iterator it = index_.lower_bound(prefix); it != index_.end() && hasPrefix(it->first, prefix); ++it)
+        ids->push_back(preKeyId(it->first));
+    storeCode_ = STORE_OK;
+    return ids;
+}
+
+void LogStoreConv::removePreKey(int32_t preKeyId)
+{
+    STORE_CHK();
+    removeValue(preKeyKey(preKeyId));
+}
+
+void LogStoreConv::dumpPreKeys() const
+{
+    STORE_CHK();
+
+    string prefix(1, PRE_KEY_KEY);
+    for (Index::const_iterator it = index_.lower_bound(prefix); it != index_.end() && hasPrefix(it->first, prefix); ++it)
+        Log("Pre-key id: %d, since: %ld", preKeyId(it->first), (long)it->second.since);
+}
+
+// ***** Outbox, the entries of an account sort by id
+int32_t LogStoreConv::insertOutboxEntries(const string& ownName, list<OutboxEntry>* entries)
+{
+    STORE_CHK(STORE_MISUSE);
+
+    string prefix = outboxPrefix(ownName);
+    int64_t nextId = 1;
+    Index::const_iterator last = index_.lower_bound(outboxKey(ownName, -1));
+    if (last != index_.begin() && hasPrefix((--last)->first, prefix))
+        nextId = outboxId(last->first) + 1;
+
+    list<pair<string, string> > puts;
+    for (list<OutboxEntry>::iterator it = entries->begin(); it != entries->end(); ++it) {
+        it->id = nextId++;
+        puts.push_back(pair<string, string>(outboxKey(ownName, it->id), outboxValue(*it)));
+    }
+    return writeBatch(puts, list<string>());
+}
+
+list<OutboxEntry>* LogStoreConv::loadOutboxEntries(const string& ownName, time_t dueTime) const
+{
+    STORE_CHK(NULL);
+
+    string prefix = outboxPrefix(ownName);
+    list<OutboxEntry>* entries = new list<OutboxEntry>;
+    for (Index::const_iterator it = index_.lower_bound(prefix); it != index_.end() && hasPrefix(it->first, prefix); ++it) {
+        string* value = loadValue(it->first);
+        OutboxEntry entry;
+        if (value == NULL || !readOutboxValue(*value, &entry)) {
+            delete value;
+            delete entries;
+            setError(STORE_CORRUPT, "Log store: corrupted outbox entry at offset %ld", (long)it->second.offset);
+            return NULL;
+        }
+        delete value;
+        entry.id = outboxId(it->first);
+        if (entry.nextTry <= dueTime)
+            entries->push_back(entry);
+    }
+    storeCode_ = STORE_OK;
+    return entries;
+}
+
+int32_t LogStoreConv::updateOutboxEntries(const string& ownName, const list<OutboxEntry>& entries)
+{
+    STORE_CHK(STORE_MISUSE);
+
+    // Records are immutable, write the complete entry again
+    list<pair<string, string> > puts;
+    for (list<OutboxEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        string key = outboxKey(ownName, it->id);
+        if (index_.find(key) != index_.end())
+            puts.push_back(pair<string, string>(key, outboxValue(*it)));
+    }
+    return writeBatch(puts, list<string>());
+}
+
+int32_t LogStoreConv::deleteOutboxEntries(const string& ownName, const list<int64_t>& ids)
+{
+    STORE_CHK(STORE_MISUSE);
+
+    list<string> removes;
+    for (list<int64_t>::const_iterator it = ids.begin(); it != ids.end(); ++it) {
+        string key = outboxKey(ownName, *it);
+        if (index_.find(key) != index_.end())
+            removes.push_back(key);
+    }
+    return writeBatch(list<pair<string, string> >(), removes);
+}
+
+// ***** Received message ids, the records hold no value, the index has the time
+int32_t LogStoreConv::insertReceivedId(const string& ownName, const string& msgKey)
+{
+    STORE_CHK(STORE_MISUSE);
+    return putValue(receivedPrefix(ownName) + msgKey, string());
+}
+
+bool LogStoreConv::hasReceivedId(const string& ownName, const string& msgKey) const
+{
+    STORE_CHK(false);
+    storeCode_ = STORE_OK;
+    return index_.find(receivedPrefix(ownName) + msgKey) != index_.end();
+}
+
+list<string>* LogStoreConv::loadReceivedIds(const string& ownName, time_t since) const
+{
+    STORE_CHK(NULL);
+
+    string prefix = receivedPrefix(ownName);
+    multimap<int64_t, string> byTime;
+    for (Index::const_iterator it = index_.lower_bound(prefix); it != index_.end() && hasPrefix(it->first, prefix); ++it) {
+        if (it->second.since >= since)
+            byTime.insert(pair<int64_t, string>(it->second.since, it->first.substr(prefix.size())));
+    }
+    list<string>* keys = new list<string>;
+    for (multimap<int64_t, string>::const_iterator it = byTime.begin(); it != byTime.end(); ++it)
+        keys->push_back(it->second);
+    storeCode_ = STORE_OK;
+    return keys;
+}
+
+int32_t LogStoreConv::deleteReceivedIds(time_t timestamp)
+{
+    STORE_CHK(STORE_MISUSE);
+
+    string prefix(1, RECEIVED_KEY);
+    list<string> removes;
+    for (Index::const_iterator it = index_.lower_bound(prefix); it != index_.end() && hasPrefix(it->first, prefix); ++it) {
+        if (it->second.since < timestamp)
+            removes.push_back(it->first);
+    }
+    return writeBatch(list<pair<string, string> >(), removes);
+}
+
+// ***** Store maintenance
+int32_t LogStoreConv::optimizeStore()
+{
+    STORE_CHK(STORE_MISUSE);
+    storeCode_ = STORE_OK;
+    return STORE_OK;
+}
+
+int32_t LogStoreConv::incrementalVacuum(int32_t /* pages */)
+{
+    STORE_CHK(STORE_MISUSE);
+    storeCode_ = STORE_OK;
+    if (garbage_ == 0)
+        return STORE_OK;
+    return compact();
+}
+
+int32_t LogStoreConv::checkpointStore()
+{
+    STORE_CHK(STORE_MISUSE);
+    storeCode_ = STORE_OK;
+    return syncLog(0, end_);
+}
+
+int32_t LogStoreConv::resetStore()
+{
+    STORE_CHK(STORE_MISUSE);
+
+    memset(base_ + HEADER_SIZE, 0, end_ - HEADER_SIZE);
+    end_ = HEADER_SIZE;
+    garbage_ = 0;
+    index_.clear();
+    storeCode_ = STORE_OK;
+    return STORE_OK;
+}
@@ -0,0 +1,290 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef LOGSTORECONV_H
+#define LOGSTORECONV_H
+
+/**
+ * @file LogStoreConv.h
+ * @brief Implementation of Salamander store as an append-only log
+ * @ingroup Salamander++
+ * @{
+ *
+ * The store keeps conversations, staged message keys, pre-keys, outbox entries
+ * and received message ids as records in one memory-mapped log file and holds
+ * an index of all live records in memory. Each write appends a record, a delete
+ * appends a tombstone. Each record is encrypted with AES-256-CBC and
+ * authenticated with HMAC-SHA256, the keys are derived from the store key.
+ *
+ * Opening the store replays the log and rebuilds the index. Replay stops at the
+ * first record that is incomplete or fails authentication, this is the tail of
+ * a write that did not finish, and the store continues after the last good
+ * record. A batch of writes, for example @c storePreKeys, is enclosed in begin
+ * and commit records, replay ignores a batch without a commit record.
+ *
+ * If superseded records take up more than half of the log the store compacts
+ * it: it copies the live records into a new file and replaces the log with the
+ * new file. @c incrementalVacuum compacts the log as well.
+ *
+ * Writes go to the mapped file and are durable if the process dies, use
+ * @c checkpointStore or @c setSyncWrites to make sure the data reaches the disk.
+ */
+
+#include <string>
+#include <stdint.h>
+#include <list>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include "../ConversationStore.h"
+
+#define LOG_STORE_ERR_BUFF_SIZE  1000
+
+using namespace std;
+
+namespace salamander {
+
+class LogStoreConv : public ConversationStore
+{
+public:
+    /**
+     * @brief Create a Salamander log store instance.
+     *
+     * The caller owns the instance, sets the key and opens the store.
+     */
+    LogStoreConv();
+
+    /**
+     * @brief Close the log and destroy the store instance.
+     */
+    ~LogStoreConv();
+
+    bool isReady() { return isReady_; }
+
+    /**
+     * @brief Open the log store and replay the log.
+     *
+     * @param filename Filename of the log, including path. An empty name opens
+     *        a store that lives in memory only.
+     * @return a store code, @c STORE_NOTADB if the file is no log store or if
+     *         the key does not match
+     */
+    int openStore(const string& filename);
+
+    /**
+     * @brief Set the key to encrypt and authenticate the log records.
+     *
+     * @param keyData a @c string container with the key data
+     * @return @c true is key is OK, @c false otherwise.
+     */
+    bool setKey(const string& keyData);
+
+    /**
+     * @brief Sync each write to the disk before the write function returns.
+     *
+     * Off by default, @c StoreMaintenance syncs the log periodically.
+     */
+    void setSyncWrites(bool sync) { syncWrites_ = sync; }
+
+    const char* getLastError() {return lastError_;}
+
+    int32_t getStoreCode() const {return storeCode_;}
+
+    /**
+     * @brief Get the size of the log in bytes, including superseded records.
+     */
+    size_t getLogSize() const { return end_; }
+
+    /**
+     * @brief Get the size of superseded records and tombstones in bytes.
+     */
+    size_t getGarbageSize() const { return garbage_; }
+
+    list<string>* getKnownConversations(const string& ownName);
+
+    list<string>* getLongDeviceIds(const string& name, const string& ownName);
+
+    // ***** Conversation store
+    string* loadConversation(const string& name, const string& longDevId, const string& ownName) const;
+
+    void storeConversation(const string& name, const string& longDevId, const string& ownName, const string& data);
+
+    int32_t storeConversations(const string& name, const string& ownName, const list<pair<string, string> >& conversations);
+
+    bool hasConversation(const string& name, const string& longDevId, const string& ownName) const;
+
+    int32_t hasConversations(const string& name, const vector<DataSpan>& longDevIds, const string& ownName,
+                             vector<bool>* known) const;
+
+    void deleteConversation(const string& name, const string& longDevId, const string& ownName);
+
+    void deleteConversationsName(const string& name, const string& ownName);
+
+    // ***** staged message keys store
+    list<string>* loadStagedMks(const string& name, const string& longDevId, const string& ownName) const;
+
+    void insertStagedMk(const string& name, const string& longDevId, const string& ownName, const string& MKiv);
+
+    void deleteStagedMk(const string& name, const string& longDevId, const string& ownName, string& MKiv);
+
+    int32_t deleteStagedMk(time_t timestamp);
+
+    // ***** Pre-key store
+    string* loadPreKey(int32_t preKeyId) const;
+
+    void storePreKey(int32_t preKeyId, const string& preKeyData);
+
+    int32_t storePreKeys(const list<pair<int32_t, string> >& preKeys);
+
+    bool containsPreKey(int32_t preKeyId) const;
+
+    list<int32_t>* getPreKeyIds() const;
+
+    void removePreKey(int32_t preKeyId);
+
+    void dumpPreKeys() const;
+
+    // ***** Outbox
+    int32_t insertOutboxEntries(const string& ownName, list<OutboxEntry>* entries);
+
+    list<OutboxEntry>* loadOutboxEntries(const string& ownName, time_t dueTime) const;
+
+    int32_t updateOutboxEntries(const string& ownName, const list<OutboxEntry>& entries);
+
+    int32_t deleteOutboxEntries(const string& ownName, const list<int64_t>& ids);
+
+    // ***** Received message ids
+    int32_t insertReceivedId(const string& ownName, const string& msgKey);
+
+    bool hasReceivedId(const string& ownName, const string& msgKey) const;
+
+    list<string>* loadReceivedIds(const string& ownName, time_t since) const;
+
+    int32_t deleteReceivedIds(time_t timestamp);
+
+    // ***** Store maintenance, see StoreMaintenance.h
+
+    /**
+     * @brief The index lives in memory, nothing to optimize.
+     *
+     * @return always @c STORE_OK
+     */
+    int32_t optimizeStore();
+
+    /**
+     * @brief Compact the log if it contains superseded records.
+     *
+     * @param pages ignored, the store always compacts the whole log
+     * @return a store code
+     */
+    int32_t incrementalVacuum(int32_t pages);
+
+    /**
+     * @brief Sync the log to the disk.
+     *
+     * @return a store code
+     */
+    int32_t checkpointStore();
+
+    int32_t resetStore();
+
+private:
+    LogStoreConv(const LogStoreConv& other) {}
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wreturn-type"
+    LogStoreConv& operator=(const LogStoreConv& other) {}
+    bool operator==(const LogStoreConv& other) const {}
+#pragma clang diagnostic pop
+
+    /**
+     * Location of a live record in the log.
+     */
+    struct IndexEntry {
+        size_t offset;          //!< offset of the record in the log
+        size_t length;          //!< length of the record, including its header
+        int64_t since;          //!< time when the record was written
+    };
+    typedef map<string, IndexEntry> Index;
+
+    /**
+     * A record that was appended to the log but is not yet in the index.
+     */
+    struct Pending {
+        string key;
+        bool remove;
+        IndexEntry entry;
+    };
+
+    int32_t mapLog(size_t capacity);
+
+    void closeLog();
+
+    int32_t replay();
+
+    int32_t ensureCapacity(size_t length);
+
+    int32_t appendRecord(uint8_t op, const string& key, const string& value, int64_t since, IndexEntry* entry);
+
+    /**
+     * Decrypt and parse a record, return false if the record is incomplete or not authentic.
+     */
+    bool readRecord(size_t offset, uint8_t* op, int64_t* since, string* key, string* value, size_t* length) const;
+
+    string* loadValue(const string& key) const;
+
+    int32_t putValue(const string& key, const string& value);
+
+    int32_t removeValue(const string& key);
+
+    void applyPending(const Pending& pending);
+
+    int32_t writeBatch(const list<pair<string, string> >& puts, const list<string>& removes);
+
+    void writeDone();
+
+    int32_t compact();
+
+    int32_t syncLog(size_t from, size_t to);
+
+    int32_t setError(int32_t code, const char* format, ...) const;
+
+    Index index_;
+
+    string fileName_;
+    int fd_;
+    uint8_t* base_;
+    size_t capacity_;
+    size_t end_;
+    size_t garbage_;
+
+    uint8_t encKey_[32];
+    uint8_t macKey_[32];
+    bool hasKey_;
+    bool syncWrites_;
+
+    bool isReady_;
+
+    mutable mutex lock_;
+    mutable int32_t storeCode_;
+    mutable char lastError_[LOG_STORE_ERR_BUFF_SIZE];
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // LOGSTORECONV_H
@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <iostream>
+#include <algorithm>
 
 #include <cryptcommon/ZrtpRandom.h>
 #include <cryptcommon/aescpp.h>
@@ -14,19 +15,19 @@
  * 
  * ERRMSG requires:
  * - a variable with name "db" is the pointer to sqlite3
- * - a char* with name "lastError" points to a buffer of at least SQL_CACHE_ERR_BUFF_SIZE chars
+ * - an integer (int) variable with name "rc" that stores return codes from sqlite
+ * ERRMSG records the code and the error message as the calling thread's last result
  *
  * SQLITE_CHK requires:
  * - a cleanup label, the macro goes to that label in case of error
  * - an integer (int) variable with name "rc" that stores return codes from sqlite
  * - ERRMSG
  */
-#define ERRMSG  {snprintf(lastError_, (size_t)DB_CACHE_ERR_BUFF_SIZE, \
-                          "SQLite3 error: %s, line: %d, error message: %s\n", __FILE__, __LINE__, sqlite3_errmsg(db));}
+#define ERRMSG  {setLastError(rc, db, __LINE__);}
 
 #define SQLITE_CHK(func) {          \
-        sqlCode_ = (func);          \
-        if(sqlCode_ != SQLITE_OK) { \
+        rc = (func);                \
+        if(rc != SQLITE_OK) {       \
             ERRMSG;                 \
             goto cleanup;           \
         }                           \
@@ -40,12 +41,21 @@
 #define SQLITE_PREPARE sqlite3_prepare
 #endif
 
-#define DB_VERSION 1
+#define DB_VERSION 4
+
+// The store returns the SQLite codes as store codes
+static_assert(salamander::STORE_OK == SQLITE_OK && salamander::STORE_ERROR == SQLITE_ERROR &&
+              salamander::STORE_BUSY == SQLITE_BUSY && salamander::STORE_NOMEM == SQLITE_NOMEM &&
+              salamander::STORE_IOERR == SQLITE_IOERR && salamander::STORE_CORRUPT == SQLITE_CORRUPT &&
+              salamander::STORE_FULL == SQLITE_FULL && salamander::STORE_CANTOPEN == SQLITE_CANTOPEN &&
+              salamander::STORE_CONSTRAINT == SQLITE_CONSTRAINT && salamander::STORE_MISUSE == SQLITE_MISUSE &&
+              salamander::STORE_NOTADB == SQLITE_NOTADB, "StoreCodes differ from the SQLite result codes");
 
 static void *(*volatile memset_volatile)(void *, int, size_t) = memset;
 
 static const char *beginTransactionSql  = "BEGIN TRANSACTION;";
 static const char *commitTransactionSql = "COMMIT;";
+static const char *rollbackTransactionSql = "ROLLBACK;";
 
 /* *****************************************************************************
  * The SQLite master table.
@@ -98,6 +108,29 @@ static const char* removeStagedMk = "DELETE FROM stagedMk WHERE name=?1 AND long
 
 static const char* removeStagedMkTime = "DELETE FROM stagedMk WHERE since < ?1;";
 
+/* *****************************************************************************
+ * SQL statements to set up shards and to move rows between the main database
+ * and the shards.
+ */
+static const char* lookupConvTable = "SELECT name FROM sqlite_master WHERE type='table' AND name='Conversations';";
+
+static const char* selectConvAll =
+    "SELECT rowid, name, longDevId, ownName, secondName, flags, since, data, checkData FROM Conversations;";
+// Keep a row that is in the shard already, the live system may have advanced it after an interrupted migration
+static const char* insertConvAll =
+    "INSERT OR IGNORE INTO Conversations (name, longDevId, ownName, secondName, flags, since, data, checkData) "
+    "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8);";
+static const char* removeConvRowid = "DELETE FROM Conversations WHERE rowid=?1;";
+
+static const char* selectStagedMkAll =
+    "SELECT rowid, name, longDevId, ownName, since, otherkey, ivkeymk, ivkeyhdr FROM stagedMk;";
+// stagedMk has no primary key, skip a key that an interrupted migration already copied
+static const char* insertStagedMkAll =
+    "INSERT INTO stagedMk (name, longDevId, ownName, since, otherkey, ivkeymk, ivkeyhdr) "
+    "SELECT ?1, ?2, ?3, ?4, ?5, ?6, ?7 WHERE NOT EXISTS (SELECT 1 FROM stagedMk "
+    "WHERE name=?1 AND longDevId=?2 AND ownName=?3 AND otherkey IS ?5 AND ivkeymk IS ?6 AND ivkeyhdr IS ?7);";
+static const char* removeStagedMkRowid = "DELETE FROM stagedMk WHERE rowid=?1;";
+
 
 /* *****************************************************************************
  * SQL statements to process account management table.
@@ -113,11 +146,57 @@ static const char* selectAccountLastUpdated = "SELECT strftime('%s', lastUpdated
  * SQL statements to process the Pre-key table.
  */
 static const char* dropPreKeys = "DROP TABLE PreKeys;";
-static const char* createPreKeys = "CREATE TABLE PreKeys (keyid INTEGER NOT NULL PRIMARY KEY, preKeyData BLOB, checkData BLOB);";
-static const char* insertPreKey = "INSERT INTO PreKeys (keyId, preKeyData) VALUES (?1, ?2);";
+static const char* createPreKeys = "CREATE TABLE PreKeys (keyid INTEGER NOT NULL PRIMARY KEY, preKeyData BLOB, checkData BLOB, since TIMESTAMP);";
+static const char* insertPreKey = "INSERT INTO PreKeys (keyId, preKeyData, since) VALUES (?1, ?2, strftime('%s', ?3, 'unixepoch'));";
 static const char* selectPreKey = "SELECT preKeyData FROM PreKeys WHERE keyid=?1;";
 static const char* deletePreKey = "DELETE FROM PreKeys WHERE keyId=?1;";
 static const char* selectPreKeyAll = "SELECT keyId, preKeyData FROM PreKeys;";
+static const char* selectPreKeyIds = "SELECT keyId FROM PreKeys;";
+
+// Version 2 adds a timestamp to pre-keys, pre-keys of older versions have a NULL timestamp.
+static const char* addPreKeySince = "ALTER TABLE PreKeys ADD COLUMN since TIMESTAMP;";
+
+/* *****************************************************************************
+ * SQL statements to process the outbox table.
+ */
+static const char* dropOutbox = "DROP TABLE Outbox;";
+static const char* createOutbox =
+    "CREATE TABLE Outbox (id INTEGER PRIMARY KEY, ownName VARCHAR NOT NULL, recipient VARCHAR NOT NULL, "
+    "longDevId VARCHAR NOT NULL, msgId VARCHAR, envelope BLOB, since TIMESTAMP, nextTry TIMESTAMP, tries INTEGER);";
+static const char* insertOutbox =
+    "INSERT INTO Outbox (ownName, recipient, longDevId, msgId, envelope, since, nextTry, tries) "
+    "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8);";
+static const char* selectOutboxDue =
+    "SELECT id, recipient, longDevId, msgId, envelope, since, nextTry, tries FROM Outbox "
+    "WHERE ownName=?1 AND nextTry <= ?2 ORDER BY id;";
+static const char* updateOutbox = "UPDATE Outbox SET nextTry=?1, tries=?2 WHERE id=?3 AND ownName=?4;";
+static const char* removeOutbox = "DELETE FROM Outbox WHERE id=?1 AND ownName=?2;";
+
+// Version 3 adds the outbox
+static const int32_t OUTBOX_VERSION = 3;
+
+/* *****************************************************************************
+ * SQL statements to process the table of received message ids.
+ */
+static const char* dropReceivedIds = "DROP TABLE ReceivedIds;";
+static const char* createReceivedIds =
+    "CREATE TABLE ReceivedIds (ownName VARCHAR NOT NULL, msgKey BLOB NOT NULL, since TIMESTAMP, PRIMARY KEY(ownName, msgKey));";
+static const char* insertReceivedIdSql = "INSERT OR REPLACE INTO ReceivedIds (ownName, msgKey, since) VALUES (?1, ?2, ?3);";
+static const char* selectReceivedId = "SELECT since FROM ReceivedIds WHERE ownName=?1 AND msgKey=?2;";
+static const char* selectReceivedIdsSince = "SELECT msgKey FROM ReceivedIds WHERE ownName=?1 AND since >= ?2 ORDER BY since;";
+static const char* removeReceivedIdsTime = "DELETE FROM ReceivedIds WHERE since < ?1;";
+
+// Version 4 adds the received message ids
+static const int32_t RECEIVED_IDS_VERSION = 4;
+
+/* *****************************************************************************
+ * SQL statements for store maintenance.
+ */
+static const char* setIncrementalVacuum = "PRAGMA auto_vacuum = INCREMENTAL;";
+static const char* selectAutoVacuum = "PRAGMA auto_vacuum;";
+static const char* optimizeSql = "PRAGMA optimize;";
+static const char* analyzeSql = "ANALYZE;";
+static const char* incrementalVacuumSql = "PRAGMA incremental_vacuum(%d);";
 
 
 #ifdef UNITTESTS
@@ -175,60 +254,140 @@ static int32_t setUserVersion(sqlite3* db, int32_t newVersion)
    return rc;
 }
 
-SQLiteStoreConv* SQLiteStoreConv::instance_ = NULL;
+static int32_t execSql(sqlite3* db, const char* statement)
+{
+    sqlite3_stmt *stmt;
+
+    int32_t rc = SQLITE_PREPARE(db, statement, -1, &stmt, NULL);
+    if (rc != SQLITE_OK)
+        return rc;
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE || rc == SQLITE_ROW) ? SQLITE_OK : rc;
+}
+
+// FNV-1a hash of name and device id. The shard layout is persistent, thus the hash
+// must not change between runs, versions or platforms.
+static uint32_t shardIndex(const char* name, int32_t nameLen, const char* devId, int32_t devIdLen, size_t shards)
+{
+    uint32_t hash = 2166136261U;
+
+    for (int32_t i = 0; i < nameLen; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619U;
+    }
+    hash *= 16777619U;          // separator, makes ("ab", "c") and ("a", "bc") different
+    for (int32_t i = 0; i < devIdLen; i++) {
+        hash ^= (uint8_t)devId[i];
+        hash *= 16777619U;
+    }
+    return hash % shards;
+}
+
+// The calling thread's result of its last store call. The threads share the store
+// instance, a shared error code would report the result of another thread's call.
+struct LastResult {
+    const void* store;
+    int32_t sqlCode;
+    char error[DB_CACHE_ERR_BUFF_SIZE];
+};
+static thread_local LastResult lastResult;
 
-SQLiteStoreConv* SQLiteStoreConv::getStore()
+SQLiteStoreConv::SQLiteStoreConv() : db(NULL), keyData_(NULL), numShards_(0), isReady_(false) {}
+
+const char* SQLiteStoreConv::getLastError()
+{
+    return (lastResult.store == this) ? lastResult.error : "";
+}
+
+int32_t SQLiteStoreConv::getSqlCode() const
 {
-    if (instance_ == NULL)
-        instance_ = new SQLiteStoreConv();
-    return instance_;
+    return (lastResult.store == this) ? lastResult.sqlCode : SQLITE_OK;
 }
 
-SQLiteStoreConv::SQLiteStoreConv() : db(NULL), keyData_(NULL), isReady_(false) {}
+int32_t SQLiteStoreConv::getStoreCode() const
+{
+    int32_t code = getSqlCode();
+    return SQL_FAIL(code) ? code : STORE_OK;
+}
+
+void SQLiteStoreConv::setLastError(int32_t code, sqlite3* db, int32_t line) const
+{
+    lastResult.store = this;
+    lastResult.sqlCode = code;
+    snprintf(lastResult.error, (size_t)DB_CACHE_ERR_BUFF_SIZE,
+             "SQLite3 error: %s, line: %d, error message: %s\n", __FILE__, line, sqlite3_errmsg(db));
+}
+
+void SQLiteStoreConv::clearLastError() const
+{
+    lastResult.store = this;
+    lastResult.sqlCode = SQLITE_OK;
+    lastResult.error[0] = '\0';
+}
 
 SQLiteStoreConv::~SQLiteStoreConv()
 {
+    for (size_t i = 0; i < shards_.size(); i++)
+        sqlite3_close(shards_[i]);
+    shards_.clear();
     sqlite3_close(db);
     db = NULL;
     delete keyData_; keyData_ = NULL;
 }
 
+sqlite3* SQLiteStoreConv::convDb(const string& name, const char* devId, int32_t devIdLen) const
+{
+    if (shards_.empty())
+        return db;
+    return shards_[shardIndex(name.data(), name.size(), devId, devIdLen, shards_.size())];
+}
+
+vector<sqlite3*> SQLiteStoreConv::convDbs() const
+{
+    if (shards_.empty())
+        return vector<sqlite3*>(1, db);
+    return shards_;
+}
+
 int SQLiteStoreConv::beginTransaction()
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
 
     SQLITE_CHK(SQLITE_PREPARE(db, beginTransactionSql, -1, &stmt, NULL));
 
-    sqlCode_ = sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    if (sqlCode_ != SQLITE_DONE) {
+    if (rc != SQLITE_DONE) {
         ERRMSG;
-        return sqlCode_;
+        return rc;
     }
     return SQLITE_OK;
 
  cleanup:
     sqlite3_finalize(stmt);
-    return sqlCode_;
+    return rc;
 }
 
 int SQLiteStoreConv::commitTransaction()
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
 
     SQLITE_CHK(SQLITE_PREPARE(db, commitTransactionSql, -1, &stmt, NULL));
 
-    sqlCode_ = sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    if (sqlCode_ != SQLITE_DONE) {
+    if (rc != SQLITE_DONE) {
         ERRMSG;
-        return sqlCode_;
+        return rc;
     }
     return SQLITE_OK;
 
  cleanup:
     sqlite3_finalize(stmt);
-    return sqlCode_;
+    return rc;
 }
 
 /*
@@ -244,6 +403,9 @@ int SQLiteStoreConv::commitTransaction()
  */
 int SQLiteStoreConv::openStore(const std::string& name)
 {
+    int32_t rc;
+
+    clearLastError();
     if (keyData_ == NULL) {
         return -1;
     }
@@ -252,14 +414,25 @@ int SQLiteStoreConv::openStore(const std::string& name)
 
     // If name has size 0 then open im-memory DB, handy for testing
     const char *dbName = name.size() == 0 ? ":memory:" : name.c_str();
-    sqlCode_ = sqlite3_open_v2(dbName, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL);
+    rc = sqlite3_open_v2(dbName, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL);
 
-    if (sqlCode_) {
+    if (rc) {
         ERRMSG;
-        return(sqlCode_);
+        return(rc);
     }
     sqlite3_key(db, keyData_->data(), keyData_->size());
 
+    // Open the shards while the key data is still available
+    for (int32_t i = 0; numShards_ > 1 && i < numShards_; i++) {
+        sqlite3* shard = NULL;
+        if ((rc = openShard(name, i, &shard)) != SQLITE_OK) {
+            sqlite3_close(shard);
+            memset_volatile((void*)keyData_->data(), 0, keyData_->size());
+            delete keyData_; keyData_ = NULL;
+            return rc;
+        }
+        shards_.push_back(shard);
+    }
     memset_volatile((void*)keyData_->data(), 0, keyData_->size());
     delete keyData_; keyData_ = NULL;
 
@@ -273,8 +446,14 @@ int SQLiteStoreConv::openStore(const std::string& name)
         commitTransaction();
     }
     else {
-        if (createTables() != SQLITE_OK)
-            return sqlCode_;
+        // auto_vacuum mode must be set before the first table exists, required for
+        // incremental vacuum during store maintenance
+        rc = SQLITE_PREPARE(db, setIncrementalVacuum, -1, &stmt, NULL);
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+
+        if ((rc = createTables()) != SQLITE_OK)
+            return rc;
     }
 
     setUserVersion(db, DB_VERSION);
@@ -284,63 +463,149 @@ int SQLiteStoreConv::openStore(const std::string& name)
 
  cleanup:
     sqlite3_finalize(stmt);
-    return sqlCode_;
+    return rc;
+}
+
+int32_t SQLiteStoreConv::openShard(const string& name, int32_t index, sqlite3** shard)
+{
+    sqlite3_stmt *stmt;
+    int32_t rc;
+    sqlite3* db;
+
+    // Shards of an in-memory DB are in-memory DBs as well
+    char suffix[20];
+    snprintf(suffix, sizeof(suffix), ".shard%d", index);
+    string shardName = name.empty() ? string(":memory:") : name + suffix;
+
+    rc = sqlite3_open_v2(shardName.c_str(), shard, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL);
+    db = *shard;
+    if (rc) {
+        ERRMSG;
+        return rc;
+    }
+    sqlite3_key(db, keyData_->data(), keyData_->size());
+
+    SQLITE_CHK(SQLITE_PREPARE(db, lookupConvTable, -1, &stmt, NULL));
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_ROW) {
+        execSql(db, setIncrementalVacuum);
+        return createConvTables(db);
+    }
+    return SQLITE_OK;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+int32_t SQLiteStoreConv::createConvTables(sqlite3* db)
+{
+    sqlite3_stmt* stmt;
+    int32_t rc;
+
+    rc = SQLITE_PREPARE(db, dropConversations, -1, &stmt, NULL);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    SQLITE_CHK(SQLITE_PREPARE(db, createConversations, -1, &stmt, NULL));
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        ERRMSG;
+        goto cleanup;
+    }
+    sqlite3_finalize(stmt);
+
+    rc = SQLITE_PREPARE(db, dropStagedMk, -1, &stmt, NULL);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    SQLITE_CHK(SQLITE_PREPARE(db, createStagedMk, -1, &stmt, NULL));
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        ERRMSG;
+        goto cleanup;
+    }
+    sqlite3_finalize(stmt);
+    return SQLITE_OK;
+
+ cleanup:
+    sqlite3_finalize(stmt);
+    return rc;
 }
 
+int32_t SQLiteStoreConv::resetStore()
+{
+    int32_t rc;
+
+    clearLastError();
+    if ((rc = createTables()) != SQLITE_OK)
+        return rc;
+
+    for (size_t i = 0; i < shards_.size(); i++) {
+        if ((rc = createConvTables(shards_[i])) != SQLITE_OK)
+            return rc;
+    }
+    return SQLITE_OK;
+}
 
 int SQLiteStoreConv::createTables()
 {
     sqlite3_stmt* stmt;
+    int32_t rc;
 
     /* First drop them, just to be on the save side
      * Ignore errors, there is nothing to drop on empty DB. If ZrtpIdOwn was
      * deleted using DB admin command then we need to drop the remote id table
      * and names also to have a clean state.
      */
+    if ((rc = createConvTables(db)) != SQLITE_OK)
+        return rc;
 
-    sqlCode_ = SQLITE_PREPARE(db, dropConversations, -1, &stmt, NULL);
-    sqlCode_ = sqlite3_step(stmt);
+    rc = SQLITE_PREPARE(db, dropAccounts, -1, &stmt, NULL);
+    rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
 
-    SQLITE_CHK(SQLITE_PREPARE(db, createConversations, -1, &stmt, NULL));
-    sqlCode_ = sqlite3_step(stmt);
-    if (sqlCode_ != SQLITE_DONE) {
+    SQLITE_CHK(SQLITE_PREPARE(db, createAccounts, -1, &stmt, NULL));
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
         ERRMSG;
         goto cleanup;
     }
     sqlite3_finalize(stmt);
 
-    sqlCode_ = SQLITE_PREPARE(db, dropStagedMk, -1, &stmt, NULL);
-    sqlCode_ = sqlite3_step(stmt);
+    rc = SQLITE_PREPARE(db, dropPreKeys, -1, &stmt, NULL);
+    rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
 
-    SQLITE_CHK(SQLITE_PREPARE(db, createStagedMk, -1, &stmt, NULL));
-    sqlCode_ = sqlite3_step(stmt);
-    if (sqlCode_ != SQLITE_DONE) {
+    SQLITE_CHK(SQLITE_PREPARE(db, createPreKeys, -1, &stmt, NULL));
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
         ERRMSG;
         goto cleanup;
     }
     sqlite3_finalize(stmt);
 
-    sqlCode_ = SQLITE_PREPARE(db, dropAccounts, -1, &stmt, NULL);
-    sqlCode_ = sqlite3_step(stmt);
+    rc = SQLITE_PREPARE(db, dropOutbox, -1, &stmt, NULL);
+    rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
 
-    SQLITE_CHK(SQLITE_PREPARE(db, createAccounts, -1, &stmt, NULL));
-    sqlCode_ = sqlite3_step(stmt);
-    if (sqlCode_ != SQLITE_DONE) {
+    SQLITE_CHK(SQLITE_PREPARE(db, createOutbox, -1, &stmt, NULL));
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
         ERRMSG;
         goto cleanup;
     }
     sqlite3_finalize(stmt);
 
-    sqlCode_ = SQLITE_PREPARE(db, dropPreKeys, -1, &stmt, NULL);
-    sqlCode_ = sqlite3_step(stmt);
+    rc = SQLITE_PREPARE(db, dropReceivedIds, -1, &stmt, NULL);
+    rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
 
-    SQLITE_CHK(SQLITE_PREPARE(db, createPreKeys, -1, &stmt, NULL));
-    sqlCode_ = sqlite3_step(stmt);
-    if (sqlCode_ != SQLITE_DONE) {
+    SQLITE_CHK(SQLITE_PREPARE(db, createReceivedIds, -1, &stmt, NULL));
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
         ERRMSG;
         goto cleanup;
     }
@@ -349,10 +614,55 @@ int SQLiteStoreConv::createTables()
 
  cleanup:
     sqlite3_finalize(stmt);
-    return sqlCode_;
+    return rc;
 }
 
 
+int32_t SQLiteStoreConv::updateDb(int32_t oldVersion, int32_t newVersion)
+{
+    sqlite3_stmt* stmt;
+    int32_t rc;
+
+    if (oldVersion == newVersion)
+        return SQLITE_OK;
+
+    // Version 1 -> 2: add timestamp to pre-keys
+    if (oldVersion < 2) {
+        SQLITE_CHK(SQLITE_PREPARE(db, addPreKeySince, -1, &stmt, NULL));
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_DONE) {
+            ERRMSG;
+            goto cleanup;
+        }
+        sqlite3_finalize(stmt);
+    }
+    // Version 2 -> 3: add the outbox
+    if (oldVersion < OUTBOX_VERSION) {
+        SQLITE_CHK(SQLITE_PREPARE(db, createOutbox, -1, &stmt, NULL));
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_DONE) {
+            ERRMSG;
+            goto cleanup;
+        }
+        sqlite3_finalize(stmt);
+    }
+    // Version 3 -> 4: add the received message ids
+    if (oldVersion < RECEIVED_IDS_VERSION) {
+        SQLITE_CHK(SQLITE_PREPARE(db, createReceivedIds, -1, &stmt, NULL));
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_DONE) {
+            ERRMSG;
+            goto cleanup;
+        }
+        sqlite3_finalize(stmt);
+    }
+    return SQLITE_OK;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
 // If the result is a BLOB or UTF-8 string then the sqlite3_column_bytes() routine returns the number of bytes in that BLOB or string.
 const static char* dummyId = "__DUMMY__";
 
@@ -360,52 +670,80 @@ const static char* dummyId = "__DUMMY__";
 std::list<std::string>* SQLiteStoreConv::getKnownConversations(const std::string& ownName)
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
     int32_t nameLen;
+    vector<sqlite3*> dbs = convDbs();
 
     std::list<std::string>* names = new std::list<std::string>;
 
-    // selectConvNames = "SELECT name FROM Conversations WHERE ownName=?1 ORDER BY name;";
-    SQLITE_CHK(SQLITE_PREPARE(db, selectConvNames, -1, &stmt, NULL));
-    SQLITE_CHK(sqlite3_bind_text(stmt, 1, ownName.data(), ownName.size(), SQLITE_STATIC));
+    clearLastError();
+    for (size_t i = 0; i < dbs.size(); i++) {
+        sqlite3* db = dbs[i];
 
-    while ((sqlCode_ = sqlite3_step(stmt)) == SQLITE_ROW) {
-        nameLen = sqlite3_column_bytes(stmt, 0);
-        std::string name((const char*)sqlite3_column_text(stmt, 0), nameLen);
-        names->push_back(name);
+        // selectConvNames = "SELECT name FROM Conversations WHERE ownName=?1 ORDER BY name;";
+        SQLITE_CHK(SQLITE_PREPARE(db, selectConvNames, -1, &stmt, NULL));
+        SQLITE_CHK(sqlite3_bind_text(stmt, 1, ownName.data(), ownName.size(), SQLITE_STATIC));
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            nameLen = sqlite3_column_bytes(stmt, 0);
+            std::string name((const char*)sqlite3_column_text(stmt, 0), nameLen);
+            names->push_back(name);
+        }
+        if (rc != SQLITE_DONE)
+            ERRMSG;
+        sqlite3_finalize(stmt);
+    }
+    // A name may have devices in several shards
+    if (dbs.size() > 1) {
+        names->sort();
+        names->unique();
     }
-    sqlite3_finalize(stmt);
     return names;
 
 cleanup:
     sqlite3_finalize(stmt);
+    delete names;
     return NULL;
 }
 
 std::list<std::string>* SQLiteStoreConv::getLongDeviceIds(const std::string& name, const std::string& ownName)
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
     int32_t idLen;
     std::string* id;
 
+    vector<sqlite3*> dbs = convDbs();
+
     std::list<std::string>* devIds = new std::list<std::string>;
 
-    // selectConvDevices = "SELECT longDevId FROM Conversations WHERE name=?1 AND ownName=?2;";
-    SQLITE_CHK(SQLITE_PREPARE(db, selectConvDevices, -1, &stmt, NULL));
-    SQLITE_CHK(sqlite3_bind_text(stmt, 1, name.data(), name.size(), SQLITE_STATIC));
-    SQLITE_CHK(sqlite3_bind_text(stmt, 2, ownName.data(), ownName.size(), SQLITE_STATIC));
+    clearLastError();
 
-    while ((sqlCode_ = sqlite3_step(stmt)) == SQLITE_ROW) {
-        idLen = sqlite3_column_bytes(stmt, 0);
-        string id((const char*)sqlite3_column_text(stmt, 0), idLen);
-        if (id.compare(0, id.size(), dummyId, id.size()) == 0)
-            continue;
-        devIds->push_back(id);
+    // The devices of a name are spread across the shards
+    for (size_t i = 0; i < dbs.size(); i++) {
+        sqlite3* db = dbs[i];
+
+        // selectConvDevices = "SELECT longDevId FROM Conversations WHERE name=?1 AND ownName=?2;";
+        SQLITE_CHK(SQLITE_PREPARE(db, selectConvDevices, -1, &stmt, NULL));
+        SQLITE_CHK(sqlite3_bind_text(stmt, 1, name.data(), name.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_text(stmt, 2, ownName.data(), ownName.size(), SQLITE_STATIC));
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            idLen = sqlite3_column_bytes(stmt, 0);
+            string id((const char*)sqlite3_column_text(stmt, 0), idLen);
+            if (id.compare(dummyId) == 0)
+                continue;
+            devIds->push_back(id);
+        }
+        if (rc != SQLITE_DONE)
+            ERRMSG;
+        sqlite3_finalize(stmt);
     }
-    sqlite3_finalize(stmt);
     return devIds;
 
 cleanup:
     sqlite3_finalize(stmt);
+    delete devIds;
     return NULL;
 }
 
@@ -414,11 +752,14 @@ cleanup:
 std::string* SQLiteStoreConv::loadConversation(const std::string& name, const std::string& longDevId, const std::string& ownName) const 
 { 
     sqlite3_stmt *stmt;
+    int32_t rc;
     int32_t len;
     string* data;
 
     const char* devId;
     int32_t devIdLen;
+
+    clearLastError();
     if (longDevId.size() > 0) {
         devId = longDevId.c_str();
         devIdLen = longDevId.size();
@@ -427,6 +768,7 @@ std::string* SQLiteStoreConv::loadConversation(const std::string& name, const st
         devId = dummyId;
         devIdLen = strlen(dummyId);
     }
+    sqlite3* db = convDb(name, devId, devIdLen);
 
     // selectConversation = "SELECT sessionData FROM Conversations WHERE name=?1 AND longDevId=?2 AND ownName=?3;";
     SQLITE_CHK(SQLITE_PREPARE(db, selectConversation, -1, &stmt, NULL));
@@ -434,9 +776,9 @@ std::string* SQLiteStoreConv::loadConversation(const std::string& name, const st
     SQLITE_CHK(sqlite3_bind_text(stmt, 2, devId, devIdLen, SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_text(stmt, 3, ownName.data(), ownName.size(), SQLITE_STATIC));
 
-    sqlCode_= sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     ERRMSG;
-    if (sqlCode_ != SQLITE_ROW) {        // No such session, return an empty session record
+    if (rc != SQLITE_ROW) {        // No such session, return an empty session record
         sqlite3_finalize(stmt);
         return NULL;
     }
@@ -456,9 +798,12 @@ cleanup:
 void SQLiteStoreConv::storeConversation(const std::string& name, const std::string& longDevId, const std::string& ownName, const std::string& data)
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
 
     const char* devId;
     int32_t devIdLen;
+
+    clearLastError();
     if (longDevId.size() > 0) {
         devId = longDevId.c_str();
         devIdLen = longDevId.size();
@@ -467,13 +812,14 @@ void SQLiteStoreConv::storeConversation(const std::string& name, const std::stri
         devId = dummyId;
         devIdLen = strlen(dummyId);
     }
+    sqlite3* db = convDb(name, devId, devIdLen);
     // updateConversation = "UPDATE Conversations SET data=?1, WHERE name=?2 AND longDevId=?3 AND ownName=?4;";
     SQLITE_CHK(SQLITE_PREPARE(db, updateConversation, -1, &stmt, NULL));
     SQLITE_CHK(sqlite3_bind_blob(stmt, 1, data.data(), data.size(), SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_text(stmt, 2, name.data(), name.size(), SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_text(stmt, 3, devId, devIdLen, SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_text(stmt, 4, ownName.data(), ownName.size(), SQLITE_STATIC));
-    sqlCode_= sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     ERRMSG;
     sqlite3_finalize(stmt);
 
@@ -484,19 +830,120 @@ void SQLiteStoreConv::storeConversation(const std::string& name, const std::stri
     SQLITE_CHK(sqlite3_bind_text(stmt, 3, devId, devIdLen, SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_blob(stmt, 4, data.data(), data.size(), SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_text(stmt, 5, ownName.data(), ownName.size(), SQLITE_STATIC));
-    sqlCode_= sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     ERRMSG;
 
 cleanup:
     sqlite3_finalize(stmt);
 }
 
+int32_t SQLiteStoreConv::storeConversations(const string& name, const string& ownName, const list<pair<string, string> >& conversations)
+{
+    // Group the conversations by the database that holds them, keep the order of
+    // the databases stable
+    vector<sqlite3*> dbs;
+    vector<vector<const pair<string, string>* > > groups;
+
+    clearLastError();
+    for (list<pair<string, string> >::const_iterator it = conversations.begin(); it != conversations.end(); ++it) {
+        const string& longDevId = it->first;
+        const char* devId = longDevId.size() > 0 ? longDevId.c_str() : dummyId;
+        sqlite3* convDatabase = convDb(name, devId, strlen(devId));
+
+        size_t i;
+        for (i = 0; i < dbs.size() && dbs[i] != convDatabase; i++)
+            ;
+        if (i == dbs.size()) {
+            dbs.push_back(convDatabase);
+            groups.push_back(vector<const pair<string, string>* >());
+        }
+        groups[i].push_back(&(*it));
+    }
+    for (size_t i = 0; i < dbs.size(); i++) {
+        int32_t result = storeConversationsDb(dbs[i], name, ownName, groups[i]);
+        if (result != SQLITE_OK)
+            return result;
+    }
+    return SQLITE_OK;
+}
+
+int32_t SQLiteStoreConv::storeConversationsDb(sqlite3* db, const string& name, const string& ownName,
+                                              const vector<const pair<string, string>* >& conversations)
+{
+    sqlite3_stmt *update = NULL;
+    sqlite3_stmt *insert = NULL;
+    int32_t rc;
+
+    // The connection is shared by all threads. Other threads must not run statements
+    // on it while the transaction is open, the mutex is recursive.
+    sqlite3_mutex* connection = sqlite3_db_mutex(db);
+    sqlite3_mutex_enter(connection);
+
+    if ((rc = execSql(db, beginTransactionSql)) != SQLITE_OK) {
+        ERRMSG;
+        sqlite3_mutex_leave(connection);
+        return rc;
+    }
+    // updateConversation = "UPDATE Conversations SET data=?1, WHERE name=?2 AND longDevId=?3 AND ownName=?4;";
+    SQLITE_CHK(SQLITE_PREPARE(db, updateConversation, -1, &update, NULL));
+    // insertConversation = "INSERT OR IGNORE INTO Conversations (name, secondName, longDevId, data, ownName) VALUES (?1, ?2, ?3, ?4, ?5);";
+    SQLITE_CHK(SQLITE_PREPARE(db, insertConversation, -1, &insert, NULL));
+
+    for (size_t i = 0; i < conversations.size(); i++) {
+        const string& longDevId = conversations[i]->first;
+        const string& data = conversations[i]->second;
+        const char* devId = longDevId.size() > 0 ? longDevId.c_str() : dummyId;
+        int32_t devIdLen = strlen(devId);
+
+        SQLITE_CHK(sqlite3_bind_blob(update, 1, data.data(), data.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_text(update, 2, name.data(), name.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_text(update, 3, devId, devIdLen, SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_text(update, 4, ownName.data(), ownName.size(), SQLITE_STATIC));
+        rc = sqlite3_step(update);
+        sqlite3_reset(update);
+        if (rc != SQLITE_DONE) {
+            ERRMSG;
+            goto cleanup;
+        }
+
+        SQLITE_CHK(sqlite3_bind_text(insert, 1, name.data(), name.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_null(insert, 2));
+        SQLITE_CHK(sqlite3_bind_text(insert, 3, devId, devIdLen, SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_blob(insert, 4, data.data(), data.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_text(insert, 5, ownName.data(), ownName.size(), SQLITE_STATIC));
+        rc = sqlite3_step(insert);
+        sqlite3_reset(insert);
+        if (rc != SQLITE_DONE) {
+            ERRMSG;
+            goto cleanup;
+        }
+    }
+    sqlite3_finalize(update);
+    sqlite3_finalize(insert);
+    if ((rc = execSql(db, commitTransactionSql)) != SQLITE_OK) {
+        ERRMSG;
+        execSql(db, rollbackTransactionSql);
+    }
+    sqlite3_mutex_leave(connection);
+    return rc;
+
+cleanup:
+    sqlite3_finalize(update);
+    sqlite3_finalize(insert);
+    execSql(db, rollbackTransactionSql);
+    sqlite3_mutex_leave(connection);
+    return rc;
+}
+
 bool SQLiteStoreConv::hasConversation(const std::string& name, const std::string& longDevId, const std::string& ownName) const 
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
 
     const char* devId;
     int32_t devIdLen;
+
+    clearLastError();
     if (longDevId.size() > 0) {
         devId = longDevId.c_str();
         devIdLen = longDevId.size();
@@ -505,28 +952,88 @@ bool SQLiteStoreConv::hasConversation(const std::string& name, const std::string
         devId = dummyId;
         devIdLen = strlen(dummyId);
     }
+    sqlite3* db = convDb(name, devId, devIdLen);
     // selectConversation = "SELECT iv, data FROM Conversations WHERE name=?1 AND longDevId=?2 AND ownName=?3;";
     SQLITE_CHK(SQLITE_PREPARE(db, selectConversation, -1, &stmt, NULL));
     SQLITE_CHK(sqlite3_bind_text(stmt, 1, name.data(), name.size(), SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_text(stmt, 2, devId, devIdLen, SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_text(stmt, 3, ownName.data(), ownName.size(), SQLITE_STATIC));
 
-    sqlCode_= sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     ERRMSG;
     sqlite3_finalize(stmt);
-    return sqlCode_ == SQLITE_ROW; 
+    return rc == SQLITE_ROW; 
 
 cleanup:
     sqlite3_finalize(stmt);
     return false;
 }
 
+// A conversation without device id, the local conversation, is stored with the dummy id
+static DataSpan storedDevId(const DataSpan& longDevId)
+{
+    if (longDevId.size > 0)
+        return longDevId;
+    return DataSpan((const uint8_t*)dummyId, strlen(dummyId));
+}
+
+int32_t SQLiteStoreConv::hasConversations(const string& name, const vector<DataSpan>& longDevIds, const string& ownName,
+                                          vector<bool>* known) const
+{
+    sqlite3_stmt *stmt = NULL;
+    int32_t rc;
+
+    clearLastError();
+    known->assign(longDevIds.size(), false);
+
+    // Query only the databases that hold one of the devices
+    vector<sqlite3*> dbs;
+    for (size_t i = 0; i < longDevIds.size(); i++) {
+        DataSpan devId = storedDevId(longDevIds[i]);
+        sqlite3* devDb = convDb(name, (const char*)devId.data, devId.size);
+        if (find(dbs.begin(), dbs.end(), devDb) == dbs.end())
+            dbs.push_back(devDb);
+    }
+    for (size_t i = 0; i < dbs.size(); i++) {
+        sqlite3* db = dbs[i];
+
+        // selectConvDevices = "SELECT longDevId FROM Conversations WHERE name=?1 AND ownName=?2;";
+        SQLITE_CHK(SQLITE_PREPARE(db, selectConvDevices, -1, &stmt, NULL));
+        SQLITE_CHK(sqlite3_bind_text(stmt, 1, name.data(), name.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_text(stmt, 2, ownName.data(), ownName.size(), SQLITE_STATIC));
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const void* id = sqlite3_column_text(stmt, 0);
+            size_t idLen = (size_t)sqlite3_column_bytes(stmt, 0);
+            for (size_t k = 0; k < longDevIds.size(); k++) {
+                DataSpan devId = storedDevId(longDevIds[k]);
+                if (devId.size == idLen && memcmp(devId.data, id, idLen) == 0)
+                    (*known)[k] = true;
+            }
+        }
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+        if (rc != SQLITE_DONE) {
+            ERRMSG;
+            return rc;
+        }
+    }
+    return SQLITE_OK;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
 void SQLiteStoreConv::deleteConversation(const std::string& name, const std::string& longDevId, const std::string& ownName)
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
 
     const char* devId;
     int32_t devIdLen;
+
+    clearLastError();
     if (longDevId.size() > 0) {
         devId = longDevId.c_str();
         devIdLen = longDevId.size();
@@ -535,13 +1042,14 @@ void SQLiteStoreConv::deleteConversation(const std::string& name, const std::str
         devId = dummyId;
         devIdLen = strlen(dummyId);
     }
+    sqlite3* db = convDb(name, devId, devIdLen);
     //removeConversation = "DELETE FROM Conversations WHERE name=?1 AND longDevId=?2 AND ownName=?3;";
     SQLITE_CHK(SQLITE_PREPARE(db, removeConversation, -1, &stmt, NULL));
     SQLITE_CHK(sqlite3_bind_text(stmt, 1, name.data(), name.size(), SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_text(stmt, 2, devId, devIdLen, SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_text(stmt, 3, ownName.data(), ownName.size(), SQLITE_STATIC));
 
-    sqlCode_= sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     ERRMSG;
 
 cleanup:
@@ -551,14 +1059,23 @@ cleanup:
 void SQLiteStoreConv::deleteConversationsName(const std::string& name, const std::string& ownName)
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
+    vector<sqlite3*> dbs = convDbs();
 
-    // removeConversations = "DELETE FROM Conversations WHERE name=?1 AND ownName=?2;";
-    SQLITE_CHK(SQLITE_PREPARE(db, removeConversations, -1, &stmt, NULL));
-    SQLITE_CHK(sqlite3_bind_text(stmt, 1, name.data(), name.size(), SQLITE_STATIC));
-    SQLITE_CHK(sqlite3_bind_text(stmt, 2, ownName.data(), ownName.size(), SQLITE_STATIC));
+    clearLastError();
+    for (size_t i = 0; i < dbs.size(); i++) {
+        sqlite3* db = dbs[i];
 
-    sqlCode_= sqlite3_step(stmt);
-    ERRMSG;
+        // removeConversations = "DELETE FROM Conversations WHERE name=?1 AND ownName=?2;";
+        SQLITE_CHK(SQLITE_PREPARE(db, removeConversations, -1, &stmt, NULL));
+        SQLITE_CHK(sqlite3_bind_text(stmt, 1, name.data(), name.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_text(stmt, 2, ownName.data(), ownName.size(), SQLITE_STATIC));
+
+        rc = sqlite3_step(stmt);
+        ERRMSG;
+        sqlite3_finalize(stmt);
+    }
+    return;
 
 cleanup:
     sqlite3_finalize(stmt);
@@ -567,11 +1084,14 @@ cleanup:
 list<string>* SQLiteStoreConv::loadStagedMks(const string& name, const string& longDevId, const string& ownName) const
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
     int32_t len;
     list<string>* keys = new list<string>;
 
     const char* devId;
     int32_t devIdLen;
+
+    clearLastError();
     if (longDevId.size() > 0) {
         devId = longDevId.c_str();
         devIdLen = longDevId.size();
@@ -580,28 +1100,31 @@ list<string>* SQLiteStoreConv::loadStagedMks(const string& name, const string& l
         devId = dummyId;
         devIdLen = strlen(dummyId);
     }
+    sqlite3* db = convDb(name, devId, devIdLen);
     // selectStagedMks = "SELECT ivkeymk FROM stagedMk WHERE name=?1 AND longDevId=?2 AND ownName=?3;";
     SQLITE_CHK(SQLITE_PREPARE(db, selectStagedMks, -1, &stmt, NULL));
     SQLITE_CHK(sqlite3_bind_text(stmt, 1, name.data(), name.size(), SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_text(stmt, 2, devId, devIdLen, SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_text(stmt, 3, ownName.data(), ownName.size(), SQLITE_STATIC));
 
-    sqlCode_= sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     ERRMSG;
-    if (sqlCode_ != SQLITE_ROW) {        // No stored MKs, return an empty session record
+    if (rc != SQLITE_ROW) {        // No stored MKs, return an empty session record
         sqlite3_finalize(stmt);
         delete keys;
         return NULL;
     }
-    while (sqlCode_ == SQLITE_ROW) {
+    while (rc == SQLITE_ROW) {
         // Get the MK and its iv
         len = sqlite3_column_bytes(stmt, 0);
         string mkivenc((const char*)sqlite3_column_blob(stmt, 0), len);
 
         keys->push_back(mkivenc);
 
-        sqlCode_= sqlite3_step(stmt);
+        rc = sqlite3_step(stmt);
     }
+    if (rc != SQLITE_DONE)
+        ERRMSG;
 
 cleanup:
     sqlite3_finalize(stmt);
@@ -611,9 +1134,12 @@ cleanup:
 void SQLiteStoreConv::insertStagedMk(const string& name, const string& longDevId, const string& ownName, const string& MKiv)
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
 
     const char* devId;
     int32_t devIdLen;
+
+    clearLastError();
     if (longDevId.size() > 0) {
         devId = longDevId.c_str();
         devIdLen = longDevId.size();
@@ -622,6 +1148,7 @@ void SQLiteStoreConv::insertStagedMk(const string& name, const string& longDevId
         devId = dummyId;
         devIdLen = strlen(dummyId);
     }
+    sqlite3* db = convDb(name, devId, devIdLen);
     
 //     insertStagedMkSql = 
 //     "INSERT OR REPLACE INTO stagedMk (name, longDevId, ownName, since, otherkey, ivkeymk, ivkeyhdr) "
@@ -635,7 +1162,7 @@ void SQLiteStoreConv::insertStagedMk(const string& name, const string& longDevId
     SQLITE_CHK(sqlite3_bind_blob(stmt,  6, MKiv.data(), MKiv.size(), SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_null(stmt,  7));
 
-    sqlCode_= sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     ERRMSG;
 
 cleanup:
@@ -645,9 +1172,12 @@ cleanup:
 void SQLiteStoreConv::deleteStagedMk(const string& name, const string& longDevId, const string& ownName, string& MKiv)
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
 
     const char* devId;
     int32_t devIdLen;
+
+    clearLastError();
     if (longDevId.size() > 0) {
         devId = longDevId.c_str();
         devIdLen = longDevId.size();
@@ -656,6 +1186,7 @@ void SQLiteStoreConv::deleteStagedMk(const string& name, const string& longDevId
         devId = dummyId;
         devIdLen = strlen(dummyId);
     }
+    sqlite3* db = convDb(name, devId, devIdLen);
     // removeStagedMk = "DELETE FROM stagedMk WHERE name=?1 AND longDevId=?2 AND ownName=?3 AND ivkeymk=?4;";
     SQLITE_CHK(SQLITE_PREPARE(db, removeStagedMk, -1, &stmt, NULL));
     SQLITE_CHK(sqlite3_bind_text(stmt, 1, name.data(), name.size(), SQLITE_STATIC));
@@ -663,46 +1194,63 @@ void SQLiteStoreConv::deleteStagedMk(const string& name, const string& longDevId
     SQLITE_CHK(sqlite3_bind_text(stmt, 3, ownName.data(), ownName.size(), SQLITE_STATIC));
     SQLITE_CHK(sqlite3_bind_blob(stmt, 4, MKiv.data(), MKiv.size(), SQLITE_STATIC));
 
-    sqlCode_= sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     ERRMSG;
 
 cleanup:
     sqlite3_finalize(stmt);
 }
 
-void SQLiteStoreConv::deleteStagedMk(time_t timestamp)
+int32_t SQLiteStoreConv::deleteStagedMk(time_t timestamp)
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
     int32_t cleaned;
-    // removeStagedMkTime = "DELETE FROM stagedMk WHERE since < ?1;";
-    SQLITE_CHK(SQLITE_PREPARE(db, removeStagedMkTime, -1, &stmt, NULL));
-    SQLITE_CHK(sqlite3_bind_int64(stmt, 1, timestamp));
-
-    sqlCode_= sqlite3_step(stmt);
-//    cleaned = sqlite3_changes(db);
-//    Log("Number of removed old MK: %d", cleaned);
-    ERRMSG;
+    vector<sqlite3*> dbs = convDbs();
+
+    clearLastError();
+    for (size_t i = 0; i < dbs.size(); i++) {
+        sqlite3* db = dbs[i];
+
+        // removeStagedMkTime = "DELETE FROM stagedMk WHERE since < ?1;";
+        SQLITE_CHK(SQLITE_PREPARE(db, removeStagedMkTime, -1, &stmt, NULL));
+        SQLITE_CHK(sqlite3_bind_int64(stmt, 1, timestamp));
+
+        rc = sqlite3_step(stmt);
+//        cleaned = sqlite3_changes(db);
+//        Log("Number of removed old MK: %d", cleaned);
+        if (rc != SQLITE_DONE) {
+            ERRMSG;
+            goto cleanup;
+        }
+        sqlite3_finalize(stmt);
+    }
+    return SQLITE_OK;
 
 cleanup:
     sqlite3_finalize(stmt);
+    return rc;
 }
 
 // ******** PreKey store
 string* SQLiteStoreConv::loadPreKey(int32_t preKeyId) const 
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
     int32_t len;
     string* preKeyData;
 
+    clearLastError();
+
     // selectPreKey = "SELECT preKeyData FROM PreKeys WHERE keyid=?1;";
 
     // SELECT iv, preKeyData FROM PreKeys WHERE keyid=?1 ;
     SQLITE_CHK(SQLITE_PREPARE(db, selectPreKey, strlen(selectPreKey)+1, &stmt, NULL));
     SQLITE_CHK(sqlite3_bind_int(stmt, 1, preKeyId));
 
-    sqlCode_= sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     ERRMSG;
-    if (sqlCode_ != SQLITE_ROW) {        // No such pre key
+    if (rc != SQLITE_ROW) {        // No such pre key
         sqlite3_finalize(stmt);
         return NULL;
     }
@@ -721,32 +1269,110 @@ cleanup:
 void SQLiteStoreConv::storePreKey(int32_t preKeyId, const string& data)
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
+
+    clearLastError();
 
-    // insertPreKey = "INSERT INTO PreKeys (keyId, preKeyData) VALUES (?1, ?2);";
+    // insertPreKey = "INSERT INTO PreKeys (keyId, preKeyData, since) VALUES (?1, ?2, strftime('%s', ?3, 'unixepoch'));";
     SQLITE_CHK(SQLITE_PREPARE(db, insertPreKey, strlen(insertPreKey)+1, &stmt, NULL));
     SQLITE_CHK(sqlite3_bind_int(stmt, 1, preKeyId));
     SQLITE_CHK(sqlite3_bind_blob(stmt, 2, data.data(), data.size(), SQLITE_STATIC));
+    SQLITE_CHK(sqlite3_bind_int64(stmt, 3, time(0)));
 
-    sqlCode_ = sqlite3_step(stmt);
-    if (sqlCode_ != SQLITE_DONE)
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE)
         ERRMSG;
 
 cleanup:
     sqlite3_finalize(stmt);
 }
 
+int32_t SQLiteStoreConv::storePreKeys(const list<pair<int32_t, string> >& preKeys)
+{
+    sqlite3_stmt *stmt = NULL;
+    int32_t rc;
+    time_t now = time(0);
+
+    clearLastError();
+
+    // Other threads must not run statements on the connection while the transaction is open
+    sqlite3_mutex* connection = sqlite3_db_mutex(db);
+    sqlite3_mutex_enter(connection);
+
+    if ((rc = execSql(db, beginTransactionSql)) != SQLITE_OK) {
+        ERRMSG;
+        sqlite3_mutex_leave(connection);
+        return rc;
+    }
+    // insertPreKey = "INSERT INTO PreKeys (keyId, preKeyData, since) VALUES (?1, ?2, strftime('%s', ?3, 'unixepoch'));";
+    SQLITE_CHK(SQLITE_PREPARE(db, insertPreKey, -1, &stmt, NULL));
+    for (list<pair<int32_t, string> >::const_iterator it = preKeys.begin(); it != preKeys.end(); ++it) {
+        SQLITE_CHK(sqlite3_bind_int(stmt, 1, it->first));
+        SQLITE_CHK(sqlite3_bind_blob(stmt, 2, it->second.data(), it->second.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_int64(stmt, 3, now));
+
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE) {
+            ERRMSG;
+            goto cleanup;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if ((rc = execSql(db, commitTransactionSql)) != SQLITE_OK) {
+        ERRMSG;
+        execSql(db, rollbackTransactionSql);
+    }
+    sqlite3_mutex_leave(connection);
+    return rc;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    execSql(db, rollbackTransactionSql);
+    sqlite3_mutex_leave(connection);
+    return rc;
+}
+
+list<int32_t>* SQLiteStoreConv::getPreKeyIds() const
+{
+    sqlite3_stmt *stmt;
+    int32_t rc;
+    list<int32_t>* ids = new list<int32_t>;
+
+    clearLastError();
+
+    // selectPreKeyIds = "SELECT keyId FROM PreKeys;";
+    SQLITE_CHK(SQLITE_PREPARE(db, selectPreKeyIds, -1, &stmt, NULL));
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        ids->push_back(sqlite3_column_int(stmt, 0));
+    }
+    if (rc != SQLITE_DONE)
+        ERRMSG;
+    sqlite3_finalize(stmt);
+    return ids;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    delete ids;
+    return NULL;
+}
+
 bool SQLiteStoreConv::containsPreKey(int32_t preKeyId) const
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
+
+    clearLastError();
 
     // SELECT preKeyData FROM PreKeys WHERE keyid=?1 ;
     SQLITE_CHK(SQLITE_PREPARE(db, selectPreKey, strlen(selectPreKey)+1, &stmt, NULL));
     SQLITE_CHK(sqlite3_bind_int(stmt, 1, preKeyId));
 
-    sqlCode_= sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     ERRMSG;
     sqlite3_finalize(stmt);
-    return (sqlCode_ == SQLITE_ROW);
+    return (rc == SQLITE_ROW);
 
 cleanup:
     sqlite3_finalize(stmt);
@@ -756,12 +1382,15 @@ cleanup:
 void SQLiteStoreConv::removePreKey(int32_t preKeyId) 
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
+
+    clearLastError();
 
     // DELETE FROM PreKeys WHERE keyId=?1
     SQLITE_CHK(SQLITE_PREPARE(db, deletePreKey, strlen(deletePreKey)+1, &stmt, NULL));
     SQLITE_CHK(sqlite3_bind_int(stmt, 1, preKeyId));
 
-    sqlCode_= sqlite3_step(stmt);
+    rc = sqlite3_step(stmt);
     ERRMSG;
 
 cleanup:
@@ -771,11 +1400,14 @@ cleanup:
 void SQLiteStoreConv::dumpPreKeys() const
 {
     sqlite3_stmt *stmt;
+    int32_t rc;
+
+    clearLastError();
 
     //  selectPreKeyAll = "SELECT keyId, preKeyData FROM PreKeys;";
     SQLITE_CHK(SQLITE_PREPARE(db, selectPreKeyAll, -1, &stmt, NULL));
 
-    while ((sqlCode_ = sqlite3_step(stmt)) == SQLITE_ROW) {
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
         int32_t keyId = sqlite3_column_int(stmt, 0);
     }
 
@@ -784,3 +1416,501 @@ cleanup:
 
 }
 
+// ******** Outbox
+int32_t SQLiteStoreConv::insertOutboxEntries(const string& ownName, list<OutboxEntry>* entries)
+{
+    sqlite3_stmt *stmt = NULL;
+    int32_t rc;
+
+    clearLastError();
+
+    // Hold the connection mutex, last_insert_rowid must return the id of this insert
+    sqlite3_mutex* connection = sqlite3_db_mutex(db);
+    sqlite3_mutex_enter(connection);
+
+    if ((rc = execSql(db, beginTransactionSql)) != SQLITE_OK) {
+        ERRMSG;
+        sqlite3_mutex_leave(connection);
+        return rc;
+    }
+    // insertOutbox = "INSERT INTO Outbox (ownName, recipient, longDevId, msgId, envelope, since, nextTry, tries) VALUES (?1, ...);";
+    SQLITE_CHK(SQLITE_PREPARE(db, insertOutbox, -1, &stmt, NULL));
+    for (list<OutboxEntry>::iterator it = entries->begin(); it != entries->end(); ++it) {
+        SQLITE_CHK(sqlite3_bind_text(stmt, 1, ownName.data(), ownName.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_text(stmt, 2, it->recipient.data(), it->recipient.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_text(stmt, 3, it->longDevId.data(), it->longDevId.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_text(stmt, 4, it->msgId.data(), it->msgId.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_blob(stmt, 5, it->envelope.data(), it->envelope.size(), SQLITE_STATIC));
+        SQLITE_CHK(sqlite3_bind_int64(stmt, 6, it->since));
+        SQLITE_CHK(sqlite3_bind_int64(stmt, 7, it->nextTry));
+        SQLITE_CHK(sqlite3_bind_int(stmt, 8, it->tries));
+
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE) {
+            ERRMSG;
+            goto cleanup;
+        }
+        it->id = sqlite3_last_insert_rowid(db);
+    }
+    sqlite3_finalize(stmt);
+    if ((rc = execSql(db, commitTransactionSql)) != SQLITE_OK) {
+        ERRMSG;
+        execSql(db, rollbackTransactionSql);
+    }
+    sqlite3_mutex_leave(connection);
+    return rc;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    execSql(db, rollbackTransactionSql);
+    sqlite3_mutex_leave(connection);
+    return rc;
+}
+
+list<OutboxEntry>* SQLiteStoreConv::loadOutboxEntries(const string& ownName, time_t dueTime) const
+{
+    sqlite3_stmt *stmt;
+    int32_t rc;
+    list<OutboxEntry>* entries = new list<OutboxEntry>;
+
+    clearLastError();
+
+    // selectOutboxDue = "SELECT id, recipient, longDevId, msgId, envelope, since, nextTry, tries FROM Outbox WHERE ownName=?1 AND nextTry <= ?2 ORDER BY id;";
+    SQLITE_CHK(SQLITE_PREPARE(db, selectOutboxDue, -1, &stmt, NULL));
+    SQLITE_CHK(sqlite3_bind_text(stmt, 1, ownName.data(), ownName.size(), SQLITE_STATIC));
+    SQLITE_CHK(sqlite3_bind_int64(stmt, 2, dueTime));
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        OutboxEntry entry;
+        entry.id = sqlite3_column_int64(stmt, 0);
+        entry.recipient.assign((const char*)sqlite3_column_text(stmt, 1), sqlite3_column_bytes(stmt, 1));
+        entry.longDevId.assign((const char*)sqlite3_column_text(stmt, 2), sqlite3_column_bytes(stmt, 2));
+        if (sqlite3_column_type(stmt, 3) != SQLITE_NULL)
+            entry.msgId.assign((const char*)sqlite3_column_text(stmt, 3), sqlite3_column_bytes(stmt, 3));
+        if (sqlite3_column_type(stmt, 4) != SQLITE_NULL)
+            entry.envelope.assign((const char*)sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4));
+        entry.since = sqlite3_column_int64(stmt, 5);
+        entry.nextTry = sqlite3_column_int64(stmt, 6);
+        entry.tries = sqlite3_column_int(stmt, 7);
+        entries->push_back(entry);
+    }
+    if (rc != SQLITE_DONE) {
+        ERRMSG;
+        goto cleanup;
+    }
+    sqlite3_finalize(stmt);
+    return entries;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    delete entries;
+    return NULL;
+}
+
+int32_t SQLiteStoreConv::updateOutboxEntries(const string& ownName, const list<OutboxEntry>& entries)
+{
+    sqlite3_stmt *stmt = NULL;
+    int32_t rc;
+
+    clearLastError();
+    sqlite3_mutex* connection = sqlite3_db_mutex(db);
+    sqlite3_mutex_enter(connection);
+
+    if ((rc = execSql(db, beginTransactionSql)) != SQLITE_OK) {
+        ERRMSG;
+        sqlite3_mutex_leave(connection);
+        return rc;
+    }
+    // updateOutbox = "UPDATE Outbox SET nextTry=?1, tries=?2 WHERE id=?3 AND ownName=?4;";
+    SQLITE_CHK(SQLITE_PREPARE(db, updateOutbox, -1, &stmt, NULL));
+    for (list<OutboxEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        SQLITE_CHK(sqlite3_bind_int64(stmt, 1, it->nextTry));
+        SQLITE_CHK(sqlite3_bind_int(stmt, 2, it->tries));
+        SQLITE_CHK(sqlite3_bind_int64(stmt, 3, it->id));
+        SQLITE_CHK(sqlite3_bind_text(stmt, 4, ownName.data(), ownName.size(), SQLITE_STATIC));
+
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE) {
+            ERRMSG;
+            goto cleanup;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if ((rc = execSql(db, commitTransactionSql)) != SQLITE_OK) {
+        ERRMSG;
+        execSql(db, rollbackTransactionSql);
+    }
+    sqlite3_mutex_leave(connection);
+    return rc;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    execSql(db, rollbackTransactionSql);
+    sqlite3_mutex_leave(connection);
+    return rc;
+}
+
+int32_t SQLiteStoreConv::deleteOutboxEntries(const string& ownName, const list<int64_t>& ids)
+{
+    sqlite3_stmt *stmt = NULL;
+    int32_t rc;
+
+    clearLastError();
+    sqlite3_mutex* connection = sqlite3_db_mutex(db);
+    sqlite3_mutex_enter(connection);
+
+    if ((rc = execSql(db, beginTransactionSql)) != SQLITE_OK) {
+        ERRMSG;
+        sqlite3_mutex_leave(connection);
+        return rc;
+    }
+    // removeOutbox = "DELETE FROM Outbox WHERE id=?1 AND ownName=?2;";
+    SQLITE_CHK(SQLITE_PREPARE(db, removeOutbox, -1, &stmt, NULL));
+    for (list<int64_t>::const_iterator it = ids.begin(); it != ids.end(); ++it) {
+        SQLITE_CHK(sqlite3_bind_int64(stmt, 1, *it));
+        SQLITE_CHK(sqlite3_bind_text(stmt, 2, ownName.data(), ownName.size(), SQLITE_STATIC));
+
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE) {
+            ERRMSG;
+            goto cleanup;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if ((rc = execSql(db, commitTransactionSql)) != SQLITE_OK) {
+        ERRMSG;
+        execSql(db, rollbackTransactionSql);
+    }
+    sqlite3_mutex_leave(connection);
+    return rc;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    execSql(db, rollbackTransactionSql);
+    sqlite3_mutex_leave(connection);
+    return rc;
+}
+
+// ******** Received message ids
+int32_t SQLiteStoreConv::insertReceivedId(const string& ownName, const string& msgKey)
+{
+    sqlite3_stmt *stmt;
+    int32_t rc;
+
+    clearLastError();
+
+    // insertReceivedIdSql = "INSERT OR REPLACE INTO ReceivedIds (ownName, msgKey, since) VALUES (?1, ?2, ?3);";
+    SQLITE_CHK(SQLITE_PREPARE(db, insertReceivedIdSql, -1, &stmt, NULL));
+    SQLITE_CHK(sqlite3_bind_text(stmt,  1, ownName.data(), ownName.size(), SQLITE_STATIC));
+    SQLITE_CHK(sqlite3_bind_blob(stmt,  2, msgKey.data(), msgKey.size(), SQLITE_STATIC));
+    SQLITE_CHK(sqlite3_bind_int64(stmt, 3, time(0)));
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        ERRMSG;
+        goto cleanup;
+    }
+    sqlite3_finalize(stmt);
+    return SQLITE_OK;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+bool SQLiteStoreConv::hasReceivedId(const string& ownName, const string& msgKey) const
+{
+    sqlite3_stmt *stmt;
+    int32_t rc;
+
+    clearLastError();
+
+    // selectReceivedId = "SELECT since FROM ReceivedIds WHERE ownName=?1 AND msgKey=?2;";
+    SQLITE_CHK(SQLITE_PREPARE(db, selectReceivedId, -1, &stmt, NULL));
+    SQLITE_CHK(sqlite3_bind_text(stmt, 1, ownName.data(), ownName.size(), SQLITE_STATIC));
+    SQLITE_CHK(sqlite3_bind_blob(stmt, 2, msgKey.data(), msgKey.size(), SQLITE_STATIC));
+
+    rc = sqlite3_step(stmt);
+    ERRMSG;
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_ROW);
+
+cleanup:
+    sqlite3_finalize(stmt);
+    return false;
+}
+
+list<string>* SQLiteStoreConv::loadReceivedIds(const string& ownName, time_t since) const
+{
+    sqlite3_stmt *stmt;
+    int32_t rc;
+    list<string>* keys = new list<string>;
+
+    clearLastError();
+
+    // selectReceivedIdsSince = "SELECT msgKey FROM ReceivedIds WHERE ownName=?1 AND since >= ?2 ORDER BY since;";
+    SQLITE_CHK(SQLITE_PREPARE(db, selectReceivedIdsSince, -1, &stmt, NULL));
+    SQLITE_CHK(sqlite3_bind_text(stmt, 1, ownName.data(), ownName.size(), SQLITE_STATIC));
+    SQLITE_CHK(sqlite3_bind_int64(stmt, 2, since));
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        keys->push_back(string((const char*)sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0)));
+    if (rc != SQLITE_DONE) {
+        ERRMSG;
+        goto cleanup;
+    }
+    sqlite3_finalize(stmt);
+    return keys;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    delete keys;
+    return NULL;
+}
+
+int32_t SQLiteStoreConv::deleteReceivedIds(time_t timestamp)
+{
+    sqlite3_stmt *stmt;
+    int32_t rc;
+
+    clearLastError();
+
+    // removeReceivedIdsTime = "DELETE FROM ReceivedIds WHERE since < ?1;";
+    SQLITE_CHK(SQLITE_PREPARE(db, removeReceivedIdsTime, -1, &stmt, NULL));
+    SQLITE_CHK(sqlite3_bind_int64(stmt, 1, timestamp));
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        ERRMSG;
+        goto cleanup;
+    }
+    sqlite3_finalize(stmt);
+    return SQLITE_OK;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+// ******** Store maintenance
+int32_t SQLiteStoreConv::optimizeStore()
+{
+    clearLastError();
+    int32_t rc = optimizeDb(db);
+
+    for (size_t i = 0; rc == SQLITE_OK && i < shards_.size(); i++)
+        rc = optimizeDb(shards_[i]);
+    return rc;
+}
+
+int32_t SQLiteStoreConv::incrementalVacuum(int32_t pages)
+{
+    clearLastError();
+    int32_t rc = incrementalVacuumDb(db, pages);
+
+    for (size_t i = 0; rc == SQLITE_OK && i < shards_.size(); i++)
+        rc = incrementalVacuumDb(shards_[i], pages);
+    return rc;
+}
+
+int32_t SQLiteStoreConv::checkpointStore()
+{
+    clearLastError();
+    int32_t rc = checkpointDb(db);
+
+    for (size_t i = 0; rc == SQLITE_OK && i < shards_.size(); i++)
+        rc = checkpointDb(shards_[i]);
+    return rc;
+}
+
+int32_t SQLiteStoreConv::optimizeDb(sqlite3* db)
+{
+    sqlite3_stmt *stmt;
+    int32_t rc;
+
+    // PRAGMA optimize is available since SQLite 3.18, older versions silently ignore
+    // unknown pragmas, thus fall back to a full ANALYZE
+    const char* sql = (sqlite3_libversion_number() >= 3018000) ? optimizeSql : analyzeSql;
+
+    SQLITE_CHK(SQLITE_PREPARE(db, sql, -1, &stmt, NULL));
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        ;
+    if (rc != SQLITE_DONE) {
+        ERRMSG;
+        goto cleanup;
+    }
+    sqlite3_finalize(stmt);
+    return SQLITE_OK;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+int32_t SQLiteStoreConv::incrementalVacuumDb(sqlite3* db, int32_t pages)
+{
+    sqlite3_stmt *stmt;
+    int32_t rc;
+    char statement[100];
+    int32_t autoVacuum = 0;
+
+    // Incremental vacuum works only if the DB was created with auto_vacuum = INCREMENTAL (2)
+    SQLITE_CHK(SQLITE_PREPARE(db, selectAutoVacuum, -1, &stmt, NULL));
+    if ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        autoVacuum = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    if (autoVacuum != 2)
+        return SQLITE_OK;
+
+    snprintf(statement, 90, incrementalVacuumSql, pages);
+    SQLITE_CHK(SQLITE_PREPARE(db, statement, -1, &stmt, NULL));
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        ;
+    if (rc != SQLITE_DONE) {
+        ERRMSG;
+        goto cleanup;
+    }
+    sqlite3_finalize(stmt);
+    return SQLITE_OK;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+int32_t SQLiteStoreConv::checkpointDb(sqlite3* db)
+{
+    int32_t rc;
+    // A passive checkpoint never blocks readers or writers. This is a no-op if the DB
+    // does not use WAL journal mode.
+    rc = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+    if (rc != SQLITE_OK)
+        ERRMSG;
+    return rc;
+}
+
+// ******** Shard migration
+int32_t SQLiteStoreConv::migrateToShards()
+{
+    int32_t rc;
+
+    clearLastError();
+    if (shards_.empty())
+        return SQLITE_OK;
+
+    // First move the rows of the single-file layout, then the rows that are in
+    // the wrong shard, for example after the number of shards was increased.
+    vector<sqlite3*> sources(1, db);
+    sources.insert(sources.end(), shards_.begin(), shards_.end());
+
+    for (size_t i = 0; i < sources.size(); i++) {
+        if ((rc = moveRows(sources[i], selectConvAll, insertConvAll, removeConvRowid, 8)) != SQLITE_OK)
+            return rc;
+        if ((rc = moveRows(sources[i], selectStagedMkAll, insertStagedMkAll, removeStagedMkRowid, 7)) != SQLITE_OK)
+            return rc;
+    }
+    return SQLITE_OK;
+}
+
+/*
+ * The select statement returns the rowid followed by the columns to copy, the second and
+ * third column must be name and longDevId. Each target shard is one unit: the function
+ * copies all rows of a target in one transaction, commits it and only then removes these
+ * rows from the source. An error while copying rolls back the copies of all targets, the
+ * source keeps its rows. If the function stops between commit and remove the next run
+ * copies the rows again, the insert statements skip rows that already exist in the target.
+ */
+int32_t SQLiteStoreConv::moveRows(sqlite3* db, const char* selectSql, const char* insertSql, const char* deleteSql, int32_t columns)
+{
+    sqlite3_stmt *stmt;
+    sqlite3_stmt *insert;
+    int32_t rc;
+    vector<sqlite3*> targets;
+    vector<sqlite3_stmt*> inserts;
+    vector<vector<int64_t> > moved;     // rowids in the source, per target
+    size_t committed = 0;
+
+    SQLITE_CHK(SQLITE_PREPARE(db, selectSql, -1, &stmt, NULL));
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        string name((const char*)sqlite3_column_text(stmt, 1), sqlite3_column_bytes(stmt, 1));
+        sqlite3* target = convDb(name, (const char*)sqlite3_column_text(stmt, 2), sqlite3_column_bytes(stmt, 2));
+        if (target == db)
+            continue;
+
+        // Copy all rows of a target in one transaction and reuse the prepared statement
+        size_t idx = find(targets.begin(), targets.end(), target) - targets.begin();
+        if (idx == targets.size()) {
+            SQLITE_CHK(SQLITE_PREPARE(target, insertSql, -1, &insert, NULL));
+            inserts.push_back(insert);
+            targets.push_back(target);
+            moved.push_back(vector<int64_t>());
+            if ((rc = execSql(target, beginTransactionSql)) != SQLITE_OK) {
+                ERRMSG;
+                goto cleanup;
+            }
+        }
+        insert = inserts[idx];
+        for (int32_t col = 1; col <= columns; col++) {
+            SQLITE_CHK(sqlite3_bind_value(insert, col, sqlite3_column_value(stmt, col)));
+        }
+        rc = sqlite3_step(insert);
+        sqlite3_reset(insert);
+        if (rc != SQLITE_DONE) {
+            ERRMSG;
+            goto cleanup;
+        }
+        moved[idx].push_back(sqlite3_column_int64(stmt, 0));
+    }
+    if (rc != SQLITE_DONE) {
+        ERRMSG;
+        goto cleanup;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    for (; committed < targets.size(); committed++) {
+        if ((rc = execSql(targets[committed], commitTransactionSql)) != SQLITE_OK) {
+            ERRMSG;
+            goto cleanup;
+        }
+
+        // The rows are safe in their shard now, remove them from the source
+        execSql(db, beginTransactionSql);
+        SQLITE_CHK(SQLITE_PREPARE(db, deleteSql, -1, &stmt, NULL));
+        for (size_t i = 0; i < moved[committed].size(); i++) {
+            SQLITE_CHK(sqlite3_bind_int64(stmt, 1, moved[committed][i]));
+            rc = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            if (rc != SQLITE_DONE) {
+                ERRMSG;
+                goto cleanup;
+            }
+        }
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+        if ((rc = execSql(db, commitTransactionSql)) != SQLITE_OK) {
+            ERRMSG;
+            goto cleanup;
+        }
+    }
+    for (size_t i = 0; i < inserts.size(); i++)
+        sqlite3_finalize(inserts[i]);
+    return SQLITE_OK;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    for (size_t i = 0; i < inserts.size(); i++)
+        sqlite3_finalize(inserts[i]);
+    // Drop the copies of the targets that are not committed yet, the source still has these rows
+    for (size_t i = committed; i < targets.size(); i++) {
+        if (sqlite3_get_autocommit(targets[i]) == 0)
+            execSql(targets[i], rollbackTransactionSql);
+    }
+    if (sqlite3_get_autocommit(db) == 0)
+        execSql(db, rollbackTransactionSql);
+    return rc;
+}
@@ -11,6 +11,10 @@
 #include <string>
 #include <stdint.h>
 #include <list>
+#include <vector>
+#include <utility>
+
+#include "../ConversationStore.h"
 
 #ifdef ANDROID
 #include "android/jni/sqlcipher/sqlite3.h"
@@ -19,7 +23,6 @@
 #endif
 
 #define DB_CACHE_ERR_BUFF_SIZE  1000
-#define OUR_KEY_LENGTH          32
 
 #define SQL_FAIL(code) ((code) > SQLITE_OK && (code) < SQLITE_ROW)
 
@@ -27,31 +30,27 @@ using namespace std;
 
 namespace salamander {
 
-class SQLiteStoreConv
+class SQLiteStoreConv : public ConversationStore
 {
 public:
     /**
-     * @brief Get the Salamander store instance.
-     * 
-     * The Salamander store is a singleton and this call returns the instance.
-     * Use @c isReady to check if this store is ready for use.
+     * @brief Create a Salamander store instance.
      * 
-     * @return Either a new or an already open Salamander store.
+     * Each account uses its own store instance and thus its own database. The
+     * caller owns the instance, sets the key and opens the store. Use @c isReady
+     * to check if this store is ready for use.
      */
-    static SQLiteStoreConv* getStore();
+    SQLiteStoreConv();
 
     /**
-     * @brief Close the Salamander store instance.
+     * @brief Close the database and destroy the store instance.
      */
-    static void closeStore() { delete instance_; instance_ = NULL;}
+    ~SQLiteStoreConv();
 
 #ifdef UNITTESTS
     static SQLiteStoreConv* getStoreForTesting() {return new SQLiteStoreConv(); }
     static SQLiteStoreConv* closeStoreForTesting(SQLiteStoreConv* store) {delete store; }
 #endif
-    /**
-     * @brief Is store ready for use?
-     */
     bool isReady() { return isReady_; }
 
     /**
@@ -63,68 +62,90 @@ public:
     int openStore(const string& filename);
 
     /**
-     * @brief Set key to encrypt sensitive data.
-     * 
-     * Several functions deal with senisitve data and these functions encrypt the
-     * data before they store it in the DB and decrypt it after reading. The
-     * @c string is not tread as a string but as a container that hold the
-     * key material, i.e. binary data. The length of the key must be 32 bytes
-     * 
-     * @param keyData a @c string container with the key data
-     * @return @c true is key is OK, @c false otherwise.
+     * @brief Spread conversations and staged message keys across several database files.
+     *
+     * The store selects the shard of a conversation and its staged message keys by a
+     * hash of the peer's name and long device id. Each shard is a separate database file,
+     * named like the main database plus a @c .shardN suffix, thus writers of conversations
+     * in different shards do not serialize on one database lock. The main database keeps
+     * all other tables. Set the number of shards before calling @c openStore and always
+     * open a store with the same number of shards, use @c migrateToShards after changing
+     * the number of shards.
+     *
+     * @param shards number of shards, 0 or 1 to use the single-file layout
      */
-    bool setKey(const string& keyData) {if (keyData.size() != OUR_KEY_LENGTH) return false; keyData_ = new string(keyData); return true; }
+    void setShards(int32_t shards) { numShards_ = shards; }
 
     /**
-     * @brief Get the last SQLite error message.
-     * 
-     * If a functions returns an error code or if the stored SQLite code is
-     * not equal @c SQLITE_OK then this function returns a pointer to the last
-     * SQLite error message
-     * 
-     * @return pointer to SQLite error message.
+     * @brief Get the number of open shards, 0 for the single-file layout.
      */
-    const char* getLastError() {return lastError_;}
+    int32_t getShards() const { return shards_.size(); }
 
     /**
-     * @brief Return the SQLite code of the last SQLite function.
-     * 
-     * Many functions interally use SQLite which may return an SQLite error.
-     * In this case the functions store the SQLite code and the caller can
-     * check if all operations were successfull. 
+     * @brief Move conversations and staged message keys to their shards.
+     *
+     * Moves rows of the single-file layout from the main database into the shards and
+     * moves rows that are stored in the wrong shard, for example after increasing the
+     * number of shards. The function copies the rows of each target shard in one
+     * transaction and removes them from their old location after the commit, a failed
+     * copy leaves the rows at their old location. If the migration is interrupted
+     * simply run it again: a row that was already copied keeps its state in the shard,
+     * its stale copy at the old location is removed. Rows in shard
+     * files beyond the current number of shards are not visible to this function.
+     *
+     * @return an SQLite code
      */
-    int32_t getSqlCode() const {return sqlCode_;}
-
+    int32_t migrateToShards();
 
     /**
-     * @brief Get a list of all known identities
+     * @brief Set key to encrypt the database.
      * 
-     * Assemble a list of names for all known identities. 
+     * The store uses the key to open the SQLCipher database.
      * 
-     * @return a new list with the names, an empty list if now identities available,
-     *         NULL in case of error
+     * @param keyData a @c string container with the key data
+     * @return @c true is key is OK, @c false otherwise.
      */
+    bool setKey(const string& keyData) {if (keyData.size() != OUR_KEY_LENGTH) return false; keyData_ = new string(keyData); return true; }
+
+    // The last error and code are per thread: they report the result of the calling thread's last store call
+    const char* getLastError();
+
+    int32_t getSqlCode() const;
+
+    // The StoreCodes have the values of the SQLite primary result codes, the store returns its codes unchanged
+    int32_t getStoreCode() const;
+
     list<string>* getKnownConversations(const string& ownName);
 
-    /**
-     * @brief Get a list of long device ids for a name.
-     * 
-     * Returns a list of known devices for a user. A user may have several Salamander device
-     * registered with the account.
-     * 
-     * @param name the user's name.
-     * @return a new list with the long device ids, NULL in case of error
-     */
     list<string>* getLongDeviceIds(const string& name, const string& ownName);
 
-
     // ***** Conversation store
     string* loadConversation(const string& name, const string& longDevId, const string& ownName) const;
 
     void storeConversation(const string& name, const string& longDevId, const string& ownName, const string& data);
 
+    /**
+     * @brief Store several conversations of one user in one batch.
+     *
+     * Writes the conversations of each database, the main database or a shard, in one
+     * transaction. If a write fails the function rolls back the transaction of this
+     * database, conversations in other shards may be stored already. The function holds
+     * the database's connection mutex during the transaction, thus writes of other
+     * threads don't end up in the batch.
+     */
+    int32_t storeConversations(const string& name, const string& ownName, const list<pair<string, string> >& conversations);
+
     bool hasConversation(const string& name, const string& longDevId, const string& ownName) const;
 
+    /**
+     * @brief Check several devices of a user for a conversation in one lookup.
+     *
+     * Runs one query per database that holds one of the devices, the query reads the
+     * device ids from the primary key index only.
+     */
+    int32_t hasConversations(const string& name, const vector<DataSpan>& longDevIds, const string& ownName,
+                             vector<bool>* known) const;
+
     void deleteConversation(const string& name, const string& longDevId, const string& ownName);
 
     void deleteConversationsName(const string& name, const string& ownName);
@@ -136,27 +157,83 @@ public:
 
     void deleteStagedMk(const string& name, const string& longDevId, const string& ownName, string& MKiv);
 
-    void deleteStagedMk(time_t timestamp);
+    int32_t deleteStagedMk(time_t timestamp);
 
     // Pre key storage. The functions encrypt, decrypt and store/retrive Pre-key JSON strings
     string* loadPreKey(int32_t preKeyId) const;
 
     void storePreKey(int32_t preKeyId, const string& preKeyData);
 
+    /**
+     * @brief Store a batch of pre-keys.
+     *
+     * Inserts all pre-keys in one transaction. If one insert fails the function
+     * rolls back the transaction and none of the pre-keys is stored.
+     *
+     * @param preKeys list of pre-key ids and their pre-key JSON strings
+     * @return SQLITE_OK if all pre-keys were stored, an SQLite error code otherwise
+     */
+    int32_t storePreKeys(const list<pair<int32_t, string> >& preKeys);
+
     bool containsPreKey(int32_t preKeyId) const;
 
+    list<int32_t>* getPreKeyIds() const;
+
     void removePreKey(int32_t preKeyId);
 
     void dumpPreKeys() const;
-    /*
-     * @brief For use for debugging and development only
+
+    // ***** Outbox, the batch functions write in one transaction
+    int32_t insertOutboxEntries(const string& ownName, list<OutboxEntry>* entries);
+
+    list<OutboxEntry>* loadOutboxEntries(const string& ownName, time_t dueTime) const;
+
+    int32_t updateOutboxEntries(const string& ownName, const list<OutboxEntry>& entries);
+
+    int32_t deleteOutboxEntries(const string& ownName, const list<int64_t>& ids);
+
+    // ***** Received message ids
+    int32_t insertReceivedId(const string& ownName, const string& msgKey);
+
+    bool hasReceivedId(const string& ownName, const string& msgKey) const;
+
+    list<string>* loadReceivedIds(const string& ownName, time_t since) const;
+
+    int32_t deleteReceivedIds(time_t timestamp);
+
+    // ***** Store maintenance, see StoreMaintenance.h
+
+    /**
+     * @brief Update the query planner statistics.
+     *
+     * Runs @c PRAGMA @c optimize if the SQLite library supports it, a full
+     * @c ANALYZE otherwise.
+     *
+     * @return an SQLite code
      */
-    int32_t resetStore() { return createTables(); }
+    int32_t optimizeStore();
 
-private:
-    SQLiteStoreConv();
-    ~SQLiteStoreConv();
+    /**
+     * @brief Return free pages to the file system.
+     *
+     * This is a no-op if the database was not created with incremental
+     * auto vacuum enabled.
+     *
+     * @param pages maximum number of pages to remove, 0 to remove all free pages
+     * @return an SQLite code
+     */
+    int32_t incrementalVacuum(int32_t pages);
+
+    /**
+     * @brief Run a passive WAL checkpoint.
+     *
+     * @return an SQLite code
+     */
+    int32_t checkpointStore();
+
+    int32_t resetStore();
 
+private:
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wreturn-type"
     SQLiteStoreConv(const SQLiteStoreConv& other) {};
@@ -172,6 +249,31 @@ private:
      */
     int createTables();
 
+    int32_t createConvTables(sqlite3* db);
+
+    int32_t openShard(const string& name, int32_t index, sqlite3** shard);
+
+    /**
+     * Return the database that holds the conversation and staged message keys of a device.
+     */
+    sqlite3* convDb(const string& name, const char* devId, int32_t devIdLen) const;
+
+    /**
+     * Return all databases that hold conversations, either the main database or the shards.
+     */
+    vector<sqlite3*> convDbs() const;
+
+    int32_t storeConversationsDb(sqlite3* db, const string& name, const string& ownName,
+                                 const vector<const pair<string, string>* >& conversations);
+
+    int32_t moveRows(sqlite3* db, const char* selectSql, const char* insertSql, const char* deleteSql, int32_t columns);
+
+    int32_t optimizeDb(sqlite3* db);
+
+    int32_t incrementalVacuumDb(sqlite3* db, int32_t pages);
+
+    int32_t checkpointDb(sqlite3* db);
+
     /**
      * Initialize the other Salamander tables.
      *
@@ -193,16 +295,20 @@ private:
      * @param newVersion the target version for the database
      * @return SQLITE_OK to commit any changes, any other code closes the database with rollback.
      */
-    int32_t updateDb(int32_t oldVersion, int32_t newVersion) {return SQLITE_OK; }
+    int32_t updateDb(int32_t oldVersion, int32_t newVersion);
+
+    // Record the code and the error message of db as the calling thread's last result
+    void setLastError(int32_t code, sqlite3* db, int32_t line) const;
+
+    void clearLastError() const;
 
-    static SQLiteStoreConv* instance_;
     sqlite3* db;
     string* keyData_;
 
-    bool isReady_;
+    vector<sqlite3*> shards_;
+    int32_t numShards_;
 
-    mutable int32_t sqlCode_;
-    mutable char lastError_[DB_CACHE_ERR_BUFF_SIZE];
+    bool isReady_;
 };
 } // namespace salamander
 
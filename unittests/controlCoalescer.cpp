@@ -0,0 +1,184 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include "gtest/gtest.h"
+
+#include "../interfaceApp/ControlCoalescer.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+using namespace salamander;
+using namespace std;
+
+static OutgoingMessage control(const string& recipient, int32_t i)
+{
+    OutgoingMessage message(recipient, "msg-" + to_string(i), string());
+    message.attributes = "{\"cmd\":\"rr\",\"rr_id\":\"" + to_string(i) + "\"}";
+    return message;
+}
+
+// Records the batches
+class Batches
+{
+public:
+    void flush(const string& recipient, vector<ControlCoalescer::Entry>* entries)
+    {
+        unique_lock<mutex> lck(lock_);
+        recipients.push_back(recipient);
+        handles.push_back(vector<int64_t>());
+        for (size_t i = 0; i < entries->size(); i++)
+            handles.back().push_back((*entries)[i].handle);
+        changed_.notify_all();
+    }
+
+    bool waitFor(size_t count)
+    {
+        unique_lock<mutex> lck(lock_);
+        return changed_.wait_for(lck, chrono::seconds(5), [this, count]{ return recipients.size() >= count; });
+    }
+
+    vector<string> recipients;
+    vector<vector<int64_t> > handles;
+
+private:
+    mutex lock_;
+    condition_variable changed_;
+};
+
+static ControlCoalescer* createCoalescer(Batches* batches, int32_t windowMillis, int32_t maxMessages = ControlCoalescer::DEFAULT_MAX_MESSAGES)
+{
+    return new ControlCoalescer([batches](const string& recipient, vector<ControlCoalescer::Entry>* entries) {
+        batches->flush(recipient, entries);
+    }, windowMillis, maxMessages);
+}
+
+TEST(ControlCoalescer, IsControl)
+{
+    ASSERT_TRUE(ControlCoalescer::isControl(control("bob", 1)));
+
+    OutgoingMessage text = control("bob", 1);
+    text.message = "hello";
+    ASSERT_FALSE(ControlCoalescer::isControl(text));
+
+    OutgoingMessage attachment = control("bob", 1);
+    attachment.attachment = "{\"cloud_url\":\"x\"}";
+    ASSERT_FALSE(ControlCoalescer::isControl(attachment));
+
+    OutgoingMessage noCommand("bob", "msg-1", string());
+    noCommand.attributes = "{\"r\":true}";
+    ASSERT_FALSE(ControlCoalescer::isControl(noCommand));
+
+    // An application can't send a batch of its own
+    OutgoingMessage batch("bob", "msg-1", string());
+    batch.attributes = "{\"cmd\":\"batch\",\"msgs\":[]}";
+    ASSERT_FALSE(ControlCoalescer::isControl(batch));
+
+    OutgoingMessage large = control("bob", 1);
+    large.attributes = "{\"cmd\":\"rr\",\"x\":\"" + string(ControlCoalescer::MAX_ATTRIBUTES_SIZE, 'x') + "\"}";
+    ASSERT_FALSE(ControlCoalescer::isControl(large));
+}
+
+TEST(ControlCoalescer, PackUnpack)
+{
+    vector<ControlCoalescer::Entry> entries(3);
+    for (int32_t i = 0; i < 3; i++) {
+        entries[i].handle = i + 1;
+        entries[i].message = control("bob", i);
+    }
+    IncomingMessage batch;
+    batch.sender = "alice";
+    batch.scClientDevId = "aliceDevId";
+    batch.msgId = "batch-1";
+    batch.attributes = ControlCoalescer::pack(entries);
+
+    vector<IncomingMessage> messages;
+    ASSERT_TRUE(ControlCoalescer::unpack(batch, &messages));
+    ASSERT_EQ(3, messages.size());
+    for (int32_t i = 0; i < 3; i++) {
+        ASSERT_EQ("alice", messages[i].sender);
+        ASSERT_EQ("aliceDevId", messages[i].scClientDevId);
+        ASSERT_EQ("msg-" + to_string(i), messages[i].msgId);
+        ASSERT_EQ(control("bob", i).attributes, messages[i].attributes);
+        ASSERT_TRUE(messages[i].message.empty());
+    }
+
+    // Other messages are no batch
+    IncomingMessage other;
+    other.attributes = "{\"cmd\":\"rr\",\"text\":\"batch\"}";
+    messages.clear();
+    ASSERT_FALSE(ControlCoalescer::unpack(other, &messages));
+    ASSERT_TRUE(messages.empty());
+}
+
+TEST(ControlCoalescer, Window)
+{
+    Batches batches;
+    ControlCoalescer* coalescer = createCoalescer(&batches, 50);
+
+    for (int32_t i = 0; i < 5; i++) {
+        coalescer->add(i + 1, SendQueue::BACKGROUND, control("bob", i));
+        coalescer->add(i + 11, SendQueue::BACKGROUND, control("carol", i));
+    }
+    ASSERT_TRUE(batches.recipients.empty());
+
+    // One batch per recipient when the window closes
+    ASSERT_TRUE(batches.waitFor(2));
+    ASSERT_EQ(2, batches.handles.size());
+    for (size_t b = 0; b < 2; b++) {
+        int64_t first = batches.recipients[b] == "bob" ? 1 : 11;
+        ASSERT_EQ(5, batches.handles[b].size());
+        for (int32_t i = 0; i < 5; i++)
+            ASSERT_EQ(first + i, batches.handles[b][i]);
+    }
+    ASSERT_EQ(2, coalescer->getBatches());
+    ASSERT_EQ(10, coalescer->getCoalesced());
+    delete coalescer;
+}
+
+TEST(ControlCoalescer, Flush)
+{
+    Batches batches;
+    ControlCoalescer* coalescer = createCoalescer(&batches, 10000, 4);
+
+    // A full batch leaves at once
+    for (int32_t i = 0; i < 5; i++)
+        coalescer->add(i + 1, SendQueue::INTERACTIVE, control("bob", i));
+    ASSERT_EQ(1, batches.recipients.size());
+    ASSERT_EQ(4, batches.handles[0].size());
+
+    // A flush sends the collected messages on the calling thread
+    coalescer->add(10, SendQueue::INTERACTIVE, control("carol", 0));
+    coalescer->flush("bob");
+    ASSERT_EQ(2, batches.recipients.size());
+    ASSERT_EQ("bob", batches.recipients[1]);
+    ASSERT_EQ(1, batches.handles[1].size());
+    ASSERT_EQ(5, batches.handles[1][0]);
+
+    coalescer->flush("bob");
+    ASSERT_EQ(2, batches.recipients.size());
+
+    // The destructor sends the rest
+    delete coalescer;
+    ASSERT_EQ(3, batches.recipients.size());
+    ASSERT_EQ("carol", batches.recipients[2]);
+}
@@ -0,0 +1,181 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include "gtest/gtest.h"
+
+#include "../interfaceApp/ConversationLocks.h"
+#include <crypto/hmac256.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <random>
+
+using namespace salamander;
+using namespace std;
+
+static std::string aliceName("alice@wonderland.org");
+
+static string peerName(int32_t i)
+{
+    char name[50];
+    snprintf(name, sizeof(name), "peer_%d@milkyway.com", i);
+    return string(name);
+}
+
+static string peerDevice(int32_t i)
+{
+    char dev[50];
+    snprintf(dev, sizeof(dev), "devId_%d", i);
+    return string(dev);
+}
+
+TEST(ConversationLocks, Stripes)
+{
+    ConversationLocks locks;
+    ASSERT_EQ(ConversationLocks::DEFAULT_STRIPES, locks.getNumStripes());
+
+    int32_t stripe = locks.getStripe(aliceName, peerName(1), peerDevice(1));
+    ASSERT_EQ(stripe, locks.getStripe(aliceName, peerName(1), peerDevice(1)));
+
+    // The conversations of 100 peers spread over the stripes
+    vector<int32_t> used(locks.getNumStripes(), 0);
+    for (int32_t i = 0; i < 100; i++) {
+        int32_t s = locks.getStripe(aliceName, peerName(i), peerDevice(i));
+        ASSERT_TRUE(s >= 0 && s < locks.getNumStripes());
+        used[s]++;
+    }
+    int32_t numUsed = 0;
+    for (size_t i = 0; i < used.size(); i++)
+        numUsed += used[i] != 0 ? 1 : 0;
+    ASSERT_GT(numUsed, locks.getNumStripes() / 2);
+
+    // One stripe: one lock for all conversations
+    ConversationLocks single(1);
+    ASSERT_EQ(0, single.getStripe(aliceName, peerName(1), peerDevice(1)));
+    ASSERT_EQ(0, single.getStripe(aliceName, peerName(2), peerDevice(2)));
+
+    // Duplicate stripes are locked once
+    vector<int32_t> stripes;
+    stripes.push_back(3); stripes.push_back(1); stripes.push_back(3);
+    locks.lockStripes(&stripes);
+    ASSERT_EQ(2, stripes.size());
+    ASSERT_EQ(1, stripes[0]);
+    ASSERT_EQ(3, stripes[1]);
+    locks.unlockStripes(stripes);
+}
+
+// Threads lock random, overlapping sets of device conversations like a multi-device
+// fan-out does. Fails by hanging if the lock order is not deadlock free. The counters
+// are not atomic, the stripes protect them.
+TEST(ConversationLocks, FanOut)
+{
+    const int32_t numThreads = 8;
+    const int32_t numRounds = 2000;
+    const int32_t numDevices = 12;
+
+    ConversationLocks locks(8);
+    vector<int64_t> counters(numDevices, 0);
+
+    vector<thread> threads;
+    for (int32_t t = 0; t < numThreads; t++) {
+        threads.push_back(thread([&locks, &counters, t]() {
+            mt19937 rng(t);
+            for (int32_t round = 0; round < numRounds; round++) {
+                vector<int32_t> devices;
+                vector<int32_t> stripes;
+                for (int32_t i = 0; i < 4; i++) {
+                    int32_t dev = rng() % numDevices;
+                    devices.push_back(dev);
+                    stripes.push_back(locks.getStripe(aliceName, peerName(1), peerDevice(dev)));
+                }
+                locks.lockStripes(&stripes);
+                if (round % 10 == 0) {
+                    locks.lockLocal();
+                    locks.unlockLocal();
+                }
+                for (size_t i = 0; i < devices.size(); i++)
+                    counters[devices[i]]++;
+                locks.unlockStripes(stripes);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+
+    int64_t total = 0;
+    for (size_t i = 0; i < counters.size(); i++)
+        total += counters[i];
+    ASSERT_EQ(numThreads * numRounds * 4, total);
+}
+
+// Simulates a ratchet step: derive a few keys and wait for the store write
+static void conversationUpdate(uint8_t* chainKey)
+{
+    uint8_t mac[SHA256_DIGEST_LENGTH];
+    uint32_t macLength;
+    for (int32_t i = 0; i < 16; i++) {
+        hmac_sha256(chainKey, SHA256_DIGEST_LENGTH, (uint8_t*)"1", 1, mac, &macLength);
+        memcpy(chainKey, mac, SHA256_DIGEST_LENGTH);
+    }
+    this_thread::sleep_for(chrono::microseconds(200));
+}
+
+static int64_t runContention(ConversationLocks* locks, int32_t numThreads, int32_t opsPerThread)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    // Each thread talks to its own peer, thus the conversations are independent
+    vector<thread> threads;
+    for (int32_t t = 0; t < numThreads; t++) {
+        threads.push_back(thread([locks, t, opsPerThread]() {
+            uint8_t chainKey[SHA256_DIGEST_LENGTH] = {0};
+            vector<int32_t> stripes(1, locks->getStripe(aliceName, peerName(t), peerDevice(t)));
+            for (int32_t i = 0; i < opsPerThread; i++) {
+                locks->lockStripes(&stripes);
+                conversationUpdate(chainKey);
+                locks->unlockStripes(stripes);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+}
+
+// Not a pass/fail test: compare one lock for all conversations with striped locks
+// for 1 to 32 threads that send to independent peers.
+TEST(ConversationLocks, Contention)
+{
+    const int32_t opsPerThread = 100;
+
+    for (int32_t numThreads = 1; numThreads <= 32; numThreads *= 2) {
+        ConversationLocks single(1);
+        ConversationLocks striped;
+
+        int64_t singleTime = runContention(&single, numThreads, opsPerThread);
+        int64_t stripedTime = runContention(&striped, numThreads, opsPerThread);
+
+        int64_t ops = (int64_t)numThreads * opsPerThread;
+        cerr << numThreads << " threads: single lock " << ops * 1000000 / singleTime << " ops/s, "
+             << "striped " << ops * 1000000 / stripedTime << " ops/s, speedup "
+             << (double)singleTime / stripedTime << endl;
+    }
+}
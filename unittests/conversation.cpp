@@ -34,10 +34,11 @@ static std::string bobDev("BobDevId");
 
 static const uint8_t keyInData[] = {0,1,2,3,4,5,6,7,8,9,19,18,17,16,15,14,13,12,11,10,20,21,22,23,24,25,26,27,28,20,31,30};
 
-static SQLiteStoreConv* store;
+static SQLiteStoreConv* store = NULL;
 void prepareStore()
 {
-    store = SQLiteStoreConv::getStore();
+    if (store == NULL)
+        store = new SQLiteStoreConv();
     if (store->isReady())
         return;
     store->setKey(string((const char*)keyInData, 32));
@@ -49,12 +50,12 @@ TEST(Conversation, BasicEmpty)
     prepareStore();
 
     // localUser, remote user, remote dev id
-    AxoConversation conv(aliceName, bobName, bobDev);
+    AxoConversation conv(aliceName, bobName, bobDev, store);
 
     conv.storeConversation();
     ASSERT_FALSE(SQL_FAIL(store->getSqlCode())) << store->getLastError();    
 
-    AxoConversation* conv1 = AxoConversation::loadConversation(aliceName, bobName, bobDev);
+    AxoConversation* conv1 = AxoConversation::loadConversation(aliceName, bobName, bobDev, store);
     ASSERT_TRUE(conv1 != NULL);
     ASSERT_TRUE(conv1->getRK().empty());
     delete conv1;
@@ -65,7 +66,7 @@ TEST(Conversation, TestDHR)
     prepareStore();
 
     // localUser, remote user, remote dev id
-    AxoConversation conv(aliceName,   bobName,   bobDev);
+    AxoConversation conv(aliceName,   bobName,   bobDev, store);
     conv.setRatchetFlag(true);
 
     Ec255PublicKey* pubKey = new Ec255PublicKey(keyInData);
@@ -75,7 +76,7 @@ TEST(Conversation, TestDHR)
     conv.setDHRs(keyPair);
 
     conv.storeConversation();
-    AxoConversation* conv1 = AxoConversation::loadConversation(aliceName, bobName, bobDev);
+    AxoConversation* conv1 = AxoConversation::loadConversation(aliceName, bobName, bobDev, store);
     ASSERT_TRUE(conv1 != NULL);
     ASSERT_TRUE(conv1->getRatchetFlag());
 
@@ -94,7 +95,7 @@ TEST(Conversation, TestDHI)
     prepareStore();
 
     // localUser, remote user, remote dev id
-    AxoConversation conv(aliceName, bobName, bobDev);
+    AxoConversation conv(aliceName, bobName, bobDev, store);
     conv.setRatchetFlag(true);
 
     Ec255PublicKey* pubKey = new Ec255PublicKey(keyInData);
@@ -104,7 +105,7 @@ TEST(Conversation, TestDHI)
     conv.setDHIs(keyPair);
 
     conv.storeConversation();
-    AxoConversation* conv1 = AxoConversation::loadConversation(aliceName, bobName, bobDev);
+    AxoConversation* conv1 = AxoConversation::loadConversation(aliceName, bobName, bobDev, store);
     ASSERT_TRUE(conv1 != NULL);
     ASSERT_TRUE(conv1->getRatchetFlag());
 
@@ -123,14 +124,14 @@ TEST(Conversation, TestA0)
     prepareStore();
 
     // localUser, remote user, remote dev id
-    AxoConversation conv(aliceName,   bobName,   bobDev);
+    AxoConversation conv(aliceName,   bobName,   bobDev, store);
     conv.setRatchetFlag(true);
 
     const DhKeyPair* keyPair = EcCurve::generateKeyPair(EcCurveTypes::Curve25519);
     conv.setA0(keyPair);
 
     conv.storeConversation();
-    AxoConversation* conv1 = AxoConversation::loadConversation(aliceName, bobName, bobDev);
+    AxoConversation* conv1 = AxoConversation::loadConversation(aliceName, bobName, bobDev, store);
     ASSERT_TRUE(conv1 != NULL);
     ASSERT_TRUE(conv1->getRatchetFlag());
 
@@ -148,7 +149,7 @@ TEST(Conversation, SimpleFields)
     string CKr("ChainKeyR 1");
 
     // localUser, remote user, remote dev id
-    AxoConversation conv(aliceName,   bobName,   bobDev);
+    AxoConversation conv(aliceName,   bobName,   bobDev, store);
     conv.setRK(RK);
     conv.setCKr(CKr);
     conv.setCKs(CKs);
@@ -161,7 +162,7 @@ TEST(Conversation, SimpleFields)
     conv.setDeviceName(tst);
 
     conv.storeConversation();
-    AxoConversation* conv1 = AxoConversation::loadConversation(aliceName, bobName, bobDev);
+    AxoConversation* conv1 = AxoConversation::loadConversation(aliceName, bobName, bobDev, store);
 
     ASSERT_EQ(RK, conv1->getRK());
     ASSERT_EQ(CKr, conv1->getCKr());
@@ -174,3 +175,32 @@ TEST(Conversation, SimpleFields)
     ASSERT_TRUE(tst == conv1->getDeviceName());
     delete conv1;
 }
+
+TEST(Conversation, BatchStore)
+{
+    prepareStore();
+
+    list<AxoConversation*> conversations;
+    for (int32_t i = 0; i < 5; i++) {
+        AxoConversation* conv = new AxoConversation(aliceName, bobName, bobDev + (char)('0' + i), store);
+        conv->setNs(i);
+        conversations.push_back(conv);
+    }
+    ASSERT_EQ(SQLITE_OK, AxoConversation::storeConversations(conversations)) << store->getLastError();
+
+    // Store again, the batch updates existing conversations
+    for (list<AxoConversation*>::iterator it = conversations.begin(); it != conversations.end(); ++it)
+        (*it)->setNs((*it)->getNs() + 10);
+    ASSERT_EQ(SQLITE_OK, AxoConversation::storeConversations(conversations)) << store->getLastError();
+
+    for (int32_t i = 0; i < 5; i++) {
+        AxoConversation* conv = AxoConversation::loadConversation(aliceName, bobName, bobDev + (char)('0' + i), store);
+        ASSERT_TRUE(conv != NULL);
+        ASSERT_EQ(i + 10, conv->getNs());
+        delete conv;
+    }
+    while (!conversations.empty()) {
+        delete conversations.front();
+        conversations.pop_front();
+    }
+}
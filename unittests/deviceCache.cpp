@@ -0,0 +1,217 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include "gtest/gtest.h"
+
+#include "../provisioning/DeviceCache.h"
+#include "../provisioning/ScProvisioning.h"
+#include "../interfaceApp/AppInterfaceImpl.h"
+#include "../interfaceTransport/sip/SipTransport.h"
+#include "../storage/sqlite/SQLiteStoreConv.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+using namespace salamander;
+using namespace std;
+
+static const uint8_t keyInData[] = {0,1,2,3,4,5,6,7,8,9,19,18,17,16,15,14,13,12,11,10,20,21,22,23,24,25,26,27,28,20,31,30};
+
+static atomic<int32_t> requests(0);
+static atomic<int32_t> delayMs(0);
+static atomic<bool> failRequests(false);
+
+// Simulates the provisioning server: "bob" has two devices, "nobody" has none
+static int32_t devicesHelper(const std::string& requestUrl, const std::string& method, const std::string& data, std::string* response)
+{
+    requests++;
+    if (delayMs > 0)
+        this_thread::sleep_for(chrono::milliseconds(delayMs));
+    if (failRequests)
+        return 500;
+
+    if (requestUrl.find("/user/nobody/") != string::npos)
+        response->assign("{\"version\": 1, \"devices\": []}");
+    else
+        response->assign("{\"version\": 1, \"devices\": [{\"version\": 1, \"id\": \"bobDev1\", \"device_name\": \"phone\"},"
+                         "{\"version\": 1, \"id\": \"bobDev2\", \"device_name\": \"tablet\"}]}");
+    return 200;
+}
+
+static void resetServer()
+{
+    ScProvisioning::setHttpHelper(devicesHelper);
+    requests = 0;
+    delayMs = 0;
+    failRequests = false;
+}
+
+static string bob("bob");
+static string auth("myAPI-key");
+
+TEST(DeviceCache, HitMiss)
+{
+    resetServer();
+    DeviceCache cache;
+
+    list<pair<string, string> >* devices = cache.getDeviceIds(bob, auth);
+    ASSERT_TRUE(devices != NULL);
+    ASSERT_EQ(2, devices->size());
+    ASSERT_EQ(string("bobDev1"), devices->front().first);
+    ASSERT_EQ(string("phone"), devices->front().second);
+    delete devices;
+
+    // The caller owns the returned list, the cache keeps its own copy
+    devices = cache.getDeviceIds(bob, auth);
+    ASSERT_EQ(2, devices->size());
+    delete devices;
+
+    ASSERT_EQ(1, requests);
+    ASSERT_EQ(1, cache.getMisses());
+    ASSERT_EQ(1, cache.getHits());
+
+    cache.invalidate(bob);
+    delete cache.getDeviceIds(bob, auth);
+    ASSERT_EQ(2, requests);
+
+    // Failed requests don't go to the cache
+    cache.clear();
+    failRequests = true;
+    ASSERT_TRUE(cache.getDeviceIds(bob, auth) == NULL);
+    failRequests = false;
+    delete cache.getDeviceIds(bob, auth);
+    ASSERT_EQ(4, requests);
+}
+
+TEST(DeviceCache, Expire)
+{
+    resetServer();
+    // The cache counts in seconds, the sleeps allow for the truncation
+    DeviceCache cache(3, 1);
+
+    delete cache.getDeviceIds(bob, auth);
+    list<pair<string, string> >* devices = cache.getDeviceIds(string("nobody"), auth);
+    ASSERT_TRUE(devices != NULL);
+    ASSERT_TRUE(devices->empty());
+    delete devices;
+    ASSERT_EQ(2, requests);
+
+    // The empty list expires first
+    this_thread::sleep_for(chrono::milliseconds(1100));
+    delete cache.getDeviceIds(bob, auth);
+    delete cache.getDeviceIds(string("nobody"), auth);
+    ASSERT_EQ(3, requests);
+
+    this_thread::sleep_for(chrono::milliseconds(2000));
+    delete cache.getDeviceIds(bob, auth);
+    ASSERT_EQ(4, requests);
+
+    // TTL 0 disables the cache
+    DeviceCache noCache(0);
+    delete noCache.getDeviceIds(bob, auth);
+    delete noCache.getDeviceIds(bob, auth);
+    ASSERT_EQ(6, requests);
+    ASSERT_EQ(2, noCache.getMisses());
+}
+
+TEST(DeviceCache, Coalesce)
+{
+    resetServer();
+    delayMs = 200;
+    DeviceCache cache;
+
+    const int32_t numThreads = 8;
+    atomic<int32_t> found(0);
+    vector<thread> threads;
+    for (int32_t i = 0; i < numThreads; i++) {
+        threads.push_back(thread([&]() {
+            list<pair<string, string> >* devices = cache.getDeviceIds(bob, auth);
+            if (devices != NULL && devices->size() == 2)
+                found++;
+            delete devices;
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    ASSERT_EQ(numThreads, found);
+    ASSERT_EQ(1, requests);
+    ASSERT_EQ(1, cache.getMisses());
+    ASSERT_EQ(numThreads - 1, cache.getHits());
+}
+
+TEST(DeviceCache, InvalidateDuringRequest)
+{
+    resetServer();
+    delayMs = 200;
+    DeviceCache cache;
+
+    thread requester([&]() { delete cache.getDeviceIds(bob, auth); });
+    this_thread::sleep_for(chrono::milliseconds(50));
+    cache.invalidate(bob);
+    requester.join();
+
+    // The list of the invalidated request is not in the cache
+    delayMs = 0;
+    delete cache.getDeviceIds(bob, auth);
+    ASSERT_EQ(2, requests);
+}
+
+static int32_t receiveData(const string& messageDescriptor, const string& attachmentDescriptor, const string& messageAttributes)
+{
+    return 0;
+}
+
+static void stateReport(int64_t messageIdentifier, int32_t statusCode, const string& stateInformation) {}
+
+static int32_t scans = 0;
+static void notify(int32_t notifyAction, const string& actionInformation, const string& devId)
+{
+    if (notifyAction == AppInterface::DEVICE_SCAN)
+        scans++;
+}
+
+// A device notification invalidates the user's device list
+TEST(DeviceCache, Notify)
+{
+    resetServer();
+    SQLiteStoreConv* store = new SQLiteStoreConv();
+    store->setKey(std::string((const char*)keyInData, 32));
+    store->openStore(string());
+
+    AppInterfaceImpl* uiIf = new AppInterfaceImpl(store, string("alice"), auth, string("aliceDev"), receiveData, stateReport, notify);
+    SipTransport* transport = new SipTransport(uiIf, store, uiIf->getDeviceCache());
+    uiIf->setTransport(transport);
+    DeviceCache* cache = uiIf->getDeviceCache();
+
+    delete cache->getDeviceIds(bob, auth);
+    delete cache->getDeviceIds(bob, auth);
+    ASSERT_EQ(1, requests);
+
+    string info("bob@sip.example.com:bobDev1;bobDev3;");
+    transport->notifyAxo((uint8_t*)info.data(), info.size());
+    ASSERT_EQ(1, scans);
+
+    delete cache->getDeviceIds(bob, auth);
+    ASSERT_EQ(2, requests);
+
+    delete uiIf;
+    delete store;
+}
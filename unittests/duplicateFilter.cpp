@@ -0,0 +1,198 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include "gtest/gtest.h"
+
+#include "../interfaceApp/DuplicateFilter.h"
+#include "../storage/logstore/LogStoreConv.h"
+#include "testHelper.h"
+
+#include <iostream>
+#include <string>
+#include <chrono>
+
+using namespace salamander;
+using namespace std;
+
+static const char* logFile = "duplicatetest.log";
+
+static string key(int32_t i)
+{
+    char msgId[20];
+    snprintf(msgId, sizeof(msgId), "msg-%d", i);
+    return DuplicateFilter::messageKey(aliceName, aliceDev, msgId);
+}
+
+static void checkStore(ConversationStore* store)
+{
+    ASSERT_FALSE(store->hasReceivedId(bobName, key(1)));
+    ASSERT_EQ(STORE_OK, store->insertReceivedId(bobName, key(1)));
+    ASSERT_EQ(STORE_OK, store->insertReceivedId(bobName, key(2)));
+    ASSERT_EQ(STORE_OK, store->insertReceivedId(bobName, key(1)));     // again, no error
+
+    ASSERT_TRUE(store->hasReceivedId(bobName, key(1)));
+    ASSERT_FALSE(store->hasReceivedId(aliceName, key(1)));
+    ASSERT_FALSE(store->hasReceivedId(bobName, key(3)));
+
+    list<string>* keys = store->loadReceivedIds(bobName, time(NULL) - 10);
+    ASSERT_TRUE(keys != NULL);
+    ASSERT_EQ(2, keys->size());
+    delete keys;
+
+    keys = store->loadReceivedIds(bobName, time(NULL) + 10);
+    ASSERT_TRUE(keys->empty());
+    delete keys;
+
+    store->deleteReceivedIds(time(NULL) - 10);
+    ASSERT_TRUE(store->hasReceivedId(bobName, key(2)));
+    store->deleteReceivedIds(time(NULL) + 10);
+    ASSERT_FALSE(store->hasReceivedId(bobName, key(2)));
+}
+
+TEST(DuplicateFilter, Store)
+{
+    SQLiteStoreConv* store = openStore();
+    checkStore(store);
+    delete store;
+
+    remove(logFile);
+    LogStoreConv* logStore = new LogStoreConv();
+    logStore->setKey(std::string((const char*)keyInData, 32));
+    logStore->openStore(logFile);
+    checkStore(logStore);
+    delete logStore;
+    remove(logFile);
+}
+
+TEST(DuplicateFilter, Basic)
+{
+    SQLiteStoreConv* store = openStore();
+    DuplicateFilter filter(store, bobName);
+
+    ASSERT_FALSE(filter.isDuplicate(key(1)));
+    ASSERT_EQ(STORE_OK, filter.add(key(1)));
+    ASSERT_TRUE(filter.isDuplicate(key(1)));
+    ASSERT_FALSE(filter.isDuplicate(key(2)));
+
+    // The same message id from another device is another message
+    ASSERT_FALSE(filter.isDuplicate(DuplicateFilter::messageKey(aliceName, "otherDevice", "msg-1")));
+
+    // The fields can't shift into each other
+    ASSERT_NE(DuplicateFilter::messageKey("a", "bc", "d"), DuplicateFilter::messageKey("ab", "c", "d"));
+
+    ASSERT_EQ(4, filter.getChecked());
+    ASSERT_EQ(1, filter.getDuplicates());
+
+    // A Bloom filter match that the store does not confirm is a false positive
+    store->deleteReceivedIds(time(NULL) + 10);
+    ASSERT_FALSE(filter.isDuplicate(key(1)));
+    ASSERT_EQ(1, filter.getDuplicates());
+    ASSERT_EQ(1, filter.getFalsePositives());
+    delete store;
+}
+
+TEST(DuplicateFilter, Rotate)
+{
+    SQLiteStoreConv* store = openStore();
+    DuplicateFilter filter(store, bobName, 100);
+
+    for (int32_t i = 0; i < 1000; i++)
+        filter.add(key(i));
+
+    // The filter remembers at least the last generation
+    for (int32_t i = 900; i < 1000; i++)
+        ASSERT_TRUE(filter.isDuplicate(key(i))) << i;
+
+    // Unknown keys rarely reach the store
+    for (int32_t i = 1000; i < 3000; i++)
+        ASSERT_FALSE(filter.isDuplicate(key(i)));
+    cerr << "False positives: " << filter.getFalsePositives() << " of 2000 checks" << endl;
+    ASSERT_GT(100, filter.getFalsePositives());
+
+    // A new filter loads the keys from the store
+    DuplicateFilter restarted(store, bobName, 2000);
+    for (int32_t i = 0; i < 1000; i++)
+        ASSERT_TRUE(restarted.isDuplicate(key(i))) << i;
+    delete store;
+}
+
+static int32_t numReceived;
+
+static int32_t receiveMessage(const string& messageDescriptor, const string& attachmentDescriptor, const string& messageAttributes)
+{
+    numReceived++;
+    return OK;
+}
+
+static int32_t numReports;
+
+static void stateReport(int64_t messageIdentifier, int32_t statusCode, const string& stateInformation)
+{
+    numReports++;
+}
+
+// The receive path drops the replayed envelope
+TEST(DuplicateFilter, Receive)
+{
+    SQLiteStoreConv* aliceStore = openAccount(aliceName);
+    SQLiteStoreConv* bobStore = openAccount(bobName);
+    connect(aliceStore, bobStore);
+
+    CollectTransport* transport = new CollectTransport();
+    AppInterfaceImpl aliceIf(aliceStore, aliceName, string("myAPI-key"), aliceDev, receiveMessage, stateReport, notifyStub);
+    aliceIf.setTransport(transport);
+    AppInterfaceImpl bobIf(bobStore, bobName, string("myAPI-key"), bobDev, receiveMessage, stateReport, notifyStub);
+    DuplicateFilter* filter = bobIf.getDuplicateFilter();
+    ASSERT_TRUE(filter != NULL);
+
+    CallContext ctx;
+    vector<int64_t>* msgIds = aliceIf.sendMessage(OutgoingMessage(bobName, "0a4b0f42-e5c6-11e5-9730-9a79f06e9478", "hello"), &ctx);
+    delete msgIds;
+    ASSERT_EQ(1, transport->numSent());
+    string envelope = transport->lastEnvelope();
+
+    numReceived = 0;
+    numReports = 0;
+    ASSERT_EQ(OK, bobIf.receiveMessage(envelope, &ctx));
+    ASSERT_EQ(1, numReceived);
+
+    // The replay is dropped without a report
+    ASSERT_EQ(DUPLICATE_MESSAGE, bobIf.receiveMessage(envelope, &ctx));
+    ASSERT_EQ(DUPLICATE_MESSAGE, ctx.getErrorCode());
+    ASSERT_EQ(1, numReceived);
+    ASSERT_EQ(0, numReports);
+    ASSERT_EQ(1, filter->getDuplicates());
+
+    // The next message passes
+    msgIds = aliceIf.sendMessage(OutgoingMessage(bobName, "1a4b0f42-e5c6-11e5-9730-9a79f06e9478", "again"), &ctx);
+    delete msgIds;
+    ASSERT_EQ(OK, bobIf.receiveMessage(transport->lastEnvelope(), &ctx));
+    ASSERT_EQ(2, numReceived);
+
+    // Drop time of a replay, the receive path stops before the ratchet
+    const int32_t rounds = 1000;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int32_t i = 0; i < rounds; i++)
+        bobIf.receiveMessage(envelope, &ctx);
+    int64_t micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    cerr << "Replayed envelope dropped in " << (double)micros / rounds << " us" << endl;
+    ASSERT_EQ(1 + rounds, filter->getDuplicates());
+    ASSERT_EQ(2, numReceived);
+
+    delete bobStore;
+    delete aliceStore;
+}
@@ -0,0 +1,219 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include "gtest/gtest.h"
+
+#include "../interfaceApp/EnvelopeView.h"
+#include "../interfaceApp/MessageEnvelope.pb.h"
+#include "../interfaceApp/AppInterfaceImpl.h"
+#include "../salamander/Constants.h"
+#include "../salamander/state/SalConversation.h"
+#include "../salamander/crypto/EcCurve.h"
+#include "../storage/sqlite/SQLiteStoreConv.h"
+#include "../util/b64helper.h"
+
+#include <iostream>
+#include <string>
+
+using namespace salamander;
+using namespace std;
+
+static std::string bobName("bob@milkyway.com");
+static std::string bobDev("0123456789abcdef0123456789abcdef");
+
+static const uint8_t keyInData[] = {0,1,2,3,4,5,6,7,8,9,19,18,17,16,15,14,13,12,11,10,20,21,22,23,24,25,26,27,28,20,31,30};
+
+static string empty;
+
+static bool parse(const string& data, EnvelopeView* view)
+{
+    return parseEnvelopeView((const uint8_t*)data.data(), data.size(), view);
+}
+
+static void expectSpan(bool has, const string& expected, const DataSpan& span)
+{
+    if (!has) {
+        EXPECT_TRUE(span.data == NULL);
+        return;
+    }
+    EXPECT_TRUE(span.data != NULL);
+    EXPECT_EQ(expected, span.toString());
+}
+
+// The view must return what the generated parser returns
+static void expectSameFields(const string& serialized)
+{
+    MessageEnvelope envelope;
+    ASSERT_TRUE(envelope.ParseFromString(serialized));
+
+    EnvelopeView view;
+    ASSERT_TRUE(parse(serialized, &view));
+
+    expectSpan(envelope.has_name(), envelope.name(), view.name);
+    expectSpan(envelope.has_scclientdevid(), envelope.scclientdevid(), view.scClientDevId);
+    EXPECT_EQ(envelope.device_id(), view.deviceId);
+    expectSpan(envelope.has_supplement(), envelope.supplement(), view.supplement);
+    expectSpan(envelope.has_message(), envelope.message(), view.message);
+    expectSpan(envelope.has_msgid(), envelope.msgid(), view.msgId);
+    expectSpan(envelope.has_recvidhash(), envelope.recvidhash(), view.recvIdHash);
+    expectSpan(envelope.has_senderidhash(), envelope.senderidhash(), view.senderIdHash);
+    expectSpan(envelope.has_recvdeviceid(), envelope.recvdeviceid(), view.recvDeviceId);
+    expectSpan(envelope.has_recvdevidbin(), envelope.recvdevidbin(), view.recvDevIdBin);
+    expectSpan(envelope.has_detached(), envelope.detached(), view.detached);
+}
+
+static string fullEnvelope()
+{
+    MessageEnvelope envelope;
+    envelope.set_name("alice@wonderland.org");
+    envelope.set_scclientdevid("aliceDevId");
+    envelope.set_device_id(300);
+    envelope.set_supplement(string(40, 's'));
+    envelope.set_message(string(1000, 'm'));
+    envelope.set_msgid("d2a6ba3e-a2ba-11e5-8f7c-0242ac110002");
+    envelope.set_recvidhash("rcv");
+    envelope.set_senderidhash("snd");
+    envelope.set_recvdeviceid(bobDev);
+    envelope.set_recvdevidbin(string("\x01\x23\x45\x67", 4));
+    envelope.set_detached(string(200, '\0'));
+
+    string serialized;
+    envelope.SerializeToString(&serialized);
+    return serialized;
+}
+
+TEST(EnvelopeView, SameAsGenerated)
+{
+    expectSameFields(fullEnvelope());
+
+    // Absent and empty fields are not the same
+    MessageEnvelope envelope;
+    envelope.set_name("alice@wonderland.org");
+    envelope.set_supplement(empty);
+    envelope.set_message("m");
+
+    string serialized;
+    envelope.SerializeToString(&serialized);
+    expectSameFields(serialized);
+
+    EnvelopeView view;
+    ASSERT_TRUE(parse(serialized, &view));
+    ASSERT_TRUE(view.supplement.data != NULL);
+    ASSERT_TRUE(view.supplement.empty());
+    ASSERT_TRUE(view.detached.data == NULL);
+
+    // An empty envelope is well-formed
+    expectSameFields(empty);
+}
+
+TEST(EnvelopeView, UnknownFields)
+{
+    string serialized = fullEnvelope();
+
+    // Field 20 as varint, field 21 as bytes, field 22 as fixed64, field 23 as fixed32
+    const char unknown[] = {(char)0xa0, 0x01, (char)0x96, 0x01,
+                            (char)0xaa, 0x01, 0x03, 'x', 'y', 'z',
+                            (char)0xb1, 0x01, 1, 2, 3, 4, 5, 6, 7, 8,
+                            (char)0xbd, 0x01, 1, 2, 3, 4};
+    serialized.append(unknown, sizeof(unknown));
+    expectSameFields(serialized);
+
+    // The last occurrence of a field wins
+    MessageEnvelope second;
+    second.set_message("second");
+    string secondSerialized;
+    second.SerializeToString(&secondSerialized);
+    serialized.append(secondSerialized);
+    expectSameFields(serialized);
+}
+
+TEST(EnvelopeView, Truncated)
+{
+    string serialized = fullEnvelope();
+
+    // Cutting the envelope within a field makes it malformed. Spans of a cut envelope
+    // never point behind the cut.
+    for (size_t length = 0; length < serialized.size(); length++) {
+        string cut = serialized.substr(0, length);
+        EnvelopeView view;
+        if (!parse(cut, &view))
+            continue;
+        const uint8_t* end = (const uint8_t*)cut.data() + cut.size();
+        ASSERT_TRUE(view.message.data == NULL || view.message.data + view.message.size <= end) << length;
+        ASSERT_TRUE(view.detached.data == NULL || view.detached.data + view.detached.size <= end) << length;
+    }
+    EnvelopeView view;
+    ASSERT_FALSE(parse(serialized.substr(0, serialized.size() - 1), &view));
+
+    // Length of the message field is larger than the data
+    const char bad[] = {0x2a, 0x10, 'm', 'm'};
+    ASSERT_FALSE(parse(string(bad, sizeof(bad)), &view));
+
+    // Wire type 7 does not exist
+    const char badType[] = {0x2f, 0x00};
+    ASSERT_FALSE(parse(string(badType, sizeof(badType)), &view));
+}
+
+static void stateReport(int64_t messageIdentifier, int32_t statusCode, const string& stateInformation) {}
+
+static int32_t receive(const string& messageDescriptor, const string& attachmentDescriptor, const string& messageAttributes)
+{
+    return OK;
+}
+
+static void notify(int32_t notifyAction, const string& actionInformation, const string& devId) {}
+
+static string toB64(const string& data)
+{
+    char* b64 = new char[data.size() * 2 + 4];
+    int32_t b64Len = b64Encode((const uint8_t*)data.data(), data.size(), b64, data.size() * 2 + 4);
+    string result(b64, b64Len);
+    delete[] b64;
+    return result;
+}
+
+// The receive path must report corrupt envelopes and ratchet messages, not read behind them
+TEST(EnvelopeView, ReceiveCorrupt)
+{
+    SQLiteStoreConv* store = new SQLiteStoreConv();
+    store->setKey(std::string((const char*)keyInData, 32));
+    store->openStore(string());
+
+    AxoConversation local(bobName, bobName, empty, store);
+    local.setDHIs(EcCurve::generateKeyPair(EcCurveTypes::Curve25519));
+    local.storeConversation();
+
+    AppInterfaceImpl bobIf(store, bobName, string("myAPI-key"), bobDev, receive, stateReport, notify);
+    CallContext ctx;
+
+    MessageEnvelope envelope;
+    envelope.set_name("alice@wonderland.org");
+    envelope.set_scclientdevid("aliceDevId");
+
+    // Malformed envelope
+    string serialized;
+    envelope.set_message(string(100, '\x01'));
+    envelope.SerializeToString(&serialized);
+    ASSERT_EQ(CORRUPT_DATA, bobIf.receiveMessage(toB64(serialized.substr(0, serialized.size() - 1)), &ctx));
+
+    // Well-formed envelope, ratchet messages too short for their headers
+    for (size_t length = 0; length < 80; length += 3) {
+        envelope.set_message(string(length, '\x01'));
+        envelope.SerializeToString(&serialized);
+        ASSERT_GT(0, bobIf.receiveMessage(toB64(serialized), &ctx)) << length;
+    }
+    delete store;
+}
@@ -0,0 +1,376 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include "gtest/gtest.h"
+
+#include "../interfaceApp/DetachedPayload.h"
+#include "../interfaceApp/MessageEnvelope.pb.h"
+#include "../salamander/crypto/Ec255PublicKey.h"
+#include "../util/WorkerPool.h"
+#include "../util/b64helper.h"
+#include "testHelper.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+using namespace salamander;
+using namespace std;
+
+static string bobDevice(int32_t i)
+{
+    char dev[50];
+    snprintf(dev, sizeof(dev), "%032x", i + 1);
+    return string(dev);
+}
+
+static SQLiteStoreConv* prepareStore(int32_t numDevices)
+{
+    SQLiteStoreConv* store = openAccount(aliceName);
+
+    // Conversations that are ready to send, the first message does a DH ratchet step
+    for (int32_t i = 0; i < numDevices; i++) {
+        AxoConversation conv(aliceName, bobName, bobDevice(i), store);
+        conv.setRK(string(32, 'r'));
+        conv.setCKs(string(32, 'c'));
+        conv.setDHIr(new Ec255PublicKey(keyInData));
+        conv.setDHRr(new Ec255PublicKey(keyInData));
+        conv.setDHRs(EcCurve::generateKeyPair(EcCurveTypes::Curve25519));
+        conv.setRatchetFlag(true);
+        conv.storeConversation();
+    }
+    return store;
+}
+
+static string messageDescriptor(int32_t i)
+{
+    char descriptor[200];
+    snprintf(descriptor, sizeof(descriptor), "{\"recipient\": \"%s\", \"msgId\": \"msg-%d\", \"message\": \"Hello Bob\"}",
+             bobName.c_str(), i);
+    return string(descriptor);
+}
+
+TEST(WorkerPool, RunAll)
+{
+    WorkerPool pool(3);
+    ASSERT_EQ(3, pool.getNumThreads());
+
+    // Several callers share the pool, each waits for its own batch only
+    atomic<int32_t> total(0);
+    vector<thread> callers;
+    for (int32_t c = 0; c < 4; c++) {
+        callers.push_back(thread([&pool, &total]() {
+            for (int32_t round = 0; round < 50; round++) {
+                vector<int32_t> results(10, 0);
+                vector<function<void()> > jobs;
+                for (int32_t i = 0; i < 10; i++)
+                    jobs.push_back([&results, i]() { results[i] = i * i; });
+                pool.runAll(jobs);
+                for (int32_t i = 0; i < 10; i++) {
+                    if (results[i] == i * i)
+                        total++;
+                }
+            }
+        }));
+    }
+    for (size_t c = 0; c < callers.size(); c++)
+        callers[c].join();
+    ASSERT_EQ(4 * 50 * 10, total);
+
+    // No pool threads: the caller runs the jobs
+    WorkerPool callerOnly(0);
+    int32_t count = 0;
+    vector<function<void()> > jobs(5, [&count]() { count++; });
+    callerOnly.runAll(jobs);
+    ASSERT_EQ(5, count);
+}
+
+TEST(FanOut, DeviceOrder)
+{
+    const int32_t numDevices = 8;
+    SQLiteStoreConv* store = prepareStore(numDevices);
+    // The interface owns and deletes the transport
+    CollectTransport* transport = new CollectTransport();
+
+    AppInterfaceImpl uiIf(store, aliceName, string("myAPI-key"), aliceDev);
+    uiIf.setTransport(transport);
+    uiIf.setWorkerThreads(4);
+
+    CallContext ctx;
+    vector<int64_t>* msgIds = uiIf.sendMessage(messageDescriptor(1), empty, empty, &ctx);
+    ASSERT_TRUE(msgIds != NULL) << ctx.getErrorCode();
+    ASSERT_EQ(numDevices, msgIds->size());
+    delete msgIds;
+
+    // Messages follow the order of the stored devices
+    list<string>* devices = store->getLongDeviceIds(bobName, aliceName);
+    ASSERT_EQ(numDevices, transport->sent.size());
+    for (size_t i = 0; i < transport->sent.size(); i++) {
+        ASSERT_EQ(devices->front(), transport->sent[i].first);
+        ASSERT_FALSE(transport->sent[i].second.empty());
+        devices->pop_front();
+    }
+    delete devices;
+
+    // The batch stored all updated conversations
+    for (int32_t i = 0; i < numDevices; i++) {
+        AxoConversation* conv = AxoConversation::loadConversation(aliceName, bobName, bobDevice(i), store);
+        ASSERT_TRUE(conv != NULL);
+        ASSERT_EQ(1, conv->getNs());
+        ASSERT_FALSE(conv->getRatchetFlag());
+        delete conv;
+    }
+    delete store;
+}
+
+TEST(DetachedPayload, Basic)
+{
+    string message(10000, 'm');
+    string supplements("{\"a\":\"attachment descriptor\"}");
+
+    string keyDescriptor;
+    string detached;
+    ASSERT_EQ(SUCCESS, detachPayload(message, supplements, &keyDescriptor, &detached));
+    ASSERT_LT(keyDescriptor.size(), 200);
+    ASSERT_GT(detached.size(), message.size() + supplements.size());
+
+    string messagePlain;
+    string supplementsPlain;
+    ASSERT_EQ(SUCCESS, attachPayload(keyDescriptor, detached, &messagePlain, &supplementsPlain));
+    ASSERT_EQ(message, messagePlain);
+    ASSERT_EQ(supplements, supplementsPlain);
+
+    // A random nonce makes the key random, even for the same payload
+    string keyDescriptor2;
+    string detached2;
+    ASSERT_EQ(SUCCESS, detachPayload(message, supplements, &keyDescriptor2, &detached2));
+    ASSERT_NE(keyDescriptor, keyDescriptor2);
+    ASSERT_NE(detached, detached2);
+
+    // The locator check detects a modified payload
+    detached[detached.size() / 2] ^= 1;
+    ASSERT_EQ(DETACHED_PAYLOAD_FAILED, attachPayload(keyDescriptor, detached, &messagePlain, &supplementsPlain));
+
+    // Payload of another message
+    ASSERT_EQ(DETACHED_PAYLOAD_FAILED, attachPayload(keyDescriptor, detached2, &messagePlain, &supplementsPlain));
+    ASSERT_EQ(DETACHED_PAYLOAD_FAILED, attachPayload(string("{}"), detached2, &messagePlain, &supplementsPlain));
+}
+
+static MessageEnvelope parseEnvelope(const string& b64Envelope)
+{
+    vector<uint8_t> binBuffer(b64Envelope.size());
+    int32_t binLength = b64Decode(b64Envelope.data(), b64Envelope.size(), &binBuffer[0], binBuffer.size());
+
+    MessageEnvelope envelope;
+    envelope.ParseFromArray(&binBuffer[0], binLength);
+    return envelope;
+}
+
+TEST(FanOut, DetachedPayload)
+{
+    const int32_t numDevices = 4;
+    SQLiteStoreConv* store = prepareStore(numDevices);
+    CollectTransport* transport = new CollectTransport();
+
+    AppInterfaceImpl uiIf(store, aliceName, string("myAPI-key"), aliceDev);
+    uiIf.setTransport(transport);
+    uiIf.setDetachThreshold(1000);
+
+    string message(5000, 'x');
+    char descriptor[6000];
+    snprintf(descriptor, sizeof(descriptor), "{\"recipient\": \"%s\", \"msgId\": \"msg-1\", \"message\": \"%s\"}",
+             bobName.c_str(), message.c_str());
+
+    CallContext ctx;
+    delete uiIf.sendMessage(string(descriptor), empty, empty, &ctx);
+    ASSERT_EQ(numDevices, transport->sent.size());
+
+    // All devices get the same payload, the ratchet message contains only the key descriptor
+    MessageEnvelope first = parseEnvelope(transport->sent[0].second);
+    ASSERT_TRUE(first.has_detached());
+    for (size_t i = 0; i < transport->sent.size(); i++) {
+        MessageEnvelope envelope = parseEnvelope(transport->sent[i].second);
+        ASSERT_EQ(first.detached(), envelope.detached());
+        ASSERT_LT(envelope.message().size(), 500);
+    }
+
+    // Small messages go with the ratchet message
+    transport->clear();
+    delete uiIf.sendMessage(messageDescriptor(2), empty, empty, &ctx);
+    ASSERT_EQ(numDevices, transport->sent.size());
+    ASSERT_FALSE(parseEnvelope(transport->sent[0].second).has_detached());
+    delete store;
+}
+
+static vector<string> received;
+
+static int32_t receiveData(const string& messageDescriptor, const string& attachmentDescriptor, const string& messageAttributes)
+{
+    received.push_back(messageDescriptor + attachmentDescriptor);
+    return 0;
+}
+
+static void stateReport(int64_t messageIdentifier, int32_t statusCode, const string& stateInformation)
+{
+    received.push_back(string("error"));
+}
+
+// Alice sends a detached payload to two devices of Bob, each device gets the message
+TEST(FanOut, DetachedRoundTrip)
+{
+    const int32_t numDevices = 2;
+    SQLiteStoreConv* aliceStore = prepareStore(0);
+
+    // Set up the conversations like a ZRTP call between Alice and each of Bob's devices
+    vector<SQLiteStoreConv*> bobStores;
+    string exportedKey((const char*)keyInData, 32);
+    for (int32_t i = 0; i < numDevices; i++) {
+        SQLiteStoreConv* bobStore = new SQLiteStoreConv();
+        bobStore->setKey(std::string((const char*)keyInData, 32));
+        bobStore->openStore(string());
+        AxoConversation local(bobName, bobName, empty, bobStore);
+        local.setDHIs(EcCurve::generateKeyPair(EcCurveTypes::Curve25519));
+        local.storeConversation();
+        bobStores.push_back(bobStore);
+
+        string aliceToBob = getAxoPublicKeyData(aliceName, bobName, bobDevice(i), aliceStore);
+        string bobToAlice = getAxoPublicKeyData(bobName, aliceName, aliceDev, bobStore);
+        setAxoPublicKeyData(aliceName, bobName, bobDevice(i), bobToAlice);
+        setAxoPublicKeyData(bobName, aliceName, aliceDev, aliceToBob);
+        setAxoExportedKey(aliceName, bobName, bobDevice(i), exportedKey);
+        setAxoExportedKey(bobName, aliceName, aliceDev, exportedKey);
+    }
+    CollectTransport* transport = new CollectTransport();
+    AppInterfaceImpl aliceIf(aliceStore, aliceName, string("myAPI-key"), aliceDev);
+    aliceIf.setTransport(transport);
+    aliceIf.setDetachThreshold(1000);
+
+    string message(3000, 'y');
+    string descriptor("{\"recipient\": \"" + bobName + "\", \"msgId\": \"msg-1\", \"message\": \"" + message + "\"}");
+    string attachment("attachment descriptor");
+
+    CallContext ctx;
+    delete aliceIf.sendMessage(descriptor, attachment, empty, &ctx);
+    ASSERT_EQ(numDevices, transport->sent.size());
+    ASSERT_TRUE(parseEnvelope(transport->sent[0].second).has_detached());
+
+    received.clear();
+    for (int32_t i = 0; i < numDevices; i++) {
+        AppInterfaceImpl bobIf(bobStores[i], bobName, string("myAPI-key"), bobDevice(i), receiveData, stateReport, notifyStub);
+        ASSERT_EQ(bobDevice(i), transport->sent[i].first);
+        ASSERT_EQ(OK, bobIf.receiveMessage(transport->sent[i].second, &ctx)) << ctx.getErrorCode();
+    }
+    ASSERT_EQ(numDevices, received.size());
+    for (size_t i = 0; i < received.size(); i++) {
+        ASSERT_NE(string::npos, received[i].find(message));
+        ASSERT_NE(string::npos, received[i].find(attachment));
+    }
+    for (int32_t i = 0; i < numDevices; i++)
+        delete bobStores[i];
+    delete aliceStore;
+}
+
+static int64_t runFanOut(int32_t threads, int32_t numDevices, int32_t numMessages)
+{
+    SQLiteStoreConv* store = prepareStore(numDevices);
+    // The interface owns and deletes the transport
+    CollectTransport* transport = new CollectTransport();
+
+    AppInterfaceImpl uiIf(store, aliceName, string("myAPI-key"), aliceDev);
+    uiIf.setTransport(transport);
+    uiIf.setWorkerThreads(threads);
+
+    CallContext ctx;
+    chrono::steady_clock::duration elapsed(0);
+    for (int32_t i = 0; i < numMessages; i++) {
+        // Each message starts with a DH ratchet step, like the first reply in a conversation
+        if (i > 0) {
+            for (int32_t d = 0; d < numDevices; d++) {
+                AxoConversation* conv = AxoConversation::loadConversation(aliceName, bobName, bobDevice(d), store);
+                conv->setRatchetFlag(true);
+                conv->storeConversation();
+                delete conv;
+            }
+        }
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        delete uiIf.sendMessage(messageDescriptor(i), empty, empty, &ctx);
+        elapsed += chrono::steady_clock::now() - start;
+    }
+    delete store;
+    return chrono::duration_cast<chrono::microseconds>(elapsed).count();
+}
+
+// Not a pass/fail test: send latency to a user with several devices, encrypted on
+// the sending thread only and on the worker pool.
+TEST(FanOut, Latency)
+{
+    const int32_t numMessages = 20;
+    int32_t threads = WorkerPool::defaultThreads();
+
+    for (int32_t numDevices = 2; numDevices <= 10; numDevices += 4) {
+        int64_t sequential = runFanOut(0, numDevices, numMessages);
+        int64_t parallel = runFanOut(threads, numDevices, numMessages);
+        cerr << numDevices << " devices: sequential " << sequential / numMessages << "us/message, "
+             << threads << " workers " << parallel / numMessages << "us/message" << endl;
+    }
+}
+
+static int64_t runDetached(int32_t numDevices, size_t messageSize, size_t threshold, int32_t numMessages, size_t* sentBytes)
+{
+    SQLiteStoreConv* store = prepareStore(numDevices);
+    CollectTransport* transport = new CollectTransport();
+
+    AppInterfaceImpl uiIf(store, aliceName, string("myAPI-key"), aliceDev);
+    uiIf.setTransport(transport);
+    uiIf.setWorkerThreads(0);
+    uiIf.setDetachThreshold(threshold);
+
+    string descriptor("{\"recipient\": \"" + bobName + "\", \"msgId\": \"msg-1\", \"message\": \"" + string(messageSize, 'x') + "\"}");
+
+    CallContext ctx;
+    *sentBytes = 0;
+    chrono::steady_clock::duration elapsed(0);
+    for (int32_t i = 0; i < numMessages; i++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        delete uiIf.sendMessage(descriptor, empty, empty, &ctx);
+        elapsed += chrono::steady_clock::now() - start;
+    }
+    for (size_t p = 0; p < transport->sent.size(); p++)
+        *sentBytes += transport->sent[p].second.size();
+    delete store;
+    return chrono::duration_cast<chrono::microseconds>(elapsed).count();
+}
+
+// Not a pass/fail test: send latency of a 64KB message with and without a detached payload
+TEST(FanOut, DetachedLatency)
+{
+    const int32_t numMessages = 10;
+    const size_t messageSize = 64 * 1024;
+
+    for (int32_t numDevices = 2; numDevices <= 10; numDevices += 4) {
+        size_t ratchetBytes;
+        size_t detachedBytes;
+        int64_t ratchet = runDetached(numDevices, messageSize, 0, numMessages, &ratchetBytes);
+        int64_t detached = runDetached(numDevices, messageSize, 1024, numMessages, &detachedBytes);
+        cerr << numDevices << " devices: ratchet only " << ratchet / numMessages << "us/message, "
+             << "detached " << detached / numMessages << "us/message, envelope bytes "
+             << ratchetBytes / numMessages << " vs " << detachedBytes / numMessages << endl;
+    }
+}
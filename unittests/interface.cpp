@@ -13,7 +13,6 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
-(replace-string "salamander" "salamander")
 #include <limits.h>
 
 #include "../storage/sqlite/SQLiteStoreConv.h"
@@ -35,6 +34,8 @@ limitations under the License.
 #include <iostream>
 #include <string>
 #include <utility>
+#include <thread>
+#include <vector>
 
 static const uint8_t keyInData[] = {0,1,2,3,4,5,6,7,8,9,19,18,17,16,15,14,13,12,11,10,20,21,22,23,24,25,26,27,28,20,31,30};
 static const uint8_t keyInData_1[] = {0,1,2,3,4,5,6,7,8,9,19,18,17,16,15,14,13,12,11,10,20,21,22,23,24,25,26,27,28,20,31,32};
@@ -89,7 +90,8 @@ static int32_t helper0(const std::string& requestUrl, const std::string& method,
 
 TEST(RegisterRequest, Basic)
 {
-    store = SQLiteStoreConv::getStore();
+    if (store == NULL)
+        store = new SQLiteStoreConv();
     if (!store->isReady()) {
         store->setKey(std::string((const char*)keyInData, 32));
         store->openStore(std::string());
@@ -99,10 +101,10 @@ TEST(RegisterRequest, Basic)
     string name("wernerd");
     string devId("myDev-id");
     AppInterfaceImpl uiIf(store, name, string("myAPI-key"), devId);
-    AxoConversation* ownAxoConv = AxoConversation::loadLocalConversation(name);
+    AxoConversation* ownAxoConv = AxoConversation::loadLocalConversation(name, store);
 
     if (ownAxoConv == NULL) {  // no yet available, create one. An own conversation has the same local and remote name
-        ownAxoConv = new AxoConversation(name, name, empty);
+        ownAxoConv = new AxoConversation(name, name, empty, store);
         const DhKeyPair* idKeyPair = EcCurve::generateKeyPair(EcCurveTypes::Curve25519);
         ownAxoConv->setDHIs(idKeyPair);
         ownAxoConv->storeConversation();
@@ -180,7 +182,8 @@ static int32_t helper1(const std::string& requestUrl, const std::string& method,
 
 TEST(PreKeyBundle, Basic)
 {
-    store = SQLiteStoreConv::getStore();
+    if (store == NULL)
+        store = new SQLiteStoreConv();
     if (!store->isReady()) {
         store->setKey(std::string((const char*)keyInData, 32));
         store->openStore(std::string());
@@ -230,7 +233,8 @@ static int32_t helper2(const std::string& requestUrl, const std::string& method,
 
 // TEST(AvailabePreKeys, Basic)
 // {
-//     store = SQLiteStoreConv::getStore();
+//     if (store == NULL)
+//         store = new SQLiteStoreConv();
 //     if (!store->isReady()) {
 //         store->setKey(std::string((const char*)keyInData, 32));
 //         store->openStore(std::string());
@@ -274,7 +278,8 @@ static int32_t helper3(const std::string& requestUrl, const std::string& method,
 
 TEST(GetDeviceIds, Basic)
 {
-    store = SQLiteStoreConv::getStore();
+    if (store == NULL)
+        store = new SQLiteStoreConv();
     if (!store->isReady()) {
         store->setKey(std::string((const char*)keyInData, 32));
         store->openStore(std::string());
@@ -328,7 +333,8 @@ static int32_t helper5(const std::string& requestUrl, const std::string& method,
 
 TEST(newPreKeys, Basic)
 {
-    store = SQLiteStoreConv::getStore();
+    if (store == NULL)
+        store = new SQLiteStoreConv();
     if (!store->isReady()) {
         store->setKey(std::string((const char*)keyInData, 32));
         store->openStore(std::string());
@@ -339,3 +345,50 @@ TEST(newPreKeys, Basic)
     int32_t ret = Provisioning::newPreKeys(store, bobDevId, bobAuth, 10, &result);
     ASSERT_TRUE(ret > 0) << "Actual return value: " << ret;
 }
+
+// Each thread sends malformed message descriptors with its own call context. Every
+// context must report the error of its own call, the stored error of the instance
+// stays untouched.
+TEST(CallContext, Concurrent)
+{
+    if (store == NULL)
+        store = new SQLiteStoreConv();
+    if (!store->isReady()) {
+        store->setKey(std::string((const char*)keyInData, 32));
+        store->openStore(std::string());
+    }
+    AppInterfaceImpl uiIf(store, string("wernerd"), string("myAPI-key"), string("myDev-id"));
+
+    static const char* descriptors[] = {
+        "{\"msgId\": \"4711\", \"message\": \"text\"}",
+        "{\"recipient\": \"bob\", \"message\": \"text\"}",
+        "{\"recipient\": \"bob\", \"msgId\": \"4711\"}"
+    };
+    static const char* missing[] = {"recipient", "msgId", "message"};
+
+    vector<std::thread> threads;
+    vector<int32_t> failures(6, 0);
+    for (int32_t t = 0; t < 6; t++) {
+        threads.push_back(std::thread([&uiIf, &failures, t]() {
+            CallContext ctx;
+            for (int32_t i = 0; i < 500; i++) {
+                int32_t which = (t + i) % 3;
+                vector<int64_t>* msgIds = uiIf.sendMessage(descriptors[which], empty, empty, &ctx);
+                if (msgIds != NULL || ctx.getErrorCode() != JS_FIELD_MISSING || ctx.getErrorInfo() != missing[which])
+                    failures[t]++;
+                delete msgIds;
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+
+    for (size_t t = 0; t < failures.size(); t++)
+        ASSERT_EQ(0, failures[t]) << "thread " << t;
+    ASSERT_TRUE(uiIf.getErrorInfo().empty());
+
+    // The functions without context still report in the instance
+    ASSERT_TRUE(uiIf.sendMessage(descriptors[1], empty, empty) == NULL);
+    ASSERT_EQ(JS_FIELD_MISSING, uiIf.getErrorCode());
+    ASSERT_EQ(string("msgId"), uiIf.getErrorInfo());
+}
@@ -0,0 +1,290 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "../storage/logstore/LogStoreConv.h"
+#include "../storage/sqlite/SQLiteStoreConv.h"
+
+#include <iostream>
+#include <string>
+#include <chrono>
+
+using namespace salamander;
+using namespace std;
+
+static std::string aliceName("alice@wonderland.org");
+
+static const uint8_t keyInData[] = {0,1,2,3,4,5,6,7,8,9,19,18,17,16,15,14,13,12,11,10,20,21,22,23,24,25,26,27,28,20,31,30};
+static const uint8_t keyInData_1[] = {0,1,2,3,4,5,6,7,8,9,19,18,17,16,15,14,13,12,11,10,20,21,22,23,24,25,26,27,28,20,31,32};
+
+static const char* logFile = "logstoretest.log";
+static const char* dbFile = "logstoretest.db";
+
+static LogStoreConv* openLogStore(const string& name)
+{
+    LogStoreConv* store = new LogStoreConv();
+    store->setKey(std::string((const char*)keyInData, 32));
+    store->openStore(name);
+    if (STORE_FAIL(store->getStoreCode())) {
+        cerr << store->getLastError() << endl;
+        exit(1);
+    }
+    return store;
+}
+
+static string peerName(int32_t i)
+{
+    char name[50];
+    snprintf(name, sizeof(name), "peer_%d@milkyway.com", i);
+    return string(name);
+}
+
+static string peerDevice(int32_t i)
+{
+    char dev[50];
+    snprintf(dev, sizeof(dev), "devId_%d", i);
+    return string(dev);
+}
+
+TEST(LogStore, Conversations)
+{
+    remove(logFile);
+    LogStoreConv* store = openLogStore(logFile);
+
+    string data("conversation data");
+    for (int32_t i = 0; i < 20; i++) {
+        store->storeConversation(peerName(i), peerDevice(i), aliceName, data);
+        store->storeConversation(peerName(i), peerDevice(i+100), aliceName, data + peerDevice(i));
+    }
+    // The local conversation has no device id
+    store->storeConversation(aliceName, string(), aliceName, data);
+    delete store;
+
+    // Replay the log
+    store = openLogStore(logFile);
+    for (int32_t i = 0; i < 20; i++) {
+        ASSERT_TRUE(store->hasConversation(peerName(i), peerDevice(i), aliceName));
+        string* stored = store->loadConversation(peerName(i), peerDevice(i+100), aliceName);
+        ASSERT_TRUE(stored != NULL);
+        ASSERT_EQ(data + peerDevice(i), *stored);
+        delete stored;
+    }
+    ASSERT_TRUE(store->hasConversation(aliceName, string(), aliceName));
+
+    list<string>* names = store->getKnownConversations(aliceName);
+    ASSERT_EQ(21, names->size());
+    delete names;
+
+    list<string>* devIds = store->getLongDeviceIds(aliceName, aliceName);
+    ASSERT_EQ(0, devIds->size());
+    delete devIds;
+
+    devIds = store->getLongDeviceIds(peerName(3), aliceName);
+    ASSERT_EQ(2, devIds->size());
+    delete devIds;
+
+    // Check several devices at once
+    string dev3 = peerDevice(3), dev4 = peerDevice(4), dev103 = peerDevice(103);
+    vector<DataSpan> devices;
+    devices.push_back(DataSpan(dev103));
+    devices.push_back(DataSpan(dev4));
+    devices.push_back(DataSpan(dev3));
+    vector<bool> known;
+    ASSERT_EQ(STORE_OK, store->hasConversations(peerName(3), devices, aliceName, &known));
+    ASSERT_EQ(3, known.size());
+    ASSERT_TRUE(known[0]);
+    ASSERT_FALSE(known[1]);
+    ASSERT_TRUE(known[2]);
+
+    devices.assign(1, DataSpan());
+    ASSERT_EQ(STORE_OK, store->hasConversations(aliceName, devices, aliceName, &known));
+    ASSERT_TRUE(known[0]);
+
+    store->deleteConversationsName(peerName(3), aliceName);
+    ASSERT_FALSE(store->hasConversation(peerName(3), peerDevice(3), aliceName));
+    ASSERT_FALSE(store->hasConversation(peerName(3), peerDevice(103), aliceName));
+    delete store;
+
+    store = openLogStore(logFile);
+    ASSERT_FALSE(store->hasConversation(peerName(3), peerDevice(3), aliceName));
+    ASSERT_TRUE(store->hasConversation(peerName(4), peerDevice(4), aliceName));
+    delete store;
+    remove(logFile);
+}
+
+TEST(LogStore, WrongKey)
+{
+    remove(logFile);
+    LogStoreConv* store = openLogStore(logFile);
+    store->storeConversation(peerName(1), peerDevice(1), aliceName, "data");
+    delete store;
+
+    store = new LogStoreConv();
+    store->setKey(std::string((const char*)keyInData_1, 32));
+    ASSERT_EQ(STORE_NOTADB, store->openStore(logFile));
+    ASSERT_FALSE(store->isReady());
+    delete store;
+
+    // The log is unchanged
+    store = openLogStore(logFile);
+    ASSERT_TRUE(store->hasConversation(peerName(1), peerDevice(1), aliceName));
+    delete store;
+    remove(logFile);
+}
+
+TEST(LogStore, Recovery)
+{
+    remove(logFile);
+    LogStoreConv* store = openLogStore(logFile);
+    store->storeConversation(peerName(1), peerDevice(1), aliceName, "data 1");
+    size_t goodEnd = store->getLogSize();
+    store->storeConversation(peerName(2), peerDevice(2), aliceName, "data 2");
+    size_t end = store->getLogSize();
+    delete store;
+
+    // Cut the last record in half, as if the write did not complete
+    ASSERT_EQ(0, truncate(logFile, (goodEnd + end) / 2));
+
+    store = openLogStore(logFile);
+    ASSERT_EQ(goodEnd, store->getLogSize());
+    ASSERT_TRUE(store->hasConversation(peerName(1), peerDevice(1), aliceName));
+    ASSERT_FALSE(store->hasConversation(peerName(2), peerDevice(2), aliceName));
+
+    store->storeConversation(peerName(3), peerDevice(3), aliceName, "data 3");
+    delete store;
+
+    store = openLogStore(logFile);
+    string* data = store->loadConversation(peerName(3), peerDevice(3), aliceName);
+    ASSERT_TRUE(data != NULL);
+    ASSERT_EQ(string("data 3"), *data);
+    delete data;
+    delete store;
+    remove(logFile);
+}
+
+TEST(LogStore, IncompleteBatch)
+{
+    remove(logFile);
+    LogStoreConv* store = openLogStore(logFile);
+    store->storePreKey(1, "pre-key 1");
+    size_t start = store->getLogSize();
+
+    list<pair<int32_t, string> > preKeys;
+    for (int32_t i = 10; i < 20; i++)
+        preKeys.push_back(pair<int32_t, string>(i, "pre-key"));
+    ASSERT_EQ(STORE_OK, store->storePreKeys(preKeys));
+    size_t end = store->getLogSize();
+    delete store;
+
+    // Drop the commit record and some of the pre-keys
+    ASSERT_EQ(0, truncate(logFile, (start + end) / 2));
+
+    store = openLogStore(logFile);
+    ASSERT_TRUE(store->containsPreKey(1));
+    list<int32_t>* ids = store->getPreKeyIds();
+    ASSERT_EQ(1, ids->size());
+    delete ids;
+    delete store;
+    remove(logFile);
+}
+
+TEST(LogStore, Compaction)
+{
+    remove(logFile);
+    LogStoreConv* store = openLogStore(logFile);
+
+    // Overwrite the same conversations, the store compacts the log once the
+    // superseded records take up more than half of it
+    string data(1000, 'x');
+    for (int32_t i = 0; i < 5000; i++)
+        store->storeConversation(peerName(i % 10), peerDevice(1), aliceName, data + peerName(i));
+
+    ASSERT_LT(store->getLogSize(), 4 * 1024 * 1024);
+
+    store->deleteConversation(peerName(0), peerDevice(1), aliceName);
+    ASSERT_GT(store->getGarbageSize(), 0);
+    ASSERT_EQ(STORE_OK, store->incrementalVacuum(0)) << store->getLastError();
+    ASSERT_EQ(0, store->getGarbageSize());
+    delete store;
+
+    store = openLogStore(logFile);
+    ASSERT_FALSE(store->hasConversation(peerName(0), peerDevice(1), aliceName));
+    for (int32_t i = 1; i < 10; i++) {
+        string* stored = store->loadConversation(peerName(i), peerDevice(1), aliceName);
+        ASSERT_TRUE(stored != NULL);
+        ASSERT_EQ(data + peerName(4990 + i), *stored);
+        delete stored;
+    }
+    delete store;
+    remove(logFile);
+}
+
+static void runThroughput(ConversationStore* store, const char* backend)
+{
+    const int32_t numPeers = 500;
+    const int32_t numRounds = 4;
+    string data(2000, 'x');
+    string mk(64, 'k');
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int32_t round = 0; round < numRounds; round++) {
+        for (int32_t i = 0; i < numPeers; i++) {
+            store->storeConversation(peerName(i), peerDevice(i), aliceName, data);
+            store->insertStagedMk(peerName(i), peerDevice(i), aliceName, mk + peerName(round));
+        }
+    }
+    chrono::steady_clock::duration writes = chrono::steady_clock::now() - start;
+
+    start = chrono::steady_clock::now();
+    for (int32_t round = 0; round < numRounds; round++) {
+        for (int32_t i = 0; i < numPeers; i++) {
+            string* stored = store->loadConversation(peerName(i), peerDevice(i), aliceName);
+            delete stored;
+            list<string>* mks = store->loadStagedMks(peerName(i), peerDevice(i), aliceName);
+            delete mks;
+        }
+    }
+    chrono::steady_clock::duration reads = chrono::steady_clock::now() - start;
+
+    cerr << backend << ": " << numPeers * numRounds * 2 << " writes: "
+         << chrono::duration_cast<chrono::milliseconds>(writes).count() << "ms, "
+         << numPeers * numRounds * 2 << " reads: "
+         << chrono::duration_cast<chrono::milliseconds>(reads).count() << "ms" << endl;
+}
+
+// Not a pass/fail test: compare the throughput of both backends for conversation
+// and staged message key writes and reads.
+TEST(LogStore, Throughput)
+{
+    remove(logFile);
+    remove(dbFile);
+
+    SQLiteStoreConv* sqlStore = new SQLiteStoreConv();
+    sqlStore->setKey(std::string((const char*)keyInData, 32));
+    sqlStore->openStore(dbFile);
+    runThroughput(sqlStore, "SQLite");
+    delete sqlStore;
+
+    LogStoreConv* logStore = openLogStore(logFile);
+    runThroughput(logStore, "Log");
+    delete logStore;
+
+    remove(logFile);
+    remove(dbFile);
+}
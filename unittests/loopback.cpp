@@ -0,0 +1,410 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include "gtest/gtest.h"
+
+#include "../interfaceTransport/loopback/LoopbackTransport.h"
+#include "testHelper.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <ctime>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+using namespace salamander;
+using namespace std;
+
+static string messageId(int32_t i)
+{
+    char msgId[40];
+    snprintf(msgId, sizeof(msgId), "%08x-e5c6-11e5-9730-9a79f06e9478", i);
+    return string(msgId);
+}
+
+// The receive callback runs on the network's thread
+static mutex receiveLock;
+static condition_variable receiveChanged;
+static vector<IncomingMessage> received;
+static map<string, chrono::steady_clock::time_point> receiveTimes;
+
+static int32_t receiveMessage(IncomingMessage&& message)
+{
+    unique_lock<mutex> lck(receiveLock);
+    receiveTimes[message.msgId] = chrono::steady_clock::now();
+    received.push_back(std::move(message));
+    receiveChanged.notify_all();
+    return OK;
+}
+
+static vector<int64_t> reports;
+
+static void stateReport(int64_t messageIdentifier, int32_t statusCode, const string& stateInformation)
+{
+    unique_lock<mutex> lck(receiveLock);
+    if (statusCode == OK)
+        reports.push_back(messageIdentifier);
+    receiveChanged.notify_all();
+}
+
+static bool waitReceived(size_t count)
+{
+    unique_lock<mutex> lck(receiveLock);
+    return receiveChanged.wait_for(lck, chrono::seconds(60), [count]{ return received.size() >= count; });
+}
+
+// Alice and Bob, connected by a loopback network
+class LoopbackTest : public ::testing::Test
+{
+protected:
+    void SetUp()
+    {
+        aliceStore = openAccount(aliceName);
+        bobStore = openAccount(bobName);
+        connect(aliceStore, bobStore);
+
+        network = new LoopbackNetwork();
+        aliceIf = new AppInterfaceImpl(aliceStore, aliceName, string("myAPI-key"), aliceDev, receiveStub, stateReport, notifyStub);
+        aliceIf->setTransport(new LoopbackTransport(network, aliceIf, aliceName, aliceDev));
+        aliceIf->setReceiveMessageCallback(receiveMessage);
+        bobIf = new AppInterfaceImpl(bobStore, bobName, string("myAPI-key"), bobDev, receiveStub, stateReport, notifyStub);
+        bobIf->setTransport(new LoopbackTransport(network, bobIf, bobName, bobDev));
+        bobIf->setReceiveMessageCallback(receiveMessage);
+
+        unique_lock<mutex> lck(receiveLock);
+        received.clear();
+        receiveTimes.clear();
+        reports.clear();
+    }
+
+    void TearDown()
+    {
+        // Deliver the pending envelopes before the interfaces go away
+        network->drain();
+        delete aliceIf;
+        delete bobIf;
+        delete network;
+        delete bobStore;
+        delete aliceStore;
+    }
+
+    SQLiteStoreConv* aliceStore;
+    SQLiteStoreConv* bobStore;
+    LoopbackNetwork* network;
+    AppInterfaceImpl* aliceIf;
+    AppInterfaceImpl* bobIf;
+};
+
+TEST_F(LoopbackTest, Deliver)
+{
+    CallContext ctx;
+    for (int32_t i = 0; i < 10; i++) {
+        vector<int64_t>* msgIds = aliceIf->sendMessage(OutgoingMessage(bobName, messageId(i), "hello " + to_string(i)), &ctx);
+        ASSERT_TRUE(msgIds != NULL);
+        ASSERT_EQ(1, msgIds->size());
+        delete msgIds;
+    }
+    network->drain();
+    ASSERT_EQ(10, received.size());
+    for (int32_t i = 0; i < 10; i++) {
+        ASSERT_EQ(aliceName, received[i].sender);
+        ASSERT_EQ(messageId(i), received[i].msgId);
+        ASSERT_EQ("hello " + to_string(i), received[i].message);
+    }
+
+    // And the answer
+    vector<int64_t>* msgIds = bobIf->sendMessage(OutgoingMessage(aliceName, messageId(100), "welcome"), &ctx);
+    delete msgIds;
+    network->drain();
+    ASSERT_EQ(11, received.size());
+    ASSERT_EQ(bobName, received[10].sender);
+    ASSERT_EQ("welcome", received[10].message);
+
+    ASSERT_EQ(11, network->getSent());
+    ASSERT_EQ(11, network->getDelivered());
+    ASSERT_EQ(0, network->getDropped());
+}
+
+// The ratchet decrypts reordered envelopes and skips lost ones
+TEST_F(LoopbackTest, ReorderLoss)
+{
+    const int32_t count = 200;
+    network->setSeed(4711);
+    network->setLatency(1000, 5000);
+    network->setLossRate(0.1);
+
+    CallContext ctx;
+    for (int32_t i = 0; i < count; i++) {
+        vector<int64_t>* msgIds = aliceIf->sendMessage(OutgoingMessage(bobName, messageId(i), "message " + to_string(i)), &ctx);
+        delete msgIds;
+    }
+    network->drain();
+
+    ASSERT_EQ(count, network->getSent());
+    ASSERT_LT(0, network->getDropped());
+    ASSERT_EQ(count - network->getDropped(), network->getDelivered());
+    ASSERT_EQ(network->getDelivered(), received.size());
+
+    int32_t overtaken = 0;
+    for (size_t i = 1; i < received.size(); i++) {
+        if (received[i].msgId < received[i - 1].msgId)
+            overtaken++;
+    }
+    ASSERT_LT(0, overtaken);
+    cerr << network->getDropped() << " of " << count << " lost, " << overtaken << " overtaken" << endl;
+}
+
+// The binary-safe mode sends the serialized envelopes without base64
+TEST_F(LoopbackTest, BinarySafe)
+{
+    CallContext ctx;
+    for (int32_t i = 0; i < 10; i++) {
+        vector<int64_t>* msgIds = aliceIf->sendMessage(OutgoingMessage(bobName, messageId(i), "text mode"), &ctx);
+        delete msgIds;
+    }
+    network->drain();
+    uint64_t textBytes = network->getBytes();
+
+    network->setBinarySafe(true);
+    for (int32_t i = 10; i < 20; i++) {
+        vector<int64_t>* msgIds = aliceIf->sendMessage(OutgoingMessage(bobName, messageId(i), "text mode"), &ctx);
+        delete msgIds;
+    }
+    network->drain();
+    uint64_t binaryBytes = network->getBytes() - textBytes;
+
+    ASSERT_EQ(20, received.size());
+    for (int32_t i = 0; i < 20; i++) {
+        ASSERT_EQ(messageId(i), received[i].msgId);
+        ASSERT_EQ("text mode", received[i].message);
+    }
+    // Base64 is 4 bytes for 3
+    ASSERT_GT(textBytes * 3 / 4 + 10 * 3, binaryBytes);
+
+    // And the answer
+    vector<int64_t>* msgIds = bobIf->sendMessage(OutgoingMessage(aliceName, messageId(100), "binary"), &ctx);
+    delete msgIds;
+    network->drain();
+    ASSERT_EQ(21, received.size());
+    ASSERT_EQ("binary", received[20].message);
+}
+
+// Control messages leave as one message, the receiver gets each of them
+TEST_F(LoopbackTest, Coalesce)
+{
+    // Off by default, a client that does not unpack batches would lose the receipts
+    ASSERT_TRUE(aliceIf->getControlCoalescer() == NULL);
+    aliceIf->setCoalesceWindow(ControlCoalescer::DEFAULT_WINDOW_MS);
+
+    vector<int64_t> handles;
+    for (int32_t i = 0; i < 10; i++) {
+        OutgoingMessage receipt(bobName, messageId(i), string());
+        receipt.attributes = "{\"cmd\":\"rr\",\"rr_id\":\"" + to_string(i) + "\"}";
+        handles.push_back(aliceIf->sendMessageAsync(std::move(receipt)));
+    }
+    // The text message flushes the receipts, it does not overtake them
+    handles.push_back(aliceIf->sendMessageAsync(OutgoingMessage(bobName, messageId(10), "after the receipts")));
+    ASSERT_TRUE(waitReceived(11));
+
+    ASSERT_EQ(2, network->getSent());
+    for (int32_t i = 0; i < 10; i++) {
+        ASSERT_EQ(messageId(i), received[i].msgId);
+        ASSERT_TRUE(received[i].message.empty());
+        ASSERT_EQ("{\"cmd\":\"rr\",\"rr_id\":\"" + to_string(i) + "\"}", received[i].attributes);
+    }
+    ASSERT_EQ("after the receipts", received[10].message);
+
+    // A state report for each handle
+    unique_lock<mutex> lck(receiveLock);
+    ASSERT_TRUE(receiveChanged.wait_for(lck, chrono::seconds(10), []{ return reports.size() >= 11; }));
+    sort(reports.begin(), reports.end());
+    ASSERT_EQ(handles, reports);
+    ASSERT_EQ(10, aliceIf->getControlCoalescer()->getCoalesced());
+}
+
+// Compressed messages are smaller on the wire and arrive unchanged
+TEST_F(LoopbackTest, Compress)
+{
+    string text;
+    for (int32_t i = 0; i < 20; i++)
+        text.append("Please bring the documents to the meeting tomorrow afternoon. ");
+    string attachment("{\"cloud_url\":\"https://s3.amazonaws.com/com.silentcircle.silenttext.scloud/123456\","
+                      "\"content_type\":\"image/jpeg\",\"filename\":\"IMG_4711.JPG\",\"display_name\":\"IMG_4711.JPG\"}");
+
+    CallContext ctx;
+    for (int32_t i = 0; i < 10; i++) {
+        OutgoingMessage message(bobName, messageId(i), text);
+        message.attachment = attachment;
+        vector<int64_t>* msgIds = aliceIf->sendMessage(message, &ctx);
+        delete msgIds;
+    }
+    network->drain();
+    uint64_t plainBytes = network->getBytes();
+
+    aliceIf->setCompressThreshold(256);
+    for (int32_t i = 10; i < 20; i++) {
+        OutgoingMessage message(bobName, messageId(i), text);
+        message.attachment = attachment;
+        vector<int64_t>* msgIds = aliceIf->sendMessage(message, &ctx);
+        delete msgIds;
+    }
+    network->drain();
+    uint64_t compressedBytes = network->getBytes() - plainBytes;
+
+    ASSERT_EQ(20, received.size());
+    for (int32_t i = 0; i < 20; i++) {
+        ASSERT_EQ(messageId(i), received[i].msgId);
+        ASSERT_EQ(text, received[i].message);
+        ASSERT_EQ(attachment, received[i].attachment);
+    }
+    cerr << "Compression: " << plainBytes << " -> " << compressedBytes << " bytes for 10 messages" << endl;
+    ASSERT_LT(compressedBytes, plainBytes / 2);
+}
+
+// A message as the clients send them: mostly receipts and short texts
+static OutgoingMessage typicalMessage(int32_t i)
+{
+    OutgoingMessage message(bobName, messageId(i), string());
+    switch (i % 10) {
+    case 0: case 1: case 2: case 3:
+        message.attributes = "{\"cmd\":\"dr\",\"dr_id\":\"" + messageId(i - 1) + "\"}";
+        break;
+    case 4: case 5: case 6:
+        message.message = "See you at " + to_string(i % 12 + 1) + " o'clock";
+        break;
+    case 7: case 8:
+        message.message = string(300 + i % 200, 't');
+        message.attributes = "{\"r\":true,\"s\":true}";
+        break;
+    default:
+        message.attachment = "{\"cloud_url\":\"https://example.com/files/" + to_string(i) + "\",\"content_type\":\"image/jpeg\"}";
+        break;
+    }
+    return message;
+}
+
+// Both wire versions arrive, version 2 saves bytes on the typical messages
+TEST_F(LoopbackTest, WireVersion)
+{
+    const int32_t count = 200;
+    CallContext ctx;
+    for (int32_t i = 0; i < count; i++) {
+        vector<int64_t>* msgIds = aliceIf->sendMessage(typicalMessage(i), &ctx);
+        delete msgIds;
+    }
+    network->drain();
+    uint64_t v1Bytes = network->getBytes();
+
+    aliceIf->setWireVersion(AxoRatchet::WIRE_VERSION_2);
+    for (int32_t i = count; i < 2 * count; i++) {
+        vector<int64_t>* msgIds = aliceIf->sendMessage(typicalMessage(i), &ctx);
+        delete msgIds;
+    }
+    network->drain();
+    uint64_t v2Bytes = network->getBytes() - v1Bytes;
+
+    ASSERT_EQ(2 * count, received.size());
+    for (int32_t i = 0; i < 2 * count; i++) {
+        OutgoingMessage expected = typicalMessage(i);
+        ASSERT_EQ(expected.msgId, received[i].msgId);
+        ASSERT_EQ(expected.message, received[i].message);
+        ASSERT_EQ(expected.attachment, received[i].attachment);
+    }
+    cerr << "Wire version 2: " << v1Bytes << " -> " << v2Bytes << " bytes for " << count << " messages, "
+         << (v1Bytes - v2Bytes) / count << " bytes (" << (v1Bytes - v2Bytes) * 100 / v1Bytes << "%) less per message" << endl;
+    ASSERT_LT(v2Bytes, v1Bytes);
+
+    // And the answer in version 2
+    bobIf->setWireVersion(AxoRatchet::WIRE_VERSION_2);
+    vector<int64_t>* msgIds = bobIf->sendMessage(OutgoingMessage(aliceName, messageId(1000), "version 2"), &ctx);
+    delete msgIds;
+    network->drain();
+    ASSERT_EQ(2 * count + 1, received.size());
+    ASSERT_EQ("version 2", received.back().message);
+}
+
+struct BenchmarkResult {
+    int64_t micros;
+    int64_t cpuMicros;          //!< CPU time of all threads
+    uint64_t bytes;
+    vector<int64_t> latencies;
+};
+
+// Send count messages asynchronously, message ids start at first
+static void runBenchmark(AppInterfaceImpl* aliceIf, LoopbackNetwork* network, int32_t first, int32_t count, BenchmarkResult* result)
+{
+    {
+        unique_lock<mutex> lck(receiveLock);
+        received.clear();
+        receiveTimes.clear();
+    }
+    map<string, chrono::steady_clock::time_point> sendTimes;
+    uint64_t bytes = network->getBytes();
+    clock_t cpuStart = clock();
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int32_t i = first; i < first + count; i++) {
+        string msgId = messageId(i);
+        sendTimes[msgId] = chrono::steady_clock::now();
+        ASSERT_LT(0, aliceIf->sendMessageAsync(OutgoingMessage(bobName, msgId, "message " + to_string(i))));
+    }
+    ASSERT_TRUE(waitReceived(count));
+    result->micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    result->cpuMicros = (int64_t)(clock() - cpuStart) * 1000000 / CLOCKS_PER_SEC;
+    result->bytes = network->getBytes() - bytes;
+
+    unique_lock<mutex> lck(receiveLock);
+    for (map<string, chrono::steady_clock::time_point>::iterator it = receiveTimes.begin(); it != receiveTimes.end(); ++it)
+        result->latencies.push_back(chrono::duration_cast<chrono::microseconds>(it->second - sendTimes[it->first]).count());
+    sort(result->latencies.begin(), result->latencies.end());
+}
+
+static void printBenchmark(const char* mode, int32_t count, const BenchmarkResult& result)
+{
+    const vector<int64_t>& latencies = result.latencies;
+    cerr << mode << ": " << count << " messages in " << result.micros / 1000 << " ms, "
+         << (int64_t)count * 1000000 / (result.micros > 0 ? result.micros : 1) << " msgs/s, "
+         << result.bytes / count << " bytes/msg, " << result.cpuMicros / count << " us CPU/msg, latency p50 "
+         << latencies[count / 2] << " us, p90 " << latencies[count * 9 / 10] << " us, p99 "
+         << latencies[count * 99 / 100] << " us, max " << latencies.back() << " us" << endl;
+}
+
+// Sustained throughput and latency of the whole stack: encrypt, store, transport queue,
+// network, decrypt and callback, with base64 and with binary envelopes
+TEST_F(LoopbackTest, Benchmark)
+{
+    const int32_t count = 2000;
+
+    BenchmarkResult text;
+    runBenchmark(aliceIf, network, 0, count, &text);
+    ASSERT_EQ(count, text.latencies.size());
+    printBenchmark("base64", count, text);
+
+    network->setBinarySafe(true);
+    BenchmarkResult binary;
+    runBenchmark(aliceIf, network, count, count, &binary);
+    ASSERT_EQ(count, binary.latencies.size());
+    printBenchmark("binary", count, binary);
+
+    ASSERT_GT(text.bytes, binary.bytes);
+    cerr << "Binary envelopes save " << (text.bytes - binary.bytes) * 100 / text.bytes << "% bytes, "
+         << (text.cpuMicros - binary.cpuMicros) * 100 / (text.cpuMicros > 0 ? text.cpuMicros : 1) << "% CPU" << endl;
+}
@@ -0,0 +1,180 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include "gtest/gtest.h"
+
+#include "../util/LzCodec.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+using namespace salamander;
+using namespace std;
+
+static string randomData(size_t size, uint32_t seed)
+{
+    string data;
+    uint32_t x = seed;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        data.push_back((char)x);
+    }
+    return data;
+}
+
+static string roundTrip(const string& data)
+{
+    string compressed;
+    lzCompress((const uint8_t*)data.data(), data.size(), &compressed);
+    string plain;
+    EXPECT_TRUE(lzDecompress((const uint8_t*)compressed.data(), compressed.size(), data.size(), &plain));
+    return plain;
+}
+
+// Payloads as the clients send them
+static string attachmentDescriptor(int32_t i)
+{
+    return "{\"cloud_url\":\"https://s3.amazonaws.com/com.silentcircle.silenttext.scloud/" + to_string(100000 + i) +
+           "\",\"cloud_key\":\"{\\\"version\\\":2,\\\"keySuite\\\":1,\\\"symkey\\\":\\\"ZDFmNGMyM2U1YWI3" + to_string(i) +
+           "\\\"}\",\"content_type\":\"image/jpeg\",\"filename\":\"IMG_" + to_string(4000 + i) +
+           ".JPG\",\"display_name\":\"IMG_" + to_string(4000 + i) + ".JPG\",\"file_size\":" + to_string(1234567 + i) +
+           ",\"media_type\":\"public.jpeg\",\"preview\":\"" + string(64, 'A' + (i % 26)) + "\"}";
+}
+
+static string messageAttributes(int32_t i)
+{
+    return "{\"r\":true,\"s\":true,\"la\":" + to_string(37.7749 + i) + ",\"lo\":-122.4194,\"a\":12.5,\"v\":0.0,"
+           "\"t\":" + to_string(1466000000 + i) + ",\"p\":\"" + to_string(i) + "\",\"or\":false,\"b\":7200}";
+}
+
+static string chatText(int32_t i)
+{
+    static const char* words[] = {"the", "meeting", "is", "moved", "to", "tomorrow", "afternoon", "please",
+                                  "bring", "the", "documents", "and", "your", "laptop", "we", "will", "review"};
+    string text;
+    for (int32_t w = 0; w < 40; w++) {
+        text.append(words[(i + w * 7) % 17]);
+        text.append(w % 9 == 8 ? ". " : " ");
+    }
+    return text;
+}
+
+TEST(LzCodec, RoundTrip)
+{
+    ASSERT_EQ(string(), roundTrip(string()));
+    ASSERT_EQ(string("a"), roundTrip(string("a")));
+    ASSERT_EQ(string(1000, 'x'), roundTrip(string(1000, 'x')));
+    ASSERT_EQ(attachmentDescriptor(1), roundTrip(attachmentDescriptor(1)));
+    ASSERT_EQ(chatText(3), roundTrip(chatText(3)));
+
+    // Long literal runs and a repeat beyond the 16 bit offset
+    string mixed = randomData(70000, 1) + randomData(1000, 2) + randomData(70000, 1);
+    ASSERT_EQ(mixed, roundTrip(mixed));
+
+    for (size_t size = 0; size < 100; size++) {
+        string data = randomData(size, 3);
+        ASSERT_EQ(data, roundTrip(data));
+        string runs = data + data + string(size, 'z');
+        ASSERT_EQ(runs, roundTrip(runs));
+    }
+
+    // A repeat within the window compresses
+    string repeated = randomData(30000, 4);
+    repeated += repeated;
+    ASSERT_EQ(repeated, roundTrip(repeated));
+    string compressed;
+    lzCompress((const uint8_t*)repeated.data(), repeated.size(), &compressed);
+    ASSERT_LT(compressed.size(), repeated.size() * 3 / 4);
+}
+
+TEST(LzCodec, Corrupt)
+{
+    string data = attachmentDescriptor(5) + attachmentDescriptor(6);
+    string compressed;
+    lzCompress((const uint8_t*)data.data(), data.size(), &compressed);
+    string plain;
+
+    // The maximum size protects against data that expands to a huge buffer
+    ASSERT_FALSE(lzDecompress((const uint8_t*)compressed.data(), compressed.size(), data.size() - 1, &plain));
+    ASSERT_TRUE(plain.empty());
+
+    // Truncated and extended data
+    for (size_t size = 0; size < compressed.size(); size++)
+        ASSERT_FALSE(lzDecompress((const uint8_t*)compressed.data(), size, data.size(), &plain));
+    string extended = compressed + 'x';
+    ASSERT_FALSE(lzDecompress((const uint8_t*)extended.data(), extended.size(), data.size(), &plain));
+
+    // Changed bytes either fail or produce data of the announced length, never more
+    for (size_t i = 0; i < compressed.size(); i++) {
+        for (int32_t bit = 0; bit < 8; bit++) {
+            string changed(compressed);
+            changed[i] ^= (char)(1 << bit);
+            if (lzDecompress((const uint8_t*)changed.data(), changed.size(), 1 << 20, &plain)) {
+                ASSERT_LE(plain.size(), (size_t)1 << 20);
+            }
+        }
+    }
+    string garbage = randomData(200, 9);
+    for (size_t i = 0; i < 200; i++)
+        lzDecompress((const uint8_t*)garbage.data() + i, garbage.size() - i, 4096, &plain);
+}
+
+static void benchmark(const char* name, const vector<string>& payloads)
+{
+    size_t plainBytes = 0;
+    size_t compressedBytes = 0;
+    string compressed;
+    string plain;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 0; i < payloads.size(); i++) {
+        lzCompress((const uint8_t*)payloads[i].data(), payloads[i].size(), &compressed);
+        plainBytes += payloads[i].size();
+        compressedBytes += compressed.size();
+    }
+    int64_t compressMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < payloads.size(); i++) {
+        lzCompress((const uint8_t*)payloads[i].data(), payloads[i].size(), &compressed);
+        ASSERT_TRUE(lzDecompress((const uint8_t*)compressed.data(), compressed.size(), payloads[i].size(), &plain));
+    }
+    int64_t roundTripMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    int64_t decompressMicros = roundTripMicros > compressMicros ? roundTripMicros - compressMicros : 1;
+
+    cerr << name << ": " << payloads.size() << " payloads, " << plainBytes << " -> " << compressedBytes << " bytes ("
+         << compressedBytes * 100 / plainBytes << "%), compress "
+         << plainBytes / (compressMicros > 0 ? compressMicros : 1) << " MB/s, decompress "
+         << plainBytes / decompressMicros << " MB/s" << endl;
+}
+
+TEST(LzCodec, Benchmark)
+{
+    vector<string> attachments, attributes, texts, random;
+    for (int32_t i = 0; i < 20000; i++) {
+        attachments.push_back(attachmentDescriptor(i));
+        attributes.push_back(messageAttributes(i));
+        texts.push_back(chatText(i));
+        random.push_back(randomData(256, i + 1));
+    }
+    benchmark("Attachment descriptors", attachments);
+    benchmark("Message attributes", attributes);
+    benchmark("Chat text", texts);
+    benchmark("Random data", random);
+}
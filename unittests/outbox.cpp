@@ -0,0 +1,398 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include "gtest/gtest.h"
+
+#include "../interfaceApp/Outbox.h"
+#include "../storage/logstore/LogStoreConv.h"
+#include "../util/cJSON.h"
+#include "testHelper.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+using namespace salamander;
+using namespace std;
+
+static std::string carolName("carol@milkyway.com");
+
+static const char* logFile = "outboxtest.log";
+
+struct Report {
+    string recipient;
+    string msgId;
+    int32_t code;
+    vector<int64_t> msgIds;
+};
+
+static mutex reportLock;
+static vector<Report> reports;
+
+static void collectReport(const string& recipient, const string& msgId, int32_t code, const vector<int64_t>& msgIds)
+{
+    unique_lock<mutex> lck(reportLock);
+    Report report;
+    report.recipient = recipient;
+    report.msgId = msgId;
+    report.code = code;
+    report.msgIds = msgIds;
+    reports.push_back(report);
+}
+
+static vector<pair<string, string> > envelopes(const string& msgId, int32_t numDevices)
+{
+    vector<pair<string, string> > msgPairs;
+    for (int32_t i = 0; i < numDevices; i++) {
+        char dev[20];
+        snprintf(dev, sizeof(dev), "dev_%d", i);
+        msgPairs.push_back(pair<string, string>(string(dev), "envelope of " + msgId + " for " + dev));
+    }
+    return msgPairs;
+}
+
+static void checkStore(ConversationStore* store)
+{
+    list<OutboxEntry> entries;
+    for (int32_t i = 0; i < 3; i++) {
+        OutboxEntry entry;
+        entry.recipient = bobName;
+        entry.longDevId = bobDev;
+        entry.msgId = "msg";
+        entry.envelope = string("envelope\0data", 13);
+        entry.since = 1000;
+        entry.nextTry = 2000 + i;
+        entry.tries = i;
+        entries.push_back(entry);
+    }
+    ASSERT_EQ(STORE_OK, store->insertOutboxEntries(aliceName, &entries));
+    ASSERT_TRUE(entries.front().id != entries.back().id);
+
+    // Other accounts don't see the entries
+    list<OutboxEntry>* loaded = store->loadOutboxEntries(bobName, 3000);
+    ASSERT_TRUE(loaded != NULL);
+    ASSERT_TRUE(loaded->empty());
+    delete loaded;
+
+    loaded = store->loadOutboxEntries(aliceName, 2001);
+    ASSERT_TRUE(loaded != NULL);
+    ASSERT_EQ(2, loaded->size());
+    OutboxEntry& first = loaded->front();
+    ASSERT_EQ(entries.front().id, first.id);
+    ASSERT_EQ(bobName, first.recipient);
+    ASSERT_EQ(bobDev, first.longDevId);
+    ASSERT_EQ(string("msg"), first.msgId);
+    ASSERT_EQ(string("envelope\0data", 13), first.envelope);
+    ASSERT_EQ(1000, first.since);
+    ASSERT_EQ(2000, first.nextTry);
+    ASSERT_EQ(0, first.tries);
+
+    first.nextTry = 5000;
+    first.tries = 7;
+    ASSERT_EQ(STORE_OK, store->updateOutboxEntries(aliceName, *loaded));
+    delete loaded;
+
+    list<int64_t> ids;
+    ids.push_back(entries.back().id);
+    ASSERT_EQ(STORE_OK, store->deleteOutboxEntries(aliceName, ids));
+
+    loaded = store->loadOutboxEntries(aliceName, 10000);
+    ASSERT_EQ(2, loaded->size());
+    ASSERT_EQ(entries.front().id, loaded->front().id);     // sorted by id
+    ASSERT_EQ(5000, loaded->front().nextTry);
+    ASSERT_EQ(7, loaded->front().tries);
+    delete loaded;
+}
+
+TEST(Outbox, Store)
+{
+    SQLiteStoreConv* store = openStore();
+    checkStore(store);
+    delete store;
+
+    remove(logFile);
+    LogStoreConv* logStore = new LogStoreConv();
+    logStore->setKey(std::string((const char*)keyInData, 32));
+    logStore->openStore(logFile);
+    checkStore(logStore);
+
+    // New entries get new ids after the log was replayed
+    delete logStore;
+    logStore = new LogStoreConv();
+    logStore->setKey(std::string((const char*)keyInData, 32));
+    logStore->openStore(logFile);
+
+    list<OutboxEntry> entries(1);
+    ASSERT_EQ(STORE_OK, logStore->insertOutboxEntries(aliceName, &entries));
+    list<OutboxEntry>* loaded = logStore->loadOutboxEntries(aliceName, 10000);
+    ASSERT_EQ(3, loaded->size());
+    ASSERT_EQ(entries.front().id, loaded->back().id);
+    delete loaded;
+    delete logStore;
+    remove(logFile);
+}
+
+TEST(Outbox, RetryBatch)
+{
+    SQLiteStoreConv* store = openStore();
+    CollectTransport transport;
+    reports.clear();
+    {
+        Outbox outbox(store, aliceName, collectReport, 100);
+        outbox.setTransport(&transport);
+
+        ASSERT_EQ(STORE_OK, outbox.add(bobName, "msg1", envelopes("msg1", 2), true));
+        ASSERT_EQ(STORE_OK, outbox.add(carolName, "msg2", envelopes("msg2", 1), true));
+        ASSERT_EQ(STORE_OK, outbox.add(bobName, "msg3", envelopes("msg3", 1), false));
+        ASSERT_EQ(4, outbox.getPending());
+        ASSERT_TRUE(outbox.hasPending(bobName));
+
+        // Not due yet
+        ASSERT_EQ(0, outbox.flushNow());
+        ASSERT_EQ(0, transport.numCalls());
+
+        // Failed again, the retry delay doubles
+        transport.failing = true;
+        time_t now = time(NULL);
+        ASSERT_EQ(0, outbox.flushNow(true));
+        ASSERT_EQ(2, transport.numCalls());
+        list<OutboxEntry>* loaded = store->loadOutboxEntries(aliceName, numeric_limits<time_t>::max());
+        ASSERT_EQ(4, loaded->size());
+        ASSERT_EQ(2, loaded->front().tries);
+        ASSERT_LE(now + 200, loaded->front().nextTry);
+        ASSERT_GE(now + 201, loaded->front().nextTry);
+        ASSERT_EQ(2, loaded->back().tries);         // waited behind the others, shares Bob's backoff
+        ASSERT_EQ(loaded->front().nextTry, loaded->back().nextTry);
+        delete loaded;
+
+        // One batch for each recipient, in the order the envelopes were added
+        transport.failing = false;
+        transport.calls.clear();
+        ASSERT_EQ(4, outbox.flushNow(true));
+        ASSERT_EQ(2, transport.calls.size());
+        ASSERT_EQ(bobName, transport.calls[0].first);
+        ASSERT_EQ(3, transport.calls[0].second);
+        ASSERT_EQ(carolName, transport.calls[1].first);
+        ASSERT_EQ(1, transport.calls[1].second);
+        ASSERT_EQ(envelopes("msg1", 2)[0].second, transport.sent[0].second);
+        ASSERT_EQ(envelopes("msg3", 1)[0].second, transport.sent[2].second);
+
+        ASSERT_EQ(0, outbox.getPending());
+        ASSERT_FALSE(outbox.hasPending(bobName));
+    }
+    ASSERT_EQ(3, reports.size());
+    ASSERT_EQ(string("msg1"), reports[0].msgId);
+    ASSERT_EQ(SUCCESS, reports[0].code);
+    ASSERT_EQ(2, reports[0].msgIds.size());
+    ASSERT_EQ(string("msg3"), reports[1].msgId);
+    ASSERT_EQ(carolName, reports[2].recipient);
+
+    list<OutboxEntry>* loaded = store->loadOutboxEntries(aliceName, numeric_limits<time_t>::max());
+    ASSERT_TRUE(loaded->empty());
+    delete loaded;
+    delete store;
+}
+
+// An older envelope with a longer backoff does not let a newer one of the same recipient overtake it
+TEST(Outbox, RecipientOrder)
+{
+    SQLiteStoreConv* store = openStore();
+    CollectTransport transport;
+    time_t now = time(NULL);
+
+    list<OutboxEntry> entries;
+    vector<pair<string, string> > msgPairs = envelopes("msg", 2);
+    for (size_t i = 0; i < msgPairs.size(); i++) {
+        OutboxEntry entry;
+        entry.recipient = bobName;
+        entry.longDevId = msgPairs[i].first;
+        entry.msgId = "msg";
+        entry.envelope = msgPairs[i].second;
+        entry.since = now;
+        entry.nextTry = i == 0 ? now + 1000 : now - 1;
+        entry.tries = i == 0 ? 5 : 0;
+        entries.push_back(entry);
+    }
+    ASSERT_EQ(STORE_OK, store->insertOutboxEntries(aliceName, &entries));
+    {
+        Outbox outbox(store, aliceName, collectReport, 100, 100000);
+
+        // The newer envelope is due, the flush sends both in order and both fail. The
+        // outbox's thread may run this flush, then flushNow finds nothing due.
+        transport.failing = true;
+        outbox.setTransport(&transport);
+        ASSERT_EQ(0, outbox.flushNow());
+        ASSERT_EQ(1, transport.numCalls());
+        ASSERT_EQ(2, transport.calls[0].second);
+
+        list<OutboxEntry>* loaded = store->loadOutboxEntries(aliceName, numeric_limits<time_t>::max());
+        ASSERT_EQ(2, loaded->size());
+        ASSERT_EQ(6, loaded->front().tries);
+        ASSERT_EQ(6, loaded->back().tries);
+        ASSERT_EQ(loaded->front().nextTry, loaded->back().nextTry);
+        ASSERT_LE(now + (100 << 5), loaded->front().nextTry);
+        delete loaded;
+
+        transport.failing = false;
+        ASSERT_EQ(2, outbox.flushNow(true));
+        ASSERT_EQ(msgPairs[0].second, transport.sent[0].second);
+        ASSERT_EQ(msgPairs[1].second, transport.sent[1].second);
+    }
+    delete store;
+}
+
+TEST(Outbox, Expire)
+{
+    SQLiteStoreConv* store = openStore();
+    CollectTransport transport;
+    reports.clear();
+
+    Outbox outbox(store, aliceName, collectReport, 100, 900, 0);
+    outbox.setTransport(&transport);
+    outbox.add(bobName, "msg1", envelopes("msg1", 2), true);
+
+    ASSERT_EQ(0, outbox.flushNow(true));
+    ASSERT_EQ(0, transport.numCalls());
+    ASSERT_EQ(0, outbox.getPending());
+    ASSERT_EQ(1, reports.size());
+    ASSERT_EQ(MSG_EXPIRED, reports[0].code);
+    ASSERT_EQ(string("msg1"), reports[0].msgId);
+    delete store;
+}
+
+static bool waitEmpty(Outbox* outbox)
+{
+    for (int32_t i = 0; i < 500 && outbox->getPending() > 0; i++)
+        this_thread::sleep_for(chrono::milliseconds(10));
+    return outbox->getPending() == 0;
+}
+
+TEST(Outbox, CoalescedFlush)
+{
+    SQLiteStoreConv* store = openStore();
+    CollectTransport transport;
+
+    Outbox outbox(store, aliceName, collectReport, 100);
+    outbox.setTransport(&transport);
+    for (int32_t i = 0; i < 10; i++) {
+        char msgId[20];
+        snprintf(msgId, sizeof(msgId), "msg%d", i);
+        outbox.add(bobName, msgId, envelopes(msgId, 2), true);
+    }
+
+    // The thread flushes on request, the requests collapse into one flush
+    for (int32_t i = 0; i < 10; i++)
+        outbox.requestFlush();
+    ASSERT_TRUE(waitEmpty(&outbox));
+    ASSERT_EQ(1, transport.numCalls());
+    ASSERT_EQ(20, transport.calls[0].second);
+    delete store;
+}
+
+TEST(Outbox, Restart)
+{
+    SQLiteStoreConv* store = openStore();
+    CollectTransport transport;
+    {
+        Outbox outbox(store, aliceName, collectReport, 100);
+        outbox.add(bobName, "msg1", envelopes("msg1", 2), true);
+    }
+    Outbox outbox(store, aliceName, collectReport, 100);
+    ASSERT_EQ(2, outbox.getPending());
+    ASSERT_TRUE(outbox.hasPending(bobName));
+
+    // The transport arrives later
+    outbox.requestFlush();
+    this_thread::sleep_for(chrono::milliseconds(50));
+    ASSERT_EQ(2, outbox.getPending());
+
+    outbox.setTransport(&transport);
+    ASSERT_TRUE(waitEmpty(&outbox));
+    ASSERT_EQ(2, transport.sent.size());
+    delete store;
+}
+
+// Integration with the send and receive functions
+static vector<string> received;
+
+static int32_t receiveMessage(const string& messageDescriptor, const string& attachmentDescriptor, const string& messageAttributes)
+{
+    cJSON* root = cJSON_Parse(messageDescriptor.c_str());
+    received.push_back(cJSON_GetObjectItem(root, "message")->valuestring);
+    cJSON_Delete(root);
+    return OK;
+}
+
+static vector<pair<int32_t, string> > stateReports;
+
+static void stateReport(int64_t messageIdentifier, int32_t statusCode, const string& stateInformation)
+{
+    unique_lock<mutex> lck(reportLock);
+    stateReports.push_back(pair<int32_t, string>(statusCode, stateInformation));
+}
+
+TEST(Outbox, SendReceive)
+{
+    SQLiteStoreConv* aliceStore = openAccount(aliceName);
+    SQLiteStoreConv* bobStore = openAccount(bobName);
+    connect(aliceStore, bobStore);
+
+    CollectTransport* transport = new CollectTransport();
+    AppInterfaceImpl* aliceIf = new AppInterfaceImpl(aliceStore, aliceName, string("myAPI-key"), aliceDev, receiveMessage, stateReport, notifyStub);
+    aliceIf->setTransport(transport);
+    AppInterfaceImpl bobIf(bobStore, bobName, string("myAPI-key"), bobDev, receiveMessage, stateReport, notifyStub);
+
+    // The transport fails, the outbox takes the envelope. The next message waits behind it.
+    transport->failing = true;
+    CallContext ctx;
+    vector<int64_t>* msgIds = aliceIf->sendMessage(OutgoingMessage(bobName, "msg-1", "first"), &ctx);
+    ASSERT_TRUE(msgIds != NULL);
+    ASSERT_TRUE(msgIds->empty());
+    delete msgIds;
+    transport->failing = false;
+    msgIds = aliceIf->sendMessage(OutgoingMessage(bobName, "msg-2", "second"), &ctx);
+    ASSERT_TRUE(msgIds->empty());
+    delete msgIds;
+    ASSERT_EQ(2, aliceIf->getOutbox()->getPending());
+    ASSERT_EQ(1, transport->numCalls());
+
+    aliceIf->flushOutbox();
+    ASSERT_TRUE(waitEmpty(aliceIf->getOutbox()));
+    ASSERT_EQ(2, transport->numCalls());
+    ASSERT_EQ(2, transport->sent.size());
+
+    // Bob decrypts the stored envelopes in order
+    received.clear();
+    ASSERT_EQ(OK, bobIf.receiveMessage(transport->sent[0].second, &ctx));
+    ASSERT_EQ(OK, bobIf.receiveMessage(transport->sent[1].second, &ctx));
+    ASSERT_EQ(2, received.size());
+    ASSERT_EQ(string("first"), received[0]);
+    ASSERT_EQ(string("second"), received[1]);
+
+    // The state reports carry the message ids
+    delete aliceIf;
+    ASSERT_EQ(2, stateReports.size());
+    ASSERT_EQ(SUCCESS, stateReports[0].first);
+    ASSERT_NE(string::npos, stateReports[0].second.find("msg-1"));
+    ASSERT_NE(string::npos, stateReports[1].second.find("msg-2"));
+
+    delete bobStore;
+    delete aliceStore;
+}
@@ -0,0 +1,181 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include "gtest/gtest.h"
+
+#include "../interfaceTransport/sip/SipTransport.h"
+#include "../provisioning/ScProvisioning.h"
+#include "../salamander/crypto/Ec255PublicKey.h"
+#include "../util/cJSON.h"
+#include "../util/b64helper.h"
+#include "testHelper.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+using namespace salamander;
+using namespace std;
+
+static string bob("bob");
+
+static atomic<int32_t> preKeyRequests(0);
+
+static string b64Key(const DhKeyPair* keyPair)
+{
+    char b64Buffer[MAX_KEY_BYTES_ENCODED*2];
+    string data = keyPair->getPublicKey().serialize();
+    int32_t b64Len = b64Encode((const uint8_t*)data.data(), data.size(), b64Buffer, MAX_KEY_BYTES_ENCODED*2);
+    return string(b64Buffer, b64Len);
+}
+
+// Simulates the provisioning server: bob has two devices and a pre-key bundle for each
+static int32_t serverHelper(const std::string& requestUrl, const std::string& method, const std::string& data, std::string* response)
+{
+    if (requestUrl.find("/device/?filter") != string::npos) {
+        response->assign("{\"version\": 1, \"devices\": [{\"version\": 1, \"id\": \"bobDev1\", \"device_name\": \"phone\"},"
+                         "{\"version\": 1, \"id\": \"bobDev2\", \"device_name\": \"tablet\"}]}");
+        return 200;
+    }
+    preKeyRequests++;
+
+    const DhKeyPair* identity = EcCurve::generateKeyPair(EcCurveTypes::Curve25519);
+    const DhKeyPair* preKey = EcCurve::generateKeyPair(EcCurveTypes::Curve25519);
+
+    cJSON* root = cJSON_CreateObject();
+    cJSON* salamander;
+    cJSON* jsonPkr;
+    cJSON_AddItemToObject(root, "salamander", salamander = cJSON_CreateObject());
+    cJSON_AddStringToObject(salamander, "identity_key", b64Key(identity).c_str());
+    cJSON_AddItemToObject(salamander, "preKey", jsonPkr = cJSON_CreateObject());
+    cJSON_AddNumberToObject(jsonPkr, "id", 4711);
+    cJSON_AddStringToObject(jsonPkr, "key", b64Key(preKey).c_str());
+    delete identity;
+    delete preKey;
+
+    char* out = cJSON_PrintUnformatted(root);
+    response->assign(out);
+    cJSON_Delete(root); free(out);
+    return 200;
+}
+
+static int32_t scans = 0;
+static void notify(int32_t notifyAction, const string& actionInformation, const string& devId)
+{
+    if (notifyAction == AppInterface::DEVICE_SCAN)
+        scans++;
+}
+
+// Alice has a conversation with bob's first device
+static SQLiteStoreConv* prepareStore()
+{
+    SQLiteStoreConv* store = openAccount(aliceName);
+
+    AxoConversation conv(aliceName, bob, string("bobDev1"), store);
+    conv.setRK(string(32, 'r'));
+    conv.setCKs(string(32, 'c'));
+    conv.setDHIr(new Ec255PublicKey(keyInData));
+    conv.setDHRr(new Ec255PublicKey(keyInData));
+    conv.setDHRs(EcCurve::generateKeyPair(EcCurveTypes::Curve25519));
+    conv.setRatchetFlag(true);
+    conv.storeConversation();
+    return store;
+}
+
+static void notifyDevices(SipTransport* sip, const string& info)
+{
+    sip->notifyAxo((uint8_t*)info.data(), info.size());
+}
+
+TEST(Prefetch, NewDevice)
+{
+    ScProvisioning::setHttpHelper(serverHelper);
+    preKeyRequests = 0;
+    scans = 0;
+    SQLiteStoreConv* store = prepareStore();
+
+    CollectTransport* transport = new CollectTransport();
+    AppInterfaceImpl* uiIf = new AppInterfaceImpl(store, aliceName, string("myAPI-key"), aliceDev, receiveStub, stateReportStub, notify);
+    uiIf->setTransport(transport);
+    SipTransport sip(uiIf, store, uiIf->getDeviceCache());
+    ASSERT_TRUE(uiIf->getPrefetchQueue() != NULL);
+
+    notifyDevices(&sip, "bob@sip.example.com:bobDev1;bobDev2;");
+    uiIf->getPrefetchQueue()->drain();
+    ASSERT_EQ(1, scans);
+    ASSERT_EQ(1, preKeyRequests);
+    ASSERT_TRUE(store->hasConversation(bob, string("bobDev2"), aliceName));
+
+    // The device is known now
+    notifyDevices(&sip, "bob@sip.example.com:bobDev1;bobDev2;");
+    uiIf->getPrefetchQueue()->drain();
+    ASSERT_EQ(1, scans);
+    ASSERT_EQ(1, preKeyRequests);
+
+    // The first message goes to both devices without a server request
+    string descriptor("{\"recipient\": \"bob\", \"msgId\": \"msg-1\", \"message\": \"Hello\"}");
+    vector<int64_t>* msgIds = uiIf->sendMessage(descriptor, empty, empty);
+    ASSERT_TRUE(msgIds != NULL);
+    ASSERT_EQ(2, msgIds->size());
+    delete msgIds;
+    ASSERT_EQ(1, preKeyRequests);
+
+    // No prefetch for users without a conversation
+    notifyDevices(&sip, "carol@sip.example.com:carolDev1;");
+    uiIf->getPrefetchQueue()->drain();
+    ASSERT_EQ(2, scans);
+    ASSERT_EQ(1, preKeyRequests);
+    ASSERT_FALSE(store->hasConversation(string("carol"), string("carolDev1"), aliceName));
+
+    delete uiIf;
+    delete store;
+}
+
+// The rescan sends the ping to prefetched devices
+TEST(Prefetch, RescanPing)
+{
+    ScProvisioning::setHttpHelper(serverHelper);
+    preKeyRequests = 0;
+    SQLiteStoreConv* store = prepareStore();
+
+    CollectTransport* transport = new CollectTransport();
+    AppInterfaceImpl* uiIf = new AppInterfaceImpl(store, aliceName, string("myAPI-key"), aliceDev, receiveStub, stateReportStub, notify);
+    uiIf->setTransport(transport);
+    SipTransport sip(uiIf, store, uiIf->getDeviceCache());
+
+    notifyDevices(&sip, "bob:bobDev2;");
+    uiIf->getPrefetchQueue()->drain();
+    ASSERT_EQ(1, preKeyRequests);
+
+    uiIf->rescanUserDevices(bob);
+    ASSERT_EQ(1, preKeyRequests);
+    ASSERT_EQ(1, transport->sent.size());
+    ASSERT_EQ(string("bobDev2"), transport->sent[0].first);
+
+    AxoConversation* conv = AxoConversation::loadConversation(aliceName, bob, string("bobDev2"), store);
+    ASSERT_TRUE(conv != NULL);
+    ASSERT_EQ(string("tablet"), conv->getDeviceName());
+    delete conv;
+
+    // The ping went out, a second rescan sends nothing
+    uiIf->rescanUserDevices(bob);
+    ASSERT_EQ(1, transport->sent.size());
+
+    delete uiIf;
+    delete store;
+}
@@ -0,0 +1,206 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include "gtest/gtest.h"
+
+#include "../interfaceTransport/SendBatch.h"
+#include "../interfaceTransport/sip/SipTransport.h"
+#include "testHelper.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+using namespace salamander;
+using namespace std;
+
+static std::string carolName("carol@milkyway.com");
+
+struct SentEnvelope {
+    string name;
+    string devId;
+    string envelope;
+};
+
+static vector<SentEnvelope> sent;
+static uint64_t nextId;
+static int32_t numCalls;
+
+// Records the envelopes, does not send the ones for device "fail"
+static void sendData(uint8_t* names[], uint8_t* devIds[], uint8_t* envelopes[], size_t sizes[], uint64_t msgIds[])
+{
+    numCalls++;
+    for (size_t i = 0; names[i] != NULL; i++) {
+        ASSERT_TRUE(devIds[i] != NULL);
+        ASSERT_TRUE(envelopes[i] != NULL);
+        SentEnvelope envelope;
+        envelope.name = (const char*)names[i];
+        envelope.devId = (const char*)devIds[i];
+        envelope.envelope.assign((const char*)envelopes[i], sizes[i]);
+        if (envelope.devId == "fail")
+            continue;
+        sent.push_back(envelope);
+        msgIds[i] = nextId++;
+    }
+}
+
+static void reset()
+{
+    sent.clear();
+    nextId = 1;
+    numCalls = 0;
+}
+
+TEST(SendBatch, Arrays)
+{
+    string devA("devA"), devB("devB"), envelope1("envelope-1"), envelope2(string("env\0lope-2", 10));
+
+    SendBatch batch;
+    ASSERT_TRUE(batch.empty());
+    ASSERT_TRUE(batch.names()[0] == NULL);
+
+    batch.add(bobName, devA, envelope1);
+    batch.add(carolName, devB, envelope2);
+    ASSERT_EQ(2, batch.size());
+    ASSERT_TRUE(batch.names()[2] == NULL);
+    ASSERT_TRUE(batch.deviceIds()[2] == NULL);
+    ASSERT_TRUE(batch.envelopes()[2] == NULL);
+
+    // The batch refers to the data, it does not copy it
+    ASSERT_TRUE(batch.envelopes()[0] == (const uint8_t*)envelope1.data());
+    ASSERT_EQ(carolName, batch.recipient(1));
+    ASSERT_EQ(devB, batch.deviceId(1));
+    ASSERT_EQ(envelope2, batch.envelope(1));
+
+    // A reused batch keeps its arrays
+    uint8_t** names = batch.names();
+    batch.clear();
+    ASSERT_TRUE(batch.empty());
+    ASSERT_TRUE(batch.names()[0] == NULL);
+    batch.add(carolName, devB, envelope2);
+    batch.add(bobName, devA, envelope1);
+    ASSERT_TRUE(batch.names() == names);
+    ASSERT_EQ(bobName, batch.recipient(1));
+}
+
+TEST(SendBatch, SipTransport)
+{
+    reset();
+    SipTransport sip(NULL, NULL);
+    sip.setSendDataFunction(sendData);
+
+    string devA("devA"), devB("devB"), fail("fail");
+    string envelope1("envelope-1"), envelope2("envelope-2"), envelope3("envelope-3");
+
+    // Two recipients in one call, the ids go to the envelopes' indexes
+    SendBatch batch;
+    batch.add(bobName, devA, envelope1);
+    batch.add(carolName, fail, envelope2);
+    batch.add(carolName, devB, envelope3);
+
+    int64_t msgIds[3];
+    ASSERT_EQ(GENERIC_ERROR, sip.sendAxoBatch(&batch, msgIds, 2));
+    ASSERT_EQ(0, numCalls);
+
+    ASSERT_EQ(2, sip.sendAxoBatch(&batch, msgIds, 3));
+    ASSERT_EQ(1, numCalls);
+    ASSERT_EQ(1, msgIds[0]);
+    ASSERT_EQ(0, msgIds[1]);
+    ASSERT_EQ(2, msgIds[2]);
+    ASSERT_EQ(2, sent.size());
+    ASSERT_EQ(bobName, sent[0].name);
+    ASSERT_EQ(carolName, sent[1].name);
+    ASSERT_EQ(envelope3, sent[1].envelope);
+
+    // The old entry points use the batch
+    vector<pair<string, string> > msgPairs;
+    msgPairs.push_back(pair<string, string>(devA, envelope1));
+    msgPairs.push_back(pair<string, string>(fail, envelope2));
+    vector<int64_t>* results = sip.sendAxoMessageResults(bobName, &msgPairs);
+    ASSERT_EQ(2, results->size());
+    ASSERT_EQ(3, (*results)[0]);
+    ASSERT_EQ(0, (*results)[1]);
+    delete results;
+
+    results = sip.sendAxoMessage(bobName, &msgPairs);
+    ASSERT_EQ(1, results->size());
+    ASSERT_EQ(4, (*results)[0]);
+    ASSERT_TRUE(msgPairs.empty());
+    delete results;
+}
+
+TEST(SendBatch, DefaultTransport)
+{
+    string devA("devA"), devB("devB"), envelope("envelope");
+
+    SendBatch batch;
+    batch.add(bobName, devA, envelope);
+    batch.add(bobName, devB, envelope);
+    batch.add(carolName, devA, envelope);
+
+    // The transport implements only the per-recipient function, the default batch function
+    // groups the envelopes
+    CollectTransport transport;
+    int64_t msgIds[3];
+    ASSERT_EQ(3, transport.sendAxoBatch(&batch, msgIds, 3));
+    ASSERT_EQ(2, transport.calls.size());
+    ASSERT_EQ(bobName, transport.calls[0].first);
+    ASSERT_EQ(2, transport.calls[0].second);
+    ASSERT_EQ(carolName, transport.calls[1].first);
+    ASSERT_EQ(devB, transport.sent[1].first);
+    ASSERT_EQ(1, msgIds[0]);
+    ASSERT_EQ(2, msgIds[1]);
+    ASSERT_EQ(3, msgIds[2]);
+}
+
+// A reused batch against the old entry point that builds its arrays on each call
+TEST(SendBatch, Benchmark)
+{
+    reset();
+    SipTransport sip(NULL, NULL);
+    sip.setSendDataFunction(sendData);
+
+    const int32_t rounds = 20000;
+    const size_t numDevices = 4;
+    vector<pair<string, string> > msgPairs;
+    for (size_t i = 0; i < numDevices; i++)
+        msgPairs.push_back(pair<string, string>("0123456789abcdef0123456789abcdef", string(200, 'e')));
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int32_t i = 0; i < rounds; i++) {
+        vector<int64_t>* results = sip.sendAxoMessageResults(bobName, &msgPairs);
+        delete results;
+        sent.clear();
+    }
+    int64_t wrapped = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+    SendBatch batch;
+    int64_t msgIds[numDevices];
+    start = chrono::steady_clock::now();
+    for (int32_t i = 0; i < rounds; i++) {
+        batch.clear();
+        for (size_t j = 0; j < numDevices; j++)
+            batch.add(bobName, msgPairs[j].first, msgPairs[j].second);
+        ASSERT_EQ(numDevices, sip.sendAxoBatch(&batch, msgIds, numDevices));
+        sent.clear();
+    }
+    int64_t batched = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+    cerr << "Send of " << numDevices << " envelopes: " << (double)wrapped * 1000 / rounds << " ns per vector call, "
+         << (double)batched * 1000 / rounds << " ns per batch call" << endl;
+}
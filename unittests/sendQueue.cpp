@@ -0,0 +1,288 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include "gtest/gtest.h"
+
+#include "../interfaceApp/SendQueue.h"
+#include "../salamander/crypto/Ec255PublicKey.h"
+#include "../util/cJSON.h"
+#include "testHelper.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <future>
+
+using namespace salamander;
+using namespace std;
+
+TEST(SendQueue, Order)
+{
+    SendQueue queue(4);
+
+    // Tasks of a key run in order and never at the same time
+    mutex resultLock;
+    map<string, vector<int32_t> > results;
+    map<string, int32_t> running;
+    bool overlap = false;
+
+    for (int32_t i = 0; i < 100; i++) {
+        string key = (i % 3 == 0) ? "bob" : (i % 3 == 1) ? "carol" : "dave";
+        queue.enqueue(key, [&, key, i]() {
+            {
+                unique_lock<mutex> lck(resultLock);
+                if (running[key]++ != 0)
+                    overlap = true;
+            }
+            this_thread::sleep_for(chrono::microseconds(100));
+            unique_lock<mutex> lck(resultLock);
+            running[key]--;
+            results[key].push_back(i);
+        });
+    }
+    queue.drain();
+    ASSERT_EQ(0, queue.getPending());
+    ASSERT_FALSE(overlap);
+
+    int32_t total = 0;
+    for (map<string, vector<int32_t> >::iterator it = results.begin(); it != results.end(); ++it) {
+        for (size_t i = 1; i < it->second.size(); i++)
+            ASSERT_LT(it->second[i - 1], it->second[i]);
+        total += it->second.size();
+    }
+    ASSERT_EQ(100, total);
+}
+
+// A slow recipient does not delay the others
+TEST(SendQueue, Parallel)
+{
+    SendQueue queue(2);
+
+    mutex resultLock;
+    vector<string> done;
+    queue.enqueue("slow", [&]() {
+        this_thread::sleep_for(chrono::milliseconds(200));
+        unique_lock<mutex> lck(resultLock);
+        done.push_back("slow");
+    });
+    for (int32_t i = 0; i < 5; i++) {
+        queue.enqueue("fast", [&]() {
+            unique_lock<mutex> lck(resultLock);
+            done.push_back("fast");
+        });
+    }
+    queue.drain();
+    ASSERT_EQ(6, done.size());
+    ASSERT_EQ(string("slow"), done.back());
+}
+
+static string peerName(int32_t i)
+{
+    char name[50];
+    snprintf(name, sizeof(name), "peer_%d@milkyway.com", i);
+    return string(name);
+}
+
+// Blocks the only thread of a queue until the test enqueued its tasks
+class Gate
+{
+public:
+    Gate(SendQueue* queue) : open_(promise_.get_future().share())
+    {
+        shared_future<void> open = open_;
+        shared_ptr<promise<void> > started = make_shared<promise<void> >();
+        future<void> running = started->get_future();
+        queue->enqueue("gate", [open, started]() { started->set_value(); open.wait(); });
+        running.wait();
+    }
+
+    void open() { promise_.set_value(); }
+
+private:
+    promise<void> promise_;
+    shared_future<void> open_;
+};
+
+static void record(SendQueue* queue, mutex* lock, string* order, const string& key, const string& name,
+                   SendQueue::Priority priority)
+{
+    queue->enqueue(key, [lock, order, name]() {
+        unique_lock<mutex> lck(*lock);
+        order->append(name);
+    }, priority);
+}
+
+TEST(SendQueue, Priority)
+{
+    SendQueue queue(1);
+    Gate gate(&queue);
+
+    mutex lock;
+    string order;
+    for (int32_t i = 0; i < 3; i++)
+        record(&queue, &lock, &order, peerName(i), "B", SendQueue::BACKGROUND);
+    for (int32_t i = 3; i < 6; i++)
+        record(&queue, &lock, &order, peerName(i), "I", SendQueue::INTERACTIVE);
+
+    ASSERT_EQ(3, queue.getQueueDepth(SendQueue::INTERACTIVE));
+    ASSERT_EQ(3, queue.getQueueDepth(SendQueue::BACKGROUND));
+    ASSERT_EQ(7, queue.getPending());
+
+    gate.open();
+    queue.drain();
+    ASSERT_EQ(string("IIIBBB"), order);
+    ASSERT_EQ(0, queue.getQueueDepth(SendQueue::INTERACTIVE));
+    ASSERT_EQ(0, queue.getQueueDepth(SendQueue::BACKGROUND));
+    ASSERT_EQ(3, queue.getMaxQueueDepth(SendQueue::BACKGROUND));
+    ASSERT_EQ(4, queue.getStarted(SendQueue::INTERACTIVE));    // the gate is interactive
+    ASSERT_EQ(3, queue.getStarted(SendQueue::BACKGROUND));
+}
+
+// A steady stream of interactive tasks does not starve the background tasks
+TEST(SendQueue, Starvation)
+{
+    SendQueue queue(1, 2);
+    Gate gate(&queue);
+
+    mutex lock;
+    string order;
+    for (int32_t i = 0; i < 3; i++)
+        record(&queue, &lock, &order, peerName(i), "B", SendQueue::BACKGROUND);
+    for (int32_t i = 3; i < 11; i++)
+        record(&queue, &lock, &order, peerName(i), "I", SendQueue::INTERACTIVE);
+
+    gate.open();
+    queue.drain();
+    ASSERT_EQ(string("IIBIIBIIBII"), order);
+}
+
+// An interactive task moves its key to the interactive lane, the key's tasks stay in order
+TEST(SendQueue, SameKey)
+{
+    SendQueue queue(1);
+    Gate gate(&queue);
+
+    mutex lock;
+    string order;
+    record(&queue, &lock, &order, "other", "x", SendQueue::BACKGROUND);
+    record(&queue, &lock, &order, "bob", "b", SendQueue::BACKGROUND);
+    record(&queue, &lock, &order, "bob", "i", SendQueue::INTERACTIVE);
+
+    gate.open();
+    queue.drain();
+    ASSERT_EQ(string("bix"), order);
+}
+
+static SQLiteStoreConv* prepareStore(int32_t numPeers)
+{
+    SQLiteStoreConv* store = openAccount(aliceName);
+
+    // One device per peer, ready to send
+    for (int32_t i = 0; i < numPeers; i++) {
+        AxoConversation conv(aliceName, peerName(i), string("0123456789abcdef0123456789abcdef"), store);
+        conv.setRK(string(32, 'r'));
+        conv.setCKs(string(32, 'c'));
+        conv.setDHIr(new Ec255PublicKey(keyInData));
+        conv.setDHRr(new Ec255PublicKey(keyInData));
+        conv.setDHRs(EcCurve::generateKeyPair(EcCurveTypes::Curve25519));
+        conv.setRatchetFlag(true);
+        conv.storeConversation();
+    }
+    return store;
+}
+
+struct StateReport {
+    int64_t handle;
+    int32_t code;
+    string recipient;
+    int32_t numIds;
+};
+
+static mutex reportLock;
+static vector<StateReport> reports;
+
+static int32_t receiveData(const string& messageDescriptor, const string& attachmentDescriptor, const string& messageAttributes)
+{
+    return 0;
+}
+
+static void stateReport(int64_t messageIdentifier, int32_t statusCode, const string& stateInformation)
+{
+    cJSON* root = cJSON_Parse(stateInformation.c_str());
+    StateReport report;
+    report.handle = messageIdentifier;
+    report.code = statusCode;
+    report.recipient = cJSON_GetObjectItem(cJSON_GetObjectItem(root, "details"), "name")->valuestring;
+    report.numIds = cJSON_GetArraySize(cJSON_GetObjectItem(root, "msgIds"));
+    cJSON_Delete(root);
+
+    unique_lock<mutex> lck(reportLock);
+    reports.push_back(report);
+}
+
+static string messageDescriptor(const string& recipient, int32_t i)
+{
+    char descriptor[200];
+    snprintf(descriptor, sizeof(descriptor), "{\"recipient\": \"%s\", \"msgId\": \"msg-%d\", \"message\": \"Hello\"}",
+             recipient.c_str(), i);
+    return string(descriptor);
+}
+
+TEST(AsyncSend, StateReport)
+{
+    const int32_t numPeers = 3;
+    const int32_t numMessages = 10;
+    SQLiteStoreConv* store = prepareStore(numPeers);
+
+    // The interface owns and deletes the transport
+    CollectTransport* transport = new CollectTransport();
+    AppInterfaceImpl* uiIf = new AppInterfaceImpl(store, aliceName, string("myAPI-key"), aliceDev, receiveData, stateReport, notifyStub);
+    uiIf->setTransport(transport);
+    ASSERT_TRUE(uiIf->getSendQueue() != NULL);
+
+    reports.clear();
+    vector<int64_t> handles;
+    for (int32_t i = 0; i < numMessages; i++) {
+        for (int32_t p = 0; p < numPeers; p++) {
+            int64_t handle = uiIf->sendMessageAsync(messageDescriptor(peerName(p), i), empty, empty);
+            ASSERT_GT(handle, 0);
+            handles.push_back(handle);
+        }
+    }
+    // Invalid descriptors fail at once
+    ASSERT_EQ(JS_FIELD_MISSING, uiIf->sendMessageAsync(string("{\"msgId\": \"msg-1\"}"), empty, empty));
+
+    uiIf->getSendQueue()->drain();
+    uiIf->getTransportQueue()->drain();
+    ASSERT_EQ(handles.size(), reports.size());
+
+    // Each recipient's reports arrive in the order of the send calls
+    map<string, int64_t> lastHandle;
+    for (size_t i = 0; i < reports.size(); i++) {
+        ASSERT_EQ(OK, reports[i].code);
+        ASSERT_EQ(1, reports[i].numIds);
+        ASSERT_LT(lastHandle[reports[i].recipient], reports[i].handle);
+        lastHandle[reports[i].recipient] = reports[i].handle;
+    }
+    ASSERT_EQ(numPeers * numMessages, transport->numSent());
+
+    delete uiIf;
+    delete store;
+}
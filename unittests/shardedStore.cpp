@@ -0,0 +1,272 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include "gtest/gtest.h"
+
+#include "../storage/sqlite/SQLiteStoreConv.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+using namespace salamander;
+using namespace std;
+
+static std::string aliceName("alice@wonderland.org");
+
+static const uint8_t keyInData[] = {0,1,2,3,4,5,6,7,8,9,19,18,17,16,15,14,13,12,11,10,20,21,22,23,24,25,26,27,28,20,31,30};
+
+static const char* dbFile = "shardtest.db";
+
+static SQLiteStoreConv* openStore(const string& name, int32_t shards)
+{
+    SQLiteStoreConv* store = new SQLiteStoreConv();
+    store->setKey(std::string((const char*)keyInData, 32));
+    store->setShards(shards);
+    store->openStore(name);
+    if (SQL_FAIL(store->getSqlCode())) {
+        cerr << store->getLastError() << endl;
+        exit(1);
+    }
+    return store;
+}
+
+static void removeFiles(int32_t shards)
+{
+    remove(dbFile);
+    for (int32_t i = 0; i < shards; i++) {
+        char name[100];
+        snprintf(name, sizeof(name), "%s.shard%d", dbFile, i);
+        remove(name);
+    }
+}
+
+static string peerName(int32_t i)
+{
+    char name[50];
+    snprintf(name, sizeof(name), "peer_%d@milkyway.com", i);
+    return string(name);
+}
+
+static string peerDevice(int32_t i)
+{
+    char dev[50];
+    snprintf(dev, sizeof(dev), "devId_%d", i);
+    return string(dev);
+}
+
+TEST(ShardedStore, Routing)
+{
+    SQLiteStoreConv* store = openStore(string(), 4);
+    ASSERT_EQ(4, store->getShards());
+
+    string data("conversation data");
+    string mk("staged message key");
+
+    // Two devices for each peer, the devices usually end up in different shards
+    for (int32_t i = 0; i < 20; i++) {
+        store->storeConversation(peerName(i), peerDevice(i), aliceName, data);
+        store->storeConversation(peerName(i), peerDevice(i+100), aliceName, data);
+        store->insertStagedMk(peerName(i), peerDevice(i), aliceName, mk);
+    }
+    for (int32_t i = 0; i < 20; i++) {
+        ASSERT_TRUE(store->hasConversation(peerName(i), peerDevice(i), aliceName));
+        string* stored = store->loadConversation(peerName(i), peerDevice(i+100), aliceName);
+        ASSERT_TRUE(stored != NULL);
+        ASSERT_EQ(data, *stored);
+        delete stored;
+
+        list<string>* mks = store->loadStagedMks(peerName(i), peerDevice(i), aliceName);
+        ASSERT_TRUE(mks != NULL);
+        ASSERT_EQ(1, mks->size());
+        delete mks;
+    }
+    list<string>* names = store->getKnownConversations(aliceName);
+    ASSERT_TRUE(names != NULL);
+    ASSERT_EQ(20, names->size());
+    delete names;
+
+    list<string>* devIds = store->getLongDeviceIds(peerName(3), aliceName);
+    ASSERT_TRUE(devIds != NULL);
+    ASSERT_EQ(2, devIds->size());
+    delete devIds;
+
+    store->deleteConversationsName(peerName(3), aliceName);
+    ASSERT_FALSE(store->hasConversation(peerName(3), peerDevice(3), aliceName));
+    ASSERT_FALSE(store->hasConversation(peerName(3), peerDevice(103), aliceName));
+
+    store->deleteStagedMk(time(0) + 10);
+    ASSERT_TRUE(store->loadStagedMks(peerName(1), peerDevice(1), aliceName) == NULL);
+
+    delete store;
+}
+
+TEST(ShardedStore, Migration)
+{
+    removeFiles(4);
+    string data("conversation data");
+    string mk("staged message key");
+
+    // Populate a store with the single-file layout
+    SQLiteStoreConv* store = openStore(dbFile, 0);
+    for (int32_t i = 0; i < 50; i++) {
+        store->storeConversation(peerName(i), peerDevice(i), aliceName, data);
+        store->insertStagedMk(peerName(i), peerDevice(i), aliceName, mk);
+    }
+    delete store;
+
+    // Re-open with shards, data is not visible before migration
+    store = openStore(dbFile, 4);
+    ASSERT_FALSE(store->hasConversation(peerName(0), peerDevice(0), aliceName));
+
+    ASSERT_EQ(SQLITE_OK, store->migrateToShards()) << store->getLastError();
+    for (int32_t i = 0; i < 50; i++) {
+        ASSERT_TRUE(store->hasConversation(peerName(i), peerDevice(i), aliceName));
+        list<string>* mks = store->loadStagedMks(peerName(i), peerDevice(i), aliceName);
+        ASSERT_TRUE(mks != NULL);
+        ASSERT_EQ(1, mks->size());
+        delete mks;
+    }
+    // Running it again is a no-op
+    ASSERT_EQ(SQLITE_OK, store->migrateToShards()) << store->getLastError();
+    delete store;
+
+    // An interrupted migration left stale copies in the source, the next run keeps the
+    // state in the shards and copies no duplicates
+    store = openStore(dbFile, 0);
+    for (int32_t i = 0; i < 50; i++) {
+        store->storeConversation(peerName(i), peerDevice(i), aliceName, string("stale data"));
+        store->insertStagedMk(peerName(i), peerDevice(i), aliceName, mk);
+    }
+    delete store;
+    store = openStore(dbFile, 4);
+    ASSERT_EQ(SQLITE_OK, store->migrateToShards()) << store->getLastError();
+    for (int32_t i = 0; i < 50; i++) {
+        string* stored = store->loadConversation(peerName(i), peerDevice(i), aliceName);
+        ASSERT_TRUE(stored != NULL);
+        ASSERT_EQ(data, *stored);
+        delete stored;
+        list<string>* mks = store->loadStagedMks(peerName(i), peerDevice(i), aliceName);
+        ASSERT_TRUE(mks != NULL);
+        ASSERT_EQ(1, mks->size());
+        delete mks;
+    }
+    delete store;
+    store = openStore(dbFile, 0);
+    ASSERT_FALSE(store->hasConversation(peerName(0), peerDevice(0), aliceName));
+    delete store;
+
+    // Increase the number of shards and rebalance
+    store = openStore(dbFile, 8);
+    ASSERT_EQ(SQLITE_OK, store->migrateToShards()) << store->getLastError();
+    for (int32_t i = 0; i < 50; i++) {
+        ASSERT_TRUE(store->hasConversation(peerName(i), peerDevice(i), aliceName));
+    }
+    list<string>* names = store->getKnownConversations(aliceName);
+    ASSERT_EQ(50, names->size());
+    delete names;
+    delete store;
+
+    removeFiles(8);
+}
+
+// The devices of a user in one lookup per shard, as for a device notification
+TEST(ShardedStore, HasConversations)
+{
+    const int32_t numDevices = 8;
+    const int32_t numLookups = 2000;
+    string data(4000, 'c');
+    string bob("bob@milkyway.com");
+
+    for (int32_t shards = 0; shards <= 4; shards += 4) {
+        SQLiteStoreConv* store = openStore(string(), shards);
+        for (int32_t i = 0; i < numDevices; i++)
+            store->storeConversation(bob, peerDevice(i), aliceName, data);
+        store->storeConversation(bob, string(), aliceName, data);
+
+        // Known devices, new devices and the local conversation
+        vector<string> ids;
+        for (int32_t i = 0; i < numDevices + 4; i++)
+            ids.push_back(peerDevice(i));
+        ids.push_back(string());
+        vector<DataSpan> devices(ids.begin(), ids.end());
+
+        vector<bool> known;
+        ASSERT_EQ(SQLITE_OK, store->hasConversations(bob, devices, aliceName, &known));
+        ASSERT_EQ(ids.size(), known.size());
+        for (size_t i = 0; i < ids.size(); i++) {
+            ASSERT_EQ(store->hasConversation(bob, ids[i], aliceName), known[i]);
+            ASSERT_EQ(i < numDevices || ids[i].empty(), known[i]);
+        }
+        ASSERT_EQ(SQLITE_OK, store->hasConversations(string("carol"), devices, aliceName, &known));
+        for (size_t i = 0; i < known.size(); i++)
+            ASSERT_FALSE(known[i]);
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int32_t n = 0; n < numLookups; n++) {
+            for (size_t i = 0; i < ids.size(); i++)
+                store->hasConversation(bob, ids[i], aliceName);
+        }
+        int64_t singleMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+        start = chrono::steady_clock::now();
+        for (int32_t n = 0; n < numLookups; n++)
+            store->hasConversations(bob, devices, aliceName, &known);
+        int64_t batchMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+        cerr << "shards: " << shards << ", " << numLookups << " lookups of " << ids.size() << " devices, single: "
+             << singleMicros / 1000 << "ms, batch: " << batchMicros / 1000 << "ms" << endl;
+        delete store;
+    }
+}
+
+// Not a pass/fail test: report the write throughput of several threads that update
+// conversations of different peers, once with the single-file layout and once sharded.
+TEST(ShardedStore, WriteBenchmark)
+{
+    const int32_t numThreads = 4;
+    const int32_t numWrites = 200;
+    string data(1000, 'x');
+
+    for (int32_t shards = 0; shards <= numThreads; shards += numThreads) {
+        removeFiles(numThreads);
+        SQLiteStoreConv* store = openStore(dbFile, shards);
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        vector<thread> writers;
+        for (int32_t t = 0; t < numThreads; t++) {
+            writers.push_back(thread([store, t, &data, numWrites]() {
+                for (int32_t i = 0; i < numWrites; i++)
+                    store->storeConversation(peerName(t * numWrites + i), peerDevice(t), aliceName, data);
+            }));
+        }
+        for (size_t t = 0; t < writers.size(); t++)
+            writers[t].join();
+        chrono::steady_clock::duration elapsed = chrono::steady_clock::now() - start;
+
+        cerr << "shards: " << shards << ", threads: " << numThreads << ", writes: " << numThreads * numWrites
+             << ", time: " << chrono::duration_cast<chrono::milliseconds>(elapsed).count() << "ms" << endl;
+
+        list<string>* names = store->getKnownConversations(aliceName);
+        ASSERT_EQ(numThreads * numWrites, names->size());
+        delete names;
+        delete store;
+    }
+    removeFiles(numThreads);
+}
@@ -18,6 +18,7 @@ limitations under the License.
 
 #include "../salamander/state/SalConversation.h"
 #include "../storage/sqlite/SQLiteStoreConv.h"
+#include "../storage/logstore/LogStoreConv.h"
 #include "../salamander/crypto/EcCurve.h"
 #include "../salamander/crypto/EcCurveTypes.h"
 #include "../salamander/crypto/Ec255PublicKey.h"
@@ -40,30 +41,38 @@ static const uint8_t keyInDataF[] = {"ZZZZZZZZZZYYYYYYYYYYXXXXXXXXXXW"};
 
 static const uint8_t keyInData[] = {0,1,2,3,4,5,6,7,8,9,19,18,17,16,15,14,13,12,11,10,20,21,22,23,24,25,26,27,28,20,31,30};
 
-void prepareStore()
+// Both store backends must pass the same tests
+typedef ConversationStore* (*StoreFactory)();
+
+static ConversationStore* openStore(ConversationStore* store)
 {
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
-    if (store->isReady())
-        return;
     store->setKey(std::string((const char*)keyInData, 32));
     store->openStore(std::string());
-    if (SQL_FAIL(store->getSqlCode())) {
+    if (STORE_FAIL(store->getStoreCode())) {
         cerr << store->getLastError() << endl;
         exit(1);
     }
+    return store;
 }
 
-TEST(StagedKeys, Basic) 
+static ConversationStore* newSQLiteStore() { return openStore(new SQLiteStoreConv()); }
+
+static ConversationStore* newLogStore() { return openStore(new LogStoreConv()); }
+
+class StagedKeys : public ::testing::TestWithParam<StoreFactory> {};
+
+INSTANTIATE_TEST_CASE_P(Backends, StagedKeys, ::testing::Values(&newSQLiteStore, &newLogStore));
+
+TEST_P(StagedKeys, Basic) 
 {
-    prepareStore();
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
+    ConversationStore* store = GetParam()();
     string mkiv((const char*)keyInData, 32);
 
     store->insertStagedMk(bobName, bobDev, aliceName, mkiv);
-    ASSERT_FALSE(SQL_FAIL(store->getSqlCode())) << store->getLastError();
+    ASSERT_FALSE(STORE_FAIL(store->getStoreCode())) << store->getLastError();
 
     list<string>* keys = store->loadStagedMks(bobName, bobDev, aliceName);
-    ASSERT_FALSE(SQL_FAIL(store->getSqlCode())) << store->getLastError();
+    ASSERT_FALSE(STORE_FAIL(store->getStoreCode())) << store->getLastError();
     ASSERT_TRUE(keys != NULL);
     ASSERT_EQ(1, keys->size());
     string both = keys->front();
@@ -72,31 +81,31 @@ TEST(StagedKeys, Basic)
     delete keys; keys = NULL;
 
     store->deleteStagedMk(bobName, bobDev, aliceName, both);
-    ASSERT_FALSE(SQL_FAIL(store->getSqlCode())) << store->getLastError();
+    ASSERT_FALSE(STORE_FAIL(store->getStoreCode())) << store->getLastError();
 
     keys = store->loadStagedMks(bobName, bobDev, aliceName);
-    ASSERT_FALSE(SQL_FAIL(store->getSqlCode())) << store->getLastError();
+    ASSERT_FALSE(STORE_FAIL(store->getStoreCode())) << store->getLastError();
     ASSERT_TRUE(keys == NULL);
     delete keys;
+    delete store;
 }
 
-TEST(StagedKeys, TimeDelete) 
+TEST_P(StagedKeys, TimeDelete) 
 {
-    prepareStore();
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
+    ConversationStore* store = GetParam()();
     string mkiv((const char*)keyInDataC, 32);
     string mkiv_1((const char*)keyInDataD, 32);
     string mkiv_2((const char*)keyInDataE, 32);
     string mkiv_3((const char*)keyInDataF, 32);
 
     store->insertStagedMk(bobName, bobDev, aliceName, mkiv);
-    ASSERT_FALSE(SQL_FAIL(store->getSqlCode())) << store->getLastError();
+    ASSERT_FALSE(STORE_FAIL(store->getStoreCode())) << store->getLastError();
 
     store->insertStagedMk(bobName, bobDev, aliceName, mkiv_1);
-    ASSERT_FALSE(SQL_FAIL(store->getSqlCode())) << store->getLastError();
+    ASSERT_FALSE(STORE_FAIL(store->getStoreCode())) << store->getLastError();
 
     list<string>* keys = store->loadStagedMks(bobName, bobDev, aliceName);
-    ASSERT_FALSE(SQL_FAIL(store->getSqlCode())) << store->getLastError();
+    ASSERT_FALSE(STORE_FAIL(store->getStoreCode())) << store->getLastError();
     ASSERT_TRUE(keys != NULL);
     ASSERT_EQ(2, keys->size());
     delete keys; keys = NULL;
@@ -104,13 +113,13 @@ TEST(StagedKeys, TimeDelete)
     sqlite3_sleep(5000);
 
     store->insertStagedMk(bobName, bobDev, aliceName, mkiv_2);
-    ASSERT_FALSE(SQL_FAIL(store->getSqlCode())) << store->getLastError();
+    ASSERT_FALSE(STORE_FAIL(store->getStoreCode())) << store->getLastError();
 
     store->insertStagedMk(bobName, bobDev, aliceName, mkiv_3);
-    ASSERT_FALSE(SQL_FAIL(store->getSqlCode())) << store->getLastError();
+    ASSERT_FALSE(STORE_FAIL(store->getStoreCode())) << store->getLastError();
 
     keys = store->loadStagedMks(bobName, bobDev, aliceName);
-    ASSERT_FALSE(SQL_FAIL(store->getSqlCode())) << store->getLastError();
+    ASSERT_FALSE(STORE_FAIL(store->getStoreCode())) << store->getLastError();
     ASSERT_TRUE(keys != NULL);
     ASSERT_EQ(4, keys->size());
     delete keys;
@@ -119,10 +128,11 @@ TEST(StagedKeys, TimeDelete)
     store->deleteStagedMk(now_4);
     keys = store->loadStagedMks(bobName, bobDev, aliceName);
 
-    ASSERT_FALSE(SQL_FAIL(store->getSqlCode())) << store->getLastError();
+    ASSERT_FALSE(STORE_FAIL(store->getStoreCode())) << store->getLastError();
     ASSERT_TRUE(keys != NULL);
     ASSERT_EQ(2, keys->size());
     delete keys;
+    delete store;
 }
 
 TEST(UUID, Basic)
@@ -16,17 +16,21 @@ limitations under the License.
 #include <limits.h>
 
 #include "../storage/sqlite/SQLiteStoreConv.h"
+#include "../storage/logstore/LogStoreConv.h"
+#include "../storage/StoreMaintenance.h"
 
 #include "../salamander/crypto/DhKeyPair.h"
 #include "../salamander/crypto/Ec255PrivateKey.h"
 #include "../salamander/crypto/Ec255PublicKey.h"
 #include "../util/cJSON.h"
 #include "../util/b64helper.h"
+#include "../keymanagment/PreKeys.h"
 
 
 #include "gtest/gtest.h"
 #include <iostream>
 #include <string>
+#include <chrono>
 
 static const uint8_t keyInData[] = {0,1,2,3,4,5,6,7,8,9,19,18,17,16,15,14,13,12,11,10,20,21,22,23,24,25,26,27,28,20,31,30};
 static const uint8_t keyInData_1[] = {0,1,2,3,4,5,6,7,8,9,19,18,17,16,15,14,13,12,11,10,20,21,22,23,24,25,26,27,28,20,31,32};
@@ -35,6 +39,29 @@ static     std::string empty;
 
 using namespace salamander;
 
+// Both store backends must pass the same tests
+typedef ConversationStore* (*StoreFactory)(const string& fileName);
+
+static ConversationStore* newSQLiteStore(const string& fileName)
+{
+    ConversationStore* store = new SQLiteStoreConv();
+    store->setKey(std::string((const char*)keyInData, 32));
+    store->openStore(fileName);
+    return store;
+}
+
+static ConversationStore* newLogStore(const string& fileName)
+{
+    ConversationStore* store = new LogStoreConv();
+    store->setKey(std::string((const char*)keyInData, 32));
+    store->openStore(fileName);
+    return store;
+}
+
+class PreKeyStore : public ::testing::TestWithParam<StoreFactory> {};
+
+INSTANTIATE_TEST_CASE_P(Backends, PreKeyStore, ::testing::Values(&newSQLiteStore, &newLogStore));
+
 static string* preKeyJson(int32_t keyId, const DhKeyPair& preKeyPair)
 {
     cJSON *root;
@@ -58,7 +85,7 @@ static string* preKeyJson(int32_t keyId, const DhKeyPair& preKeyPair)
     return data;
 }
 
-TEST(PreKeyStore, Basic)
+TEST_P(PreKeyStore, Basic)
 {
     // Need a key pair here
     const Ec255PublicKey baseKey_1(keyInData_1);
@@ -67,9 +94,7 @@ TEST(PreKeyStore, Basic)
 
     string* pk = preKeyJson(3, basePair);
 
-    SQLiteStoreConv* pks = SQLiteStoreConv::getStoreForTesting();
-    pks->setKey(std::string((const char*)keyInData, 32));
-    pks->openStore(std::string());
+    ConversationStore* pks = GetParam()(std::string());
 
     string* pk_1 = pks->loadPreKey(3);
     ASSERT_EQ(NULL, pk_1) <<  "Some data in an empty store?";
@@ -78,7 +103,7 @@ TEST(PreKeyStore, Basic)
     ASSERT_TRUE(pks->containsPreKey(3));
 
     pks->storePreKey(3, *pk);
-    ASSERT_TRUE(pks->getSqlCode() == SQLITE_CONSTRAINT) << pks->getLastError();
+    ASSERT_TRUE(pks->getStoreCode() == STORE_CONSTRAINT) << pks->getLastError();
 
     pk_1 = pks->loadPreKey(3);
     ASSERT_EQ(*pk, *pk_1);
@@ -87,6 +112,106 @@ TEST(PreKeyStore, Basic)
     pks->removePreKey(3);
     ASSERT_FALSE(pks->containsPreKey(3));
 
-    SQLiteStoreConv::closeStoreForTesting(pks);
+    delete pks;
 }
 
+
+TEST_P(PreKeyStore, Maintenance)
+{
+    const Ec255PublicKey baseKey_1(keyInData_1);
+    const Ec255PrivateKey basePriv_1(keyInData_2);
+    const DhKeyPair basePair(baseKey_1, basePriv_1);
+
+    string* pk = preKeyJson(5, basePair);
+
+    ConversationStore* pks = GetParam()(std::string());
+
+    pks->storePreKey(5, *pk);
+    ASSERT_TRUE(pks->containsPreKey(5));
+
+    // The server may still hand out an unused pre-key, maintenance must keep it
+    StoreMaintenance maintenance(pks);
+    ASSERT_EQ(STORE_OK, maintenance.runNow()) << pks->getLastError();
+    ASSERT_TRUE(pks->containsPreKey(5));
+
+    ASSERT_EQ(STORE_OK, pks->optimizeStore()) << pks->getLastError();
+    ASSERT_EQ(STORE_OK, pks->incrementalVacuum(0)) << pks->getLastError();
+    ASSERT_EQ(STORE_OK, pks->deleteStagedMk(time(0))) << pks->getLastError();
+    ASSERT_EQ(STORE_OK, pks->deleteReceivedIds(time(0))) << pks->getLastError();
+
+    delete pk;
+    delete pks;
+}
+
+TEST_P(PreKeyStore, Batch)
+{
+    ConversationStore* pks = GetParam()(std::string());
+
+    list<pair<int32_t, const DhKeyPair*> >* preList = PreKeys::generatePreKeys(pks, 20);
+    ASSERT_EQ(20, preList->size());
+
+    list<int32_t>* ids = pks->getPreKeyIds();
+    ASSERT_TRUE(ids != NULL);
+    ASSERT_EQ(20, ids->size());
+    delete ids;
+
+    // Stored data must parse and match the returned key pairs
+    while (!preList->empty()) {
+        pair<int32_t, const DhKeyPair*> pkPair = preList->front();
+        preList->pop_front();
+
+        string* data = pks->loadPreKey(pkPair.first);
+        ASSERT_TRUE(data != NULL);
+        DhKeyPair* stored = PreKeys::parsePreKeyData(*data);
+        ASSERT_TRUE(pkPair.second->getPublicKey() == stored->getPublicKey());
+        delete stored;
+        delete data;
+        delete pkPair.second;
+    }
+    delete preList;
+
+    // A duplicate id rolls back the whole batch
+    list<int32_t>* storedIds = pks->getPreKeyIds();
+    list<pair<int32_t, string> > batch;
+    batch.push_back(pair<int32_t, string>(INT_MAX, "new pre-key"));
+    batch.push_back(pair<int32_t, string>(storedIds->front(), "duplicate pre-key"));
+    delete storedIds;
+    ASSERT_EQ(STORE_CONSTRAINT, pks->storePreKeys(batch));
+    ASSERT_FALSE(pks->containsPreKey(INT_MAX));
+
+    delete pks;
+}
+
+// Not a pass/fail test: report the time to generate and store pre-keys one by one,
+// as done before the batch path existed, and in one batch.
+TEST_P(PreKeyStore, BatchBenchmark)
+{
+    const char* dbFile = "prekeybench.db";
+    remove(dbFile);
+    ConversationStore* pks = GetParam()(dbFile);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int32_t i = 0; i < NUM_PRE_KEYS; i++) {
+        pair<int32_t, const DhKeyPair*> pkPair = PreKeys::generatePreKey(pks);
+        delete pkPair.second;
+    }
+    chrono::steady_clock::duration single = chrono::steady_clock::now() - start;
+
+    start = chrono::steady_clock::now();
+    list<pair<int32_t, const DhKeyPair*> >* preList = PreKeys::generatePreKeys(pks);
+    chrono::steady_clock::duration batch = chrono::steady_clock::now() - start;
+    ASSERT_EQ(NUM_PRE_KEYS, preList->size());
+
+    while (!preList->empty()) {
+        delete preList->front().second;
+        preList->pop_front();
+    }
+    delete preList;
+
+    cerr << "pre-keys: " << NUM_PRE_KEYS
+         << ", single: " << chrono::duration_cast<chrono::milliseconds>(single).count() << "ms"
+         << ", batch: " << chrono::duration_cast<chrono::milliseconds>(batch).count() << "ms" << endl;
+
+    delete pks;
+    remove(dbFile);
+}
@@ -0,0 +1,165 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include "gtest/gtest.h"
+
+#include "../interfaceApp/MessageData.h"
+#include "../util/cJSON.h"
+#include "testHelper.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+using namespace salamander;
+using namespace std;
+
+static IncomingMessage lastReceived;
+static string lastDescriptorMessage;
+
+static int32_t receiveStruct(IncomingMessage&& message)
+{
+    lastReceived = std::move(message);
+    return OK;
+}
+
+// Like an application, parse the descriptor to get the message
+static int32_t receiveJson(const string& messageDescriptor, const string& attachmentDescriptor, const string& messageAttributes)
+{
+    cJSON* root = cJSON_Parse(messageDescriptor.c_str());
+    cJSON* cjTemp = cJSON_GetObjectItem(root, "message");
+    lastDescriptorMessage = (cjTemp != NULL && cjTemp->valuestring != NULL) ? cjTemp->valuestring : "";
+    cJSON_Delete(root);
+    return OK;
+}
+
+// Like an application, create the descriptor with a JSON library, it escapes the message
+static string messageDescriptor(const OutgoingMessage& message)
+{
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "version", 1);
+    cJSON_AddStringToObject(root, "recipient", message.recipient.c_str());
+    cJSON_AddStringToObject(root, "msgId", message.msgId.c_str());
+    cJSON_AddStringToObject(root, "message", message.message.c_str());
+    char *out = cJSON_PrintUnformatted(root);
+    string descriptor(out);
+    cJSON_Delete(root); free(out);
+    return descriptor;
+}
+
+static OutgoingMessage testMessage(int32_t i, size_t size)
+{
+    char msgId[50];
+    snprintf(msgId, sizeof(msgId), "msg-%d", i);
+    OutgoingMessage message(bobName, string(msgId), string());
+
+    // Quotes and control characters need escaping in JSON
+    while (message.message.size() < size)
+        message.message.append("Hello \"Bob\",\n\tsee you at 5\\6. ");
+    message.message.resize(size);
+    message.attachment = "{\"cloud_url\": \"https://example.com/a\", \"cloud_key\": \"k\"}";
+    message.attributes = "{\"r\": true, \"s\": 5}";
+    return message;
+}
+
+TEST(StructApi, RoundTrip)
+{
+    SQLiteStoreConv* aliceStore = openAccount(aliceName);
+    SQLiteStoreConv* bobStore = openAccount(bobName);
+    connect(aliceStore, bobStore);
+
+    CollectTransport* transport = new CollectTransport();
+    AppInterfaceImpl aliceIf(aliceStore, aliceName, string("myAPI-key"), aliceDev);
+    aliceIf.setTransport(transport);
+    AppInterfaceImpl bobIf(bobStore, bobName, string("myAPI-key"), bobDev, receiveJson, stateReportStub, notifyStub);
+    bobIf.setReceiveMessageCallback(receiveStruct);
+
+    OutgoingMessage message = testMessage(1, 200);
+    CallContext ctx;
+    vector<int64_t>* msgIds = aliceIf.sendMessage(message, &ctx);
+    ASSERT_TRUE(msgIds != NULL) << ctx.getErrorCode();
+    delete msgIds;
+
+    ASSERT_EQ(OK, bobIf.receiveMessage(transport->lastEnvelope(), &ctx));
+    ASSERT_EQ(aliceName, lastReceived.sender);
+    ASSERT_EQ(aliceDev, lastReceived.scClientDevId);
+    ASSERT_EQ(message.msgId, lastReceived.msgId);
+    ASSERT_EQ(message.message, lastReceived.message);
+    ASSERT_EQ(message.attachment, lastReceived.attachment);
+    ASSERT_EQ(message.attributes, lastReceived.attributes);
+
+    // The JSON callback gets the same message. It needs a new message id, the receiver
+    // drops a message id it has seen as a duplicate.
+    bobIf.setReceiveMessageCallback(NULL);
+    message.msgId = "msg-2";
+    msgIds = aliceIf.sendMessage(messageDescriptor(message), message.attachment, message.attributes, &ctx);
+    delete msgIds;
+    ASSERT_EQ(OK, bobIf.receiveMessage(transport->lastEnvelope(), &ctx));
+    ASSERT_EQ(message.message, lastDescriptorMessage);
+
+    delete bobStore;
+    delete aliceStore;
+}
+
+static int64_t runRoundTrips(bool structured, size_t size, int32_t numMessages)
+{
+    SQLiteStoreConv* aliceStore = openAccount(aliceName);
+    SQLiteStoreConv* bobStore = openAccount(bobName);
+    connect(aliceStore, bobStore);
+
+    CollectTransport* transport = new CollectTransport();
+    AppInterfaceImpl* aliceIf = new AppInterfaceImpl(aliceStore, aliceName, string("myAPI-key"), aliceDev);
+    aliceIf->setTransport(transport);
+    AppInterfaceImpl* bobIf = new AppInterfaceImpl(bobStore, bobName, string("myAPI-key"), bobDev, receiveJson, stateReportStub, notifyStub);
+    bobIf->setReceiveMessageCallback(structured ? receiveStruct : NULL);
+
+    vector<OutgoingMessage> messages;
+    for (int32_t i = 0; i < numMessages; i++)
+        messages.push_back(testMessage(i, size));
+
+    CallContext ctx;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int32_t i = 0; i < numMessages; i++) {
+        if (structured)
+            delete aliceIf->sendMessage(messages[i], &ctx);
+        else
+            delete aliceIf->sendMessage(messageDescriptor(messages[i]), messages[i].attachment, messages[i].attributes, &ctx);
+        bobIf->receiveMessage(transport->lastEnvelope(), &ctx);
+    }
+    int64_t elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+    delete bobIf;
+    delete aliceIf;
+    delete bobStore;
+    delete aliceStore;
+    return elapsed / numMessages;
+}
+
+// Benchmark, not a pass/fail test: send and receive time per message, JSON and structured
+TEST(StructApi, Latency)
+{
+    const int32_t numMessages = 200;
+    size_t sizes[] = {100, 4000, 32000};
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int64_t json = runRoundTrips(false, sizes[i], numMessages);
+        int64_t structured = runRoundTrips(true, sizes[i], numMessages);
+        cerr << "message size " << sizes[i] << ": JSON " << json << " us/message, structured " << structured
+             << " us/message" << endl;
+    }
+}
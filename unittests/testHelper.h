@@ -0,0 +1,136 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef TESTHELPER_H
+#define TESTHELPER_H
+
+// Accounts, stores and a transport stub that the interface tests share. Each test
+// program is one source file, the definitions are static to that file.
+
+#include "../interfaceApp/AppInterfaceImpl.h"
+#include "../interfaceTransport/Transport.h"
+#include "../salamander/state/SalConversation.h"
+#include "../salamander/SalZrtpConnector.h"
+#include "../salamander/crypto/EcCurve.h"
+#include "../storage/sqlite/SQLiteStoreConv.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+static std::string aliceName("alice@wonderland.org");
+static std::string aliceDev("aliceDevId");
+static std::string bobName("bob@milkyway.com");
+static std::string bobDev("0123456789abcdef0123456789abcdef");
+
+static const uint8_t keyInData[] = {0,1,2,3,4,5,6,7,8,9,19,18,17,16,15,14,13,12,11,10,20,21,22,23,24,25,26,27,28,20,31,30};
+
+static std::string empty;
+
+// An empty store in memory
+static inline salamander::SQLiteStoreConv* openStore()
+{
+    salamander::SQLiteStoreConv* store = new salamander::SQLiteStoreConv();
+    store->setKey(std::string((const char*)keyInData, 32));
+    store->openStore(std::string());
+    return store;
+}
+
+// A store in memory with the identity key of the account
+static inline salamander::SQLiteStoreConv* openAccount(const std::string& name)
+{
+    salamander::SQLiteStoreConv* store = openStore();
+
+    salamander::AxoConversation local(name, name, empty, store);
+    local.setDHIs(salamander::EcCurve::generateKeyPair(salamander::EcCurveTypes::Curve25519));
+    local.setPreKeysAvail(salamander::NUM_PRE_KEYS);
+    local.storeConversation();
+    return store;
+}
+
+// Set up the conversations like a ZRTP call between Alice and Bob
+static inline void connect(salamander::SQLiteStoreConv* aliceStore, salamander::SQLiteStoreConv* bobStore)
+{
+    std::string exportedKey((const char*)keyInData, 32);
+    std::string aliceToBob = getAxoPublicKeyData(aliceName, bobName, bobDev, aliceStore);
+    std::string bobToAlice = getAxoPublicKeyData(bobName, aliceName, aliceDev, bobStore);
+    setAxoPublicKeyData(aliceName, bobName, bobDev, bobToAlice);
+    setAxoPublicKeyData(bobName, aliceName, aliceDev, aliceToBob);
+    setAxoExportedKey(aliceName, bobName, bobDev, exportedKey);
+    setAxoExportedKey(bobName, aliceName, aliceDev, exportedKey);
+}
+
+// Callbacks for the interfaces whose results a test does not check
+static inline int32_t receiveStub(const std::string&, const std::string&, const std::string&) { return salamander::OK; }
+
+static inline void stateReportStub(int64_t, int32_t, const std::string&) {}
+
+static inline void notifyStub(int32_t, const std::string&, const std::string&) {}
+
+// Collects the envelopes instead of sending them. While failing is set it sends
+// nothing and returns no message ids, like a transport without network.
+class CollectTransport : public salamander::Transport
+{
+public:
+    CollectTransport() : failing(false), nextId(1) {}
+
+    void setSendDataFunction(SEND_DATA_FUNC) {}
+
+    SEND_DATA_FUNC getTransport() { return NULL; }
+
+    std::vector<int64_t>* sendAxoMessage(const std::string& recipient, std::vector<std::pair<std::string, std::string> >* msgPairs)
+    {
+        std::unique_lock<std::mutex> lck(lock);
+        calls.push_back(std::pair<std::string, size_t>(recipient, msgPairs->size()));
+        std::vector<int64_t>* ids = new std::vector<int64_t>;
+        if (failing)
+            return ids;
+        for (size_t i = 0; i < msgPairs->size(); i++) {
+            recipients.push_back(recipient);
+            sent.push_back(msgPairs->at(i));
+            ids->push_back(nextId++);
+        }
+        return ids;
+    }
+
+    int32_t receiveAxoMessage(uint8_t*, size_t) { return 0; }
+
+    void stateReportAxo(int64_t, int32_t, uint8_t*, size_t) {}
+
+    void notifyAxo(uint8_t*, size_t) {}
+
+    size_t numCalls() { std::unique_lock<std::mutex> lck(lock); return calls.size(); }
+
+    size_t numSent() { std::unique_lock<std::mutex> lck(lock); return sent.size(); }
+
+    std::string lastEnvelope() { std::unique_lock<std::mutex> lck(lock); return sent.empty() ? std::string() : sent.back().second; }
+
+    void clear()
+    {
+        std::unique_lock<std::mutex> lck(lock);
+        calls.clear();
+        recipients.clear();
+        sent.clear();
+    }
+
+    bool failing;
+    int64_t nextId;
+    std::vector<std::pair<std::string, size_t> > calls;    //!< recipient and number of envelopes of each call
+    std::vector<std::string> recipients;                    //!< recipient of each envelope
+    std::vector<std::pair<std::string, std::string> > sent; //!< device id and envelope, in send order
+    std::mutex lock;
+};
+
+#endif // TESTHELPER_H
@@ -0,0 +1,234 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <limits.h>
+#include <stdio.h>
+#include "gtest/gtest.h"
+
+#include "../interfaceApp/TransportQueue.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+using namespace salamander;
+using namespace std;
+
+// Records the batches, the first send waits until the test opens the gate
+class Recorder
+{
+public:
+    Recorder() : open_(false), blocked_(false) {}
+
+    void send(vector<TransportQueue::Item>* batch)
+    {
+        unique_lock<mutex> lck(lock_);
+        blocked_ = true;
+        changed_.notify_all();
+        changed_.wait(lck, [this]{ return open_; });
+
+        batches.push_back(vector<string>());
+        for (size_t i = 0; i < batch->size(); i++) {
+            const TransportQueue::Item& item = (*batch)[i];
+            batches.back().push_back(item.recipient);
+            order[item.recipient].push_back(item.handle);
+        }
+    }
+
+    void watermark(bool high, size_t depth)
+    {
+        unique_lock<mutex> lck(lock_);
+        events.push_back(high ? 'H' : 'L');
+    }
+
+    // Wait until the drain thread is in the send function
+    void waitBlocked()
+    {
+        unique_lock<mutex> lck(lock_);
+        changed_.wait(lck, [this]{ return blocked_; });
+    }
+
+    void open()
+    {
+        unique_lock<mutex> lck(lock_);
+        open_ = true;
+        changed_.notify_all();
+    }
+
+    vector<vector<string> > batches;
+    map<string, vector<int64_t> > order;
+    string events;
+
+private:
+    mutex lock_;
+    condition_variable changed_;
+    bool open_;
+    bool blocked_;
+};
+
+static TransportQueue::Item item(const string& recipient, int64_t handle)
+{
+    TransportQueue::Item item;
+    item.recipient = recipient;
+    item.handle = handle;
+    item.msgPairs.push_back(pair<string, string>("device", "envelope"));
+    return item;
+}
+
+static TransportQueue* createQueue(Recorder* recorder, int32_t capacity, int32_t maxBatch = TransportQueue::DEFAULT_MAX_BATCH)
+{
+    return new TransportQueue([recorder](vector<TransportQueue::Item>* batch) { recorder->send(batch); },
+                              [recorder](bool high, size_t depth) { recorder->watermark(high, depth); },
+                              capacity, maxBatch);
+}
+
+TEST(TransportQueue, Batch)
+{
+    Recorder recorder;
+    TransportQueue* queue = createQueue(&recorder, 64);
+    ASSERT_EQ(64, queue->getCapacity());
+
+    queue->push(item("first", 1));
+    recorder.waitBlocked();
+
+    // The messages queue up behind the blocked send
+    const char* recipients[] = {"alice", "bob", "carol"};
+    for (int32_t i = 0; i < 4; i++) {
+        for (int32_t r = 0; r < 3; r++)
+            queue->push(item(recipients[r], 10 * (r + 1) + i));
+    }
+    ASSERT_EQ(13, queue->getDepth());
+    recorder.open();
+    queue->drain();
+    ASSERT_EQ(0, queue->getDepth());
+
+    // One message per recipient and batch, each recipient's messages in push order
+    ASSERT_EQ(5, recorder.batches.size());
+    for (size_t i = 1; i < recorder.batches.size(); i++) {
+        ASSERT_EQ(3, recorder.batches[i].size());
+        ASSERT_EQ(3, set<string>(recorder.batches[i].begin(), recorder.batches[i].end()).size());
+    }
+    for (int32_t r = 0; r < 3; r++) {
+        vector<int64_t>& handles = recorder.order[recipients[r]];
+        ASSERT_EQ(4, handles.size());
+        for (int32_t i = 0; i < 4; i++)
+            ASSERT_EQ(10 * (r + 1) + i, handles[i]);
+    }
+    ASSERT_EQ(5, queue->getBatches());
+    delete queue;
+}
+
+TEST(TransportQueue, Watermarks)
+{
+    Recorder recorder;
+    TransportQueue* queue = createQueue(&recorder, 8);
+    ASSERT_EQ(6, queue->getHighWatermark());
+    ASSERT_EQ(2, queue->getLowWatermark());
+
+    queue->push(item("r0", 1));
+    recorder.waitBlocked();
+    for (int32_t i = 1; i < 5; i++)
+        queue->push(item("r" + to_string(i), i + 1));
+    ASSERT_EQ(string(""), recorder.events);
+
+    // The 6th message reaches the high watermark, once
+    queue->push(item("r5", 6));
+    queue->push(item("r6", 7));
+    ASSERT_EQ(string("H"), recorder.events);
+
+    recorder.open();
+    queue->drain();
+    ASSERT_EQ(string("HL"), recorder.events);
+    delete queue;
+}
+
+TEST(TransportQueue, Full)
+{
+    Recorder recorder;
+    TransportQueue* queue = createQueue(&recorder, 4, 1);
+
+    queue->push(item("r", 0));
+    recorder.waitBlocked();
+
+    // The ring holds 4 messages, the producer waits for the 5th
+    thread producer([queue]() {
+        for (int32_t i = 1; i <= 5; i++)
+            queue->push(item("r", i));
+    });
+    this_thread::sleep_for(chrono::milliseconds(50));
+    ASSERT_EQ(1, queue->getFullWaits());
+
+    recorder.open();
+    producer.join();
+    queue->drain();
+    ASSERT_EQ(6, recorder.order["r"].size());
+    for (int32_t i = 0; i <= 5; i++)
+        ASSERT_EQ(i, recorder.order["r"][i]);
+    delete queue;
+}
+
+// The destructor sends the queued messages
+TEST(TransportQueue, Stop)
+{
+    Recorder recorder;
+    TransportQueue* queue = createQueue(&recorder, 16);
+    queue->push(item("r", 0));
+    recorder.waitBlocked();
+    for (int32_t i = 1; i < 10; i++)
+        queue->push(item("r", i));
+    recorder.open();
+    delete queue;
+    ASSERT_EQ(10, recorder.order["r"].size());
+}
+
+TEST(TransportQueue, Producers)
+{
+    const int32_t numProducers = 4;
+    const int32_t numItems = 20000;
+
+    Recorder recorder;
+    recorder.open();
+    TransportQueue* queue = createQueue(&recorder, TransportQueue::DEFAULT_CAPACITY);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<thread> producers;
+    for (int32_t p = 0; p < numProducers; p++) {
+        producers.push_back(thread([queue, p, numItems]() {
+            string recipient = "producer-" + to_string(p);
+            for (int32_t i = 0; i < numItems; i++)
+                queue->push(item(recipient, i));
+        }));
+    }
+    for (size_t p = 0; p < producers.size(); p++)
+        producers[p].join();
+    queue->drain();
+    int64_t micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+    for (int32_t p = 0; p < numProducers; p++) {
+        vector<int64_t>& handles = recorder.order["producer-" + to_string(p)];
+        ASSERT_EQ(numItems, handles.size());
+        for (int32_t i = 0; i < numItems; i++)
+            ASSERT_EQ(i, handles[i]);
+    }
+    cerr << numProducers * numItems << " messages from " << numProducers << " threads in " << micros / 1000 << " ms, "
+         << queue->getBatches() << " batches, " << queue->getFullWaits() << " full waits" << endl;
+    delete queue;
+}
@@ -21,6 +21,7 @@ limitations under the License.
 #include "../storage/sqlite/SQLiteStoreConv.h"
 #include "../salamander/crypto/EcCurve.h"
 #include "../salamander/ratchet/SalRatchet.h"
+#include "../salamander/Constants.h"
 
 #include <iostream>
 using namespace salamander;
@@ -35,7 +36,7 @@ static const string p2Name("party2");
 static const string p1dev("party1_dev");
 static const string p2dev("party2_dev");
 
-const string getAxoPublicKeyData(const string& localUser, const string& user, const string& deviceId);
+const string getAxoPublicKeyData(const string& localUser, const string& user, const string& deviceId, ConversationStore* store);
 void setAxoPublicKeyData(const string& localUser, const string& user, const string& deviceId, const string& pubKeyData);
 void setAxoExportedKey( const string& localUser, const string& user, const string& deviceId, const string& exportedKey );
 
@@ -61,22 +62,34 @@ static void hexdump(const char* title, const std::string& in)
     hexdump(title, (uint8_t*)in.data(), in.size());
 }
 
-void prepareStore()
+// Each party uses its own store, as two accounts on the same host would do
+static SQLiteStoreConv* p1Store = NULL;
+static SQLiteStoreConv* p2Store = NULL;
+
+static SQLiteStoreConv* openStore()
 {
-    SQLiteStoreConv* store = SQLiteStoreConv::getStore();
-    if (store->isReady())
-        return;
+    SQLiteStoreConv* store = new SQLiteStoreConv();
     store->setKey(std::string((const char*)keyInData, 32));
     store->openStore(std::string());
     if (SQL_FAIL(store->getSqlCode())) {
         cerr << store->getLastError() << endl;
         exit(1);
     }
-    p1Conv = new AxoConversation(p1Name, p1Name, emptyString);   // Create P1's own (local) conversation
+    return store;
+}
+
+void prepareStore()
+{
+    if (p1Store != NULL)
+        return;
+    p1Store = openStore();
+    p2Store = openStore();
+
+    p1Conv = new AxoConversation(p1Name, p1Name, emptyString, p1Store);   // Create P1's own (local) conversation
     p1Conv->setDHIs(EcCurve::generateKeyPair(EcCurveTypes::Curve25519));
     p1Conv->storeConversation();
 
-    p2Conv = new AxoConversation(p2Name, p2Name, emptyString);   // Create P2's own (local) conversation
+    p2Conv = new AxoConversation(p2Name, p2Name, emptyString, p2Store);   // Create P2's own (local) conversation
     p2Conv->setDHIs(EcCurve::generateKeyPair(EcCurveTypes::Curve25519));
     p2Conv->storeConversation();
 }
@@ -87,8 +100,8 @@ TEST(ZrtpRatchet, Setup)
     prepareStore();
 
     // Simulate the ZRTP data exchange via the confirm packets
-    string p1_0_p2 = getAxoPublicKeyData(p1Name, p2Name, p2dev);
-    string p2_0_p1 = getAxoPublicKeyData(p2Name, p1Name, p1dev);
+    string p1_0_p2 = getAxoPublicKeyData(p1Name, p2Name, p2dev, p1Store);
+    string p2_0_p1 = getAxoPublicKeyData(p2Name, p1Name, p1dev, p2Store);
 
     setAxoPublicKeyData(p1Name, p2Name, p2dev, p2_0_p1);
     setAxoPublicKeyData(p2Name, p1Name, p1dev, p1_0_p2);
@@ -98,11 +111,11 @@ TEST(ZrtpRatchet, Setup)
     setAxoExportedKey(p2Name, p1Name, p1dev, exportedKey);
 
     // Load P2's conversation
-    AxoConversation* p1p2Conv = AxoConversation::loadConversation(p1Name, p2Name, p2dev);
+    AxoConversation* p1p2Conv = AxoConversation::loadConversation(p1Name, p2Name, p2dev, p1Store);
     ASSERT_TRUE(p1p2Conv != NULL);
     ASSERT_TRUE(p2Conv->getDHIs()->getPublicKey() == *p1p2Conv->getDHIr());
 
-    AxoConversation* p2p1Conv = AxoConversation::loadConversation(p2Name, p1Name, p1dev);
+    AxoConversation* p2p1Conv = AxoConversation::loadConversation(p2Name, p1Name, p1dev, p2Store);
     ASSERT_TRUE(p1p2Conv != NULL);
     ASSERT_TRUE(p1Conv->getDHIs()->getPublicKey() == *p2p1Conv->getDHIr());
 
@@ -255,6 +268,216 @@ TEST(ZrtpRatchet, Setup)
 
 }
 
+// Set up a conversation between two devices of party1 and party2
+static void setupDevices(const string& dev1, const string& dev2, AxoConversation** p1p2Conv, AxoConversation** p2p1Conv)
+{
+    prepareStore();
+
+    string p1_0_p2 = getAxoPublicKeyData(p1Name, p2Name, dev2, p1Store);
+    string p2_0_p1 = getAxoPublicKeyData(p2Name, p1Name, dev1, p2Store);
+
+    setAxoPublicKeyData(p1Name, p2Name, dev2, p2_0_p1);
+    setAxoPublicKeyData(p2Name, p1Name, dev1, p1_0_p2);
+
+    string exportedKey((const char*)keyInData, 32);
+    setAxoExportedKey(p1Name, p2Name, dev2, exportedKey);
+    setAxoExportedKey(p2Name, p1Name, dev1, exportedKey);
+
+    *p1p2Conv = AxoConversation::loadConversation(p1Name, p2Name, dev2, p1Store);
+    *p2p1Conv = AxoConversation::loadConversation(p2Name, p1Name, dev1, p2Store);
+}
+
+TEST(ZrtpRatchet, Compressed)
+{
+    AxoConversation* p1p2Conv;
+    AxoConversation* p2p1Conv;
+    setupDevices("party1_dev_c", "party2_dev_c", &p1p2Conv, &p2p1Conv);
+    ASSERT_TRUE(p1p2Conv != NULL);
+    ASSERT_TRUE(p2p1Conv != NULL);
+
+    string message;
+    for (int32_t i = 0; i < 8; i++)
+        message.append("{\"cloud_url\":\"https://example.com/files/00" + to_string(i) + "\",\"content_type\":\"image/jpeg\"}");
+    string supplements("{\"a\":\"");
+    for (int32_t i = 0; i < 8; i++)
+        supplements.append("{\\\"r\\\":true,\\\"s\\\":true}");
+    supplements.append("\"}");
+
+    // The compressed wire message is smaller and has the flag
+    const string* plainWire = AxoRatchet::encrypt(*p1p2Conv, message, string(), NULL);
+    const string* wire = AxoRatchet::encrypt(*p1p2Conv, message, string(), NULL, NULL, 64);
+    ASSERT_TRUE(plainWire != NULL && wire != NULL);
+    ASSERT_EQ(0, (*plainWire)[3]);
+    ASSERT_EQ(AxoRatchet::COMPRESSED, (*wire)[3]);
+    ASSERT_LT(wire->size(), plainWire->size());
+
+    string* plain = AxoRatchet::decrypt(p2p1Conv, *plainWire, string(), NULL);
+    ASSERT_TRUE(plain != NULL);
+    ASSERT_EQ(message, *plain);
+    delete plain; delete plainWire;
+
+    plain = AxoRatchet::decrypt(p2p1Conv, *wire, string(), NULL);
+    ASSERT_TRUE(plain != NULL);
+    ASSERT_EQ(message, *plain);
+    delete plain; delete wire;
+
+    // Supplements are compressed with the message
+    string supplementsEncrypted;
+    wire = AxoRatchet::encrypt(*p1p2Conv, message, supplements, &supplementsEncrypted, NULL, 64);
+    ASSERT_EQ(AxoRatchet::COMPRESSED, (*wire)[3]);
+    string supplementsPlain;
+    plain = AxoRatchet::decrypt(p2p1Conv, *wire, supplementsEncrypted, &supplementsPlain);
+    ASSERT_TRUE(plain != NULL);
+    ASSERT_EQ(message, *plain);
+    ASSERT_EQ(supplements, supplementsPlain);
+    delete plain; delete wire;
+
+    // The MAC covers the flag, a cleared flag does not pass as an uncompressed message
+    wire = AxoRatchet::encrypt(*p1p2Conv, message, string(), NULL, NULL, 64);
+    string tampered(*wire);
+    tampered[3] = 0;
+    ASSERT_TRUE(AxoRatchet::decrypt(p2p1Conv, tampered, string(), NULL) == NULL);
+    ASSERT_EQ(MAC_CHECK_FAILED, p2p1Conv->getErrorCode());
+    tampered[3] = 0x04;
+    ASSERT_TRUE(AxoRatchet::decrypt(p2p1Conv, tampered, string(), NULL) == NULL);
+    ASSERT_EQ(CORRUPT_DATA, p2p1Conv->getErrorCode());
+
+    plain = AxoRatchet::decrypt(p2p1Conv, *wire, string(), NULL);
+    ASSERT_TRUE(plain != NULL);
+    ASSERT_EQ(message, *plain);
+    delete plain; delete wire;
+
+    // Short messages and data that does not compress go out as they are
+    wire = AxoRatchet::encrypt(*p1p2Conv, "short", string(), NULL, NULL, 64);
+    ASSERT_EQ(0, (*wire)[3]);
+    delete wire;
+
+    string random;
+    uint32_t x = 2463534242U;
+    for (int32_t i = 0; i < 256; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        random.push_back((char)x);
+    }
+    wire = AxoRatchet::encrypt(*p1p2Conv, random, string(), NULL, NULL, 64);
+    ASSERT_EQ(0, (*wire)[3]);
+    plain = AxoRatchet::decrypt(p2p1Conv, *wire, string(), NULL);
+    ASSERT_TRUE(plain != NULL);
+    ASSERT_EQ(random, *plain);
+    delete plain; delete wire;
+
+    delete p1p2Conv;
+    delete p2p1Conv;
+}
+
+TEST(ZrtpRatchet, DetachedFlag)
+{
+    AxoConversation* p1p2Conv;
+    AxoConversation* p2p1Conv;
+    setupDevices("party1_dev_d", "party2_dev_d", &p1p2Conv, &p2p1Conv);
+    ASSERT_TRUE(p1p2Conv != NULL);
+    ASSERT_TRUE(p2p1Conv != NULL);
+
+    string keyDescriptor("{\"k\":\"key\",\"l\":\"locator\"}");
+
+    // The receiver gets the flag the sender set, in both wire versions
+    for (int32_t version = AxoRatchet::WIRE_VERSION_1; version <= AxoRatchet::WIRE_VERSION_2; version++) {
+        const string* wire = AxoRatchet::encrypt(*p1p2Conv, keyDescriptor, string(), NULL, NULL, 0, version, AxoRatchet::DETACHED);
+        ASSERT_TRUE(wire != NULL);
+        int32_t flags = 0;
+        string* plain = AxoRatchet::decrypt(p2p1Conv, *wire, string(), NULL, NULL, &flags);
+        ASSERT_TRUE(plain != NULL);
+        ASSERT_EQ(keyDescriptor, *plain);
+        ASSERT_EQ(AxoRatchet::DETACHED, flags);
+        delete plain; delete wire;
+
+        wire = AxoRatchet::encrypt(*p1p2Conv, keyDescriptor, string(), NULL, NULL, 0, version);
+        plain = AxoRatchet::decrypt(p2p1Conv, *wire, string(), NULL, NULL, &flags);
+        ASSERT_TRUE(plain != NULL);
+        ASSERT_EQ(0, flags);
+        delete plain; delete wire;
+    }
+
+    // The MAC covers the flag, nobody can set or clear it on the way
+    const string* wire = AxoRatchet::encrypt(*p1p2Conv, keyDescriptor, string(), NULL, NULL, 0, AxoRatchet::WIRE_VERSION_1,
+                                             AxoRatchet::DETACHED);
+    string tampered(*wire);
+    tampered[3] = 0;
+    ASSERT_TRUE(AxoRatchet::decrypt(p2p1Conv, tampered, string(), NULL) == NULL);
+    ASSERT_EQ(MAC_CHECK_FAILED, p2p1Conv->getErrorCode());
+    delete wire;
+
+    wire = AxoRatchet::encrypt(*p1p2Conv, keyDescriptor, string(), NULL);
+    tampered = *wire;
+    tampered[3] = AxoRatchet::DETACHED;
+    ASSERT_TRUE(AxoRatchet::decrypt(p2p1Conv, tampered, string(), NULL) == NULL);
+    ASSERT_EQ(MAC_CHECK_FAILED, p2p1Conv->getErrorCode());
+    delete wire;
+
+    delete p1p2Conv;
+    delete p2p1Conv;
+}
+
+TEST(ZrtpRatchet, WireVersion2)
+{
+    AxoConversation* p1p2Conv;
+    AxoConversation* p2p1Conv;
+    setupDevices("party1_dev_v2", "party2_dev_v2", &p1p2Conv, &p2p1Conv);
+    ASSERT_TRUE(p1p2Conv != NULL);
+    ASSERT_TRUE(p2p1Conv != NULL);
+
+    // Both versions decrypt, version 2 saves the fixed size fields and the inner length
+    string message("Version 2 wire message");
+    const string* v1Wire = AxoRatchet::encrypt(*p1p2Conv, message, string(), NULL);
+    const string* v2Wire = AxoRatchet::encrypt(*p1p2Conv, message, string(), NULL, NULL, 0, AxoRatchet::WIRE_VERSION_2);
+    ASSERT_TRUE(v1Wire != NULL && v2Wire != NULL);
+    ASSERT_EQ(v1Wire->size() - 12, v2Wire->size());
+    ASSERT_FALSE(AxoRatchet::isPreKeyMessage(DataSpan(*v1Wire)));
+    ASSERT_FALSE(AxoRatchet::isPreKeyMessage(DataSpan(*v2Wire)));
+
+    string* plain = AxoRatchet::decrypt(p2p1Conv, *v1Wire, string(), NULL);
+    ASSERT_TRUE(plain != NULL);
+    ASSERT_EQ(message, *plain);
+    delete plain; delete v1Wire;
+
+    plain = AxoRatchet::decrypt(p2p1Conv, *v2Wire, string(), NULL);
+    ASSERT_TRUE(plain != NULL);
+    ASSERT_EQ(message, *plain);
+    delete plain; delete v2Wire;
+
+    // Out of order and compressed, the answer in version 2 starts a new ratchet
+    vector<const string*> wires;
+    for (int32_t i = 0; i < 200; i++)
+        wires.push_back(AxoRatchet::encrypt(*p1p2Conv, message + to_string(i) + string(100, 'x'), string(), NULL, NULL, 64,
+                                            AxoRatchet::WIRE_VERSION_2));
+    ASSERT_EQ(AxoRatchet::COMPRESSED, (*wires[0])[1]);
+    for (int32_t i = 199; i >= 0; i--) {
+        plain = AxoRatchet::decrypt(p2p1Conv, *wires[i], string(), NULL);
+        ASSERT_TRUE(plain != NULL);
+        ASSERT_EQ(message + to_string(i) + string(100, 'x'), *plain);
+        delete plain; delete wires[i];
+    }
+    v2Wire = AxoRatchet::encrypt(*p2p1Conv, message, string(), NULL, NULL, 0, AxoRatchet::WIRE_VERSION_2);
+    plain = AxoRatchet::decrypt(p1p2Conv, *v2Wire, string(), NULL);
+    ASSERT_TRUE(plain != NULL);
+    ASSERT_EQ(message, *plain);
+    delete plain;
+
+    // Truncated headers are corrupt data
+    for (size_t size = 0; size < 1 + 3 + 32 + 8; size++) {
+        ASSERT_TRUE(AxoRatchet::decrypt(p1p2Conv, v2Wire->substr(0, size), string(), NULL) == NULL);
+        ASSERT_EQ(CORRUPT_DATA, p1p2Conv->getErrorCode());
+    }
+    // A varint that does not end
+    string endless(*v2Wire);
+    for (size_t i = 1; i < 7; i++)
+        endless[i] = (char)0xff;
+    ASSERT_TRUE(AxoRatchet::decrypt(p1p2Conv, endless, string(), NULL) == NULL);
+    delete v2Wire;
+
+    delete p1p2Conv;
+    delete p2p1Conv;
+}
+
 
 
 
@@ -0,0 +1,58 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef DATASPAN_H
+#define DATASPAN_H
+
+/**
+ * @file DataSpan.h
+ * @brief A view of bytes in a buffer that someone else owns
+ * @ingroup Salamander++
+ * @{
+ *
+ * The receive path uses spans to hand the fields of a decoded message envelope to
+ * the ratchet without copying them. The owner of the buffer must keep it while a
+ * span refers to it.
+ */
+
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace salamander {
+
+struct DataSpan {
+    DataSpan() : data(NULL), size(0) {}
+
+    DataSpan(const uint8_t* spanData, size_t spanSize) : data(spanData), size(spanSize) {}
+
+    // Not explicit, functions that take a span also take a string
+    DataSpan(const std::string& str) : data((const uint8_t*)str.data()), size(str.size()) {}
+
+    bool empty() const             { return size == 0; }
+
+    std::string toString() const   { return (data == NULL) ? std::string() : std::string((const char*)data, size); }
+
+    const uint8_t* data;    //!< NULL if the field is not present
+    size_t size;
+};
+
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // DATASPAN_H
@@ -0,0 +1,177 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "LzCodec.h"
+
+#include <string.h>
+
+using namespace std;
+
+static const size_t MIN_MATCH = 4;
+static const size_t LAST_LITERALS = 5;      // as in LZ4: the last bytes are literals
+static const size_t MATCH_LIMIT = 12;       // as in LZ4: no match starts in the last bytes
+static const size_t MAX_OFFSET = 65535;
+static const int32_t HASH_BITS = 12;
+
+static inline uint32_t read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash32(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// A length of 15 or more continues in the following bytes, 255 means more bytes follow
+static void writeLength(size_t length, string* out)
+{
+    for (; length >= 255; length -= 255)
+        out->push_back((char)255);
+    out->push_back((char)length);
+}
+
+static void writeSequence(const uint8_t* literals, size_t numLiterals, size_t offset, size_t matchLength, string* out)
+{
+    size_t matchCode = matchLength >= MIN_MATCH ? matchLength - MIN_MATCH : 0;
+    uint8_t token = (uint8_t)(((numLiterals < 15 ? numLiterals : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+    out->push_back((char)token);
+    if (numLiterals >= 15)
+        writeLength(numLiterals - 15, out);
+    out->append((const char*)literals, numLiterals);
+
+    if (matchLength == 0)
+        return;                 // the last sequence has only literals
+    out->push_back((char)(offset & 0xff));
+    out->push_back((char)(offset >> 8));
+    if (matchCode >= 15)
+        writeLength(matchCode - 15, out);
+}
+
+void salamander::lzCompress(const uint8_t* data, size_t size, string* compressed)
+{
+    compressed->clear();
+    compressed->reserve(4 + size + size / 255 + 16);
+
+    uint32_t length = (uint32_t)size;
+    compressed->push_back((char)(length >> 24));
+    compressed->push_back((char)(length >> 16));
+    compressed->push_back((char)(length >> 8));
+    compressed->push_back((char)length);
+
+    // Position + 1 of the last occurrence of each hash, 0 if none
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    if (size >= MATCH_LIMIT) {
+        size_t matchEnd = size - LAST_LITERALS;
+        while (pos + MATCH_LIMIT <= size) {
+            uint32_t sequence = read32(&data[pos]);
+            uint32_t h = hash32(sequence);
+            size_t candidate = table[h];
+            table[h] = (uint32_t)(pos + 1);
+
+            if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET || read32(&data[candidate - 1]) != sequence) {
+                pos++;
+                continue;
+            }
+            size_t ref = candidate - 1;
+            size_t matchLength = MIN_MATCH;
+            while (pos + matchLength < matchEnd && data[ref + matchLength] == data[pos + matchLength])
+                matchLength++;
+
+            writeSequence(&data[anchor], pos - anchor, pos - ref, matchLength, compressed);
+            pos += matchLength;
+            anchor = pos;
+        }
+    }
+    writeSequence(&data[anchor], size - anchor, 0, 0, compressed);
+}
+
+// Read the continuation bytes of a length
+static bool readLength(const uint8_t** in, const uint8_t* end, size_t* length)
+{
+    uint8_t next;
+    do {
+        if (*in >= end)
+            return false;
+        next = *(*in)++;
+        *length += next;
+    } while (next == 255);
+    return true;
+}
+
+bool salamander::lzDecompress(const uint8_t* data, size_t size, size_t maxSize, string* plain)
+{
+    plain->clear();
+    if (size < 5)
+        return false;
+
+    size_t length = ((size_t)data[0] << 24) | ((size_t)data[1] << 16) | ((size_t)data[2] << 8) | data[3];
+    if (length > maxSize)
+        return false;
+
+    plain->resize(length);
+    uint8_t* out = length > 0 ? (uint8_t*)&(*plain)[0] : NULL;
+    size_t outPos = 0;
+
+    const uint8_t* in = data + 4;
+    const uint8_t* end = data + size;
+    while (in < end) {
+        uint8_t token = *in++;
+
+        size_t numLiterals = token >> 4;
+        if (numLiterals == 15 && !readLength(&in, end, &numLiterals))
+            break;
+        if (numLiterals > (size_t)(end - in) || numLiterals > length - outPos)
+            break;
+        if (numLiterals > 0)
+            memcpy(&out[outPos], in, numLiterals);
+        in += numLiterals;
+        outPos += numLiterals;
+
+        // The last sequence has no match
+        if (in == end) {
+            if (outPos == length)
+                return true;
+            break;
+        }
+        if (end - in < 2)
+            break;
+        size_t offset = in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > outPos)
+            break;
+
+        size_t matchLength = token & 0x0f;
+        if (matchLength == 15 && !readLength(&in, end, &matchLength))
+            break;
+        matchLength += MIN_MATCH;
+        if (matchLength > length - outPos)
+            break;
+
+        // The match may overlap the bytes it writes, copy byte by byte
+        const uint8_t* ref = &out[outPos - offset];
+        for (size_t i = 0; i < matchLength; i++)
+            out[outPos + i] = ref[i];
+        outPos += matchLength;
+    }
+    plain->clear();
+    return false;
+}
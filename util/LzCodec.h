@@ -0,0 +1,70 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef LZCODEC_H
+#define LZCODEC_H
+
+/**
+ * @file LzCodec.h
+ * @brief Small and fast LZ77 compression for message payloads
+ * @ingroup Salamander++
+ * @{
+ *
+ * The codec uses the sequence format of LZ4 blocks: a token with the literal
+ * length and the match length, the literals, and a 16 bit offset of the match.
+ * A 4 byte length of the plain data in network order precedes the sequences,
+ * the decoder checks it and writes no more than this length.
+ *
+ * The compressor does a single greedy pass with a hash table of recent
+ * positions. It does not reach the ratio of DEFLATE but it is several times
+ * faster, which matters on the send path that encrypts each message.
+ */
+
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace salamander {
+
+/**
+ * @brief Compress data.
+ *
+ * @param data the plain data
+ * @param size number of bytes
+ * @param compressed gets the compressed data, replaces its content
+ */
+void lzCompress(const uint8_t* data, size_t size, std::string* compressed);
+
+/**
+ * @brief Decompress data.
+ *
+ * The function checks each length and offset, it rejects corrupt data without
+ * reading or writing outside the buffers.
+ *
+ * @param data the compressed data
+ * @param size number of bytes
+ * @param maxSize the maximum size of the plain data
+ * @param plain gets the plain data, replaces its content
+ * @return @c true if the data was valid
+ */
+bool lzDecompress(const uint8_t* data, size_t size, size_t maxSize, std::string* plain);
+
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // LZCODEC_H
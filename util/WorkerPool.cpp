@@ -0,0 +1,135 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "WorkerPool.h"
+
+using namespace salamander;
+using namespace std;
+
+WorkerPool::WorkerPool(int32_t numThreads) : stop_(false)
+{
+    for (int32_t i = 0; i < numThreads; i++)
+        threads_.push_back(thread(&WorkerPool::run, this));
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        unique_lock<mutex> lck(lock_);
+        stop_ = true;
+    }
+    workAvailable_.notify_all();
+    for (size_t i = 0; i < threads_.size(); i++)
+        threads_[i].join();
+}
+
+int32_t WorkerPool::defaultThreads()
+{
+    // The calling thread runs jobs too
+    int32_t cores = thread::hardware_concurrency();
+    if (cores <= 1)
+        return 1;
+    return cores > 8 ? 7 : cores - 1;
+}
+
+WorkerPool* WorkerPool::shared()
+{
+    // Never deleted: joining the threads during static destruction may deadlock
+    static WorkerPool* pool = new WorkerPool(defaultThreads());
+    return pool;
+}
+
+bool WorkerPool::claimJob(Batch** batch, size_t* index)
+{
+    if (batches_.empty())
+        return false;
+
+    Batch* front = batches_.front();
+    *batch = front;
+    *index = front->next++;
+
+    // All jobs of this batch are claimed, the batch leaves the queue. Only the
+    // threads that run its jobs use the batch from now on.
+    if (front->next >= front->jobs->size())
+        batches_.pop_front();
+    return true;
+}
+
+void WorkerPool::finishJob(Batch* batch)
+{
+    unique_lock<mutex> lck(lock_);
+    if (++batch->done == batch->jobs->size())
+        batchDone_.notify_all();
+}
+
+void WorkerPool::runAll(const vector<function<void()> >& jobs)
+{
+    if (jobs.empty())
+        return;
+
+    if (threads_.empty() || jobs.size() == 1) {
+        for (size_t i = 0; i < jobs.size(); i++)
+            jobs[i]();
+        return;
+    }
+
+    Batch batch;
+    batch.jobs = &jobs;
+    batch.next = 0;
+    batch.done = 0;
+
+    unique_lock<mutex> lck(lock_);
+    batches_.push_back(&batch);
+    workAvailable_.notify_all();
+
+    // Help with the own batch, then wait for the jobs the pool threads run. The
+    // batch lives on this stack, thus wait until every job reported completion.
+    while (batch.next < jobs.size()) {
+        size_t index = batch.next++;
+        if (batch.next >= jobs.size()) {
+            for (deque<Batch*>::iterator it = batches_.begin(); it != batches_.end(); ++it) {
+                if (*it == &batch) {
+                    batches_.erase(it);
+                    break;
+                }
+            }
+        }
+        lck.unlock();
+        jobs[index]();
+        lck.lock();
+        batch.done++;
+    }
+    batchDone_.wait(lck, [&batch, &jobs]{ return batch.done == jobs.size(); });
+}
+
+void WorkerPool::run()
+{
+    unique_lock<mutex> lck(lock_);
+    while (true) {
+        workAvailable_.wait(lck, [this]{ return stop_ || !batches_.empty(); });
+        if (stop_)
+            return;
+
+        Batch* batch;
+        size_t index;
+        if (!claimJob(&batch, &index))
+            continue;
+
+        lck.unlock();
+        (*batch->jobs)[index]();
+        finishJob(batch);
+        lck.lock();
+    }
+}
@@ -0,0 +1,114 @@
+/*
+Copyright 2016 Silent Circle, LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+/**
+ * @file WorkerPool.h
+ * @brief A small fixed size thread pool that runs batches of jobs
+ * @ingroup Salamander++
+ * @{
+ *
+ * The caller hands a batch of independent jobs to @c runAll and waits until
+ * all jobs of the batch completed. The pool threads and the calling thread
+ * run the jobs, thus a pool with @c n threads runs up to @c n+1 jobs of a batch
+ * in parallel. Several threads may call @c runAll at the same time, the pool
+ * threads then work on the batches in order of arrival.
+ *
+ * Jobs must not call @c runAll of the same pool.
+ */
+
+#include <stdint.h>
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace salamander {
+
+class WorkerPool
+{
+public:
+    /**
+     * @brief Create a pool and start its threads.
+     *
+     * @param numThreads number of pool threads, 0 runs all jobs on the calling thread
+     */
+    explicit WorkerPool(int32_t numThreads);
+
+    /**
+     * @brief Stop the pool threads and wait until they terminate.
+     *
+     * There must be no active @c runAll call.
+     */
+    ~WorkerPool();
+
+    /**
+     * @brief Run a batch of jobs and wait until all jobs completed.
+     *
+     * @param jobs the jobs to run, the jobs may run in any order
+     */
+    void runAll(const std::vector<std::function<void()> >& jobs);
+
+    int32_t getNumThreads() const { return threads_.size(); }
+
+    /**
+     * @brief Default number of pool threads for this machine.
+     */
+    static int32_t defaultThreads();
+
+    /**
+     * @brief The pool that all accounts of this process share.
+     *
+     * The function creates the pool with @c defaultThreads threads on first use. The
+     * pool lives until the process exits, do not delete it.
+     */
+    static WorkerPool* shared();
+
+private:
+    WorkerPool(const WorkerPool& other);
+    WorkerPool& operator=(const WorkerPool& other);
+
+    struct Batch {
+        const std::vector<std::function<void()> >* jobs;
+        size_t next;        //!< index of the next job to claim
+        size_t done;        //!< number of completed jobs
+    };
+
+    // Claim the next job of the oldest batch, lock_ must be held
+    bool claimJob(Batch** batch, size_t* index);
+
+    void finishJob(Batch* batch);
+
+    void run();
+
+    std::vector<std::thread> threads_;
+    std::deque<Batch*> batches_;    //!< batches with unclaimed jobs
+    std::mutex lock_;
+    std::condition_variable workAvailable_;
+    std::condition_variable batchDone_;
+    bool stop_;
+};
+} // namespace salamander
+
+/**
+ * @}
+ */
+
+#endif // WORKERPOOL_H